@@ -0,0 +1,153 @@
+#include "alloc_guard.h"
+
+#ifdef ALLOC_CHECK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <atomic>
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t align, size_t size);
+void __libc_free(void* p);
+}
+
+static const int MAX_FRAMES = 32;
+
+static __thread int t_depth = 0;            //区间可以嵌套（process里的write）
+static __thread int t_paused = 0;
+static __thread bool t_tracing = false;     //正在取调用栈，这期间的分配不算
+static __thread uint64_t t_allocs = 0;      //最外层区间开始以来的分配次数
+static __thread void* t_frames[MAX_FRAMES];
+static __thread int t_frame_count = 0;
+
+static std::atomic<uint64_t> g_regions(0);  //检查过的稳态区间
+static std::atomic<uint64_t> g_allocs(0);   //所有线程的分配次数
+
+//backtrace第一次调用时加载libgcc会分配内存，启动时先调一次
+static struct backtrace_primer{
+    backtrace_primer()
+    {
+        void* frames[4];
+        backtrace(frames, 4);
+    }
+} primer;
+
+static inline void count_alloc()
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if(t_depth == 0 || t_paused > 0 || t_tracing)
+    {
+        return;
+    }
+    if(t_allocs++ == 0)
+    {
+        t_tracing = true;
+        t_frame_count = backtrace(t_frames, MAX_FRAMES);
+        t_tracing = false;
+    }
+}
+
+extern "C" {
+
+void* malloc(size_t size)
+{
+    count_alloc();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    count_alloc();
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    count_alloc();
+    return __libc_realloc(p, size);
+}
+
+void free(void* p)
+{
+    __libc_free(p);
+}
+
+void* memalign(size_t align, size_t size)
+{
+    count_alloc();
+    return __libc_memalign(align, size);
+}
+
+void* aligned_alloc(size_t align, size_t size)
+{
+    count_alloc();
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void** out, size_t align, size_t size)
+{
+    count_alloc();
+    void* p = __libc_memalign(align, size);
+    if(!p)
+    {
+        return ENOMEM;
+    }
+    *out = p;
+    return 0;
+}
+
+}
+
+void alloc_guard::enter()
+{
+    if(t_depth++ == 0)
+    {
+        t_allocs = 0;
+    }
+}
+
+void alloc_guard::leave(bool steady, const char* where)
+{
+    if(--t_depth > 0 || !steady)
+    {
+        return;
+    }
+    g_regions.fetch_add(1, std::memory_order_relaxed);
+    if(t_allocs == 0)
+    {
+        return;
+    }
+    //稳态路径分配了内存：打印第一次分配的调用栈后退出
+    char line[128];
+    int len = snprintf(line, sizeof(line), "alloc check: %llu allocation(s) on the steady-state %s path, first one at:\n",
+                       (unsigned long long)t_allocs, where);
+    ::write(2, line, len);
+    backtrace_symbols_fd(t_frames, t_frame_count, 2);
+    abort();
+}
+
+void alloc_guard::pause()
+{
+    t_paused++;
+}
+
+void alloc_guard::resume()
+{
+    t_paused--;
+}
+
+int alloc_guard::report(char* buf, int len)
+{
+    return snprintf(buf, len, "steady_regions %llu\nallocations %llu\n",
+                    (unsigned long long)g_regions.load(std::memory_order_relaxed),
+                    (unsigned long long)g_allocs.load(std::memory_order_relaxed));
+}
+
+#endif
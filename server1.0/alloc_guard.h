@@ -0,0 +1,53 @@
+#ifndef ALLOC_GUARD_H__
+#define ALLOC_GUARD_H__
+
+#include <stdint.h>
+
+// 稳态零分配检查（编译时加 -DALLOC_CHECK，测试和压测用）
+// 替换malloc/calloc/realloc/memalign一族，线程处在检查区间（alloc_scope）里时记下每次分配和第一次分配的调用栈；
+// 区间结束时由调用者判断这一段是不是稳态路径（已经服务过请求的明文HTTP/1.1连接上的静态文件GET、主线程的读和派发），
+// 是的话有分配就打印调用栈并abort，压测时服务器直接失败。缓存的第一次填充、线程私有结构的创建这类预热用alloc_pause排除。
+// /allocz 查看检查过的区间数，确认检查确实在进行；链接时加 -rdynamic 调用栈里才有函数名。
+// 不加这个宏时下面都是空的内联函数，malloc也不替换。
+class alloc_guard{
+
+public:
+#ifdef ALLOC_CHECK
+    static bool enabled() { return true; }
+    static void enter();
+    static void leave(bool steady, const char* where);
+    static void pause();
+    static void resume();
+    static int report(char* buf, int len);
+#else
+    static bool enabled() { return false; }
+    static void enter() {}
+    static void leave(bool, const char*) {}
+    static void pause() {}
+    static void resume() {}
+    static int report(char* buf, int len) { if(len > 0) buf[0] = '\0'; return 0; }
+#endif
+};
+
+// 检查区间，steady在析构之前都可以改
+class alloc_scope{
+
+public:
+    alloc_scope(const char* where, bool steady) : steady(steady), m_where(where) { alloc_guard::enter(); }
+    ~alloc_scope() { alloc_guard::leave(steady, m_where); }
+
+    bool steady;
+
+private:
+    const char* m_where;
+};
+
+// 预热：这期间的分配不算
+class alloc_pause{
+
+public:
+    alloc_pause() { alloc_guard::pause(); }
+    ~alloc_pause() { alloc_guard::resume(); }
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef ARENA_H__
+#define ARENA_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <new>
+#include <string>
+#include <vector>
+
+// 请求期间的临时内存（http_request::arena）
+// 指针碰撞分配，不单独释放，请求结束时reset整体回卷。块在第一次使用时分配，之后的请求重复使用，
+// 同样的负载下稳态不再调用malloc；一块放不下时再串一块，reset时把这些块合并成一块，下一次就放得下了。
+// 对象的析构函数不会被调用，只放POD或者用arena_allocator的容器（它们的析构只是no-op的deallocate）。
+// 同一时刻只属于一个请求，不加锁。
+class request_arena{
+
+public:
+    static const size_t BLOCK_SIZE = 4096;          //第一块的最小大小
+    static const size_t MAX_KEEP = 64 * 1024;       //reset时保留的上限，偶尔一个大请求不让连接一直占着内存
+
+    request_arena() : m_blocks(NULL), m_ptr(NULL), m_end(NULL) {}
+    ~request_arena() { release(); }
+
+    void* alloc(size_t len, size_t align = alignof(max_align_t))
+    {
+        char* p = (char*)(((size_t)m_ptr + align - 1) & ~(align - 1));
+        if(!m_ptr || p + len > m_end)
+        {
+            if(!grow(len + align))
+            {
+                return NULL;
+            }
+            p = (char*)(((size_t)m_ptr + align - 1) & ~(align - 1));
+        }
+        m_ptr = p + len;
+        return p;
+    }
+
+    //拷贝一份以'\0'结尾的字符串
+    char* strdup(const char* s, size_t len)
+    {
+        char* p = (char*)alloc(len + 1, 1);
+        if(p)
+        {
+            memcpy(p, s, len);
+            p[len] = '\0';
+        }
+        return p;
+    }
+
+    //回卷到空：只有一块时原地重用，有多块时合并成一块（不超过MAX_KEEP）
+    void reset()
+    {
+        if(!m_blocks)
+        {
+            return;
+        }
+        if(m_blocks->next)
+        {
+            size_t total = 0;
+            for(block* b = m_blocks; b; b = b->next)
+            {
+                total += b->size;
+            }
+            release();
+            if(total <= MAX_KEEP)
+            {
+                grow(total);
+            }
+            return;
+        }
+        m_ptr = m_blocks->data;
+    }
+
+    //当前块里已经用掉的字节数
+    size_t used() const { return m_blocks ? m_ptr - m_blocks->data : 0; }
+
+private:
+    struct block{
+        block* next;
+        size_t size;
+        alignas(max_align_t) char data[];
+    };
+
+    bool grow(size_t len)
+    {
+        size_t size = BLOCK_SIZE;
+        while(size < len)
+        {
+            size *= 2;
+        }
+        block* b = (block*)malloc(sizeof(block) + size);
+        if(!b)
+        {
+            return false;
+        }
+        b->next = m_blocks;
+        b->size = size;
+        m_blocks = b;
+        m_ptr = b->data;
+        m_end = b->data + size;
+        return true;
+    }
+
+    void release()
+    {
+        while(m_blocks)
+        {
+            block* next = m_blocks->next;
+            free(m_blocks);
+            m_blocks = next;
+        }
+        m_ptr = m_end = NULL;
+    }
+
+    request_arena(const request_arena&);
+    request_arena& operator=(const request_arena&);
+
+private:
+    block* m_blocks;        //最新的块在前，m_ptr和m_end指向它
+    char* m_ptr;
+    char* m_end;
+};
+
+// 从request_arena分配的标准库分配器，deallocate什么也不做
+template<typename T>
+class arena_allocator{
+
+public:
+    typedef T value_type;
+
+    explicit arena_allocator(request_arena* arena) : m_arena(arena) {}
+    template<typename U>
+    arena_allocator(const arena_allocator<U>& other) : m_arena(other.arena()) {}
+
+    T* allocate(size_t n)
+    {
+        void* p = m_arena->alloc(n * sizeof(T), alignof(T));
+        if(!p)
+        {
+            throw std::bad_alloc();
+        }
+        return (T*)p;
+    }
+    void deallocate(T*, size_t) {}
+
+    request_arena* arena() const { return m_arena; }
+
+    template<typename U>
+    bool operator==(const arena_allocator<U>& other) const { return m_arena == other.arena(); }
+    template<typename U>
+    bool operator!=(const arena_allocator<U>& other) const { return m_arena != other.arena(); }
+
+private:
+    request_arena* m_arena;
+};
+
+typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char> > arena_string;
+
+template<typename T>
+using arena_vector = std::vector<T, arena_allocator<T> >;
+
+#endif
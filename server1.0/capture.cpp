@@ -0,0 +1,179 @@
+#include "capture.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t now_usec(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+traffic_capture::traffic_capture():
+    m_fd(-1), m_start(0), m_next_conn(1), m_records(0) {
+
+    m_buf.reserve(FLUSH_BYTES * 2);
+}
+
+traffic_capture::~traffic_capture()
+{
+    if(m_fd != -1)
+    {
+        std::vector<char> rest;
+        m_lock.lock();
+        rest.swap(m_buf);
+        m_file_lock.lock();
+        m_lock.unlock();
+        write_out(rest);
+        m_file_lock.unlock();
+        close(m_fd);
+    }
+}
+
+bool traffic_capture::open(const char* path)
+{
+    m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(m_fd < 0)
+    {
+        printf("open %s failure: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    capture_header header;
+    memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.start_usec = now_usec(CLOCK_REALTIME);
+    m_start = now_usec(CLOCK_MONOTONIC);
+    if(::write(m_fd, &header, sizeof(header)) != sizeof(header))
+    {
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    if(pthread_create(&m_thread, NULL, worker, this) != 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    pthread_detach(m_thread);
+    return true;
+}
+
+uint32_t traffic_capture::on_open()
+{
+    uint32_t conn = m_next_conn.fetch_add(1, std::memory_order_relaxed);
+    append(conn, OPEN, 0, NULL, 0);
+    return conn;
+}
+
+void traffic_capture::on_data(uint32_t conn, uint64_t sent, const char* data, int len)
+{
+    append(conn, DATA, sent, data, len);
+}
+
+void traffic_capture::on_close(uint32_t conn, uint64_t sent)
+{
+    append(conn, CLOSE, sent, NULL, 0);
+}
+
+void traffic_capture::append(uint32_t conn, int type, uint64_t sent, const char* data, int len)
+{
+    m_lock.lock();
+    //时间在锁内取，文件中记录的时间单调不减
+    capture_record rec;
+    rec.usec = now_usec(CLOCK_MONOTONIC) - m_start;
+    rec.conn = conn;
+    rec.type_len = ((uint32_t)type << 24) | (uint32_t)len;
+    rec.sent = sent;
+    const char* p = (const char*)&rec;
+    m_buf.insert(m_buf.end(), p, p + sizeof(rec));
+    if(len > 0)
+    {
+        m_buf.insert(m_buf.end(), data, data + len);
+    }
+    m_records.fetch_add(1, std::memory_order_relaxed);
+
+    if(m_buf.size() < (size_t)FLUSH_BYTES)
+    {
+        m_lock.unlock();
+        return;
+    }
+    if(m_buf.size() < (size_t)MAX_BUFFER)
+    {
+        m_cond.signal();
+        m_lock.unlock();
+        return;
+    }
+
+    //写线程跟不上：宁可让这个线程等磁盘，也不能丢记录，否则重放的连接会错位
+    std::vector<char> full;
+    full.reserve(FLUSH_BYTES * 2);
+    full.swap(m_buf);
+    m_file_lock.lock();
+    m_lock.unlock();
+    write_out(full);
+    m_file_lock.unlock();
+}
+
+bool traffic_capture::write_out(const std::vector<char>& buf)
+{
+    size_t done = 0;
+    while(done < buf.size())
+    {
+        ssize_t n = ::write(m_fd, buf.data() + done, buf.size() - done);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            printf("capture write failure: %s\n", strerror(errno));
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+void* traffic_capture::worker(void* arg)
+{
+    traffic_capture* capture = (traffic_capture*)arg;
+    capture->run();
+    return capture;
+}
+
+// 每FLUSH_INTERVAL_MS毫秒或者缓冲区超过FLUSH_BYTES时把缓冲区写到文件
+void traffic_capture::run()
+{
+    std::vector<char> out;
+    out.reserve(FLUSH_BYTES * 2);
+    while(true)
+    {
+        m_lock.lock();
+        if(m_buf.size() < (size_t)FLUSH_BYTES)
+        {
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_sec += FLUSH_INTERVAL_MS / 1000;
+            t.tv_nsec += (FLUSH_INTERVAL_MS % 1000) * 1000000L;
+            if(t.tv_nsec >= 1000000000L)
+            {
+                t.tv_sec++;
+                t.tv_nsec -= 1000000000L;
+            }
+            m_cond.timedwait(m_lock.get(), t);
+        }
+        out.swap(m_buf);
+        //在交换之后、释放m_lock之前拿文件锁，多个写入者按交换的顺序写文件
+        m_file_lock.lock();
+        m_lock.unlock();
+        write_out(out);
+        m_file_lock.unlock();
+        out.clear();
+    }
+}
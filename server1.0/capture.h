@@ -0,0 +1,74 @@
+#ifndef CAPTURE_H__
+#define CAPTURE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "locker.h"
+
+// 流量录制：把收到的请求字节、到达时间和连接的建立/关闭写入一个二进制日志，供tools/replay离线重放
+//
+// 文件格式（本机字节序）：
+//   文件头  capture_header：魔数 + 录制开始的墙上时间
+//   记录    capture_record + 数据（只有DATA有）
+// 记录里的sent是此刻服务器在这个连接上已经发出的应答字节数，重放时据此保持因果关系：
+// 必须等收到同样多的应答字节才发送这段数据（原来在等应答的客户端不会变成流水线，流水线的仍然是流水线）。
+// TLS连接记录的是解密后的明文。
+
+struct capture_header{
+    char magic[8];              //"HTTPCAP1"
+    uint64_t start_usec;        //CLOCK_REALTIME
+};
+
+struct capture_record{
+    uint64_t usec;              //距录制开始的微秒数
+    uint32_t conn;              //连接编号，按建立顺序从1开始，不复用
+    uint32_t type_len;          //高8位是类型，低24位是数据长度
+    uint64_t sent;              //服务器在这个连接上已经发出的字节数
+};
+
+class traffic_capture{
+
+public:
+    enum RECORD_TYPE { OPEN = 1, DATA, CLOSE };
+
+    static constexpr char MAGIC[8] = {'H', 'T', 'T', 'P', 'C', 'A', 'P', '1'};
+    static const int FLUSH_BYTES = 256 * 1024;          //缓冲区超过这个大小时唤醒写线程
+    static const int MAX_BUFFER = 16 * 1024 * 1024;     //写线程跟不上时，由记录的线程自己写文件
+    static const int FLUSH_INTERVAL_MS = 1000;
+
+    traffic_capture();
+    ~traffic_capture();
+
+    //打开（截断）日志文件，创建写线程
+    bool open(const char* path);
+
+    //新连接，返回连接编号
+    uint32_t on_open();
+    void on_data(uint32_t conn, uint64_t sent, const char* data, int len);
+    void on_close(uint32_t conn, uint64_t sent);
+
+    uint64_t records() const { return m_records.load(std::memory_order_relaxed); }
+
+private:
+    void append(uint32_t conn, int type, uint64_t sent, const char* data, int len);
+    bool write_out(const std::vector<char>& buf);
+
+    static void* worker(void* arg);
+    void run();
+
+private:
+    int m_fd;
+    uint64_t m_start;                   //CLOCK_MONOTONIC，微秒
+    std::atomic<uint32_t> m_next_conn;
+    std::atomic<uint64_t> m_records;
+
+    locker m_lock;                      //保护m_buf
+    cond m_cond;
+    std::vector<char> m_buf;
+    locker m_file_lock;                 //保证写入文件的顺序和记录的顺序一致
+    pthread_t m_thread;
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include "chunked_decoder.h"
+#include <string.h>
+
+void chunked_decoder::init()
+{
+    m_state = STATE_SIZE;
+    m_chunk_left = 0;
+    m_size_digits = 0;
+    m_line_len = 0;
+}
+
+static int hex_value(char c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+chunked_decoder::RESULT chunked_decoder::decode(char* buf, int len, int* consumed, int* out_len)
+{
+    int in = 0;         //读位置
+    int out = 0;        //写位置，始终不超过读位置
+
+    while(in < len)
+    {
+        char c = buf[in];
+        switch(m_state)
+        {
+            case STATE_SIZE:
+            {
+                int v = hex_value(c);
+                if(v >= 0)
+                {
+                    //块大小最多15位十六进制，防止溢出
+                    if(++m_size_digits > 15)
+                    {
+                        return CHUNK_ERROR;
+                    }
+                    m_chunk_left = m_chunk_left * 16 + v;
+                }
+                else if(m_size_digits == 0)
+                {
+                    return CHUNK_ERROR;
+                }
+                else if(c == ';' || c == ' ' || c == '\t')
+                {
+                    m_state = STATE_EXT;
+                }
+                else if(c == '\r')
+                {
+                    m_state = STATE_SIZE_LF;
+                }
+                else
+                {
+                    return CHUNK_ERROR;
+                }
+                in++;
+                break;
+            }
+            case STATE_EXT:
+            {
+                if(c == '\r')
+                {
+                    m_state = STATE_SIZE_LF;
+                }
+                in++;
+                break;
+            }
+            case STATE_SIZE_LF:
+            {
+                if(c != '\n')
+                {
+                    return CHUNK_ERROR;
+                }
+                in++;
+                m_size_digits = 0;
+                if(m_chunk_left == 0)
+                {
+                    //最后一个块，后面是可选的尾部头部和一个空行
+                    m_state = STATE_TRAILER;
+                    m_line_len = 0;
+                }
+                else
+                {
+                    m_state = STATE_DATA;
+                }
+                break;
+            }
+            case STATE_DATA:
+            {
+                //整段搬移块数据
+                int n = len - in;
+                if(n > m_chunk_left)
+                {
+                    n = (int)m_chunk_left;
+                }
+                if(out != in)
+                {
+                    memmove(buf + out, buf + in, n);
+                }
+                out += n;
+                in += n;
+                m_chunk_left -= n;
+                if(m_chunk_left == 0)
+                {
+                    m_state = STATE_DATA_CR;
+                }
+                break;
+            }
+            case STATE_DATA_CR:
+            {
+                if(c != '\r')
+                {
+                    return CHUNK_ERROR;
+                }
+                in++;
+                m_state = STATE_DATA_LF;
+                break;
+            }
+            case STATE_DATA_LF:
+            {
+                if(c != '\n')
+                {
+                    return CHUNK_ERROR;
+                }
+                in++;
+                m_state = STATE_SIZE;
+                break;
+            }
+            case STATE_TRAILER:
+            {
+                if(c == '\r')
+                {
+                    m_state = STATE_TRAILER_LF;
+                }
+                else
+                {
+                    m_line_len++;
+                }
+                in++;
+                break;
+            }
+            case STATE_TRAILER_LF:
+            {
+                if(c != '\n')
+                {
+                    return CHUNK_ERROR;
+                }
+                in++;
+                if(m_line_len == 0)
+                {
+                    *consumed = in;
+                    *out_len = out;
+                    return CHUNK_DONE;
+                }
+                m_line_len = 0;
+                m_state = STATE_TRAILER;
+                break;
+            }
+        }
+    }
+
+    *consumed = in;
+    *out_len = out;
+    return CHUNK_MORE;
+}
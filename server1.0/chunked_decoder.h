@@ -0,0 +1,51 @@
+#ifndef CHUNKED_DECODER_H__
+#define CHUNKED_DECODER_H__
+
+// Transfer-Encoding: chunked 请求体的增量解码器
+// 数据可以分任意多次到达，解码器记住自己处于哪个位置；
+// 解出的数据原地紧凑到缓冲区开头，不需要额外的缓冲区
+
+class chunked_decoder{
+
+public:
+    /*
+        解码结果
+        CHUNK_MORE  :输入已全部消耗，请求体尚未结束
+        CHUNK_DONE  :读到了最后一个块(0\r\n)和结尾的空行，请求体结束
+        CHUNK_ERROR :格式错误
+    */
+    enum RESULT {CHUNK_MORE = 0, CHUNK_DONE, CHUNK_ERROR};
+
+    chunked_decoder() { init(); }
+
+    void init();
+
+    /*
+        解码 buf 中的 len 个字节
+        consumed    :消耗的输入字节数（CHUNK_DONE时其后的字节属于下一个请求）
+        out_len     :解出的数据长度，数据位于 buf 开头
+    */
+    RESULT decode(char* buf, int len, int* consumed, int* out_len);
+
+private:
+    /*
+        解码器的状态
+        STATE_SIZE      :读块大小（十六进制）
+        STATE_EXT       :读块扩展（;name=value），忽略
+        STATE_SIZE_LF   :块大小行的\r之后，等待\n
+        STATE_DATA      :读块数据
+        STATE_DATA_CR   :块数据之后的\r
+        STATE_DATA_LF   :块数据之后的\n
+        STATE_TRAILER   :最后一个块之后的尾部头部行，忽略
+        STATE_TRAILER_LF:尾部行的\r之后，等待\n
+    */
+    enum STATE {STATE_SIZE = 0, STATE_EXT, STATE_SIZE_LF, STATE_DATA, STATE_DATA_CR, STATE_DATA_LF,
+                STATE_TRAILER, STATE_TRAILER_LF};
+
+    STATE m_state;
+    long long m_chunk_left;         //当前块还剩多少字节数据
+    int m_size_digits;              //块大小已经读了几位，防止溢出
+    int m_line_len;                 //当前尾部行的长度，0表示空行
+};
+
+#endif
@@ -0,0 +1,749 @@
+#include "co_conn.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <string>
+#include "http_conn.h"
+#include "chunked_decoder.h"
+
+extern const char* ok_200_title;
+extern const char* error_400_title;
+extern const char* error_400_form;
+extern const char* error_403_title;
+extern const char* error_403_form;
+extern const char* error_404_title;
+extern const char* error_404_form;
+extern const char* error_405_title;
+extern const char* error_405_form;
+extern const char* error_413_title;
+extern const char* error_413_form;
+extern const char* error_500_title;
+extern const char* error_500_form;
+extern const char* continue_100;
+
+static const char too_many_requests_429[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\n"
+                                            "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+// 解析完的请求头，指针都指向连接的读缓冲区
+struct co_request{
+    http_request view;
+    char* url;
+    bool keep_alive;
+    bool chunked;
+    bool expect_continue;
+    bool accept_gzip;
+    long long content_length;
+};
+
+// 生产者和推迟的应答在别的线程得到数据后，通过reactor恢复等在notified(fd)上的连接协程
+class co_waker : public body_waker{
+
+public:
+    co_waker(co_reactor* reactor, int fd) : m_reactor(reactor), m_fd(fd) {}
+    void wake() { m_reactor->notify(m_fd); }
+
+private:
+    co_reactor* m_reactor;
+    int m_fd;
+};
+
+// 应答头部格式化到写缓冲区，与http_conn的add_response系列输出相同的字节
+class co_writer : public response_sink{
+
+public:
+    co_writer(char* buf, bool keep_alive, body_waker* waker)
+        : m_buf(buf), m_len(0), m_keep_alive(keep_alive), m_waker(waker), m_producer(NULL), m_deferred(NULL) {}
+
+    bool add(const char* format, ...)
+    {
+        va_list arg_list;
+        va_start(arg_list, format);
+        int room = co_conn::WRITE_BUFFER_SIZE - 1 - m_len;
+        int len = vsnprintf(m_buf + m_len, room, format, arg_list);
+        va_end(arg_list);
+        if(len >= room)
+        {
+            return false;
+        }
+        m_len += len;
+        return true;
+    }
+
+    bool add_linger() { return add("Conection: %s\r\n", m_keep_alive ? "keep-alive" : "close"); }
+
+    //状态行 + 固定的text/html头部（文件和错误页），extra是状态行之后额外的头部行
+    bool add_page(int code, const char* title, long long content_len, const char* extra = "")
+    {
+        return add("HTTP/1.1 %d %s\r\n%s", code, title, extra) && add("Content-Length: %lld\r\n", content_len)
+            && add("Content-Type: %s\r\n", "text/html") && add_linger() && add("\r\n");
+    }
+
+    bool status(int code, const char* title) { return add("HTTP/1.1 %d %s\r\n", code, title); }
+    bool header(const char* name, const char* value) { return add("%s: %s\r\n", name, value); }
+    //应答体按字节拷贝（可以含'\0'）；写缓冲区放不下时拷贝到m_body，作为第二块iovec发送
+    bool body(const char* content_type, const char* data, int len)
+    {
+        if(len < 0 || !(add("Content-Type: %s\r\n", content_type) && add("Content-Length: %d\r\n", len)
+            && add_linger() && add("\r\n")))
+        {
+            return false;
+        }
+        if(m_len + len <= co_conn::WRITE_BUFFER_SIZE)
+        {
+            memcpy(m_buf + m_len, data, len);
+            m_len += len;
+        }
+        else
+        {
+            m_body.assign(data, len);
+        }
+        return true;
+    }
+    bool stream(const char* content_type, body_producer* producer)
+    {
+        if(!(add("Content-Type: %s\r\n", content_type) && add("Transfer-Encoding: chunked\r\n")
+            && add_linger() && add("\r\n")))
+        {
+            return false;
+        }
+        producer->set_waker(m_waker);
+        m_producer = producer;
+        return true;
+    }
+    bool defer(deferred_response* deferred)
+    {
+        m_deferred = deferred;
+        return true;
+    }
+    bool can_wait() const { return true; }
+
+    int length() const { return m_len; }
+    const std::string& extra_body() const { return m_body; }
+    void reset() { m_len = 0; m_body.clear(); }
+    body_producer* take_producer() { body_producer* p = m_producer; m_producer = NULL; return p; }
+    deferred_response* take_deferred() { deferred_response* d = m_deferred; m_deferred = NULL; return d; }
+
+private:
+    char* m_buf;
+    int m_len;
+    bool m_keep_alive;
+    body_waker* m_waker;
+    body_producer* m_producer;
+    deferred_response* m_deferred;
+    std::string m_body;
+};
+
+//请求头结束（\r\n\r\n之后）的位置，还不完整返回0
+static int head_length(const char* buf, int len)
+{
+    for(int i = 3; i < len; i++)
+    {
+        if(buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n' && buf[i - 3] == '\r')
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static char* skip_space(char* p)
+{
+    return p + strspn(p, " \t");
+}
+
+//就地解析请求行和头部：把每一行的\r\n换成'\0'。返回http_conn::NO_REQUEST表示成功，否则是错误码
+static int parse_head(char* buf, int head, co_request& r)
+{
+    memset(&r, 0, sizeof(r));
+    r.view.body_fd = -1;
+
+    char* line = buf;
+    char* end = buf + head;
+    bool first = true;
+    bool has_length = false;
+    while(line < end)
+    {
+        char* eol = strstr(line, "\r\n");
+        if(!eol || eol >= end)
+        {
+            return http_conn::BAD_REQUEST;
+        }
+        *eol = '\0';
+        if(first)
+        {
+            first = false;
+            //GET /index.html HTTP/1.1
+            char* url = strpbrk(line, " \t");
+            if(!url)
+            {
+                return http_conn::BAD_REQUEST;
+            }
+            *url++ = '\0';
+            if(strcasecmp(line, "GET") == 0)
+            {
+                r.view.method = http_conn::GET;
+            }
+            else if(strcasecmp(line, "POST") == 0)
+            {
+                r.view.method = http_conn::POST;
+            }
+            else if(strcasecmp(line, "PUT") == 0)
+            {
+                r.view.method = http_conn::PUT;
+            }
+            else
+            {
+                return http_conn::BAD_REQUEST;
+            }
+            char* version = strpbrk(url, " \t");
+            if(!version)
+            {
+                return http_conn::BAD_REQUEST;
+            }
+            *version++ = '\0';
+            if(strcasecmp(version, "HTTP/1.1") != 0)
+            {
+                return http_conn::BAD_REQUEST;
+            }
+            if(strncasecmp(url, "http://", 7) == 0)
+            {
+                url = strchr(url + 7, '/');
+            }
+            if(!url || url[0] != '/')
+            {
+                return http_conn::BAD_REQUEST;
+            }
+            r.url = url;
+            r.view.headers = eol + 2;
+            r.view.headers_len = end - r.view.headers;
+        }
+        else if(line[0] != '\0')
+        {
+            if(strncasecmp(line, "Connection:", 11) == 0)
+            {
+                r.keep_alive = strcasecmp(skip_space(line + 11), "keep-alive") == 0;
+            }
+            else if(strncasecmp(line, "Content-Length:", 15) == 0)
+            {
+                long long length = atoll(skip_space(line + 15));
+                if(length < 0 || (has_length && length != r.content_length))
+                {
+                    return http_conn::BAD_REQUEST;
+                }
+                r.content_length = length;
+                has_length = true;
+            }
+            else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+            {
+                if(strcasecmp(skip_space(line + 18), "chunked") != 0)
+                {
+                    return http_conn::BAD_REQUEST;     //只支持chunked
+                }
+                r.chunked = true;
+            }
+            else if(strncasecmp(line, "Expect:", 7) == 0)
+            {
+                r.expect_continue = strcasecmp(skip_space(line + 7), "100-continue") == 0;
+            }
+            else if(strncasecmp(line, "Host:", 5) == 0)
+            {
+                r.view.host = skip_space(line + 5);
+            }
+            else if(strncasecmp(line, "Accept-Encoding:", 16) == 0)
+            {
+                r.accept_gzip = strcasestr(line + 16, "gzip") != NULL;
+            }
+        }
+        line = eol + 2;
+    }
+
+    //Content-Length和chunked同时出现：RFC 7230 3.3.3，拒绝
+    if(has_length && r.chunked)
+    {
+        return http_conn::BAD_REQUEST;
+    }
+
+    r.view.path = r.url;
+    r.view.path_len = strcspn(r.url, "?");
+    r.view.query = (r.url[r.view.path_len] == '?') ? r.url + r.view.path_len + 1 : NULL;
+    r.view.keep_alive = r.keep_alive;
+    r.view.chunked = r.chunked;
+    r.view.content_length = r.chunked ? -1 : r.content_length;
+    return http_conn::NO_REQUEST;
+}
+
+//写出iov中的所有数据，socket写满时等待可写；对方关闭或超时返回false
+static task<bool> send_all(co_reactor* reactor, int fd, struct iovec* iov, int count)
+{
+    while(count > 0)
+    {
+        ssize_t n = writev(fd, iov, count);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                co_return false;
+            }
+            if(!co_await reactor->writable(fd, co_conn::IO_TIMEOUT_MS))
+            {
+                co_return false;
+            }
+            continue;
+        }
+        while(count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    co_return true;
+}
+
+//向buf读入最多room字节，返回读到的字节数；对方关闭、出错或超时返回0
+static task<int> recv_some(co_reactor* reactor, int fd, char* buf, int room, int timeout_ms)
+{
+    while(true)
+    {
+        ssize_t n = recv(fd, buf, room, 0);
+        if(n > 0)
+        {
+            co_return (int)n;
+        }
+        if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            co_return 0;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            if(!co_await reactor->readable(fd, timeout_ms))
+            {
+                co_return 0;
+            }
+        }
+    }
+}
+
+static bool deliver_body(request_handler* handler, http_request& req, const char* data, int len)
+{
+    if(req.body_fd < 0)
+    {
+        return handler->on_body(req, data, len);
+    }
+    while(len > 0)
+    {
+        ssize_t n = ::write(req.body_fd, data, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+//读完请求体交给处理器。请求体从buf + head开始，每一段交付后丢弃，buf的头部（请求行和头部）保持不动；
+//返回时*len是head加上读过头的、属于下一个请求的字节数（已经移到buf + head）
+static task<int> read_body(co_reactor* reactor, int fd, char* buf, int head, int* len,
+                           co_request& r, request_handler* handler)
+{
+    chunked_decoder decoder;
+    long long remain = r.content_length;
+    long long received = 0;
+    int pos = head;
+    while(true)
+    {
+        if(pos < *len)
+        {
+            int consumed = 0, out_len = 0;
+            bool done = false;
+            if(r.chunked)
+            {
+                chunked_decoder::RESULT ret = decoder.decode(buf + pos, *len - pos, &consumed, &out_len);
+                if(ret == chunked_decoder::CHUNK_ERROR)
+                {
+                    co_return http_conn::BAD_REQUEST;
+                }
+                done = (ret == chunked_decoder::CHUNK_DONE);
+            }
+            else
+            {
+                consumed = out_len = (*len - pos < remain) ? *len - pos : (int)remain;
+                remain -= consumed;
+                done = (remain == 0);
+            }
+            received += out_len;
+            if(received > http_conn::m_max_body_size)
+            {
+                co_return http_conn::PAYLOAD_TOO_LARGE;
+            }
+            if(out_len > 0 && !deliver_body(handler, r.view, buf + pos, out_len))
+            {
+                co_return http_conn::INTERNAL_ERROR;
+            }
+            pos += consumed;
+            if(done)
+            {
+                memmove(buf + head, buf + pos, *len - pos);
+                *len = head + (*len - pos);
+                co_return http_conn::GET_REQUEST;
+            }
+        }
+
+        //这一段已经交付，丢弃后继续读
+        *len = pos = head;
+        int n = co_await recv_some(reactor, fd, buf + head, co_conn::READ_BUFFER_SIZE - head, co_conn::IO_TIMEOUT_MS);
+        if(n == 0)
+        {
+            co_return http_conn::CLOSED_CONNECTION;
+        }
+        *len += n;
+    }
+}
+
+//流式应答：按块生成并发送，直到最后一个块
+static task<bool> send_stream(co_reactor* reactor, int fd, body_producer* producer)
+{
+    static const int HEAD_LEN = 16;
+    char* chunk = new char[HEAD_LEN + co_conn::STREAM_CHUNK_SIZE + 2];
+    bool ok = true;
+    while(ok)
+    {
+        char* data = chunk + HEAD_LEN;
+        int len = producer->produce(data, co_conn::STREAM_CHUNK_SIZE);
+        if(len == body_producer::PENDING)
+        {
+            //数据由别的线程产生：等它的waker通知
+            co_await reactor->notified(fd);
+            continue;
+        }
+        if(len < 0 || len > co_conn::STREAM_CHUNK_SIZE)
+        {
+            ok = false;
+            break;
+        }
+        struct iovec iv;
+        if(len == 0)
+        {
+            iv.iov_base = (void*)"0\r\n\r\n";
+            iv.iov_len = 5;
+            ok = co_await send_all(reactor, fd, &iv, 1);
+            break;
+        }
+        char head[HEAD_LEN];
+        int head_len = snprintf(head, sizeof(head), "%x\r\n", len);
+        memcpy(data - head_len, head, head_len);
+        memcpy(data + len, "\r\n", 2);
+        iv.iov_base = data - head_len;
+        iv.iov_len = head_len + len + 2;
+        ok = co_await send_all(reactor, fd, &iv, 1);
+    }
+    delete [] chunk;
+    delete producer;
+    co_return ok;
+}
+
+//错误页，返回false时连接要关闭
+static bool error_page(co_writer& out, int code)
+{
+    switch(code)
+    {
+        case http_conn::BAD_REQUEST: return out.add_page(400, error_400_title, strlen(error_400_form)) && out.add("%s", error_400_form);
+        case http_conn::FORBIDDEN_REQUEST: return out.add_page(403, error_403_title, strlen(error_403_form)) && out.add("%s", error_403_form);
+        case http_conn::NO_RESOURCE: return out.add_page(404, error_404_title, strlen(error_404_form)) && out.add("%s", error_404_form);
+        case http_conn::METHOD_NOT_ALLOWED: return out.add_page(405, error_405_title, strlen(error_405_form)) && out.add("%s", error_405_form);
+        case http_conn::PAYLOAD_TOO_LARGE: return out.add_page(413, error_413_title, strlen(error_413_form)) && out.add("%s", error_413_form);
+        default: return out.add_page(500, error_500_title, strlen(error_500_form)) && out.add("%s", error_500_form);
+    }
+}
+
+conn_task co_conn::serve(co_reactor* reactor, int fd, sockaddr_in addr)
+{
+    if(!reactor->attach(fd))
+    {
+        close(fd);
+        if(http_conn::m_limiter)
+        {
+            http_conn::m_limiter->on_close(addr.sin_addr.s_addr);
+        }
+        if(http_conn::m_worker_stats)
+        {
+            http_conn::m_worker_stats->count_close();
+        }
+        co_return;
+    }
+
+    sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    int server_port = (getsockname(fd, (struct sockaddr*)&local, &local_len) == 0) ? ntohs(local.sin_port) : 0;
+    co_waker waker(reactor, fd);
+
+    char buf[READ_BUFFER_SIZE];
+    char out_buf[WRITE_BUFFER_SIZE];
+    char real_file[http_conn::FILENAME_LEN];
+    int len = 0;
+    int served = 0;
+    bool keep_alive = true;
+    request_arena arena;        //和连接一起放在协程帧里，每个请求回卷
+
+    while(keep_alive)
+    {
+        //读到空行为止：两个请求之间按空闲超时，请求头读到一半按I/O超时
+        int head;
+        while((head = head_length(buf, len)) == 0 && len < READ_BUFFER_SIZE - 1)
+        {
+            int n = co_await recv_some(reactor, fd, buf + len, READ_BUFFER_SIZE - 1 - len,
+                                       len ? IO_TIMEOUT_MS : IDLE_TIMEOUT_MS);
+            if(n == 0)
+            {
+                break;
+            }
+            len += n;
+        }
+        if(head == 0 && len < READ_BUFFER_SIZE - 1)
+        {
+            break;      //对方关闭、出错或超时
+        }
+
+        //请求头超过了读缓冲区也按400处理
+        co_request r;
+        int ret = head ? parse_head(buf, head, r) : (int)http_conn::BAD_REQUEST;
+        arena.reset();
+        r.view.arena = &arena;
+        r.view.remote_addr = addr.sin_addr.s_addr;
+        r.view.remote_port = ntohs(addr.sin_port);
+        r.view.server_port = server_port;
+        keep_alive = (ret == http_conn::NO_REQUEST) && r.keep_alive;
+
+        request_handler* handler = NULL;
+        if(ret == http_conn::NO_REQUEST)
+        {
+            if(http_conn::m_worker_stats)
+            {
+                http_conn::m_worker_stats->count_request();
+            }
+            if(http_conn::m_router)
+            {
+                handler = http_conn::m_router->match(r.view.method, r.view.path, r.view.path_len);
+            }
+            if(http_conn::m_limiter && !http_conn::m_limiter->on_request(addr.sin_addr.s_addr))
+            {
+                struct iovec iv;
+                iv.iov_base = (void*)too_many_requests_429;
+                iv.iov_len = sizeof(too_many_requests_429) - 1;
+                co_await send_all(reactor, fd, &iv, 1);
+                break;
+            }
+            //有请求体时拒绝的话请求体不会被读取，应答后只能关闭连接
+            if(r.view.method != http_conn::GET && !handler)
+            {
+                ret = http_conn::METHOD_NOT_ALLOWED;
+            }
+            else if(r.content_length > http_conn::m_max_body_size)
+            {
+                ret = http_conn::PAYLOAD_TOO_LARGE;
+            }
+            else if(handler && !handler->on_headers(r.view))
+            {
+                ret = http_conn::FORBIDDEN_REQUEST;
+            }
+            else if(!handler && (r.chunked || r.content_length > 0))
+            {
+                keep_alive = false;     //带请求体的静态文件请求：不读请求体，应答后关闭
+            }
+        }
+        if(ret != http_conn::NO_REQUEST)
+        {
+            keep_alive = false;
+        }
+
+        //请求体：读完之后len只剩下一个请求的字节
+        if(ret == http_conn::NO_REQUEST && handler && (r.chunked || r.content_length > 0))
+        {
+            //和应答走同一条发送路径，socket暂时写满时等待可写
+            if(r.expect_continue)
+            {
+                struct iovec iv;
+                iv.iov_base = (void*)continue_100;
+                iv.iov_len = strlen(continue_100);
+                if(!co_await send_all(reactor, fd, &iv, 1))
+                {
+                    handler->on_abort(r.view);
+                    break;
+                }
+            }
+            ret = co_await read_body(reactor, fd, buf, head, &len, r, handler);
+            if(ret != http_conn::GET_REQUEST)
+            {
+                handler->on_abort(r.view);
+                if(ret == http_conn::CLOSED_CONNECTION)
+                {
+                    break;
+                }
+                keep_alive = false;
+            }
+            else
+            {
+                ret = http_conn::NO_REQUEST;
+            }
+        }
+
+        //应答：头部在out_buf，文件内容直接从mmap发送，流式应答体随后逐块生成
+        co_writer out(out_buf, keep_alive, &waker);
+        struct iovec iv[2];
+        int iv_count = 1;
+        char* file_address = NULL;
+        struct stat file_stat;
+        shared_response* listing = NULL;
+        body_producer* producer = NULL;
+        if(ret == http_conn::NO_REQUEST && handler)
+        {
+            http_response resp(&out);
+            bool handled = handler->handle(r.view, resp);
+            //推迟的应答：等结果时协程挂起，reactor继续处理别的连接
+            deferred_response* deferred;
+            while(handled && (deferred = out.take_deferred()) != NULL)
+            {
+                while(!deferred->ready(&waker))
+                {
+                    co_await reactor->notified(fd);
+                }
+                http_response later(&out);
+                handled = deferred->respond(later);
+                delete deferred;
+            }
+            if(!handled)
+            {
+                //丢弃处理器已经写了一部分的应答
+                delete out.take_deferred();
+                delete out.take_producer();
+                out.reset();
+                error_page(out, http_conn::INTERNAL_ERROR);
+            }
+            producer = out.take_producer();
+        }
+        else if(ret == http_conn::NO_REQUEST)
+        {
+            dir_target dir;
+            dir.gzip_ok = r.accept_gzip;
+            ret = http_conn::map_file(http_conn::m_vhosts->lookup(r.view.host), r.url, real_file, &file_stat, &file_address, &dir);
+            if(ret == http_conn::FILE_REQUEST)
+            {
+                out.add_page(200, ok_200_title, file_stat.st_size,
+                             dir.encoding ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" : "");
+                iv[1].iov_base = file_address;
+                iv[1].iov_len = file_stat.st_size;
+                iv_count = 2;
+            }
+            else if(ret == http_conn::DIR_REDIRECT)
+            {
+                char location[READ_BUFFER_SIZE + 16];
+                int path_len = r.view.path_len;
+                snprintf(location, sizeof(location), "Location: %.*s/%s\r\n", path_len, r.url, r.url + path_len);
+                if(!out.add_page(301, "Moved Permanently", 0, location))
+                {
+                    out.reset();
+                    error_page(out, http_conn::BAD_REQUEST);
+                }
+            }
+            else if(ret == http_conn::DIR_LISTING)
+            {
+                //目录列表：头部拷贝到out_buf，应答体直接引用，发送完释放
+                listing = dir.listing;
+                out.add("%s", listing->head(keep_alive).c_str());
+                iv[1].iov_base = (void*)listing->body().data();
+                iv[1].iov_len = listing->body().size();
+                iv_count = 2;
+            }
+            else
+            {
+                error_page(out, ret);
+            }
+        }
+        else
+        {
+            error_page(out, ret);
+        }
+        iv[0].iov_base = out_buf;
+        iv[0].iov_len = out.length();
+        if(!out.extra_body().empty())
+        {
+            iv[1].iov_base = (void*)out.extra_body().data();
+            iv[1].iov_len = out.extra_body().size();
+            iv_count = 2;
+        }
+
+        bool ok = co_await send_all(reactor, fd, iv, iv_count);
+        if(file_address)
+        {
+            munmap(file_address, file_stat.st_size);
+        }
+        if(listing)
+        {
+            listing->unref();
+        }
+        if(producer)
+        {
+            if(ok)
+            {
+                ok = co_await send_stream(reactor, fd, producer);
+            }
+            else
+            {
+                delete producer;
+            }
+        }
+        if(!ok)
+        {
+            break;
+        }
+
+        //流水线：读过头的字节属于下一个请求
+        memmove(buf, buf + head, len - head);
+        len -= head;
+
+        //一个连接连续处理很多请求时让出，同一个reactor上的其它连接不会等太久
+        if(++served % 16 == 0)
+        {
+            co_await reactor->yield();
+        }
+    }
+
+    reactor->detach(fd);
+    close(fd);
+    if(http_conn::m_limiter)
+    {
+        http_conn::m_limiter->on_close(addr.sin_addr.s_addr);
+    }
+    if(http_conn::m_worker_stats)
+    {
+        http_conn::m_worker_stats->count_close();
+    }
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef CO_CONN_H__
+#define CO_CONN_H__
+
+#include "coroutine.h"
+
+#if defined(__cpp_impl_coroutine)
+
+// 协程模型下的HTTP/1.1连接（-K）：一个连接就是一个协程，读请求头、读请求体、写应答、keep-alive循环
+// 都写成顺序代码，阻塞的地方 co_await 所在reactor的事件。
+// 与http_conn共用路由表、处理器接口、静态文件的映射和限流器，应答与http_conn逐字节相同；
+// 不支持TLS、HTTP/2和WebSocket升级（这些连接请使用默认的线程池模型）。
+
+class co_conn{
+
+public:
+    static const int READ_BUFFER_SIZE = 2048;   //与http_conn相同，请求头必须放得下
+    static const int WRITE_BUFFER_SIZE = 1024;
+    static const int STREAM_CHUNK_SIZE = 8192;
+    static const int IDLE_TIMEOUT_MS = 60000;   //keep-alive连接两个请求之间
+    static const int IO_TIMEOUT_MS = 30000;     //请求进行中读写阻塞的最长时间
+
+    //reactor收到新连接时调用，协程运行到连接关闭
+    static conn_task serve(co_reactor* reactor, int fd, sockaddr_in addr);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,372 @@
+#include "coroutine.h"
+#include "profiler.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+std::atomic<uint64_t> frame_pool::m_in_use(0);
+
+// 每个线程的空闲链表，空闲的块头部存放下一块的指针
+static thread_local void* free_lists[frame_pool::CLASSES];
+static thread_local char* chunk_cursor = NULL;
+static thread_local char* chunk_end = NULL;
+
+void* frame_pool::allocate(size_t n)
+{
+    size_t cls = (n + GRANULE - 1) / GRANULE;
+    if(cls >= (size_t)CLASSES)
+    {
+        void* p = malloc(n);
+        if(!p)
+        {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+    m_in_use.fetch_add(cls * GRANULE, std::memory_order_relaxed);
+
+    void* p = free_lists[cls];
+    if(p)
+    {
+        free_lists[cls] = *(void**)p;
+        return p;
+    }
+
+    size_t size = cls * GRANULE;
+    if(chunk_cursor == NULL || chunk_cursor + size > chunk_end)
+    {
+        //当前块剩下的部分不再使用，帧的大小种类很少，浪费有限
+        chunk_cursor = (char*)malloc(CHUNK_SIZE);
+        if(!chunk_cursor)
+        {
+            throw std::bad_alloc();
+        }
+        chunk_end = chunk_cursor + CHUNK_SIZE;
+    }
+    p = chunk_cursor;
+    chunk_cursor += size;
+    return p;
+}
+
+void frame_pool::deallocate(void* p, size_t n)
+{
+    size_t cls = (n + GRANULE - 1) / GRANULE;
+    if(cls >= (size_t)CLASSES)
+    {
+        free(p);
+        return;
+    }
+    m_in_use.fetch_sub(cls * GRANULE, std::memory_order_relaxed);
+    *(void**)p = free_lists[cls];
+    free_lists[cls] = p;
+}
+
+co_reactor::co_reactor(co_handler handler):
+    m_handler(handler), m_epollfd(-1), m_eventfd(-1), m_connections(0) {
+
+    m_slots = new fd_slot[FD_LIMIT];
+    for(int i = 0; i < FD_LIMIT; i++)
+    {
+        m_slots[i].waiter = nullptr;
+        m_slots[i].ready = 0;
+        m_slots[i].wanted = 0;
+        m_slots[i].deadline = 0;
+        m_slots[i].timer_at = 0;
+        m_slots[i].timed_out = false;
+    }
+}
+
+co_reactor::~co_reactor()
+{
+    if(m_epollfd != -1)
+    {
+        close(m_epollfd);
+    }
+    if(m_eventfd != -1)
+    {
+        close(m_eventfd);
+    }
+    delete [] m_slots;
+}
+
+bool co_reactor::start()
+{
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_epollfd < 0 || m_eventfd < 0)
+    {
+        printf("co_reactor: %s\n", strerror(errno));
+        return false;
+    }
+    epoll_event ev;
+    ev.data.fd = m_eventfd;
+    ev.events = EPOLLIN;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_eventfd, &ev);
+
+    if(pthread_create(&m_thread, NULL, worker, this) != 0)
+    {
+        return false;
+    }
+    pthread_detach(m_thread);
+    return true;
+}
+
+void co_reactor::adopt(int fd, const sockaddr_in& addr)
+{
+    m_inbox_lock.lock();
+    m_inbox.push_back(std::make_pair(fd, addr));
+    m_inbox_lock.unlock();
+    uint64_t one = 1;
+    ::write(m_eventfd, &one, sizeof(one));
+}
+
+void co_reactor::notify(int fd)
+{
+    m_inbox_lock.lock();
+    m_notified.push_back(fd);
+    m_inbox_lock.unlock();
+    uint64_t one = 1;
+    ::write(m_eventfd, &one, sizeof(one));
+}
+
+bool co_reactor::attach(int fd)
+{
+    if(fd >= FD_LIMIT)
+    {
+        return false;
+    }
+    fd_slot& slot = m_slots[fd];
+    slot.waiter = nullptr;
+    slot.ready = 0;
+    slot.deadline = 0;
+    slot.timed_out = false;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    epoll_event ev;
+    ev.data.fd = fd;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    if(epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        return false;
+    }
+    m_connections.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void co_reactor::detach(int fd)
+{
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, NULL);
+    fd_slot& slot = m_slots[fd];
+    slot.waiter = nullptr;
+    slot.ready = 0;
+    slot.deadline = 0;
+    m_connections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool co_reactor::io_awaiter::await_ready()
+{
+    fd_slot& slot = reactor->m_slots[fd];
+    if(slot.ready & events)
+    {
+        slot.ready &= ~events;
+        return true;
+    }
+    return false;
+}
+
+void co_reactor::io_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    fd_slot& slot = reactor->m_slots[fd];
+    slot.waiter = h;
+    slot.wanted = events;
+    slot.timed_out = false;
+    slot.deadline = 0;
+    if(timeout_ms >= 0)
+    {
+        slot.deadline = now_ms() + timeout_ms;
+        if(slot.timer_at == 0 || slot.deadline < slot.timer_at)
+        {
+            slot.timer_at = slot.deadline;
+            reactor->add_timer(slot.deadline, fd, nullptr);
+        }
+    }
+}
+
+bool co_reactor::io_awaiter::await_resume()
+{
+    fd_slot& slot = reactor->m_slots[fd];
+    slot.ready &= ~events;
+    return !slot.timed_out;
+}
+
+void co_reactor::sleep_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    reactor->add_timer(now_ms() + ms, -1, h);
+}
+
+void co_reactor::add_timer(uint64_t deadline, int fd, std::coroutine_handle<> handle)
+{
+    timer t;
+    t.deadline = deadline;
+    t.fd = fd;
+    t.handle = handle;
+    m_timers.push(t);
+}
+
+uint64_t co_reactor::now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void* co_reactor::worker(void* arg)
+{
+    co_reactor* reactor = (co_reactor*)arg;
+    profiler::register_thread("reactor");
+    reactor->run();
+    profiler::unregister_thread();
+    return reactor;
+}
+
+//fd上到达了事件：记下来，等待它的协程在这里恢复
+void co_reactor::wake(int fd, uint32_t events)
+{
+    fd_slot& slot = m_slots[fd];
+    //出错和对方关闭时读写都要醒来，由recv/send返回具体的错误
+    if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+        slot.ready |= READABLE | WRITABLE;
+    }
+    if(events & EPOLLIN)
+    {
+        slot.ready |= READABLE;
+    }
+    if(events & EPOLLOUT)
+    {
+        slot.ready |= WRITABLE;
+    }
+    if(slot.waiter && (slot.ready & slot.wanted))
+    {
+        std::coroutine_handle<> h = slot.waiter;
+        slot.waiter = nullptr;
+        slot.deadline = 0;
+        h.resume();
+    }
+}
+
+void co_reactor::expire(uint64_t now)
+{
+    while(!m_timers.empty() && m_timers.top().deadline <= now)
+    {
+        timer t = m_timers.top();
+        m_timers.pop();
+        if(t.fd < 0)
+        {
+            t.handle.resume();
+            continue;
+        }
+
+        fd_slot& slot = m_slots[t.fd];
+        if(t.deadline != slot.timer_at)
+        {
+            continue;       //被更早的项取代了
+        }
+        slot.timer_at = 0;
+        if(!slot.waiter || slot.deadline == 0)
+        {
+            continue;       //已经被I/O唤醒，或者连接已经关闭
+        }
+        if(slot.deadline > now)
+        {
+            //后来又以更晚的期限等待：按新的期限重新排队
+            slot.timer_at = slot.deadline;
+            add_timer(slot.deadline, t.fd, nullptr);
+            continue;
+        }
+        std::coroutine_handle<> h = slot.waiter;
+        slot.waiter = nullptr;
+        slot.deadline = 0;
+        slot.timed_out = true;
+        h.resume();
+    }
+}
+
+void co_reactor::run()
+{
+    epoll_event events[MAX_EVENTS];
+    std::vector<std::pair<int, sockaddr_in> > incoming;
+    std::vector<int> notified;
+    while(true)
+    {
+        //yield的协程：只运行这一轮之前排队的，新排队的留到下一轮，避免饿死I/O
+        size_t ready = m_ready.size();
+        for(size_t i = 0; i < ready; i++)
+        {
+            std::coroutine_handle<> h = m_ready.front();
+            m_ready.pop_front();
+            h.resume();
+        }
+
+        int timeout = -1;
+        if(!m_ready.empty())
+        {
+            timeout = 0;
+        }
+        else if(!m_timers.empty())
+        {
+            uint64_t now = now_ms();
+            timeout = m_timers.top().deadline > now ? (int)(m_timers.top().deadline - now) : 0;
+        }
+
+        int num = epoll_wait(m_epollfd, events, MAX_EVENTS, timeout);
+        if(num < 0 && errno != EINTR)
+        {
+            printf("co_reactor epoll failure\n");
+            break;
+        }
+
+        for(int i = 0; i < num; i++)
+        {
+            int fd = events[i].data.fd;
+            if(fd != m_eventfd)
+            {
+                wake(fd, events[i].events);
+                continue;
+            }
+
+            uint64_t count;
+            while(read(m_eventfd, &count, sizeof(count)) > 0)
+            {
+            }
+            m_inbox_lock.lock();
+            incoming.swap(m_inbox);
+            notified.swap(m_notified);
+            m_inbox_lock.unlock();
+            for(size_t j = 0; j < incoming.size(); j++)
+            {
+                m_handler(this, incoming[j].first, incoming[j].second);
+            }
+            incoming.clear();
+            for(size_t j = 0; j < notified.size(); j++)
+            {
+                m_slots[notified[j]].ready |= NOTIFIED;
+                wake(notified[j], 0);
+            }
+            notified.clear();
+        }
+
+        expire(now_ms());
+    }
+}
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef COROUTINE_H__
+#define COROUTINE_H__
+
+// 协程连接模型的运行时（需要C++20：g++ -std=c++20）
+// 每个连接是一个协程，读写阻塞时 co_await 所在reactor的可读/可写/定时事件，
+// 请求的处理过程就是一段顺序代码，不需要状态机在每次唤醒时恢复进度。
+// 每个reactor是一个线程，有自己的epoll、定时器堆和就绪队列；连接一旦交给某个reactor，
+// 它的协程只在这个线程上被恢复，协程帧从线程私有的内存池分配和释放，不需要任何锁。
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <netinet/in.h>
+#include "locker.h"
+
+// 协程帧的内存池：按256字节分级，每个线程一组空闲链表，帧在哪个线程创建就在哪个线程释放
+class frame_pool{
+
+public:
+    static const int GRANULE = 256;
+    static const int CLASSES = 64;                  //最大16KB，更大的帧直接malloc
+    static const int CHUNK_SIZE = 64 * 1024;        //每次向系统申请的块
+
+    static void* allocate(size_t n);
+    static void deallocate(void* p, size_t n);
+
+    //所有线程正在使用的帧字节数（按分级取整后）
+    static uint64_t bytes_in_use() { return m_in_use.load(std::memory_order_relaxed); }
+
+private:
+    static std::atomic<uint64_t> m_in_use;
+};
+
+// 连接协程的返回类型：创建后立即运行，结束时自己释放，没有人等待它
+struct conn_task{
+    struct promise_type{
+        conn_task get_return_object() { return conn_task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new(size_t n) { return frame_pool::allocate(n); }
+        static void operator delete(void* p, size_t n) { frame_pool::deallocate(p, n); }
+    };
+};
+
+// 可以被 co_await 的子协程，返回T；被等待时才开始运行，结束时直接切回等待者（对称转移，不增加栈深度）
+template<typename T>
+class task{
+
+public:
+    struct promise_type{
+        T value;
+        std::coroutine_handle<> continuation;
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct final_awaiter{
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+            {
+                return h.promise().continuation;
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = v; }
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new(size_t n) { return frame_pool::allocate(n); }
+        static void operator delete(void* p, size_t n) { frame_pool::deallocate(p, n); }
+    };
+
+    explicit task(std::coroutine_handle<promise_type> h) : m_handle(h) {}
+    task(task&& other) : m_handle(other.m_handle) { other.m_handle = nullptr; }
+    task(const task&) = delete;
+    ~task()
+    {
+        if(m_handle)
+        {
+            m_handle.destroy();
+        }
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter)
+    {
+        m_handle.promise().continuation = waiter;
+        return m_handle;
+    }
+    T await_resume() { return m_handle.promise().value; }
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+class co_reactor;
+
+// 新连接交给reactor后在它的线程上运行的协程，由使用者提供（co_conn.cpp）
+typedef conn_task (*co_handler)(co_reactor* reactor, int fd, sockaddr_in addr);
+
+class co_reactor{
+
+public:
+    static const int FD_LIMIT = 65536;
+    static const int MAX_EVENTS = 256;
+
+    explicit co_reactor(co_handler handler);
+    ~co_reactor();
+
+    //创建epoll和线程，失败返回false
+    bool start();
+
+    //把刚accept的连接交给这个reactor，可以在任何线程调用
+    void adopt(int fd, const sockaddr_in& addr);
+
+    int connections() const { return m_connections.load(std::memory_order_relaxed); }
+
+    //通知等在notified(fd)上的连接协程（如生产者的数据到了），可以在任何线程调用
+    void notify(int fd);
+
+    //下面的函数只能在reactor自己的线程（即连接协程中）调用
+
+    //连接协程开始时登记fd（边沿触发，同时关注读写），关闭fd之前注销
+    bool attach(int fd);
+    void detach(int fd);
+
+    // co_await readable(fd, ms)：fd可读（或出错/对方关闭）时返回true，超时返回false；ms<0表示不超时
+    struct io_awaiter{
+        co_reactor* reactor;
+        int fd;
+        uint32_t events;
+        int timeout_ms;
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> h);
+        bool await_resume();
+    };
+    io_awaiter readable(int fd, int timeout_ms = -1) { return io_awaiter{this, fd, READABLE, timeout_ms}; }
+    io_awaiter writable(int fd, int timeout_ms = -1) { return io_awaiter{this, fd, WRITABLE, timeout_ms}; }
+    //等notify(fd)；之前已经通知过就立即返回
+    io_awaiter notified(int fd) { return io_awaiter{this, fd, NOTIFIED, -1}; }
+
+    // co_await sleep(ms)
+    struct sleep_awaiter{
+        co_reactor* reactor;
+        int ms;
+
+        bool await_ready() { return ms <= 0; }
+        void await_suspend(std::coroutine_handle<> h);
+        void await_resume() {}
+    };
+    sleep_awaiter sleep(int ms) { return sleep_awaiter{this, ms}; }
+
+    // co_await yield()：排到就绪队列末尾，让同一个reactor上的其它连接先运行
+    struct yield_awaiter{
+        co_reactor* reactor;
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> h) { reactor->m_ready.push_back(h); }
+        void await_resume() {}
+    };
+    yield_awaiter yield() { return yield_awaiter{this}; }
+
+private:
+    enum { READABLE = 1, WRITABLE = 2, NOTIFIED = 4 };
+
+    //每个fd一个槽位：等待它的协程、已经到达但还没被消费的事件（边沿触发不会再通知）
+    struct fd_slot{
+        std::coroutine_handle<> waiter;
+        uint32_t ready;
+        uint32_t wanted;
+        uint64_t deadline;          //等待的超时时刻，0表示不超时
+        uint64_t timer_at;          //定时器堆里这个fd最早的有效项，0表示没有；到期时按deadline重新检查，
+                                    //所以连续的等待不需要每次都入堆
+        bool timed_out;
+    };
+
+    //fd >= 0：fd的等待超时；fd == -1：sleep，到期恢复handle
+    struct timer{
+        uint64_t deadline;
+        int fd;
+        std::coroutine_handle<> handle;
+        bool operator>(const timer& other) const { return deadline > other.deadline; }
+    };
+
+    static void* worker(void* arg);
+    void run();
+    void wake(int fd, uint32_t events);
+    void add_timer(uint64_t deadline, int fd, std::coroutine_handle<> handle);
+    void expire(uint64_t now);
+    static uint64_t now_ms();
+
+private:
+    co_handler m_handler;
+    int m_epollfd;
+    int m_eventfd;                  //adopt唤醒reactor
+    pthread_t m_thread;
+
+    fd_slot* m_slots;
+    std::priority_queue<timer, std::vector<timer>, std::greater<timer> > m_timers;
+    std::deque<std::coroutine_handle<> > m_ready;
+
+    locker m_inbox_lock;
+    std::vector<std::pair<int, sockaddr_in> > m_inbox;
+    std::vector<int> m_notified;    //notify的fd，和m_inbox一起由m_inbox_lock保护
+    std::atomic<int> m_connections;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,374 @@
+#include "dir_index.h"
+#include "file_cache.h"
+#include "micro_cache.h"
+#include "alloc_guard.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+char dir_index::s_names[MAX_NAMES][NAME_LEN] = { "index.html", "index.htm" };
+int dir_index::s_name_count = 2;
+
+static __thread dir_index* t_index = NULL;
+
+//FNV-1a
+static uint32_t path_hash(const char* path)
+{
+    uint32_t h = 2166136261u;
+    for(; *path; ++path)
+    {
+        h ^= (unsigned char)*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bool dir_index::configure(const char* names)
+{
+    if(!names)
+    {
+        return true;
+    }
+
+    s_name_count = 0;
+    const char* p = names;
+    while(*p)
+    {
+        int len = strcspn(p, ",");
+        if(len == 0 || len >= NAME_LEN || s_name_count == MAX_NAMES || memchr(p, '/', len))
+        {
+            return false;
+        }
+        memcpy(s_names[s_name_count], p, len);
+        s_names[s_name_count][len] = '\0';
+        s_name_count++;
+        p += len;
+        if(*p == ',')
+        {
+            p++;
+        }
+    }
+    return s_name_count > 0;
+}
+
+dir_index* dir_index::local(file_watcher* watcher)
+{
+    if(!t_index)
+    {
+        alloc_pause warmup;
+        t_index = new dir_index(watcher);
+    }
+    return t_index;
+}
+
+dir_index::dir_index(file_watcher* watcher):
+    m_watcher(watcher), m_cursor(watcher ? watcher->channel()->head() : 0), m_count(0) {
+
+    m_entries = new entry[CAPACITY];
+    memset(m_entries, 0, sizeof(entry) * CAPACITY);
+}
+
+dir_index::~dir_index()
+{
+    clear();
+    delete[] m_entries;
+}
+
+void dir_index::clear()
+{
+    for(int i = 0; i < CAPACITY; i++)
+    {
+        if(m_entries[i].listing)
+        {
+            m_entries[i].listing->unref();
+        }
+    }
+    memset(m_entries, 0, sizeof(entry) * CAPACITY);
+    m_count = 0;
+}
+
+// 与file_cache::sync相同，只是失效的是事件路径所在的目录
+void dir_index::sync()
+{
+    inval_channel* channel = m_watcher->channel();
+    uint64_t head = channel->head();
+    if(head == m_cursor)
+    {
+        return;
+    }
+
+    if(head - m_cursor > (uint64_t)inval_channel::CAPACITY)
+    {
+        clear();
+        m_cursor = head;
+        return;
+    }
+
+    int type;
+    char path[PATH_LEN];
+    for(uint64_t seq = m_cursor + 1; seq <= head; seq++)
+    {
+        if(!channel->read(seq, type, path, PATH_LEN) || type == INVAL_ALL)
+        {
+            clear();
+            break;
+        }
+        //目录里的一项变了：目录的索引和列表都要重新生成
+        char* slash = strrchr(path, '/');
+        if(slash)
+        {
+            slash[1] = '\0';
+            invalidate(path);
+        }
+    }
+    m_cursor = head;
+}
+
+void dir_index::invalidate(const char* dir)
+{
+    entry* e = find(dir, path_hash(dir));
+    if(e && e->state == SLOT_VALID)
+    {
+        e->state = SLOT_STALE;
+        if(e->listing)
+        {
+            e->listing->unref();
+            e->listing = NULL;
+        }
+    }
+}
+
+dir_index::entry* dir_index::find(const char* path, uint32_t hash)
+{
+    for(int i = 0; i < CAPACITY; i++)
+    {
+        entry* e = m_entries + ((hash + i) & (CAPACITY - 1));
+        if(e->state == SLOT_EMPTY)
+        {
+            return e;
+        }
+        if(e->hash == hash && strcmp(e->path, path) == 0)
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+int dir_index::stat_path(const char* path, struct stat* st)
+{
+    return m_watcher ? file_cache::local(m_watcher)->stat(path, st) : ::stat(path, st);
+}
+
+//按配置的顺序找第一个对所有人可读的普通文件
+void dir_index::scan(const char* dir, entry* e)
+{
+    char path[PATH_LEN + NAME_LEN + 4];
+    struct stat st;
+    e->index = -1;
+    e->gzip = false;
+    for(int i = 0; i < s_name_count; i++)
+    {
+        if(snprintf(path, sizeof(path) - 3, "%s%s", dir, s_names[i]) >= (int)sizeof(path) - 3)
+        {
+            continue;
+        }
+        if(stat_path(path, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IROTH))
+        {
+            e->index = i;
+            strcat(path, ".gz");
+            e->gzip = stat_path(path, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IROTH);
+            return;
+        }
+    }
+}
+
+dir_index::RESULT dir_index::resolve(char* real_file, int size, struct stat* st, dir_target* target)
+{
+    bool cached = m_watcher && m_watcher->active() && strlen(real_file) < PATH_LEN;
+    entry tmp;
+    entry* e = &tmp;
+    memset(&tmp, 0, sizeof(tmp));
+
+    if(cached)
+    {
+        sync();
+        uint32_t hash = path_hash(real_file);
+        e = find(real_file, hash);
+        //装载因子超过3/4时整体清空，保证探测链足够短
+        if(!e || (e->state == SLOT_EMPTY && m_count >= CAPACITY * 3 / 4))
+        {
+            clear();
+            e = find(real_file, hash);
+        }
+        if(e->state == SLOT_EMPTY)
+        {
+            e->hash = hash;
+            strcpy(e->path, real_file);
+            m_count++;
+        }
+        if(e->state != SLOT_VALID)
+        {
+            scan(real_file, e);
+            e->state = SLOT_VALID;
+        }
+    }
+    else
+    {
+        scan(real_file, e);
+    }
+
+    if(e->index >= 0)
+    {
+        int len = strlen(real_file);
+        bool gzip = e->gzip && target->gzip_ok;
+        if(snprintf(real_file + len, size - len, "%s%s", s_names[e->index], gzip ? ".gz" : "") >= size - len
+            || stat_path(real_file, st) < 0)
+        {
+            real_file[len] = '\0';
+            return NO_INDEX;
+        }
+        target->encoding = gzip ? "gzip" : NULL;
+        return INDEX_FILE;
+    }
+
+    if(!target->listing_ok)
+    {
+        return NO_INDEX;
+    }
+    //生成列表算缓存的填充，不是稳态
+    alloc_pause warmup;
+    if(!cached)
+    {
+        target->listing = render_listing(real_file, target->root_len);
+        return target->listing ? LISTING : NO_INDEX;
+    }
+    if(!e->listing)
+    {
+        e->listing = render_listing(real_file, target->root_len);
+        if(!e->listing)
+        {
+            return NO_INDEX;
+        }
+    }
+    e->listing->ref();
+    target->listing = e->listing;
+    return LISTING;
+}
+
+static void append_html(std::string& out, const char* s)
+{
+    for(; *s; s++)
+    {
+        switch(*s)
+        {
+            case '&': out += "&amp;"; break;
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            case '"': out += "&quot;"; break;
+            default: out.push_back(*s); break;
+        }
+    }
+}
+
+//链接里除了不需要编码的字符都写成%XX
+static void append_href(std::string& out, const char* s)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for(; *s; s++)
+    {
+        unsigned char c = *s;
+        if(isalnum(c) || strchr("-._~/", c))
+        {
+            out.push_back(c);
+        }
+        else
+        {
+            out.push_back('%');
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 15]);
+        }
+    }
+}
+
+struct listing_item{
+    std::string name;
+    bool dir;
+    long long size;
+    time_t mtime;
+
+    bool operator<(const listing_item& other) const
+    {
+        return dir != other.dir ? dir : name < other.name;
+    }
+};
+
+//子目录在前，名字排序；隐藏文件和对其他用户不可读的不列出
+shared_response* dir_index::render_listing(const char* dir, int root_len)
+{
+    DIR* d = opendir(dir);
+    if(!d)
+    {
+        return NULL;
+    }
+    std::vector<listing_item> items;
+    struct dirent* ent;
+    while((ent = readdir(d)) != NULL && (int)items.size() < MAX_LISTING)
+    {
+        struct stat st;
+        if(ent->d_name[0] == '.' || fstatat(dirfd(d), ent->d_name, &st, 0) != 0 || !(st.st_mode & S_IROTH))
+        {
+            continue;
+        }
+        listing_item item;
+        item.name = ent->d_name;
+        item.dir = S_ISDIR(st.st_mode);
+        item.size = st.st_size;
+        item.mtime = st.st_mtime;
+        items.push_back(item);
+    }
+    closedir(d);
+    std::sort(items.begin(), items.end());
+
+    const char* url = dir + ((int)strlen(dir) > root_len ? root_len : 0);
+    std::string body = "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ";
+    append_html(body, url);
+    body += "</title></head>\n<body><h1>Index of ";
+    append_html(body, url);
+    body += "</h1>\n<table>\n";
+    if(strcmp(url, "/") != 0)
+    {
+        body += "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n";
+    }
+    for(size_t i = 0; i < items.size(); i++)
+    {
+        const listing_item& item = items[i];
+        char line[96];
+        struct tm tm;
+        localtime_r(&item.mtime, &tm);
+        body += "<tr><td><a href=\"";
+        append_href(body, item.name.c_str());
+        body += item.dir ? "/\">" : "\">";
+        append_html(body, item.name.c_str());
+        body += item.dir ? "/</a></td><td>-</td>" : "</a></td>";
+        if(!item.dir)
+        {
+            snprintf(line, sizeof(line), "<td>%lld</td>", item.size);
+            body += line;
+        }
+        strftime(line, sizeof(line), "<td>%Y-%m-%d %H:%M</td></tr>\n", &tm);
+        body += line;
+    }
+    body += "</table>\n</body></html>\n";
+
+    return new shared_response(200, "OK", std::vector<shared_response::field>(), "text/html; charset=utf-8",
+                               body.data(), body.size());
+}
@@ -0,0 +1,86 @@
+#ifndef DIR_INDEX_H__
+#define DIR_INDEX_H__
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include "file_watcher.h"
+
+// 目录请求的解析（-i index.html,index.htm,...  -L或者虚拟主机的:listing 自动生成目录列表）
+// 以'/'结尾的目录URL按配置的顺序找第一个存在的索引文件，客户端接受gzip时优先发送它的.gz预压缩变体；
+// 都没有时生成目录列表（开启了-L）或者返回404；不以'/'结尾的目录先301到加了'/'的URL，列表里的相对链接才对。
+// 每个工作线程缓存每个目录的解析结果（包括"没有索引文件"这样的否定结果）和生成好的列表，
+// 目录下有文件创建、删除、移动或修改时由file_watcher的失效事件清掉，命中时不产生系统调用；
+// 监视器不可用时每次重新解析。
+
+class shared_response;
+
+// map_file对目录的附加输入输出，HTTP/1.1、HTTP/2和协程连接共用
+struct dir_target{
+    bool gzip_ok;                   //输入：客户端接受gzip（Accept-Encoding）
+    bool listing_ok;                //输入（map_file按虚拟主机填写）：没有索引文件时生成列表
+    int root_len;                   //输入（map_file按虚拟主机填写）：文档根目录的长度，列表的标题里去掉它
+    const char* encoding;           //输出：发送的是预压缩变体时为"gzip"，否则为NULL
+    shared_response* listing;       //输出：DIR_LISTING时的目录列表，加了一个引用，发送完由调用者释放
+
+    dir_target() : gzip_ok(false), listing_ok(false), root_len(0), encoding(NULL), listing(NULL) {}
+};
+
+class dir_index{
+
+public:
+    static const int CAPACITY = 1024;       //槽位数量，必须是2的幂
+    static const int PATH_LEN = 256;
+    static const int MAX_NAMES = 8;
+    static const int NAME_LEN = 64;
+    static const int MAX_LISTING = 10000;   //列表最多的条目数，更多的不显示
+
+    enum RESULT{
+        INDEX_FILE,     //real_file和st换成了索引文件
+        LISTING,        //listing是目录列表
+        NO_INDEX        //没有索引文件，也没有开启列表
+    };
+
+    //启动时配置：names是逗号分隔的索引文件名，为NULL时用index.html,index.htm
+    static bool configure(const char* names);
+
+    //获取当前线程的缓存，第一次调用时创建；watcher为NULL时返回一个不缓存的实例
+    static dir_index* local(file_watcher* watcher);
+
+    //real_file是以'/'结尾的目录的完整路径，size是它的缓冲区大小
+    RESULT resolve(char* real_file, int size, struct stat* st, dir_target* target);
+
+private:
+    enum SLOT_STATE {SLOT_EMPTY = 0, SLOT_VALID, SLOT_STALE};
+
+    struct entry{
+        uint32_t hash;
+        int state;
+        int index;                  //第一个存在的索引文件在s_names里的下标，-1表示没有
+        bool gzip;                  //它有.gz变体
+        shared_response* listing;   //第一次需要时生成，失效时释放
+        char path[PATH_LEN];        //目录，以'/'结尾
+    };
+
+    explicit dir_index(file_watcher* watcher);
+    ~dir_index();
+
+    void sync();
+    void invalidate(const char* dir);
+    void clear();
+    entry* find(const char* path, uint32_t hash);
+
+    int stat_path(const char* path, struct stat* st);
+    void scan(const char* dir, entry* e);                  //找索引文件
+    shared_response* render_listing(const char* dir, int root_len);    //读目录生成列表
+
+private:
+    static char s_names[MAX_NAMES][NAME_LEN];
+    static int s_name_count;
+
+    file_watcher* m_watcher;
+    uint64_t m_cursor;
+    entry* m_entries;
+    int m_count;
+};
+
+#endif
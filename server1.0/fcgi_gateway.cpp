@@ -0,0 +1,1391 @@
+#include "fcgi_gateway.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "http_conn.h"
+#include "micro_cache.h"
+
+//FastCGI 1.0 协议常量
+#define FCGI_VERSION_1          1
+#define FCGI_BEGIN_REQUEST      1
+#define FCGI_ABORT_REQUEST      2
+#define FCGI_END_REQUEST        3
+#define FCGI_PARAMS             4
+#define FCGI_STDIN              5
+#define FCGI_STDOUT             6
+#define FCGI_STDERR             7
+#define FCGI_GET_VALUES         9
+#define FCGI_GET_VALUES_RESULT  10
+#define FCGI_RESPONDER          1
+#define FCGI_KEEP_CONN          1
+#define FCGI_REQUEST_COMPLETE   0
+#define FCGI_CANT_MPX_CONN      1
+
+static const size_t MAX_RECORD = 32768;                 //发送时每个记录最多带这么多数据
+static const size_t MAX_BUFFERED = 16 * 1024 * 1024;    //不能流式发送时最多收这么多应答体
+static const int BUCKET_MS[fcgi_backend::BUCKETS - 1] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000};
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void update_max(std::atomic<uint64_t>& max, uint64_t v)
+{
+    uint64_t cur = max.load(std::memory_order_relaxed);
+    while(v > cur && !max.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+    {
+    }
+}
+
+//记录头8字节，数据补齐到8字节的倍数；len为0时是流的结束标记
+static void put_record(std::string& out, int type, int id, const char* data, size_t len)
+{
+    size_t off = 0;
+    do
+    {
+        size_t n = len - off < MAX_RECORD ? len - off : MAX_RECORD;
+        size_t pad = (8 - n % 8) % 8;
+        char head[8] = {FCGI_VERSION_1, (char)type, (char)(id >> 8), (char)id,
+                        (char)(n >> 8), (char)n, (char)pad, 0};
+        out.append(head, 8);
+        out.append(data + off, n);
+        out.append(pad, '\0');
+        off += n;
+    }while(off < len);
+}
+
+//名值对的长度：小于128用一个字节，否则四个字节、最高位置1
+static void put_length(std::string& out, size_t len)
+{
+    if(len < 128)
+    {
+        out.push_back((char)len);
+        return;
+    }
+    out.push_back((char)((len >> 24) | 0x80));
+    out.push_back((char)(len >> 16));
+    out.push_back((char)(len >> 8));
+    out.push_back((char)len);
+}
+
+static void put_param(std::string& out, const char* name, const char* value, size_t value_len)
+{
+    size_t name_len = strlen(name);
+    put_length(out, name_len);
+    put_length(out, value_len);
+    out.append(name, name_len);
+    out.append(value, value_len);
+}
+
+static bool get_length(const unsigned char*& p, const unsigned char* end, size_t* len)
+{
+    if(p >= end)
+    {
+        return false;
+    }
+    if(!(*p & 0x80))
+    {
+        *len = *p++;
+        return true;
+    }
+    if(end - p < 4)
+    {
+        return false;
+    }
+    *len = ((size_t)(p[0] & 0x7f) << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+    p += 4;
+    return true;
+}
+
+void fcgi_parser::feed(const char* data, int len)
+{
+    //取走的记录占了一半以上时整理一次，缓冲区里只留不完整的记录
+    if(m_off > 0 && m_off * 2 >= m_buf.size())
+    {
+        m_buf.erase(0, m_off);
+        m_off = 0;
+    }
+    m_buf.append(data, len);
+}
+
+bool fcgi_parser::next(record* rec)
+{
+    if(m_bad || m_buf.size() - m_off < 8)
+    {
+        return false;
+    }
+    const unsigned char* h = (const unsigned char*)m_buf.data() + m_off;
+    if(h[0] != FCGI_VERSION_1)
+    {
+        m_bad = true;
+        return false;
+    }
+    size_t content = ((size_t)h[4] << 8) | h[5];
+    size_t total = 8 + content + h[6];
+    if(m_buf.size() - m_off < total)
+    {
+        return false;
+    }
+    rec->type = h[1];
+    rec->request_id = (h[2] << 8) | h[3];
+    rec->data = (const char*)h + 8;
+    rec->len = content;
+    m_off += total;
+    return true;
+}
+
+fcgi_request::fcgi_request():
+    status(200), title("OK"), m_headers_ready(false), m_ended(false), m_error(NONE), m_out_off(0), m_waker(NULL),
+    m_streaming(false), m_paused(false), m_backend(NULL), m_conn(NULL), m_id(0), m_cancelled(false),
+    m_pause_counted(false), m_start_us(0), m_first_us(0), m_refs(1) {
+}
+
+void fcgi_request::set_streaming()
+{
+    m_lock.lock();
+    m_streaming = true;
+    m_lock.unlock();
+}
+
+bool fcgi_request::ready(bool streaming, body_waker* waker)
+{
+    m_lock.lock();
+    bool ok = m_error != NONE || (streaming ? m_headers_ready : m_ended);
+    if(!ok)
+    {
+        m_waker = waker;
+    }
+    m_lock.unlock();
+    return ok;
+}
+
+fcgi_request::ERROR fcgi_request::error()
+{
+    m_lock.lock();
+    ERROR e = m_error;
+    m_lock.unlock();
+    return e;
+}
+
+int fcgi_request::read(char* buf, int len, body_waker* waker, fcgi_gateway* gateway)
+{
+    m_lock.lock();
+    size_t avail = m_out.size() - m_out_off;
+    if(avail > 0)
+    {
+        size_t n = avail < (size_t)len ? avail : len;
+        memcpy(buf, m_out.data() + m_out_off, n);
+        m_out_off += n;
+        if(m_out_off == m_out.size())
+        {
+            m_out.clear();
+            m_out_off = 0;
+        }
+        else if(m_out_off * 2 >= m_out.size())
+        {
+            m_out.erase(0, m_out_off);
+            m_out_off = 0;
+        }
+        bool resume = m_paused && m_out.size() - m_out_off < fcgi_gateway::HIGH_WATER / 2;
+        if(resume)
+        {
+            m_paused = false;
+        }
+        m_lock.unlock();
+        if(resume)
+        {
+            gateway->resume(this);
+        }
+        return n;
+    }
+    int ret;
+    if(m_error != NONE || (!m_ended && !waker))
+    {
+        ret = -1;
+    }
+    else if(m_ended)
+    {
+        ret = 0;
+    }
+    else
+    {
+        m_waker = waker;
+        ret = body_producer::PENDING;
+    }
+    m_lock.unlock();
+    return ret;
+}
+
+// 应答体的生产者，接管处理器对请求的引用
+class fcgi_producer : public body_producer{
+
+public:
+    fcgi_producer(fcgi_gateway* gateway, fcgi_request* r) : m_gateway(gateway), m_request(r) {}
+
+    //网关线程在锁内调用waker，这里清掉之后连接就不会再被唤醒（连接对象会被下一个客户端复用）
+    ~fcgi_producer()
+    {
+        m_request->m_lock.lock();
+        m_request->m_waker = NULL;
+        bool done = m_request->m_ended || m_request->m_error != fcgi_request::NONE;
+        m_request->m_lock.unlock();
+        if(!done)
+        {
+            m_gateway->cancel(m_request);
+        }
+        m_request->unref();
+    }
+
+    int produce(char* buf, int len)
+    {
+        return m_request->read(buf, len, m_waker, m_gateway);
+    }
+
+private:
+    fcgi_gateway* m_gateway;
+    fcgi_request* m_request;
+};
+
+// handle交给连接的推迟应答，接管处理器对请求的引用；流式的连接在应答时把引用转交给生产者
+class fcgi_response : public deferred_response{
+
+public:
+    fcgi_response(fcgi_gateway* gateway, fcgi_request* r, bool streaming)
+        : m_gateway(gateway), m_request(r), m_streaming(streaming) {}
+
+    //和fcgi_producer一样在锁内清掉waker；连接在结果到达之前关闭时取消请求
+    ~fcgi_response()
+    {
+        if(!m_request)
+        {
+            return;
+        }
+        m_request->m_lock.lock();
+        m_request->m_waker = NULL;
+        bool done = m_request->m_ended || m_request->m_error != fcgi_request::NONE;
+        m_request->m_lock.unlock();
+        if(!done)
+        {
+            m_gateway->cancel(m_request);
+        }
+        m_request->unref();
+    }
+
+    bool ready(body_waker* waker)
+    {
+        return m_request->ready(m_streaming, waker);
+    }
+
+    bool respond(http_response& resp)
+    {
+        fcgi_request* r = m_request;
+        fcgi_request::ERROR error = r->error();
+        if(error != fcgi_request::NONE)
+        {
+            if(error == fcgi_request::TIMEOUT)
+            {
+                static const char timeout[] = "upstream application timed out\n";
+                return resp.status(504, "Gateway Timeout") && resp.body("text/plain", timeout, sizeof(timeout) - 1);
+            }
+            static const char bad[] = "upstream application unavailable\n";
+            return resp.status(502, "Bad Gateway") && resp.body("text/plain", bad, sizeof(bad) - 1);
+        }
+
+        bool ok = resp.status(r->status, r->title.c_str());
+        for(size_t i = 0; ok && i < r->headers.size(); i++)
+        {
+            ok = resp.header(r->headers[i].name.c_str(), r->headers[i].value.c_str());
+        }
+        if(!ok)
+        {
+            return false;
+        }
+
+        //应答体到一点发一点，生产者接管引用
+        if(m_streaming)
+        {
+            m_request = NULL;
+            return resp.stream(r->content_type.c_str(), new fcgi_producer(m_gateway, r));
+        }
+
+        //不能等待的连接：已经收齐了
+        r->m_lock.lock();
+        std::string body(r->m_out, r->m_out_off, std::string::npos);
+        r->m_lock.unlock();
+        return resp.body(r->content_type.c_str(), body.data(), body.size());
+    }
+
+private:
+    fcgi_gateway* m_gateway;
+    fcgi_request* m_request;
+    bool m_streaming;
+};
+
+fcgi_gateway::fcgi_gateway():
+    m_epollfd(-1), m_eventfd(-1), m_next_backend(0), m_waiting_count(0), m_rejected(0) {
+
+    m_prefix[0] = '\0';
+}
+
+fcgi_gateway::~fcgi_gateway()
+{
+    if(m_epollfd != -1)
+    {
+        close(m_epollfd);
+    }
+    if(m_eventfd != -1)
+    {
+        close(m_eventfd);
+    }
+}
+
+bool fcgi_gateway::configure(const char* spec)
+{
+    const char* eq = strchr(spec, '=');
+    if(!eq || eq == spec || spec[0] != '/' || eq - spec >= (int)sizeof(m_prefix))
+    {
+        return false;
+    }
+    memcpy(m_prefix, spec, eq - spec);
+    m_prefix[eq - spec] = '\0';
+
+    const char* p = eq + 1;
+    while(*p)
+    {
+        const char* end = strchr(p, ',');
+        if(!end)
+        {
+            end = p + strlen(p);
+        }
+        if(end == p || end - p >= (int)sizeof(((struct sockaddr_un*)0)->sun_path)
+            || (int)m_backends.size() >= MAX_BACKENDS)
+        {
+            return false;
+        }
+        fcgi_backend* b = new fcgi_backend();
+        b->path.assign(p, end - p);
+        b->inflight = 0;
+        b->down_until_us = 0;
+        m_backends.push_back(b);
+        p = *end ? end + 1 : end;
+    }
+    return !m_backends.empty();
+}
+
+bool fcgi_gateway::start()
+{
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_epollfd < 0 || m_eventfd < 0)
+    {
+        printf("fcgi gateway: %s\n", strerror(errno));
+        return false;
+    }
+    epoll_event event;
+    event.data.ptr = NULL;
+    event.events = EPOLLIN;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_eventfd, &event);
+
+    if(pthread_create(&m_thread, NULL, worker, this) != 0)
+    {
+        return false;
+    }
+    pthread_detach(m_thread);
+    return true;
+}
+
+void fcgi_gateway::submit(fcgi_request* r)
+{
+    post(SUBMIT, r);
+}
+
+void fcgi_gateway::cancel(fcgi_request* r)
+{
+    post(CANCEL, r);
+}
+
+void fcgi_gateway::resume(fcgi_request* r)
+{
+    post(RESUME, r);
+}
+
+void fcgi_gateway::post(COMMAND type, fcgi_request* r)
+{
+    r->ref();
+    command cmd = {type, r};
+    m_lock.lock();
+    m_commands.push_back(cmd);
+    m_lock.unlock();
+    uint64_t one = 1;
+    ssize_t ret = ::write(m_eventfd, &one, sizeof(one));
+    (void)ret;
+}
+
+void* fcgi_gateway::worker(void* arg)
+{
+    fcgi_gateway* gateway = (fcgi_gateway*)arg;
+    profiler::register_thread("fcgi");
+    gateway->run();
+    profiler::unregister_thread();
+    return gateway;
+}
+
+void fcgi_gateway::run()
+{
+    epoll_event events[256];
+    uint64_t next_expire = now_us() + 1000000;
+
+    while(true)
+    {
+        int num = epoll_wait(m_epollfd, events, 256, 1000);
+        if(num < 0 && errno != EINTR)
+        {
+            printf("fcgi gateway epoll failure\n");
+            break;
+        }
+
+        for(int i = 0; i < num; i++)
+        {
+            if(events[i].data.ptr == NULL)
+            {
+                uint64_t count;
+                ssize_t ret = ::read(m_eventfd, &count, sizeof(count));
+                (void)ret;
+                continue;
+            }
+            on_event((fcgi_conn*)events[i].data.ptr, events[i].events);
+        }
+
+        run_commands();
+        dispatch();
+
+        if(now_us() >= next_expire)
+        {
+            expire();
+            next_expire = now_us() + 1000000;
+        }
+    }
+}
+
+void fcgi_gateway::run_commands()
+{
+    std::vector<command> commands;
+    m_lock.lock();
+    commands.swap(m_commands);
+    m_lock.unlock();
+
+    for(size_t i = 0; i < commands.size(); i++)
+    {
+        fcgi_request* r = commands[i].request;
+        switch(commands[i].type)
+        {
+            case SUBMIT:
+                //命令的引用转给网关
+                r->m_start_us = now_us();
+                m_waiting.push_back(r);
+                continue;
+            case CANCEL:
+                abort_request(r);
+                break;
+            case RESUME:
+                if(r->m_pause_counted)
+                {
+                    r->m_pause_counted = false;
+                    r->m_conn->paused--;
+                    update_events(r->m_conn);
+                }
+                break;
+        }
+        r->unref();
+    }
+    m_waiting_count.store(m_waiting.size(), std::memory_order_relaxed);
+}
+
+void fcgi_gateway::dispatch()
+{
+    while(!m_waiting.empty())
+    {
+        fcgi_request* r = m_waiting.front();
+        fcgi_backend* b;
+        fcgi_conn* c = pick(&b);
+        if(!c && b)
+        {
+            break;      //都忙，等有请求结束
+        }
+        m_waiting.pop_front();
+        if(!c)
+        {
+            m_rejected.fetch_add(1, std::memory_order_relaxed);
+            fail(r, fcgi_request::UNAVAILABLE);
+            r->unref();
+            continue;
+        }
+        start_request(c, r);
+    }
+    m_waiting_count.store(m_waiting.size(), std::memory_order_relaxed);
+}
+
+//未完成请求最少的应用进程优先，相同时从上次选中的下一个开始；
+//连接的容量：还没有问到参数时1个，支持多路复用时FCGI_MAX_REQS个，否则1个
+fcgi_conn* fcgi_gateway::pick(fcgi_backend** chosen)
+{
+    uint64_t now = now_us();
+    size_t n = m_backends.size();
+    fcgi_backend* order[MAX_BACKENDS];
+    size_t count = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+        fcgi_backend* b = m_backends[(m_next_backend + i) % n];
+        if(b->down_until_us > now)
+        {
+            continue;
+        }
+        size_t j = count++;
+        while(j > 0 && order[j - 1]->inflight > b->inflight)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = b;
+    }
+
+    *chosen = NULL;
+    for(size_t i = 0; i < count; i++)
+    {
+        fcgi_backend* b = order[i];
+        fcgi_conn* best = NULL;
+        for(size_t j = 0; j < b->conns.size(); j++)
+        {
+            fcgi_conn* c = b->conns[j];
+            size_t capacity = (c->probed && c->mpxs) ? c->max_reqs : 1;
+            if(c->requests.size() < capacity && (!best || c->requests.size() < best->requests.size()))
+            {
+                best = c;
+            }
+        }
+        if(!best && b->conns.size() < (size_t)CONNS_PER_BACKEND)
+        {
+            best = open_conn(b);
+        }
+        if(best)
+        {
+            for(size_t j = 0; j < n; j++)
+            {
+                if(m_backends[j] == b)
+                {
+                    m_next_backend = j + 1;
+                }
+            }
+            return best;
+        }
+        //连接失败的刚刚被标记为不可用
+        if(b->down_until_us <= now)
+        {
+            *chosen = b;
+        }
+    }
+    return NULL;
+}
+
+fcgi_conn* fcgi_gateway::open_conn(fcgi_backend* b)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, b->path.c_str(), b->path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+    //Unix socket的connect要么立即完成，要么失败（对方的backlog满了是EAGAIN）
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        printf("fcgi: connect %s: %s\n", b->path.c_str(), strerror(errno));
+        close(fd);
+        b->down_until_us = now_us() + RETRY_MS * 1000;
+        return NULL;
+    }
+
+    fcgi_conn* c = new fcgi_conn;
+    c->fd = fd;
+    c->owner = b;
+    c->probed = false;
+    c->mpxs = false;
+    c->max_reqs = 1;
+    c->paused = 0;
+    c->out_off = 0;
+    c->next_id = 1;
+    c->events = 0;
+    c->stuck_since_us = 0;
+
+    //问应用进程能不能多路复用、最多同时处理多少个请求
+    std::string query;
+    put_param(query, "FCGI_MPXS_CONNS", "", 0);
+    put_param(query, "FCGI_MAX_REQS", "", 0);
+    put_record(c->out, FCGI_GET_VALUES, 0, query.data(), query.size());
+
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLIN | EPOLLOUT;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event);
+    c->events = event.events;
+
+    b->conns.push_back(c);
+    b->open_conns.fetch_add(1, std::memory_order_relaxed);
+    return c;
+}
+
+void fcgi_gateway::close_conn(fcgi_conn* c, const char* why)
+{
+    fcgi_backend* b = c->owner;
+    if(!c->requests.empty())
+    {
+        printf("fcgi: %s: %s with %zu requests in flight\n", b->path.c_str(), why, c->requests.size());
+    }
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+
+    std::map<uint16_t, fcgi_request*> requests;
+    requests.swap(c->requests);
+    for(std::map<uint16_t, fcgi_request*>::iterator it = requests.begin(); it != requests.end(); ++it)
+    {
+        fcgi_request* r = it->second;
+        fail(r, fcgi_request::UNAVAILABLE);
+        r->m_conn = NULL;
+        r->m_pause_counted = false;
+        retire(r);
+    }
+
+    for(size_t i = 0; i < b->conns.size(); i++)
+    {
+        if(b->conns[i] == c)
+        {
+            b->conns.erase(b->conns.begin() + i);
+            break;
+        }
+    }
+    b->open_conns.fetch_sub(1, std::memory_order_relaxed);
+    delete c;
+}
+
+void fcgi_gateway::start_request(fcgi_conn* c, fcgi_request* r)
+{
+    uint16_t id = c->next_id;
+    while(id == 0 || c->requests.count(id))
+    {
+        id++;
+    }
+    c->next_id = id + 1;
+    c->requests[id] = r;
+
+    fcgi_backend* b = c->owner;
+    r->m_backend = b;
+    r->m_conn = c;
+    r->m_id = id;
+    r->m_start_us = now_us();
+    b->inflight++;
+    b->active.store(b->inflight, std::memory_order_relaxed);
+    b->requests.fetch_add(1, std::memory_order_relaxed);
+
+    char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+    put_record(c->out, FCGI_BEGIN_REQUEST, id, begin, sizeof(begin));
+    put_record(c->out, FCGI_PARAMS, id, r->params.data(), r->params.size());
+    if(!r->params.empty())
+    {
+        put_record(c->out, FCGI_PARAMS, id, NULL, 0);
+    }
+    put_record(c->out, FCGI_STDIN, id, r->body.data(), r->body.size());
+    if(!r->body.empty())
+    {
+        put_record(c->out, FCGI_STDIN, id, NULL, 0);
+    }
+    std::string().swap(r->params);
+    std::string().swap(r->body);
+
+    if(!flush(c))
+    {
+        close_conn(c, "write failed");
+        return;
+    }
+    update_events(c);
+}
+
+void fcgi_gateway::abort_request(fcgi_request* r)
+{
+    //还在排队：直接丢掉
+    for(std::deque<fcgi_request*>::iterator it = m_waiting.begin(); it != m_waiting.end(); ++it)
+    {
+        if(*it == r)
+        {
+            m_waiting.erase(it);
+            fail(r, fcgi_request::UNAVAILABLE);
+            r->unref();
+            return;
+        }
+    }
+    if(!r->m_conn || r->m_cancelled)
+    {
+        return;
+    }
+    //已经发出去了：请应用进程停止，id要等它的FCGI_END_REQUEST之后才能复用
+    r->m_cancelled = true;
+    fcgi_conn* c = r->m_conn;
+    if(r->m_pause_counted)
+    {
+        r->m_pause_counted = false;
+        c->paused--;
+    }
+    r->m_lock.lock();
+    r->m_out.clear();
+    r->m_out_off = 0;
+    r->m_lock.unlock();
+    //可能正在处理这条连接上的记录，这里不发送、不关闭连接，等可写事件
+    put_record(c->out, FCGI_ABORT_REQUEST, r->m_id, NULL, 0);
+    update_events(c);
+}
+
+void fcgi_gateway::on_event(fcgi_conn* c, uint32_t events)
+{
+    if((events & EPOLLOUT) && !flush(c))
+    {
+        close_conn(c, "write failed");
+        return;
+    }
+    if((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !on_readable(c))
+    {
+        return;
+    }
+    update_events(c);
+}
+
+//读出所有能读的数据，逐个处理完整的记录；连接被关闭时返回false
+bool fcgi_gateway::on_readable(fcgi_conn* c)
+{
+    char buf[65536];
+    while(true)
+    {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if(n == 0)
+        {
+            close_conn(c, "closed by application");
+            return false;
+        }
+        if(n < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            close_conn(c, strerror(errno));
+            return false;
+        }
+
+        c->parser.feed(buf, n);
+        fcgi_parser::record rec;
+        while(c->parser.next(&rec))
+        {
+            if(!on_record(c, rec))
+            {
+                close_conn(c, "protocol error");
+                return false;
+            }
+        }
+        if(c->parser.bad())
+        {
+            close_conn(c, "bad record");
+            return false;
+        }
+        //有请求积压太多：不再读，等生产者取走一些
+        if(c->paused > 0)
+        {
+            return true;
+        }
+    }
+}
+
+bool fcgi_gateway::flush(fcgi_conn* c)
+{
+    while(c->out_off < c->out.size())
+    {
+        ssize_t n = send(c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->out_off += n;
+    }
+    c->out.clear();
+    c->out_off = 0;
+    return true;
+}
+
+void fcgi_gateway::update_events(fcgi_conn* c)
+{
+    uint32_t want = (c->paused > 0 ? 0 : EPOLLIN) | (c->out_off < c->out.size() ? EPOLLOUT : 0);
+    if(want == c->events)
+    {
+        return;
+    }
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = want;
+    epoll_ctl(m_epollfd, EPOLL_CTL_MOD, c->fd, &event);
+    c->events = want;
+}
+
+bool fcgi_gateway::on_record(fcgi_conn* c, const fcgi_parser::record& rec)
+{
+    if(rec.request_id == 0)
+    {
+        if(rec.type == FCGI_GET_VALUES_RESULT)
+        {
+            const unsigned char* p = (const unsigned char*)rec.data;
+            const unsigned char* end = p + rec.len;
+            size_t name_len, value_len;
+            while(get_length(p, end, &name_len) && get_length(p, end, &value_len)
+                  && (size_t)(end - p) >= name_len + value_len)
+            {
+                std::string name((const char*)p, name_len);
+                std::string value((const char*)p + name_len, value_len);
+                p += name_len + value_len;
+                if(name == "FCGI_MPXS_CONNS")
+                {
+                    c->mpxs = (value == "1");
+                }
+                else if(name == "FCGI_MAX_REQS" && atoi(value.c_str()) > 0)
+                {
+                    c->max_reqs = atoi(value.c_str());
+                }
+            }
+            c->probed = true;
+        }
+        return true;
+    }
+
+    std::map<uint16_t, fcgi_request*>::iterator it = c->requests.find(rec.request_id);
+    if(it == c->requests.end())
+    {
+        return true;        //已经断开过的连接上的旧请求
+    }
+    fcgi_request* r = it->second;
+    switch(rec.type)
+    {
+        case FCGI_STDOUT:
+            if(rec.len > 0 && !r->m_cancelled && !on_stdout(r, rec.data, rec.len))
+            {
+                fail(r, fcgi_request::BAD_RESPONSE);
+                abort_request(r);
+            }
+            return true;
+
+        case FCGI_STDERR:
+            c->owner->stderr_bytes.fetch_add(rec.len, std::memory_order_relaxed);
+            return true;
+
+        case FCGI_END_REQUEST:
+        {
+            if(rec.len < 8)
+            {
+                return false;
+            }
+            int protocol_status = (unsigned char)rec.data[4];
+            if(protocol_status == FCGI_CANT_MPX_CONN)
+            {
+                c->mpxs = false;
+            }
+            if(!r->m_cancelled)
+            {
+                if(protocol_status != FCGI_REQUEST_COMPLETE)
+                {
+                    fail(r, fcgi_request::UNAVAILABLE);
+                }
+                else if(!r->m_head.empty() || r->m_first_us == 0)
+                {
+                    fail(r, fcgi_request::BAD_RESPONSE);     //没有完整的CGI头部
+                }
+                else
+                {
+                    r->m_lock.lock();
+                    r->m_ended = true;
+                    if(r->m_waker)
+                    {
+                        r->m_waker->wake();
+                        r->m_waker = NULL;
+                    }
+                    r->m_lock.unlock();
+                }
+            }
+            c->requests.erase(it);
+            if(r->m_pause_counted)
+            {
+                r->m_pause_counted = false;
+                c->paused--;
+            }
+            r->m_conn = NULL;
+            retire(r);
+            return true;
+        }
+
+        default:
+            return true;
+    }
+}
+
+bool fcgi_gateway::on_stdout(fcgi_request* r, const char* data, int len)
+{
+    if(r->m_first_us == 0)
+    {
+        r->m_first_us = now_us();
+        r->m_head.append(data, len);
+    }
+    else if(!r->m_head.empty())
+    {
+        r->m_head.append(data, len);
+    }
+    else
+    {
+        //头部已经交给处理器，之后的都是应答体
+        bool pause = false;
+        r->m_lock.lock();
+        r->m_out.append(data, len);
+        size_t backlog = r->m_out.size() - r->m_out_off;
+        if(!r->m_streaming && backlog > MAX_BUFFERED)
+        {
+            r->m_lock.unlock();
+            return false;
+        }
+        if(r->m_streaming && !r->m_paused && backlog > HIGH_WATER)
+        {
+            r->m_paused = pause = true;
+        }
+        //在锁内唤醒：生产者析构时拿到锁以后就不会再被唤醒
+        if(r->m_waker)
+        {
+            r->m_waker->wake();
+            r->m_waker = NULL;
+        }
+        r->m_lock.unlock();
+        if(pause)
+        {
+            r->m_pause_counted = true;
+            r->m_conn->paused++;
+        }
+        return true;
+    }
+
+    //CGI头部以空行结束
+    size_t end = r->m_head.find("\r\n\r\n");
+    size_t skip = 4;
+    size_t lf = r->m_head.find("\n\n");
+    if(lf != std::string::npos && (end == std::string::npos || lf < end))
+    {
+        end = lf;
+        skip = 2;
+    }
+    if(end == std::string::npos)
+    {
+        return r->m_head.size() <= MAX_HEAD;
+    }
+    if(end > MAX_HEAD || !parse_head(r, end))
+    {
+        return false;
+    }
+
+    r->m_lock.lock();
+    r->m_out.append(r->m_head, end + skip, std::string::npos);
+    r->m_headers_ready = true;
+    //流式的连接在等头部
+    if(r->m_streaming && r->m_waker)
+    {
+        r->m_waker->wake();
+        r->m_waker = NULL;
+    }
+    r->m_lock.unlock();
+    std::string().swap(r->m_head);
+    return true;
+}
+
+//Status、Content-Type和Location之外的头部原样转发，长度和连接相关的由服务器自己决定
+bool fcgi_gateway::parse_head(fcgi_request* r, size_t head_len)
+{
+    bool has_status = false;
+    bool has_location = false;
+    size_t pos = 0;
+    while(pos < head_len)
+    {
+        size_t eol = r->m_head.find('\n', pos);
+        if(eol == std::string::npos || eol > head_len)
+        {
+            eol = head_len;
+        }
+        size_t line_end = (eol > pos && r->m_head[eol - 1] == '\r') ? eol - 1 : eol;
+        std::string line = r->m_head.substr(pos, line_end - pos);
+        pos = eol + 1;
+
+        size_t colon = line.find(':');
+        if(colon == std::string::npos || colon == 0)
+        {
+            return false;
+        }
+        std::string name = line.substr(0, colon);
+        size_t v = colon + 1;
+        while(v < line.size() && (line[v] == ' ' || line[v] == '\t'))
+        {
+            v++;
+        }
+        std::string value = line.substr(v);
+
+        if(strcasecmp(name.c_str(), "Status") == 0)
+        {
+            char* rest;
+            long code = strtol(value.c_str(), &rest, 10);
+            if(code < 100 || code > 999)
+            {
+                return false;
+            }
+            while(*rest == ' ')
+            {
+                rest++;
+            }
+            r->status = code;
+            r->title = *rest ? rest : "Unknown";
+            has_status = true;
+        }
+        else if(strcasecmp(name.c_str(), "Content-Type") == 0)
+        {
+            r->content_type = value;
+        }
+        else if(strcasecmp(name.c_str(), "Content-Length") != 0 && strcasecmp(name.c_str(), "Transfer-Encoding") != 0
+                && strcasecmp(name.c_str(), "Connection") != 0)
+        {
+            if(strcasecmp(name.c_str(), "Location") == 0)
+            {
+                has_location = true;
+            }
+            fcgi_request::field f = {name, value};
+            r->headers.push_back(f);
+        }
+    }
+    //只有Location时是重定向
+    if(has_location && !has_status)
+    {
+        r->status = 302;
+        r->title = "Found";
+    }
+    if(r->content_type.empty())
+    {
+        r->content_type = "text/html";
+    }
+    return true;
+}
+
+void fcgi_gateway::fail(fcgi_request* r, fcgi_request::ERROR error)
+{
+    r->m_lock.lock();
+    if(r->m_error == fcgi_request::NONE && !r->m_ended)
+    {
+        r->m_error = error;
+    }
+    if(r->m_waker)
+    {
+        r->m_waker->wake();
+        r->m_waker = NULL;
+    }
+    r->m_lock.unlock();
+}
+
+void fcgi_gateway::retire(fcgi_request* r)
+{
+    fcgi_backend* b = r->m_backend;
+    b->inflight--;
+    b->active.store(b->inflight, std::memory_order_relaxed);
+
+    uint64_t now = now_us();
+    bool failed = r->error() != fcgi_request::NONE;
+    if(failed && !r->m_cancelled)
+    {
+        b->errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if(!r->m_cancelled)
+    {
+        uint64_t ttfb = r->m_first_us - r->m_start_us;
+        uint64_t total = now - r->m_start_us;
+        b->ttfb_us_total.fetch_add(ttfb, std::memory_order_relaxed);
+        update_max(b->ttfb_us_max, ttfb);
+        b->total_us_total.fetch_add(total, std::memory_order_relaxed);
+        update_max(b->total_us_max, total);
+        int i = 0;
+        while(i < fcgi_backend::BUCKETS - 1 && total > (uint64_t)BUCKET_MS[i] * 1000)
+        {
+            i++;
+        }
+        b->buckets[i].fetch_add(1, std::memory_order_relaxed);
+    }
+    r->unref();
+}
+
+//超过TIMEOUT_MS的请求：排队的直接失败，发出去的告诉客户端超时并请应用进程停止；
+//取消之后又过了TIMEOUT_MS还没有结束的，断开那条连接
+void fcgi_gateway::expire()
+{
+    uint64_t now = now_us();
+    uint64_t limit = (uint64_t)TIMEOUT_MS * 1000;
+    while(!m_waiting.empty() && now - m_waiting.front()->m_start_us > limit)
+    {
+        fcgi_request* r = m_waiting.front();
+        m_waiting.pop_front();
+        fail(r, fcgi_request::TIMEOUT);
+        r->unref();
+    }
+    m_waiting_count.store(m_waiting.size(), std::memory_order_relaxed);
+
+    for(size_t i = 0; i < m_backends.size(); i++)
+    {
+        std::vector<fcgi_conn*> conns = m_backends[i]->conns;
+        for(size_t j = 0; j < conns.size(); j++)
+        {
+            fcgi_conn* c = conns[j];
+            std::vector<fcgi_request*> late;
+            bool stuck = false;
+            for(std::map<uint16_t, fcgi_request*>::iterator it = c->requests.begin(); it != c->requests.end(); ++it)
+            {
+                fcgi_request* r = it->second;
+                if(now - r->m_start_us <= limit)
+                {
+                    continue;
+                }
+                if(!r->m_cancelled)
+                {
+                    late.push_back(r);
+                }
+                else if(now - r->m_start_us > 2 * limit)
+                {
+                    stuck = true;
+                }
+            }
+            if(stuck)
+            {
+                close_conn(c, "aborted request never ended");
+                continue;
+            }
+            for(size_t k = 0; k < late.size(); k++)
+            {
+                fail(late[k], fcgi_request::TIMEOUT);
+                abort_request(late[k]);
+            }
+        }
+    }
+}
+
+int fcgi_gateway::report(char* buf, int len)
+{
+    int n = snprintf(buf, len, "gateway %s waiting %d rejected %llu\n", m_prefix,
+                     m_waiting_count.load(std::memory_order_relaxed),
+                     (unsigned long long)m_rejected.load(std::memory_order_relaxed));
+    for(size_t i = 0; i < m_backends.size() && n < len; i++)
+    {
+        fcgi_backend* b = m_backends[i];
+        uint64_t errors = b->errors.load(std::memory_order_relaxed);
+        uint64_t done = 0;
+        for(int k = 0; k < fcgi_backend::BUCKETS; k++)
+        {
+            done += b->buckets[k].load(std::memory_order_relaxed);
+        }
+        uint64_t div = done ? done : 1;
+        n += snprintf(buf + n, len - n,
+                      "backend %s conns %d active %d requests %llu errors %llu stderr_bytes %llu\n"
+                      "  ttfb_avg_us %llu ttfb_max_us %llu total_avg_us %llu total_max_us %llu\n  latency_ms",
+                      b->path.c_str(), b->open_conns.load(std::memory_order_relaxed),
+                      b->active.load(std::memory_order_relaxed),
+                      (unsigned long long)b->requests.load(std::memory_order_relaxed),
+                      (unsigned long long)errors,
+                      (unsigned long long)b->stderr_bytes.load(std::memory_order_relaxed),
+                      (unsigned long long)(b->ttfb_us_total.load(std::memory_order_relaxed) / div),
+                      (unsigned long long)b->ttfb_us_max.load(std::memory_order_relaxed),
+                      (unsigned long long)(b->total_us_total.load(std::memory_order_relaxed) / div),
+                      (unsigned long long)b->total_us_max.load(std::memory_order_relaxed));
+        for(int k = 0; k < fcgi_backend::BUCKETS && n < len; k++)
+        {
+            uint64_t v = b->buckets[k].load(std::memory_order_relaxed);
+            if(k < fcgi_backend::BUCKETS - 1)
+            {
+                n += snprintf(buf + n, len - n, " <=%d:%llu", BUCKET_MS[k], (unsigned long long)v);
+            }
+            else
+            {
+                n += snprintf(buf + n, len - n, " >%d:%llu\n", BUCKET_MS[k - 1], (unsigned long long)v);
+            }
+        }
+    }
+    return (n < len) ? n : len - 1;
+}
+
+fcgi_handler::fcgi_handler(fcgi_gateway* gateway) : m_gateway(gateway)
+{
+    m_prefix_len = strlen(gateway->prefix());
+}
+
+bool fcgi_handler::on_headers(http_request& req)
+{
+    req.context = new fcgi_request;
+    return true;
+}
+
+bool fcgi_handler::on_body(http_request& req, const char* data, int len)
+{
+    ((fcgi_request*)req.context)->body.append(data, len);
+    return true;
+}
+
+void fcgi_handler::on_abort(http_request& req)
+{
+    if(req.context)
+    {
+        ((fcgi_request*)req.context)->unref();
+        req.context = NULL;
+    }
+}
+
+//CGI变量由请求行、连接的地址和请求体得出，请求头部按RFC 3875 4.1.18转成HTTP_*
+void fcgi_handler::build_params(const http_request& req, fcgi_request* r)
+{
+    const char* method = (req.method == http_conn::POST) ? "POST" : (req.method == http_conn::PUT) ? "PUT" : "GET";
+    int script_len = m_prefix_len;
+    if(script_len > 1 && m_gateway->prefix()[script_len - 1] == '/')
+    {
+        script_len--;
+    }
+    if(script_len > req.path_len)
+    {
+        script_len = req.path_len;
+    }
+    std::string uri(req.path, req.path_len);
+    const char* query = req.query ? req.query : "";
+    if(req.query)
+    {
+        uri += '?';
+        uri += query;
+    }
+    char length[24];
+    int length_len = snprintf(length, sizeof(length), "%zu", r->body.size());
+
+    std::string& p = r->params;
+    put_param(p, "GATEWAY_INTERFACE", "CGI/1.1", 7);
+    put_param(p, "SERVER_PROTOCOL", "HTTP/1.1", 8);
+    put_param(p, "REQUEST_METHOD", method, strlen(method));
+    put_param(p, "REQUEST_URI", uri.data(), uri.size());
+    put_param(p, "SCRIPT_NAME", req.path, script_len);
+    put_param(p, "PATH_INFO", req.path + script_len, req.path_len - script_len);
+    put_param(p, "QUERY_STRING", query, strlen(query));
+    if(req.method != http_conn::GET || !r->body.empty())
+    {
+        put_param(p, "CONTENT_LENGTH", length, length_len);
+    }
+    if(req.host)
+    {
+        put_param(p, "HTTP_HOST", req.host, strlen(req.host));
+        const char* colon = strchr(req.host, ':');
+        put_param(p, "SERVER_NAME", req.host, colon ? colon - req.host : strlen(req.host));
+    }
+
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in;
+    in.s_addr = req.remote_addr;
+    if(inet_ntop(AF_INET, &in, addr, sizeof(addr)))
+    {
+        put_param(p, "REMOTE_ADDR", addr, strlen(addr));
+    }
+    char port[8];
+    int port_len = snprintf(port, sizeof(port), "%d", req.remote_port);
+    put_param(p, "REMOTE_PORT", port, port_len);
+    port_len = snprintf(port, sizeof(port), "%d", req.server_port);
+    put_param(p, "SERVER_PORT", port, port_len);
+
+    //Host已经发过；Content-Type和Content-Length是CGI自己的变量，Transfer-Encoding由我们解码掉了；
+    //Proxy不转发，否则应用会把它当成HTTP_PROXY环境变量（httpoxy）
+    std::string var;
+    const char* name;
+    int name_len;
+    const char* value;
+    int pos = 0;
+    while(next_header(req, &pos, &name, &name_len, &value))
+    {
+        if(name_len == 12 && strncasecmp(name, "content-type", 12) == 0)
+        {
+            put_param(p, "CONTENT_TYPE", value, strlen(value));
+            continue;
+        }
+        if((name_len == 4 && strncasecmp(name, "host", 4) == 0)
+            || (name_len == 14 && strncasecmp(name, "content-length", 14) == 0)
+            || (name_len == 17 && strncasecmp(name, "transfer-encoding", 17) == 0)
+            || (name_len == 5 && strncasecmp(name, "proxy", 5) == 0))
+        {
+            continue;
+        }
+        var.assign("HTTP_", 5);
+        for(int i = 0; i < name_len; i++)
+        {
+            var += (name[i] == '-') ? '_' : toupper((unsigned char)name[i]);
+        }
+        put_param(p, var.c_str(), value, strlen(value));
+    }
+}
+
+bool fcgi_handler::handle(http_request& req, http_response& resp)
+{
+    fcgi_request* r = (fcgi_request*)req.context;
+    req.context = NULL;
+    if(!r)
+    {
+        r = new fcgi_request;
+    }
+    build_params(req, r);
+
+    //HTTP/1.1和协程模型：CGI头部到了就开始应答，应答体流式转发；HTTP/2：收齐再发
+    bool streaming = resp.can_wait();
+    if(streaming)
+    {
+        r->set_streaming();
+    }
+    m_gateway->submit(r);
+    return resp.defer(new fcgi_response(m_gateway, r, streaming));
+}
+
+//每个网关的统计可能超过写缓冲区，做成共享应答发送
+bool fcgi_stats_handler::handle(http_request& req, http_response& resp)
+{
+    std::vector<char> body(16384 * (gateways.size() + 1));
+    int len = 0;
+    for(size_t i = 0; i < gateways.size(); i++)
+    {
+        len += gateways[i]->report(body.data() + len, body.size() - len);
+    }
+    shared_response* r = new shared_response(200, "OK", std::vector<shared_response::field>(), "text/plain", body.data(), len);
+    bool ok = resp.shared(r);
+    r->unref();
+    return ok;
+}
@@ -0,0 +1,273 @@
+#ifndef FCGI_GATEWAY_H__
+#define FCGI_GATEWAY_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "locker.h"
+#include "router.h"
+
+// FastCGI网关（-F prefix=socket[,socket...]）
+// <prefix>下的请求交给本机的FastCGI应用进程（responder角色），每个应用进程监听一个Unix socket。
+//      连接是持久的（FCGI_KEEP_CONN），每个应用进程最多CONNS_PER_BACKEND条；新连接先用FCGI_GET_VALUES
+//      询问是否支持多路复用（FCGI_MPXS_CONNS）和最大并发请求数，支持时一条连接上同时跑多个请求；
+//      每个请求交给当前未完成请求最少的应用进程，连接都忙时在网关里排队；
+//      网关自己一个线程，用epoll非阻塞读写所有应用连接，记录按到达的字节增量解析；
+//      FCGI_STDOUT先解析CGI头部（Status、Content-Type、Location等），之后的数据到一点发一点：
+//      HTTP/1.1和协程模型连接的生产者没有数据时返回PENDING，数据到达后由网关线程唤醒连接；积压超过HIGH_WATER时暂停读那条应用连接；
+//      HTTP/2的流不能等待，收齐应答后一次发送。
+// handle提交请求后立即返回一个推迟的应答（deferred_response），不占着工作线程：CGI头部（HTTP/2是整个应答）到达、
+// 失败或者超过TIMEOUT_MS时网关线程唤醒连接，连接再写应答。GET /fcgiz 查看每个应用进程的请求数、错误和延迟分布。
+
+class fcgi_gateway;
+struct fcgi_backend;
+struct fcgi_conn;
+
+// 一个FastCGI记录的增量解析：feed收到的字节，next逐个取出完整的记录
+class fcgi_parser{
+
+public:
+    struct record{
+        int type;
+        int request_id;
+        const char* data;       //指向内部缓冲区，下一次feed之前有效
+        int len;
+    };
+
+    fcgi_parser() : m_off(0), m_bad(false) {}
+
+    void feed(const char* data, int len);
+
+    //取出下一个完整的记录，不完整或格式错误（bad）时返回false
+    bool next(record* rec);
+    bool bad() const { return m_bad; }
+
+private:
+    std::string m_buf;
+    size_t m_off;
+    bool m_bad;
+};
+
+// 网关里的一个请求，处理器、生产者和网关线程共享，引用计数
+class fcgi_request{
+
+public:
+    //请求失败的原因，决定应答的状态码
+    enum ERROR{
+        NONE,
+        UNAVAILABLE,    //没有可用的应用进程、连接断开、应用拒绝（502）
+        TIMEOUT,        //超过TIMEOUT_MS（504）
+        BAD_RESPONSE    //CGI头部格式错误或者太长（502）
+    };
+
+    struct field{
+        std::string name;
+        std::string value;
+    };
+
+    fcgi_request();
+
+    void ref() { m_refs.fetch_add(1, std::memory_order_relaxed); }
+    void unref()
+    {
+        if(m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete this;
+        }
+    }
+
+    //处理器在提交之前填写
+    std::string params;         //编码好的FCGI_PARAMS名值对
+    std::string body;           //请求体，作为FCGI_STDIN发送
+
+    //处理器在提交之前：应答体由生产者逐段取走，积压太多时网关可以暂停读取
+    void set_streaming();
+    //推迟的应答：CGI头部（streaming为false时是整个应答体）已经到达或者请求失败时返回true，否则记下waker
+    bool ready(bool streaming, body_waker* waker);
+    ERROR error();
+
+    //生产者：取走最多len字节的应答体，没有数据时记下waker返回PENDING（waker为NULL时返回-1）
+    int read(char* buf, int len, body_waker* waker, fcgi_gateway* gateway);
+
+    //头部解析之后只读
+    int status;
+    std::string title;
+    std::string content_type;
+    std::vector<field> headers;
+
+    //以下由m_lock保护
+    locker m_lock;
+    bool m_headers_ready;
+    bool m_ended;               //收到了FCGI_END_REQUEST
+    ERROR m_error;
+    std::string m_out;          //还没有被生产者取走的应答体
+    size_t m_out_off;
+    body_waker* m_waker;        //连接在等CGI头部或者生产者在等数据
+    bool m_streaming;
+    bool m_paused;              //积压太多，网关暂停读它所在的连接，生产者取走一半后恢复
+
+    //以下只在网关线程访问
+    fcgi_backend* m_backend;
+    fcgi_conn* m_conn;          //已经发给应用进程、还没有收到FCGI_END_REQUEST时不为NULL
+    uint16_t m_id;
+    bool m_cancelled;           //客户端已经不要了，之后的输出丢弃
+    bool m_pause_counted;       //计入了连接的paused
+    std::string m_head;         //CGI头部还没有收完时的数据
+    uint64_t m_start_us;
+    uint64_t m_first_us;        //第一个STDOUT字节到达的时间
+
+private:
+    ~fcgi_request() {}
+
+    std::atomic<int> m_refs;
+};
+
+// 一个应用进程
+struct fcgi_backend{
+    static const int BUCKETS = 12;      //延迟分布：<=1,2,5,10,20,50,100,200,500,1000,2000ms和更长
+
+    std::string path;
+    std::vector<fcgi_conn*> conns;
+    int inflight;                       //已经发出、还没有结束的请求
+    uint64_t down_until_us;             //连接失败后这段时间内不再选它
+
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> ttfb_us_total;    //到第一个STDOUT字节的时间
+    std::atomic<uint64_t> ttfb_us_max;
+    std::atomic<uint64_t> total_us_total;   //到FCGI_END_REQUEST的时间
+    std::atomic<uint64_t> total_us_max;
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> stderr_bytes;
+    std::atomic<int> open_conns;
+    std::atomic<int> active;
+};
+
+// 到一个应用进程的一条连接，只在网关线程访问
+struct fcgi_conn{
+    int fd;
+    fcgi_backend* owner;
+    bool probed;                        //收到了FCGI_GET_VALUES_RESULT
+    bool mpxs;                          //支持多路复用
+    int max_reqs;
+    int paused;                         //积压太多而暂停读取的请求数
+    fcgi_parser parser;
+    std::string out;
+    size_t out_off;
+    std::map<uint16_t, fcgi_request*> requests;
+    uint16_t next_id;
+    uint32_t events;                    //当前在epoll里注册的事件
+    uint64_t stuck_since_us;            //有取消了的请求一直没有结束，超时后断开
+};
+
+class fcgi_gateway{
+
+public:
+    static const int MAX_BACKENDS = 16;
+    static const int CONNS_PER_BACKEND = 4;
+    static const int TIMEOUT_MS = 30000;
+    static const int RETRY_MS = 1000;               //连接失败的应用进程过这么久再试
+    static const size_t HIGH_WATER = 256 * 1024;    //一个请求积压的应答体超过这么多时暂停读它的连接
+    static const size_t MAX_HEAD = 8192;            //CGI头部的最大长度
+
+    fcgi_gateway();
+    ~fcgi_gateway();
+
+    //解析 prefix=socket[,socket...]
+    bool configure(const char* spec);
+    const char* prefix() const { return m_prefix; }
+
+    //创建网关线程，失败返回false
+    bool start();
+
+    //以下可以在任何线程调用
+    void submit(fcgi_request* r);       //网关持有一个引用直到请求结束
+    void cancel(fcgi_request* r);       //客户端不再需要应答：还没发出去的直接丢掉，已经发出的发FCGI_ABORT_REQUEST
+    void resume(fcgi_request* r);       //积压降下来了，恢复读取它的连接
+
+    int report(char* buf, int len);
+
+private:
+    enum COMMAND{
+        SUBMIT,
+        CANCEL,
+        RESUME
+    };
+    struct command{
+        COMMAND type;
+        fcgi_request* request;          //命令持有一个引用
+    };
+
+    static void* worker(void* arg);
+    void run();
+    void post(COMMAND type, fcgi_request* r);
+    void run_commands();
+
+    void dispatch();                            //把排队的请求分给有空的连接
+    fcgi_conn* pick(fcgi_backend** chosen);     //未完成请求最少的应用进程上可以再接一个请求的连接
+    fcgi_conn* open_conn(fcgi_backend* b);
+    void close_conn(fcgi_conn* c, const char* why);
+    void start_request(fcgi_conn* c, fcgi_request* r);
+    void abort_request(fcgi_request* r);
+
+    void on_event(fcgi_conn* c, uint32_t events);
+    bool on_readable(fcgi_conn* c);
+    bool flush(fcgi_conn* c);
+    void update_events(fcgi_conn* c);
+    bool on_record(fcgi_conn* c, const fcgi_parser::record& rec);
+    bool on_stdout(fcgi_request* r, const char* data, int len);
+    bool parse_head(fcgi_request* r, size_t head_len);
+    void fail(fcgi_request* r, fcgi_request::ERROR error);     //告诉客户端这边请求失败了，不影响和应用进程的交互
+    void retire(fcgi_request* r);                               //应用进程结束了请求（或者连接断开），释放网关的引用
+    void expire();
+
+private:
+    char m_prefix[64];
+    std::vector<fcgi_backend*> m_backends;
+    int m_epollfd;
+    int m_eventfd;
+    pthread_t m_thread;
+
+    locker m_lock;                      //保护m_commands
+    std::vector<command> m_commands;
+
+    std::deque<fcgi_request*> m_waiting;    //网关线程：还没有分到连接的请求
+    size_t m_next_backend;                  //负载相同时轮流选
+
+    std::atomic<int> m_waiting_count;
+    std::atomic<uint64_t> m_rejected;       //没有可用的应用进程
+};
+
+// <prefix>下的GET/POST/PUT请求：请求体收齐后交给网关，CGI头部到达后再应答，应答体流式转发
+class fcgi_handler : public request_handler{
+
+public:
+    explicit fcgi_handler(fcgi_gateway* gateway);
+
+    bool on_headers(http_request& req);
+    bool on_body(http_request& req, const char* data, int len);
+    bool handle(http_request& req, http_response& resp);
+    void on_abort(http_request& req);
+
+private:
+    void build_params(const http_request& req, fcgi_request* r);
+
+private:
+    fcgi_gateway* m_gateway;
+    int m_prefix_len;
+};
+
+// GET /fcgiz
+class fcgi_stats_handler : public request_handler{
+
+public:
+    std::vector<fcgi_gateway*> gateways;
+
+    bool handle(http_request& req, http_response& resp);
+};
+
+#endif
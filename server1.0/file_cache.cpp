@@ -0,0 +1,153 @@
+#include "file_cache.h"
+#include "alloc_guard.h"
+#include <string.h>
+#include <errno.h>
+
+static __thread file_cache* t_cache = NULL;
+
+//FNV-1a
+static uint32_t path_hash(const char* path)
+{
+    uint32_t h = 2166136261u;
+    for(; *path; ++path)
+    {
+        h ^= (unsigned char)*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+file_cache* file_cache::local(file_watcher* watcher)
+{
+    if(!t_cache)
+    {
+        alloc_pause warmup;
+        t_cache = new file_cache(watcher);
+    }
+    return t_cache;
+}
+
+file_cache::file_cache(file_watcher* watcher):
+    m_watcher(watcher), m_cursor(watcher->channel()->head()), m_count(0) {
+
+    m_entries = new entry[CAPACITY];
+    memset(m_entries, 0, sizeof(entry) * CAPACITY);
+}
+
+file_cache::~file_cache()
+{
+    delete[] m_entries;
+}
+
+void file_cache::clear()
+{
+    memset(m_entries, 0, sizeof(entry) * CAPACITY);
+    m_count = 0;
+}
+
+// 没有新事件时只有一次原子读，不进入内核
+void file_cache::sync()
+{
+    inval_channel* channel = m_watcher->channel();
+    uint64_t head = channel->head();
+    if(head == m_cursor)
+    {
+        return;
+    }
+
+    //落后太多，中间的事件已经被覆盖
+    if(head - m_cursor > (uint64_t)inval_channel::CAPACITY)
+    {
+        clear();
+        m_cursor = head;
+        return;
+    }
+
+    int type;
+    char path[PATH_LEN];
+    for(uint64_t seq = m_cursor + 1; seq <= head; seq++)
+    {
+        if(!channel->read(seq, type, path, PATH_LEN) || type == INVAL_ALL)
+        {
+            clear();
+            break;
+        }
+        invalidate(path);
+    }
+    m_cursor = head;
+}
+
+file_cache::entry* file_cache::find(const char* path, uint32_t hash)
+{
+    for(int i = 0; i < CAPACITY; i++)
+    {
+        entry* e = m_entries + ((hash + i) & (CAPACITY - 1));
+        if(e->state == SLOT_EMPTY)
+        {
+            return e;
+        }
+        if(e->hash == hash && strcmp(e->path, path) == 0)
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void file_cache::invalidate(const char* path)
+{
+    entry* e = find(path, path_hash(path));
+    if(e && e->state == SLOT_VALID)
+    {
+        e->state = SLOT_STALE;
+    }
+}
+
+int file_cache::stat(const char* path, struct stat* st)
+{
+    sync();
+
+    //监视器不可用，或者路径太长无法作为键，直接stat
+    if(!m_watcher->active() || strlen(path) >= PATH_LEN)
+    {
+        return ::stat(path, st);
+    }
+
+    uint32_t hash = path_hash(path);
+    entry* e = find(path, hash);
+    if(e && e->state == SLOT_VALID)
+    {
+        if(e->err)
+        {
+            errno = e->err;
+            return -1;
+        }
+        *st = e->st;
+        return 0;
+    }
+
+    //装载因子超过3/4时整体清空，保证探测链足够短
+    if(!e || (e->state == SLOT_EMPTY && m_count >= CAPACITY * 3 / 4))
+    {
+        clear();
+        e = find(path, hash);
+    }
+
+    if(e->state == SLOT_EMPTY)
+    {
+        e->hash = hash;
+        strcpy(e->path, path);
+        m_count++;
+    }
+
+    e->err = (::stat(path, &e->st) < 0) ? errno : 0;
+    e->state = SLOT_VALID;
+
+    if(e->err)
+    {
+        errno = e->err;
+        return -1;
+    }
+    *st = e->st;
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef FILE_CACHE_H__
+#define FILE_CACHE_H__
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include "file_watcher.h"
+
+// 每个工作线程私有的文件元数据缓存
+// 缓存stat的结果（包括"文件不存在"这样的否定结果），命中时不需要任何系统调用；
+// 缓存的正确性依赖file_watcher推送的失效事件，监视器不可用时退化为直接stat
+
+class file_cache{
+
+public:
+    static const int CAPACITY = 4096;       //槽位数量，必须是2的幂
+    static const int PATH_LEN = 256;
+
+    //获取当前线程的缓存，第一次调用时创建
+    static file_cache* local(file_watcher* watcher);
+
+    //语义与stat()相同：成功返回0，失败返回-1并设置errno
+    int stat(const char* path, struct stat* st);
+
+private:
+    /*
+        槽位状态
+        SLOT_EMPTY  :空槽位，线性探测到这里结束
+        SLOT_VALID  :缓存的结果可信
+        SLOT_STALE  :收到失效事件，下次访问时重新stat（保留槽位，不破坏探测链）
+    */
+    enum SLOT_STATE {SLOT_EMPTY = 0, SLOT_VALID, SLOT_STALE};
+
+    struct entry{
+        uint32_t hash;
+        int state;
+        int err;                    //stat失败时的errno，0表示成功
+        struct stat st;
+        char path[PATH_LEN];
+    };
+
+    explicit file_cache(file_watcher* watcher);
+    ~file_cache();
+
+    void sync();                            //取出监视器发布的所有新事件
+    void invalidate(const char* path);
+    void clear();
+    entry* find(const char* path, uint32_t hash);
+
+private:
+    file_watcher* m_watcher;
+    uint64_t m_cursor;                      //已经处理到的事件序号
+    entry* m_entries;
+    int m_count;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include "file_io.h"
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+//5.14以后的内核才有
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+std::atomic<uint64_t> file_io::m_probes(0);
+std::atomic<uint64_t> file_io::m_cold(0);
+std::atomic<uint64_t> file_io::m_faulted_bytes(0);
+std::atomic<uint64_t> file_io::m_fault_usec(0);
+
+static size_t page_size()
+{
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+//mincore和madvise要求起始地址按页对齐
+static char* page_down(const char* addr)
+{
+    return (char*)((uintptr_t)addr & ~(uintptr_t)(page_size() - 1));
+}
+
+bool file_io::resident(const char* addr, size_t len)
+{
+    if(len == 0)
+    {
+        return true;
+    }
+    char* start = page_down(addr);
+    size_t span = (addr - start) + len;
+    size_t pages = (span + page_size() - 1) / page_size();
+    unsigned char vec[WINDOW / 4096 + 2];
+    if(pages > sizeof(vec))
+    {
+        pages = sizeof(vec);
+    }
+    if(mincore(start, pages * page_size(), vec) != 0)
+    {
+        return true;        //查不了就当作在，和原来的行为一样
+    }
+    for(size_t i = 0; i < pages; i++)
+    {
+        if(!(vec[i] & 1))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void file_io::fault_in(const char* addr, size_t len)
+{
+    if(len == 0)
+    {
+        return;
+    }
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    char* start = page_down(addr);
+    size_t span = (addr - start) + len;
+    if(madvise(start, span, MADV_POPULATE_READ) != 0)
+    {
+        //老内核：先发起预读，再逐页访问等它完成
+        madvise(start, span, MADV_WILLNEED);
+        for(size_t off = 0; off < span; off += page_size())
+        {
+            (void)*(volatile const char*)(start + off);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    m_faulted_bytes.fetch_add(len, std::memory_order_relaxed);
+    m_fault_usec.fetch_add((end.tv_sec - begin.tv_sec) * 1000000 + (end.tv_nsec - begin.tv_nsec) / 1000,
+                           std::memory_order_relaxed);
+}
+
+void file_io::readahead(const char* addr, size_t len)
+{
+    if(len == 0)
+    {
+        return;
+    }
+    char* start = page_down(addr);
+    madvise(start, (addr - start) + len, MADV_WILLNEED);
+}
+
+int file_io::report(char* buf, int len)
+{
+    return snprintf(buf, len, "probes %llu\ncold %llu\nfaulted_bytes %llu\nfault_usec %llu\n",
+                    (unsigned long long)m_probes.load(std::memory_order_relaxed),
+                    (unsigned long long)m_cold.load(std::memory_order_relaxed),
+                    (unsigned long long)m_faulted_bytes.load(std::memory_order_relaxed),
+                    (unsigned long long)m_fault_usec.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,57 @@
+#ifndef FILE_IO_H__
+#define FILE_IO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// 按页缓存驻留情况发送文件
+// 文件是mmap之后由主线程writev发出去的：页不在页缓存里时缺页在writev里同步读盘，整个事件循环跟着等磁盘。
+// 发送文件之前（以及大文件每发完一个窗口）先用mincore检查接下来WINDOW字节是否都在页缓存里：
+//      在：照常发送，一次最多发一个窗口，不会碰到没有检查过的页；
+//      不在：连接交给I/O线程池，由它把这个窗口读进页缓存（MADV_POPULATE_READ，不支持时逐页访问），
+//           并对下一个窗口发起异步预读（MADV_WILLNEED），完成后再注册写事件，主线程接着发送。
+// 冷文件只占用I/O线程，其它连接的读写不受影响。
+
+class http_conn;
+
+// I/O线程池的任务，每个连接一个，连接交给I/O线程期间不会有别的事件（EPOLLONESHOT）
+struct io_task{
+    http_conn* conn;
+    void process();
+};
+
+class file_io{
+
+public:
+    static const size_t WINDOW = 2 * 1024 * 1024;  //每次检查、读入和发送的最大字节数
+
+    //[addr, addr+len)的页是否都在页缓存里
+    static bool resident(const char* addr, size_t len);
+
+    //把这一段读进页缓存，阻塞，只在I/O线程里调用
+    static void fault_in(const char* addr, size_t len);
+
+    //异步预读，不等待
+    static void readahead(const char* addr, size_t len);
+
+    static void count_probe(bool cold)
+    {
+        m_probes.fetch_add(1, std::memory_order_relaxed);
+        if(cold)
+        {
+            m_cold.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    //统计，GET /ioz
+    static int report(char* buf, int len);
+
+private:
+    static std::atomic<uint64_t> m_probes;          //检查过的窗口
+    static std::atomic<uint64_t> m_cold;            //不在页缓存里、交给了I/O线程的窗口
+    static std::atomic<uint64_t> m_faulted_bytes;   //I/O线程读入的字节
+    static std::atomic<uint64_t> m_fault_usec;      //I/O线程读入花的时间
+};
+
+#endif
@@ -0,0 +1,252 @@
+#include "file_watcher.h"
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+inval_channel::inval_channel():m_head(0)
+{
+    for(int i = 0; i < CAPACITY; i++)
+    {
+        m_ring[i].seq.store(0, std::memory_order_relaxed);
+        m_ring[i].type = INVAL_ALL;
+        m_ring[i].path[0] = '\0';
+    }
+}
+
+// 发布一个失效事件：先把槽位序号置0表示"正在写"，写完内容后再写入新序号，最后推进head
+// 读者据此判断拷贝出来的内容是否完整（类似seqlock）
+void inval_channel::publish(int type, const char* path)
+{
+    uint64_t seq = m_head.load(std::memory_order_relaxed) + 1;
+    inval_event& slot = m_ring[seq & (CAPACITY - 1)];
+
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.type = type;
+    if(path)
+    {
+        strncpy(slot.path, path, sizeof(slot.path) - 1);
+        slot.path[sizeof(slot.path) - 1] = '\0';
+    }
+    else
+    {
+        slot.path[0] = '\0';
+    }
+
+    slot.seq.store(seq, std::memory_order_release);
+    m_head.store(seq, std::memory_order_release);
+}
+
+bool inval_channel::read(uint64_t seq, int& type, char* path, int path_len) const
+{
+    const inval_event& slot = m_ring[seq & (CAPACITY - 1)];
+
+    if(slot.seq.load(std::memory_order_acquire) != seq)
+    {
+        return false;
+    }
+
+    type = slot.type;
+    strncpy(path, slot.path, path_len - 1);
+    path[path_len - 1] = '\0';
+
+    //拷贝期间如果生产者覆盖了这个槽位，序号会变化
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.seq.load(std::memory_order_relaxed) == seq;
+}
+
+file_watcher::file_watcher():
+    m_inotifyfd(-1), m_active(false), m_move_cookie(0) {
+
+}
+
+file_watcher::~file_watcher()
+{
+    if(m_inotifyfd != -1)
+    {
+        close(m_inotifyfd);
+    }
+}
+
+bool file_watcher::start(const char* root)
+{
+    return start(std::vector<const char*>(1, root));
+}
+
+bool file_watcher::start(const std::vector<const char*>& roots)
+{
+    m_inotifyfd = inotify_init1(IN_CLOEXEC);
+    if(m_inotifyfd < 0)
+    {
+        printf("inotify_init1 failure: %s\n", strerror(errno));
+        return false;
+    }
+
+    for(size_t i = 0; i < roots.size(); i++)
+    {
+        if(!add_watch_tree(roots[i]))
+        {
+            printf("can not watch %s\n", roots[i]);
+            close(m_inotifyfd);
+            m_inotifyfd = -1;
+            m_dirs.clear();
+            return false;
+        }
+    }
+
+    if(pthread_create(&m_thread, NULL, worker, this) != 0)
+    {
+        close(m_inotifyfd);
+        m_inotifyfd = -1;
+        return false;
+    }
+    pthread_detach(m_thread);
+
+    m_active.store(true, std::memory_order_release);
+    return true;
+}
+
+bool file_watcher::add_watch_tree(const std::string& dir)
+{
+    const uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                          IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+    int wd = inotify_add_watch(m_inotifyfd, dir.c_str(), mask);
+    if(wd < 0)
+    {
+        return false;
+    }
+    m_dirs[wd] = dir;
+
+    DIR* dp = opendir(dir.c_str());
+    if(!dp)
+    {
+        return true;
+    }
+
+    struct dirent* entry;
+    while((entry = readdir(dp)) != NULL)
+    {
+        if(entry->d_type != DT_DIR
+            || strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        add_watch_tree(dir + "/" + entry->d_name);
+    }
+    closedir(dp);
+    return true;
+}
+
+void* file_watcher::worker(void* arg)
+{
+    file_watcher* watcher = (file_watcher*)arg;
+    watcher->run();
+    return watcher;
+}
+
+void file_watcher::run()
+{
+    //inotify_event后面紧跟变长的文件名，缓冲区需要按inotify_event对齐
+    char buf[8192] __attribute__((aligned(__alignof__(inotify_event))));
+
+    while(true)
+    {
+        int len = ::read(m_inotifyfd, buf, sizeof(buf));
+        if(len <= 0)
+        {
+            if(len < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            //监视失效后无法保证缓存正确，让所有缓存清空并不再信任
+            m_active.store(false, std::memory_order_release);
+            m_channel.publish(INVAL_ALL, NULL);
+            return;
+        }
+
+        for(char* p = buf; p < buf + len; )
+        {
+            const inotify_event* ev = (const inotify_event*)p;
+            handle_event(ev);
+            p += sizeof(inotify_event) + ev->len;
+        }
+    }
+}
+
+//目录在监视的树内从from移到了to：它自己和所有子目录的wd不变，只改记录的路径
+void file_watcher::rename_tree(const std::string& from, const std::string& to)
+{
+    for(std::map<int, std::string>::iterator it = m_dirs.begin(); it != m_dirs.end(); ++it)
+    {
+        std::string& dir = it->second;
+        if(dir.compare(0, from.size(), from) == 0 && (dir.size() == from.size() || dir[from.size()] == '/'))
+        {
+            dir = to + dir.substr(from.size());
+        }
+    }
+}
+
+void file_watcher::handle_event(const inotify_event* ev)
+{
+    //内核事件队列溢出，丢失了事件
+    if(ev->mask & IN_Q_OVERFLOW)
+    {
+        m_channel.publish(INVAL_ALL, NULL);
+        return;
+    }
+
+    std::map<int, std::string>::iterator it = m_dirs.find(ev->wd);
+    if(it == m_dirs.end())
+    {
+        return;
+    }
+
+    //被监视的目录本身消失了
+    if(ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+        //IN_MOVE_SELF不撤销监视：树内的重命名由父目录的IN_MOVED_TO改写路径，重新添加时拿到的还是同一个wd
+        if(ev->mask & IN_IGNORED)
+        {
+            m_dirs.erase(it);
+        }
+        m_channel.publish(INVAL_ALL, NULL);
+        return;
+    }
+
+    if(ev->len == 0)
+    {
+        return;
+    }
+
+    std::string path = it->second + "/" + ev->name;
+
+    //子目录被创建/移入/移出/删除：其下所有路径（包括之前缓存的"不存在"）都可能变化，直接整体失效
+    if(ev->mask & IN_ISDIR)
+    {
+        if(ev->mask & IN_MOVED_FROM)
+        {
+            m_move_cookie = ev->cookie;
+            m_move_from = path;
+        }
+        if((ev->mask & IN_MOVED_TO) && ev->cookie != 0 && ev->cookie == m_move_cookie)
+        {
+            rename_tree(m_move_from, path);
+            m_move_cookie = 0;
+        }
+        if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+            add_watch_tree(path);
+        }
+        if(ev->mask & (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE))
+        {
+            m_channel.publish(INVAL_ALL, NULL);
+        }
+        return;
+    }
+
+    m_channel.publish(INVAL_PATH, path.c_str());
+}
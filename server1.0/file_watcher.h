@@ -0,0 +1,100 @@
+#ifndef FILE_WATCHER_H__
+#define FILE_WATCHER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+// 基于inotify的文档根目录监视器
+// 后台线程监听 doc_root（有虚拟主机时是每个主机的根目录）下的修改/移动/删除/创建事件，
+// 通过无锁的广播环形队列把失效事件推送给各个工作线程的元数据缓存(file_cache)
+
+/*
+    失效事件类型
+    INVAL_PATH  :某一个路径的元数据失效（修改、属性变化、创建、删除、移动）
+    INVAL_ALL   :整棵目录树失效（目录被移动/删除、inotify队列溢出等），缓存整体清空
+*/
+enum INVAL_TYPE {INVAL_PATH = 0, INVAL_ALL};
+
+struct inval_event{
+    std::atomic<uint64_t> seq;          //该槽位当前保存的事件序号，0表示正在写入
+    int type;
+    char path[256];                     //失效文件的完整路径
+};
+
+// 单生产者、多消费者的广播环形队列
+// 生产者(监视线程)不等待消费者；每个消费者自己维护读游标，
+// 被生产者"套圈"的消费者通过序号检测到丢失事件，退化为清空整个缓存
+class inval_channel{
+
+public:
+    static const int CAPACITY = 1024;   //必须是2的幂
+
+    inval_channel();
+
+    void publish(int type, const char* path);   //仅由监视线程调用
+
+    uint64_t head() const
+    {
+        return m_head.load(std::memory_order_acquire);
+    }
+
+    /*
+        读取序号为seq的事件，拷贝到type/path中
+        返回false表示该槽位已经被覆盖(消费者落后超过CAPACITY)，调用者需要清空缓存
+    */
+    bool read(uint64_t seq, int& type, char* path, int path_len) const;
+
+private:
+    inval_event m_ring[CAPACITY];
+    alignas(64) std::atomic<uint64_t> m_head;   //最近一次发布的事件序号，单独占一个缓存行
+};
+
+class file_watcher{
+
+public:
+    file_watcher();
+    ~file_watcher();
+
+    //递归监视root目录并启动后台线程，失败返回false（此时缓存不可信，调用者应退回每次stat）
+    bool start(const char* root);
+    //同时监视多棵目录树（虚拟主机的根目录），任何一棵监视不了都返回false
+    bool start(const std::vector<const char*>& roots);
+
+    bool active() const
+    {
+        return m_active.load(std::memory_order_acquire);
+    }
+
+    inval_channel* channel()
+    {
+        return &m_channel;
+    }
+
+private:
+    static void* worker(void* arg);
+    void run();
+
+    bool add_watch_tree(const std::string& dir);    //递归地为dir及其子目录添加监视，dir本身监视不了返回false
+    void handle_event(const inotify_event* ev);
+    void rename_tree(const std::string& from, const std::string& to);
+
+private:
+    int m_inotifyfd;
+    pthread_t m_thread;
+    std::atomic<bool> m_active;
+
+    std::map<int, std::string> m_dirs;  //watch描述符 -> 目录路径，只在监视线程中访问
+
+    //最近一次移出的子目录：同一个cookie的IN_MOVED_TO到达时把它和它下面所有目录记录的路径改到新位置
+    uint32_t m_move_cookie;
+    std::string m_move_from;
+
+    inval_channel m_channel;
+};
+
+#endif
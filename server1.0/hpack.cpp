@@ -0,0 +1,473 @@
+#include "hpack.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// 静态表(RFC 7541 附录A)，下标从1开始
+struct static_entry{
+    const char* name;
+    const char* value;
+};
+
+static const static_entry static_table[] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static const uint32_t STATIC_TABLE_LEN = sizeof(static_table) / sizeof(static_table[0]) - 1;
+
+// Huffman码(RFC 7541 附录B)是规范Huffman码，只需要每个符号的码长就能还原出码字；下标256是EOS
+static const unsigned char huffman_code_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// 按码长分组的解码表：长度为L的码字是 [first_code[L], first_code[L] + count[L]) 中连续的值
+struct huffman_table{
+    uint32_t first_code[31];
+    int first_index[31];
+    int count[31];
+    uint16_t symbols[257];      //按(码长, 符号)排序
+
+    huffman_table()
+    {
+        memset(count, 0, sizeof(count));
+        for(int s = 0; s < 257; s++)
+        {
+            count[huffman_code_len[s]]++;
+        }
+
+        int index = 0;
+        uint32_t code = 0;
+        for(int len = 1; len <= 30; len++)
+        {
+            first_code[len] = code;
+            first_index[len] = index;
+            for(int s = 0; s < 257; s++)
+            {
+                if(huffman_code_len[s] == len)
+                {
+                    symbols[index++] = s;
+                }
+            }
+            code = (code + count[len]) << 1;
+        }
+    }
+};
+
+static const huffman_table& huffman()
+{
+    static const huffman_table table;
+    return table;
+}
+
+//从bits的低nbits位中（高位在前）解出一个符号，返回码长，解不出返回0
+static int huffman_symbol(const huffman_table& t, uint64_t bits, int nbits, int* symbol)
+{
+    for(int len = 5; len <= 30 && len <= nbits; len++)
+    {
+        uint32_t code = (uint32_t)(bits >> (nbits - len)) & ((1u << len) - 1);
+        if(t.count[len] && code >= t.first_code[len] && code - t.first_code[len] < (uint32_t)t.count[len])
+        {
+            *symbol = t.symbols[t.first_index[len] + code - t.first_code[len]];
+            return len;
+        }
+    }
+    return 0;
+}
+
+bool hpack_huffman_decode(const unsigned char* data, int len, std::string& out)
+{
+    const huffman_table& t = huffman();
+    uint64_t bits = 0;
+    int nbits = 0;
+    int symbol;
+
+    for(int i = 0; i < len; i++)
+    {
+        bits = (bits << 8) | data[i];
+        nbits += 8;
+
+        //最长的码字是30位，凑够了再解，保证不会因为位数不够而失败
+        while(nbits >= 30)
+        {
+            int code_len = huffman_symbol(t, bits, nbits, &symbol);
+            if(code_len == 0 || symbol == 256)
+            {
+                return false;
+            }
+            out.push_back((char)symbol);
+            nbits -= code_len;
+        }
+        bits &= (1ull << nbits) - 1;
+    }
+
+    while(nbits >= 5)
+    {
+        int code_len = huffman_symbol(t, bits, nbits, &symbol);
+        if(code_len == 0)
+        {
+            break;
+        }
+        if(symbol == 256)
+        {
+            return false;
+        }
+        out.push_back((char)symbol);
+        nbits -= code_len;
+        bits &= (1ull << nbits) - 1;
+    }
+
+    //剩下的只能是不超过7位的填充，而且必须全是1（EOS的前缀）
+    return nbits <= 7 && bits == (1ull << nbits) - 1;
+}
+
+//整数表示：prefix_bits位前缀，值不够放时后面跟7位一组的续字节
+static bool read_int(const unsigned char*& p, const unsigned char* end, int prefix_bits, uint32_t* out)
+{
+    if(p >= end)
+    {
+        return false;
+    }
+    uint32_t max = (1u << prefix_bits) - 1;
+    uint32_t value = *p++ & max;
+    if(value < max)
+    {
+        *out = value;
+        return true;
+    }
+
+    for(int shift = 0; p < end && shift < 28; shift += 7)
+    {
+        unsigned char b = *p++;
+        value += (uint32_t)(b & 0x7f) << shift;
+        if(!(b & 0x80))
+        {
+            *out = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void write_int(std::string& out, unsigned char first, int prefix_bits, uint32_t value)
+{
+    uint32_t max = (1u << prefix_bits) - 1;
+    if(value < max)
+    {
+        out.push_back((char)(first | value));
+        return;
+    }
+    out.push_back((char)(first | max));
+    value -= max;
+    while(value >= 128)
+    {
+        out.push_back((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+hpack_decoder::hpack_decoder():
+    m_size(0), m_max_size(DEFAULT_TABLE_SIZE), m_max_size_limit(DEFAULT_TABLE_SIZE) {
+
+}
+
+bool hpack_decoder::read_string(const unsigned char*& p, const unsigned char* end, std::string& out)
+{
+    out.clear();
+    if(p >= end)
+    {
+        return false;
+    }
+    bool huffman_coded = (*p & 0x80) != 0;
+    uint32_t len;
+    if(!read_int(p, end, 7, &len) || len > (uint32_t)(end - p))
+    {
+        return false;
+    }
+    if(huffman_coded)
+    {
+        if(!hpack_huffman_decode(p, len, out))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        out.assign((const char*)p, len);
+    }
+    p += len;
+    return true;
+}
+
+bool hpack_decoder::lookup(uint32_t index, const char** name, int* name_len,
+                           const char** value, int* value_len) const
+{
+    if(index == 0)
+    {
+        return false;
+    }
+    if(index <= STATIC_TABLE_LEN)
+    {
+        *name = static_table[index].name;
+        *name_len = strlen(*name);
+        *value = static_table[index].value;
+        *value_len = strlen(*value);
+        return true;
+    }
+    index -= STATIC_TABLE_LEN + 1;
+    if(index >= m_table.size())
+    {
+        return false;
+    }
+    const entry& e = m_table[index];
+    *name = e.name.data();
+    *name_len = e.name.size();
+    *value = e.value.data();
+    *value_len = e.value.size();
+    return true;
+}
+
+//淘汰最旧的条目，直到再放入size字节也不超过上限
+void hpack_decoder::evict(int size)
+{
+    while(!m_table.empty() && m_size + size > m_max_size)
+    {
+        const entry& e = m_table.back();
+        m_size -= 32 + e.name.size() + e.value.size();
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::insert(const char* name, int name_len, const char* value, int value_len)
+{
+    int size = 32 + name_len + value_len;
+    evict(size);
+    //比整个表还大的条目：表被清空，条目不插入
+    if(size > m_max_size)
+    {
+        return;
+    }
+    entry e;
+    e.name.assign(name, name_len);
+    e.value.assign(value, value_len);
+    m_table.push_front(e);
+    m_size += size;
+}
+
+bool hpack_decoder::decode(const unsigned char* data, int len, hpack_emit emit, void* arg)
+{
+    const unsigned char* p = data;
+    const unsigned char* end = data + len;
+    bool header_seen = false;
+
+    while(p < end)
+    {
+        unsigned char b = *p;
+        uint32_t index;
+
+        if(b & 0x80)
+        {
+            //索引表示
+            const char *name, *value;
+            int name_len, value_len;
+            if(!read_int(p, end, 7, &index) || !lookup(index, &name, &name_len, &value, &value_len))
+            {
+                return false;
+            }
+            if(!emit(arg, name, name_len, value, value_len))
+            {
+                return false;
+            }
+            header_seen = true;
+            continue;
+        }
+
+        if((b & 0xe0) == 0x20)
+        {
+            //动态表大小更新，只能出现在头部块的开头
+            if(header_seen || !read_int(p, end, 5, &index) || index > (uint32_t)m_max_size_limit)
+            {
+                return false;
+            }
+            m_max_size = index;
+            evict(0);
+            continue;
+        }
+
+        //字面量：01 带索引，0000 不索引，0001 永不索引
+        bool indexing = (b & 0xc0) == 0x40;
+        if(!read_int(p, end, indexing ? 6 : 4, &index))
+        {
+            return false;
+        }
+
+        if(index == 0)
+        {
+            if(!read_string(p, end, m_name))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            const char *name, *value;
+            int name_len, value_len;
+            if(!lookup(index, &name, &name_len, &value, &value_len))
+            {
+                return false;
+            }
+            m_name.assign(name, name_len);
+        }
+
+        if(!read_string(p, end, m_value))
+        {
+            return false;
+        }
+
+        if(indexing)
+        {
+            insert(m_name.data(), m_name.size(), m_value.data(), m_value.size());
+        }
+        if(!emit(arg, m_name.data(), m_name.size(), m_value.data(), m_value.size()))
+        {
+            return false;
+        }
+        header_seen = true;
+    }
+    return true;
+}
+
+void hpack_encoder::begin_block(std::string& out)
+{
+    if(m_first)
+    {
+        //动态表大小更新为0
+        out.push_back((char)0x20);
+        m_first = false;
+    }
+}
+
+void hpack_encoder::encode_status(std::string& out, int status)
+{
+    begin_block(out);
+
+    //常见状态码在静态表中有完整的条目
+    for(uint32_t i = 8; i <= 14; i++)
+    {
+        if(atoi(static_table[i].value) == status)
+        {
+            write_int(out, 0x80, 7, i);
+            return;
+        }
+    }
+
+    char value[16];
+    int len = snprintf(value, sizeof(value), "%d", status);
+    encode(out, ":status", value, len);
+}
+
+void hpack_encoder::encode(std::string& out, const char* name, const char* value, int value_len)
+{
+    uint32_t name_index = 0;
+    for(uint32_t i = 1; i <= STATIC_TABLE_LEN; i++)
+    {
+        if(strcmp(static_table[i].name, name) == 0)
+        {
+            name_index = i;
+            break;
+        }
+    }
+
+    //不索引的字面量
+    write_int(out, 0x00, 4, name_index);
+    if(name_index == 0)
+    {
+        int name_len = strlen(name);
+        write_int(out, 0x00, 7, name_len);
+        out.append(name, name_len);
+    }
+    write_int(out, 0x00, 7, value_len);
+    out.append(value, value_len);
+}
+
+void hpack_encoder::encode(std::string& out, const char* name, const char* value)
+{
+    encode(out, name, value, strlen(value));
+}
@@ -0,0 +1,71 @@
+#ifndef HPACK_H__
+#define HPACK_H__
+
+#include <stdint.h>
+#include <string>
+#include <deque>
+
+// HPACK(RFC 7541)：HTTP/2的头部压缩
+// 解码器支持静态表、动态表（受SETTINGS_HEADER_TABLE_SIZE限制）和Huffman编码的字符串；
+// 编码器只使用静态表和不索引的字面量，不维护动态表，也不做Huffman编码
+
+//每解出一个头部调用一次，name/value在回调返回后失效；返回false中止解码
+typedef bool (*hpack_emit)(void* arg, const char* name, int name_len, const char* value, int value_len);
+
+class hpack_decoder{
+
+public:
+    static const int DEFAULT_TABLE_SIZE = 4096;
+
+    hpack_decoder();
+
+    //我们在SETTINGS中通告的表大小上限，对端的大小更新指令不能超过它
+    void set_max_table_size(int size) { m_max_size_limit = size; }
+
+    //解码一个完整的头部块（HEADERS+CONTINUATION拼接后的内容），格式错误返回false（COMPRESSION_ERROR）
+    bool decode(const unsigned char* data, int len, hpack_emit emit, void* arg);
+
+private:
+    struct entry{
+        std::string name;
+        std::string value;
+    };
+
+    bool lookup(uint32_t index, const char** name, int* name_len, const char** value, int* value_len) const;
+    void insert(const char* name, int name_len, const char* value, int value_len);
+    void evict(int size);
+    bool read_string(const unsigned char*& p, const unsigned char* end, std::string& out);
+
+private:
+    std::deque<entry> m_table;      //动态表，新条目在前面
+    int m_size;                     //当前动态表大小（每个条目 32 + name + value）
+    int m_max_size;                 //当前动态表上限，由对端的大小更新指令设置
+    int m_max_size_limit;           //协议允许的上限
+
+    std::string m_name;             //解码字面量用的临时缓冲区，重复使用
+    std::string m_value;
+};
+
+class hpack_encoder{
+
+public:
+    hpack_encoder() : m_first(true) {}
+
+    void encode_status(std::string& out, int status);
+
+    //名字必须是小写；静态表中有这个名字时用它的索引
+    void encode(std::string& out, const char* name, const char* value, int value_len);
+
+    void encode(std::string& out, const char* name, const char* value);
+
+private:
+    void begin_block(std::string& out);
+
+private:
+    bool m_first;                   //第一个头部块先发送"动态表大小=0"，表示我们不使用动态表
+};
+
+//Huffman解码，失败返回false
+bool hpack_huffman_decode(const unsigned char* data, int len, std::string& out);
+
+#endif
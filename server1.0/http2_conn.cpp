@@ -0,0 +1,1620 @@
+#include "http2_conn.h"
+#include "http_conn.h"
+#include <string.h>
+#include <ctype.h>
+#include <sys/mman.h>
+
+extern const char* error_400_form;
+extern const char* error_403_form;
+extern const char* error_404_form;
+extern const char* error_405_form;
+extern const char* error_413_form;
+extern const char* error_500_form;
+
+static const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const int PREFACE_LEN = sizeof(client_preface) - 1;
+
+static const int FLAG_END_STREAM = 0x1;
+static const int FLAG_ACK = 0x1;
+static const int FLAG_END_HEADERS = 0x4;
+static const int FLAG_PADDED = 0x8;
+static const int FLAG_PRIORITY = 0x20;
+
+static const int SETTINGS_HEADER_TABLE_SIZE = 0x1;
+static const int SETTINGS_ENABLE_PUSH = 0x2;
+static const int SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+static const int SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+static const int SETTINGS_MAX_FRAME_SIZE = 0x5;
+
+static const int64_t MAX_WINDOW = 0x7fffffff;
+static const int DEFAULT_WINDOW = 65535;
+static const int DEFAULT_WEIGHT = 16;
+
+static uint32_t get_u32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(std::string& out, uint32_t v)
+{
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+//HTTP2-Settings头部是不带填充的base64url
+static bool base64url_decode(const char* in, std::string& out)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+    for(; *in && *in != ' ' && *in != '\t'; in++)
+    {
+        int v;
+        char c = *in;
+        if(c >= 'A' && c <= 'Z') v = c - 'A';
+        else if(c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if(c >= '0' && c <= '9') v = c - '0' + 52;
+        else if(c == '-') v = 62;
+        else if(c == '_') v = 63;
+        else if(c == '=') break;
+        else return false;
+
+        acc = (acc << 6) | v;
+        bits += 6;
+        if(bits >= 8)
+        {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    return true;
+}
+
+http2_session::http2_session(bool copy_bodies):
+    m_copy_bodies(copy_bodies), m_preface(false), m_settings_received(false),
+    m_goaway_sent(false), m_goaway_received(false), m_block_stream(0), m_block_end_stream(false),
+    m_last_stream_id(0), m_active(0), m_vclock(0), m_deferred(0), m_waker(NULL),
+    m_remote_addr(0), m_remote_port(0), m_server_port(0),
+    m_send_window(DEFAULT_WINDOW), m_peer_initial_window(DEFAULT_WINDOW), m_peer_max_frame(16384),
+    m_recv_window(CONNECTION_WINDOW_SIZE), m_recv_unacked(0),
+    m_queue_off(0), m_queued(0)
+{
+    m_decoder.set_max_table_size(hpack_decoder::DEFAULT_TABLE_SIZE);
+}
+
+http2_session::~http2_session()
+{
+    for(std::map<uint32_t, h2_stream*>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        if(it->second->in_request)
+        {
+            it->second->handler->on_abort(it->second->req);
+        }
+        free_stream(it->second);
+    }
+    for(size_t i = 0; i < m_closed.size(); i++)
+    {
+        free_stream(m_closed[i]);
+    }
+}
+
+void http2_session::start()
+{
+    size_t off = m_out.size();
+    frame_header(12, FRAME_SETTINGS, 0, 0);
+    m_out.push_back(0);
+    m_out.push_back((char)SETTINGS_MAX_CONCURRENT_STREAMS);
+    put_u32(m_out, MAX_CONCURRENT_STREAMS);
+    m_out.push_back(0);
+    m_out.push_back((char)SETTINGS_INITIAL_WINDOW_SIZE);
+    put_u32(m_out, INITIAL_WINDOW_SIZE);
+    queue_internal(off, m_out.size() - off);
+
+    //连接级窗口不能通过SETTINGS修改，只能用WINDOW_UPDATE扩大
+    queue_window_update(0, CONNECTION_WINDOW_SIZE - DEFAULT_WINDOW);
+}
+
+bool http2_session::upgrade(const char* settings, int method, const char* url, const char* host)
+{
+    std::string payload;
+    if(!base64url_decode(settings, payload) || payload.size() % 6 != 0
+        || apply_settings((const unsigned char*)payload.data(), payload.size()) != NO_ERROR)
+    {
+        return false;
+    }
+
+    //原来的请求没有请求体，流1处于half-closed(remote)状态
+    h2_stream* s = open_stream(1);
+    s->method = (method == http_conn::POST) ? "POST" : (method == http_conn::PUT) ? "PUT" : "GET";
+    s->path = url;
+    if(host)
+    {
+        s->authority = host;
+    }
+    s->headers_done = true;
+    s->end_remote = true;
+    m_last_stream_id = 1;
+    begin_request(s);
+    return true;
+}
+
+bool http2_session::on_input(const char* data, int len)
+{
+    if(m_goaway_sent)
+    {
+        return false;
+    }
+    m_in.append(data, len);
+
+    size_t pos = 0;
+    if(!m_preface)
+    {
+        if(m_in.size() < (size_t)PREFACE_LEN)
+        {
+            return memcmp(m_in.data(), client_preface, m_in.size()) == 0 || connection_error(PROTOCOL_ERROR);
+        }
+        if(memcmp(m_in.data(), client_preface, PREFACE_LEN) != 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        m_preface = true;
+        pos = PREFACE_LEN;
+    }
+
+    //只处理完整的帧，不完整的留到下一次
+    while(m_in.size() - pos >= 9)
+    {
+        const unsigned char* p = (const unsigned char*)m_in.data() + pos;
+        int frame_len = (p[0] << 16) | (p[1] << 8) | p[2];
+        int type = p[3];
+        int flags = p[4];
+        uint32_t id = get_u32(p + 5) & 0x7fffffff;
+
+        if(frame_len > MAX_FRAME_SIZE)
+        {
+            return connection_error(FRAME_SIZE_ERROR);
+        }
+        if(m_in.size() - pos < (size_t)(9 + frame_len))
+        {
+            break;
+        }
+        if(!m_settings_received && type != FRAME_SETTINGS)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        m_settings_received = true;
+
+        //头部块没有结束时只能收到同一个流的CONTINUATION
+        if(m_block_stream && (type != FRAME_CONTINUATION || id != m_block_stream))
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+
+        if(!process_frame(type, flags, id, p + 9, frame_len))
+        {
+            return false;
+        }
+        pos += 9 + frame_len;
+    }
+    m_in.erase(0, pos);
+    return true;
+}
+
+bool http2_session::process_frame(int type, int flags, uint32_t id, const unsigned char* payload, int len)
+{
+    switch(type)
+    {
+        case FRAME_DATA:
+            return on_data(flags, id, payload, len);
+        case FRAME_HEADERS:
+            return on_headers(flags, id, payload, len);
+        case FRAME_PRIORITY:
+            return on_priority(id, payload, len);
+        case FRAME_RST_STREAM:
+            return on_rst_stream(id, payload, len);
+        case FRAME_SETTINGS:
+            return on_settings(flags, id, payload, len);
+        case FRAME_PUSH_PROMISE:
+            //客户端不能推送
+            return connection_error(PROTOCOL_ERROR);
+        case FRAME_PING:
+            return on_ping(flags, id, payload, len);
+        case FRAME_GOAWAY:
+            return on_goaway(id, payload, len);
+        case FRAME_WINDOW_UPDATE:
+            return on_window_update(id, payload, len);
+        case FRAME_CONTINUATION:
+            return on_continuation(flags, id, payload, len);
+        default:
+            //未知类型的帧必须忽略
+            return true;
+    }
+}
+
+//去掉填充，返回false表示填充长度不合法
+static bool strip_padding(int flags, const unsigned char*& payload, int& len)
+{
+    if(!(flags & FLAG_PADDED))
+    {
+        return true;
+    }
+    if(len < 1)
+    {
+        return false;
+    }
+    int pad = payload[0];
+    payload++;
+    len--;
+    if(pad > len)
+    {
+        return false;
+    }
+    len -= pad;
+    return true;
+}
+
+bool http2_session::on_data(int flags, uint32_t id, const unsigned char* payload, int len)
+{
+    if(id == 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+
+    //流量控制按整个帧的长度（包括填充）计算，无论这个流是否还存在
+    int frame_len = len;
+    if(frame_len > m_recv_window)
+    {
+        return connection_error(FLOW_CONTROL_ERROR);
+    }
+    m_recv_window -= frame_len;
+    m_recv_unacked += frame_len;
+    if(m_recv_unacked >= CONNECTION_WINDOW_SIZE / 2)
+    {
+        queue_window_update(0, m_recv_unacked);
+        m_recv_window += m_recv_unacked;
+        m_recv_unacked = 0;
+    }
+
+    if(!strip_padding(flags, payload, len))
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+
+    h2_stream* s = find_stream(id);
+    if(!s)
+    {
+        if(id > m_last_stream_id)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        //我们已经关闭（重置）的流，对方可能还在途中发来数据
+        return true;
+    }
+    if(s->end_remote)
+    {
+        reset_stream(s, STREAM_CLOSED);
+        return true;
+    }
+    if(frame_len > s->recv_window)
+    {
+        reset_stream(s, FLOW_CONTROL_ERROR);
+        return true;
+    }
+    s->recv_window -= frame_len;
+
+    //提前应答过的流，请求体直接丢弃
+    if(!s->responded && len > 0)
+    {
+        s->body_received += len;
+        if(s->body_received > http_conn::m_max_body_size)
+        {
+            respond_error(s, 413, error_413_form);
+        }
+        else if(s->content_length >= 0 && s->body_received > s->content_length)
+        {
+            reset_stream(s, PROTOCOL_ERROR);
+            return true;
+        }
+        else if(!deliver_body(s, payload, len))
+        {
+            respond_error(s, 500, error_500_form);
+        }
+    }
+
+    if(flags & FLAG_END_STREAM)
+    {
+        s->end_remote = true;
+        if(!s->responded)
+        {
+            if(s->content_length >= 0 && s->body_received != s->content_length)
+            {
+                reset_stream(s, PROTOCOL_ERROR);
+                return true;
+            }
+            finish_request(s);
+        }
+        else if(s->end_local)
+        {
+            close_stream(s);
+        }
+        return true;
+    }
+
+    //请求体已经被消费，归还流的窗口
+    s->recv_unacked += frame_len;
+    if(s->recv_unacked >= INITIAL_WINDOW_SIZE / 2)
+    {
+        queue_window_update(id, s->recv_unacked);
+        s->recv_window += s->recv_unacked;
+        s->recv_unacked = 0;
+    }
+    return true;
+}
+
+bool http2_session::on_headers(int flags, uint32_t id, const unsigned char* payload, int len)
+{
+    if(id == 0 || !(id & 1))
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if(!strip_padding(flags, payload, len))
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+
+    uint32_t parent = 0;
+    int weight = DEFAULT_WEIGHT;
+    bool exclusive = false;
+    bool has_priority = false;
+    if(flags & FLAG_PRIORITY)
+    {
+        if(len < 5)
+        {
+            return connection_error(FRAME_SIZE_ERROR);
+        }
+        uint32_t dep = get_u32(payload);
+        exclusive = (dep & 0x80000000) != 0;
+        parent = dep & 0x7fffffff;
+        weight = payload[4] + 1;
+        payload += 5;
+        len -= 5;
+        has_priority = true;
+    }
+
+    h2_stream* s = find_stream(id);
+    if(s)
+    {
+        //trailer：必须结束请求体
+        if(s->end_remote || !(flags & FLAG_END_STREAM))
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+    }
+    else
+    {
+        if(id <= m_last_stream_id)
+        {
+            return connection_error(STREAM_CLOSED);
+        }
+        m_last_stream_id = id;
+        if(parent == id)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+
+        //超过并发上限或者已经GOAWAY：头部块仍然要解码以保持HPACK状态同步，然后拒绝
+        if(m_active < MAX_CONCURRENT_STREAMS && !m_goaway_received)
+        {
+            s = open_stream(id);
+            if(has_priority)
+            {
+                set_priority(s, parent, weight, exclusive);
+            }
+        }
+    }
+
+    m_block.assign((const char*)payload, len);
+    m_block_stream = id;
+    m_block_end_stream = (flags & FLAG_END_STREAM) != 0;
+    if(flags & FLAG_END_HEADERS)
+    {
+        return end_header_block();
+    }
+    return true;
+}
+
+bool http2_session::on_continuation(int flags, uint32_t id, const unsigned char* payload, int len)
+{
+    if(!m_block_stream)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if(m_block.size() + len > (size_t)MAX_HEADER_BLOCK)
+    {
+        return connection_error(ENHANCE_YOUR_CALM);
+    }
+    m_block.append((const char*)payload, len);
+    if(flags & FLAG_END_HEADERS)
+    {
+        return end_header_block();
+    }
+    return true;
+}
+
+struct header_context{
+    h2_stream* stream;          //为NULL时只解码不保存（trailer或被拒绝的流）
+    bool bad;
+    bool regular_seen;
+};
+
+static bool on_request_header(void* arg, const char* name, int name_len, const char* value, int value_len)
+{
+    header_context* ctx = (header_context*)arg;
+    for(int i = 0; i < name_len; i++)
+    {
+        if(isupper((unsigned char)name[i]))
+        {
+            ctx->bad = true;
+        }
+    }
+    if(!ctx->stream)
+    {
+        return true;
+    }
+
+    h2_stream* s = ctx->stream;
+    if(name_len > 0 && name[0] == ':')
+    {
+        //伪头部必须在普通头部之前
+        if(ctx->regular_seen)
+        {
+            ctx->bad = true;
+        }
+        if(name_len == 7 && memcmp(name, ":method", 7) == 0)
+        {
+            s->method.assign(value, value_len);
+        }
+        else if(name_len == 5 && memcmp(name, ":path", 5) == 0)
+        {
+            s->path.assign(value, value_len);
+        }
+        else if(name_len == 10 && memcmp(name, ":authority", 10) == 0)
+        {
+            s->authority.assign(value, value_len);
+        }
+        else if(!(name_len == 7 && memcmp(name, ":scheme", 7) == 0))
+        {
+            ctx->bad = true;
+        }
+        return true;
+    }
+
+    ctx->regular_seen = true;
+    if(name_len == 14 && memcmp(name, "content-length", 14) == 0)
+    {
+        std::string v(value, value_len);
+        char* end = NULL;
+        s->content_length = strtoll(v.c_str(), &end, 10);
+        if(end == v.c_str() || *end != '\0' || s->content_length < 0)
+        {
+            ctx->bad = true;
+        }
+    }
+    else if((name_len == 10 && memcmp(name, "connection", 10) == 0)
+        || (name_len == 17 && memcmp(name, "transfer-encoding", 17) == 0))
+    {
+        //HTTP/2中禁止的连接相关头部
+        ctx->bad = true;
+    }
+    else if(name_len == 4 && memcmp(name, "host", 4) == 0 && s->authority.empty())
+    {
+        s->authority.assign(value, value_len);
+    }
+    else if(name_len == 15 && memcmp(name, "accept-encoding", 15) == 0)
+    {
+        s->accept_gzip = memmem(value, value_len, "gzip", 4) != NULL;
+    }
+    if(!ctx->bad)
+    {
+        s->headers.append(name, name_len);
+        s->headers.append(": ", 2);
+        s->headers.append(value, value_len);
+        s->headers.push_back('\0');
+    }
+    return true;
+}
+
+bool http2_session::end_header_block()
+{
+    uint32_t id = m_block_stream;
+    m_block_stream = 0;
+
+    h2_stream* s = find_stream(id);
+    bool trailer = s && s->headers_done;
+
+    header_context ctx;
+    ctx.stream = trailer ? NULL : s;
+    ctx.bad = false;
+    ctx.regular_seen = false;
+    if(!m_decoder.decode((const unsigned char*)m_block.data(), m_block.size(), on_request_header, &ctx))
+    {
+        return connection_error(COMPRESSION_ERROR);
+    }
+    m_block.clear();
+
+    if(!s)
+    {
+        queue_rst(id, REFUSED_STREAM);
+        return true;
+    }
+    if(ctx.bad)
+    {
+        reset_stream(s, PROTOCOL_ERROR);
+        return true;
+    }
+
+    if(trailer)
+    {
+        //trailer只标志请求体结束，内容不使用
+        s->end_remote = true;
+        if(!s->responded)
+        {
+            finish_request(s);
+        }
+        else if(s->end_local)
+        {
+            close_stream(s);
+        }
+        return true;
+    }
+
+    s->headers_done = true;
+    s->end_remote = m_block_end_stream;
+    if(s->method.empty() || s->path.empty() || s->path[0] != '/')
+    {
+        reset_stream(s, PROTOCOL_ERROR);
+        return true;
+    }
+    begin_request(s);
+    return true;
+}
+
+bool http2_session::on_priority(uint32_t id, const unsigned char* payload, int len)
+{
+    if(id == 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if(len != 5)
+    {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+    uint32_t dep = get_u32(payload);
+    uint32_t parent = dep & 0x7fffffff;
+    if(parent == id)
+    {
+        h2_stream* s = find_stream(id);
+        if(s)
+        {
+            reset_stream(s, PROTOCOL_ERROR);
+        }
+        return true;
+    }
+
+    //空闲流和已关闭流的优先级信息不保存，依赖它们的流按依赖根处理
+    h2_stream* s = find_stream(id);
+    if(s)
+    {
+        set_priority(s, parent, payload[4] + 1, (dep & 0x80000000) != 0);
+    }
+    return true;
+}
+
+bool http2_session::on_rst_stream(uint32_t id, const unsigned char* payload, int len)
+{
+    if(id == 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if(len != 4)
+    {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+    if(id > m_last_stream_id)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    h2_stream* s = find_stream(id);
+    if(s)
+    {
+        if(s->in_request)
+        {
+            s->handler->on_abort(s->req);
+            s->in_request = false;
+        }
+        close_stream(s);
+    }
+    return true;
+}
+
+http2_session::ERROR_CODE http2_session::apply_settings(const unsigned char* payload, int len)
+{
+    for(int i = 0; i + 6 <= len; i += 6)
+    {
+        int key = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = get_u32(payload + i + 2);
+        switch(key)
+        {
+            case SETTINGS_ENABLE_PUSH:
+                if(value > 1)
+                {
+                    return PROTOCOL_ERROR;
+                }
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+            {
+                if(value > MAX_WINDOW)
+                {
+                    return FLOW_CONTROL_ERROR;
+                }
+                //已经打开的流按差值调整，窗口可以因此变成负数
+                int64_t delta = (int64_t)value - m_peer_initial_window;
+                m_peer_initial_window = value;
+                for(std::map<uint32_t, h2_stream*>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+                {
+                    it->second->send_window += delta;
+                    if(it->second->send_window > MAX_WINDOW)
+                    {
+                        return FLOW_CONTROL_ERROR;
+                    }
+                }
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if(value < 16384 || value > 16777215)
+                {
+                    return PROTOCOL_ERROR;
+                }
+                m_peer_max_frame = value;
+                break;
+            case SETTINGS_HEADER_TABLE_SIZE:
+            case SETTINGS_MAX_CONCURRENT_STREAMS:
+            default:
+                //编码器不使用动态表，我们也不推送，其余设置忽略
+                break;
+        }
+    }
+    return NO_ERROR;
+}
+
+bool http2_session::on_settings(int flags, uint32_t id, const unsigned char* payload, int len)
+{
+    if(id != 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if(flags & FLAG_ACK)
+    {
+        return len == 0 || connection_error(FRAME_SIZE_ERROR);
+    }
+    if(len % 6 != 0)
+    {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+    ERROR_CODE code = apply_settings(payload, len);
+    if(code != NO_ERROR)
+    {
+        return connection_error(code);
+    }
+
+    size_t off = m_out.size();
+    frame_header(0, FRAME_SETTINGS, FLAG_ACK, 0);
+    queue_internal(off, 9);
+    return true;
+}
+
+bool http2_session::on_ping(int flags, uint32_t id, const unsigned char* payload, int len)
+{
+    if(id != 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if(len != 8)
+    {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+    if(!(flags & FLAG_ACK))
+    {
+        size_t off = m_out.size();
+        frame_header(8, FRAME_PING, FLAG_ACK, 0);
+        m_out.append((const char*)payload, 8);
+        queue_internal(off, 17);
+    }
+    return true;
+}
+
+bool http2_session::on_goaway(uint32_t id, const unsigned char* payload, int len)
+{
+    if(id != 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if(len < 8)
+    {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+    //已经打开的流照常完成，之后关闭连接
+    m_goaway_received = true;
+    return true;
+}
+
+bool http2_session::on_window_update(uint32_t id, const unsigned char* payload, int len)
+{
+    if(len != 4)
+    {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = get_u32(payload) & 0x7fffffff;
+
+    if(id == 0)
+    {
+        if(increment == 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        m_send_window += increment;
+        if(m_send_window > MAX_WINDOW)
+        {
+            return connection_error(FLOW_CONTROL_ERROR);
+        }
+        return true;
+    }
+
+    h2_stream* s = find_stream(id);
+    if(!s)
+    {
+        if(id > m_last_stream_id)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        return true;
+    }
+    if(increment == 0)
+    {
+        reset_stream(s, PROTOCOL_ERROR);
+        return true;
+    }
+    s->send_window += increment;
+    if(s->send_window > MAX_WINDOW)
+    {
+        reset_stream(s, FLOW_CONTROL_ERROR);
+    }
+    return true;
+}
+
+bool http2_session::connection_error(ERROR_CODE code)
+{
+    if(!m_goaway_sent)
+    {
+        size_t off = m_out.size();
+        frame_header(8, FRAME_GOAWAY, 0, 0);
+        put_u32(m_out, m_last_stream_id);
+        put_u32(m_out, code);
+        queue_internal(off, 17);
+        m_goaway_sent = true;
+    }
+    return false;
+}
+
+h2_stream* http2_session::open_stream(uint32_t id)
+{
+    h2_stream* s = new h2_stream;
+    s->id = id;
+    s->end_remote = false;
+    s->end_local = false;
+    s->reset_after_response = false;
+    s->parent = 0;
+    s->weight = DEFAULT_WEIGHT;
+    s->vtime = 0;
+    s->send_window = m_peer_initial_window;
+    s->recv_window = INITIAL_WINDOW_SIZE;
+    s->recv_unacked = 0;
+    s->content_length = -1;
+    s->accept_gzip = false;
+    s->body_received = 0;
+    s->headers_done = false;
+    s->handler = NULL;
+    memset(&s->req, 0, sizeof(s->req));
+    s->req.body_fd = -1;
+    s->req.arena = &s->arena;
+    s->in_request = false;
+    s->responded = false;
+    s->status = 0;
+    s->body = NULL;
+    s->body_len = 0;
+    s->body_off = 0;
+    s->file_address = NULL;
+    s->file_size = 0;
+    s->producer = NULL;
+    s->deferred = NULL;
+
+    m_streams[id] = s;
+    m_active++;
+    return s;
+}
+
+h2_stream* http2_session::find_stream(uint32_t id)
+{
+    std::map<uint32_t, h2_stream*>::iterator it = m_streams.find(id);
+    return it == m_streams.end() ? NULL : it->second;
+}
+
+//依赖树：parent为0表示依赖根；依赖自己的后代时，先把那个后代移到自己原来的父节点下
+void http2_session::set_priority(h2_stream* s, uint32_t parent, int weight, bool exclusive)
+{
+    h2_stream* p = find_stream(parent);
+    if(!p)
+    {
+        parent = 0;
+    }
+    else
+    {
+        //p是不是s的后代
+        uint32_t up = p->parent;
+        while(up && up != s->id)
+        {
+            h2_stream* a = find_stream(up);
+            up = a ? a->parent : 0;
+        }
+        if(up == s->id)
+        {
+            p->parent = s->parent;
+        }
+    }
+
+    if(exclusive)
+    {
+        for(std::map<uint32_t, h2_stream*>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+        {
+            if(it->second != s && it->second->parent == parent)
+            {
+                it->second->parent = s->id;
+            }
+        }
+    }
+    s->parent = parent;
+    s->weight = weight;
+}
+
+//请求头已经完整：匹配路由，通知处理器；没有请求体的话直接应答
+void http2_session::begin_request(h2_stream* s)
+{
+    int method;
+    if(s->method == "GET")
+    {
+        method = http_conn::GET;
+    }
+    else if(s->method == "POST")
+    {
+        method = http_conn::POST;
+    }
+    else if(s->method == "PUT")
+    {
+        method = http_conn::PUT;
+    }
+    else
+    {
+        respond_error(s, 405, error_405_form);
+        return;
+    }
+
+    if(http_conn::m_worker_stats)
+    {
+        http_conn::m_worker_stats->count_request();
+    }
+
+    int path_len = strcspn(s->path.c_str(), "?");
+    if(http_conn::m_router)
+    {
+        s->handler = http_conn::m_router->match(method, s->path.c_str(), path_len);
+    }
+
+    if(method != http_conn::GET && !s->handler)
+    {
+        respond_error(s, 405, error_405_form);
+        return;
+    }
+    if(s->content_length > http_conn::m_max_body_size)
+    {
+        respond_error(s, 413, error_413_form);
+        return;
+    }
+
+    if(s->handler)
+    {
+        http_request& req = s->req;
+        req.method = method;
+        req.path = s->path.c_str();
+        req.path_len = path_len;
+        req.query = (s->path[path_len] == '?') ? s->path.c_str() + path_len + 1 : NULL;
+        req.host = s->authority.empty() ? NULL : s->authority.c_str();
+        req.keep_alive = true;
+        //长度未知的请求体按chunked对待
+        req.chunked = !s->end_remote && s->content_length < 0;
+        req.content_length = s->end_remote ? 0 : s->content_length;
+        req.headers = s->headers.empty() ? NULL : s->headers.data();
+        req.headers_len = s->headers.size();
+        req.remote_addr = m_remote_addr;
+        req.remote_port = m_remote_port;
+        req.server_port = m_server_port;
+
+        if(!s->handler->on_headers(req))
+        {
+            respond_error(s, 403, error_403_form);
+            return;
+        }
+        s->in_request = true;
+    }
+
+    if(s->end_remote)
+    {
+        finish_request(s);
+    }
+}
+
+void http2_session::finish_request(h2_stream* s)
+{
+    if(!s->handler)
+    {
+        respond_file(s);
+        return;
+    }
+
+    s->in_request = false;
+    http2_sink sink(this, s);
+    http_response resp(&sink);
+    end_handler(s, s->handler->handle(s->req, resp));
+}
+
+void http2_session::end_handler(h2_stream* s, bool ok)
+{
+    if(s->deferred)
+    {
+        return;
+    }
+    if(!s->responded)
+    {
+        //处理失败，或者处理器没有写应答体
+        s->block.clear();
+        if(s->producer)
+        {
+            delete s->producer;
+            s->producer = NULL;
+        }
+        respond_error(s, 500, error_500_form);
+    }
+    else if(!ok)
+    {
+        reset_stream(s, INTERNAL_ERROR);
+    }
+}
+
+//在produce的开头调用：先收集已经就绪的流，应答时不会改变m_streams
+void http2_session::respond_deferred()
+{
+    std::vector<h2_stream*> ready;
+    for(std::map<uint32_t, h2_stream*>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        h2_stream* s = it->second;
+        if(s->deferred && s->deferred->ready(m_waker))
+        {
+            ready.push_back(s);
+        }
+    }
+    for(size_t i = 0; i < ready.size(); i++)
+    {
+        h2_stream* s = ready[i];
+        deferred_response* deferred = s->deferred;
+        s->deferred = NULL;
+        m_deferred--;
+
+        http2_sink sink(this, s);
+        http_response resp(&sink);
+        bool ok = deferred->respond(resp);
+        delete deferred;
+        end_handler(s, ok);
+    }
+}
+
+bool http2_session::deliver_body(h2_stream* s, const unsigned char* data, int len)
+{
+    if(!s->in_request)
+    {
+        return true;
+    }
+    if(s->req.body_fd < 0)
+    {
+        return s->handler->on_body(s->req, (const char*)data, len);
+    }
+
+    while(len > 0)
+    {
+        ssize_t n = ::write(s->req.body_fd, data, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+void http2_session::reset_stream(h2_stream* s, ERROR_CODE code)
+{
+    if(find_stream(s->id) != s)
+    {
+        return;
+    }
+    if(s->in_request)
+    {
+        s->handler->on_abort(s->req);
+        s->in_request = false;
+    }
+    queue_rst(s->id, code);
+    close_stream(s);
+}
+
+//流关闭：子节点挂到它的父节点下；流的内存可能还被输出队列引用，等队列清空后释放
+void http2_session::close_stream(h2_stream* s)
+{
+    if(find_stream(s->id) != s)
+    {
+        return;
+    }
+    for(std::map<uint32_t, h2_stream*>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        if(it->second->parent == s->id)
+        {
+            it->second->parent = s->parent;
+        }
+    }
+    m_streams.erase(s->id);
+    m_active--;
+    //不再需要的结果：推迟的应答释放时取消
+    if(s->deferred)
+    {
+        delete s->deferred;
+        s->deferred = NULL;
+        m_deferred--;
+    }
+    if(m_queued == 0)
+    {
+        free_stream(s);
+    }
+    else
+    {
+        m_closed.push_back(s);
+    }
+}
+
+void http2_session::free_stream(h2_stream* s)
+{
+    if(s->deferred)
+    {
+        delete s->deferred;
+        m_deferred--;
+    }
+    if(s->producer)
+    {
+        delete s->producer;
+    }
+    if(s->file_address)
+    {
+        munmap(s->file_address, s->file_size);
+    }
+    delete s;
+}
+
+//错误应答：正文是静态字符串，直接引用
+void http2_session::respond_error(h2_stream* s, int status, const char* form)
+{
+    if(s->in_request)
+    {
+        s->handler->on_abort(s->req);
+        s->in_request = false;
+    }
+    s->block.clear();
+    begin_response(s, status);
+    m_encoder.encode(s->block, "content-type", "text/html");
+    char len[16];
+    snprintf(len, sizeof(len), "%d", (int)strlen(form));
+    m_encoder.encode(s->block, "content-length", len);
+
+    s->body = form;
+    s->body_len = strlen(form);
+    //请求体超限时用RST_STREAM(NO_ERROR)让客户端停止发送，其余情况收下请求体丢弃即可
+    s->reset_after_response = (status == 413) && !s->end_remote;
+    queue_response(s, false);
+}
+
+//静态文件：与HTTP/1.1相同的查找和mmap，DATA帧直接引用映射的页
+void http2_session::respond_file(h2_stream* s)
+{
+    char real_file[http_conn::FILENAME_LEN];
+    struct stat st;
+    char* address = NULL;
+    dir_target dir;
+    dir.gzip_ok = s->accept_gzip;
+    vhost* host = http_conn::m_vhosts->lookup(s->authority.empty() ? NULL : s->authority.c_str());
+    http_conn::HTTP_CODE ret = http_conn::map_file(host, s->path.c_str(), real_file, &st, &address, &dir);
+    switch(ret)
+    {
+        case http_conn::DIR_REDIRECT:
+        {
+            size_t path_len = s->path.find('?');
+            if(path_len == std::string::npos)
+            {
+                path_len = s->path.size();
+            }
+            std::string location = s->path.substr(0, path_len) + "/" + s->path.substr(path_len);
+            begin_response(s, 301);
+            m_encoder.encode(s->block, "location", location.c_str());
+            m_encoder.encode(s->block, "content-length", "0");
+            queue_response(s, true);
+            return;
+        }
+        case http_conn::DIR_LISTING:
+            //目录列表拷贝到流里，不用跟踪共享应答的引用
+            s->body_copy = dir.listing->body();
+            dir.listing->unref();
+            s->body = s->body_copy.data();
+            s->body_len = s->body_copy.size();
+            begin_response(s, 200);
+            m_encoder.encode(s->block, "content-type", "text/html; charset=utf-8");
+            {
+                char len[24];
+                snprintf(len, sizeof(len), "%zu", s->body_len);
+                m_encoder.encode(s->block, "content-length", len);
+            }
+            queue_response(s, false);
+            return;
+        case http_conn::NO_RESOURCE:
+            respond_error(s, 404, error_404_form);
+            return;
+        case http_conn::FORBIDDEN_REQUEST:
+            respond_error(s, 403, error_403_form);
+            return;
+        case http_conn::BAD_REQUEST:
+            respond_error(s, 400, error_400_form);
+            return;
+        case http_conn::FILE_REQUEST:
+            break;
+        default:
+            respond_error(s, 500, error_500_form);
+            return;
+    }
+
+    s->file_address = address;
+    s->file_size = st.st_size;
+    s->body = address;
+    s->body_len = st.st_size;
+
+    begin_response(s, 200);
+    m_encoder.encode(s->block, "content-type", "text/html");
+    if(dir.encoding)
+    {
+        m_encoder.encode(s->block, "content-encoding", dir.encoding);
+        m_encoder.encode(s->block, "vary", "accept-encoding");
+    }
+    char len[24];
+    snprintf(len, sizeof(len), "%lld", (long long)st.st_size);
+    m_encoder.encode(s->block, "content-length", len);
+    queue_response(s, false);
+}
+
+void http2_session::begin_response(h2_stream* s, int status)
+{
+    s->status = status;
+    s->block.clear();
+    m_encoder.encode_status(s->block, status);
+}
+
+//头部块按对端的最大帧大小拆成HEADERS+CONTINUATION；没有应答体时HEADERS带END_STREAM
+void http2_session::queue_response(h2_stream* s, bool end_stream)
+{
+    if(!end_stream && !s->producer && s->body_len == 0)
+    {
+        end_stream = true;
+    }
+
+    size_t pos = 0;
+    size_t total = s->block.size();
+    int type = FRAME_HEADERS;
+    do
+    {
+        size_t n = total - pos;
+        if(n > (size_t)m_peer_max_frame)
+        {
+            n = m_peer_max_frame;
+        }
+        int flags = 0;
+        if(pos + n == total)
+        {
+            flags |= FLAG_END_HEADERS;
+        }
+        if(type == FRAME_HEADERS && end_stream)
+        {
+            flags |= FLAG_END_STREAM;
+        }
+        size_t off = m_out.size();
+        frame_header(n, type, flags, s->id);
+        m_out.append(s->block, pos, n);
+        queue_internal(off, 9 + n);
+        pos += n;
+        type = FRAME_CONTINUATION;
+    }while(pos < total);
+
+    s->block.clear();
+    s->block.shrink_to_fit();
+    s->responded = true;
+    s->vtime = m_vclock;
+
+    if(end_stream)
+    {
+        s->end_local = true;
+        if(s->end_remote)
+        {
+            close_stream(s);
+        }
+        else if(s->reset_after_response)
+        {
+            queue_rst(s->id, NO_ERROR);
+            close_stream(s);
+        }
+    }
+}
+
+//流有应答体等待发送，且流量控制窗口允许
+bool http2_session::sendable(const h2_stream* s) const
+{
+    return s->responded && !s->end_local && s->send_window > 0;
+}
+
+//调度：祖先中有可发送的流时子流等待；其余的流中选虚拟时间最小的，权重越大虚拟时间走得越慢
+h2_stream* http2_session::pick_stream()
+{
+    h2_stream* best = NULL;
+    for(std::map<uint32_t, h2_stream*>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        h2_stream* s = it->second;
+        if(!sendable(s) || (best && s->vtime >= best->vtime))
+        {
+            continue;
+        }
+
+        bool blocked = false;
+        int depth = 0;
+        for(uint32_t up = s->parent; up && depth < MAX_CONCURRENT_STREAMS; depth++)
+        {
+            h2_stream* a = find_stream(up);
+            if(!a)
+            {
+                break;
+            }
+            if(sendable(a))
+            {
+                blocked = true;
+                break;
+            }
+            up = a->parent;
+        }
+        if(!blocked)
+        {
+            best = s;
+        }
+    }
+    return best;
+}
+
+void http2_session::produce()
+{
+    //h2c升级后流1的应答等客户端的连接前言和SETTINGS到达后再发，客户端此时才准备好接收大量数据
+    if(m_goaway_sent || !m_settings_received)
+    {
+        return;
+    }
+    if(m_deferred > 0)
+    {
+        respond_deferred();
+    }
+    while(m_queued < (size_t)HIGH_WATER && m_send_window > 0)
+    {
+        h2_stream* s = pick_stream();
+        if(!s)
+        {
+            break;
+        }
+        send_data(s);
+    }
+}
+
+//为一个流生成一个DATA帧
+void http2_session::send_data(h2_stream* s)
+{
+    int64_t max = m_peer_max_frame;
+    if(s->send_window < max)
+    {
+        max = s->send_window;
+    }
+    if(m_send_window < max)
+    {
+        max = m_send_window;
+    }
+
+    size_t n;
+    bool end;
+    size_t off = m_out.size();
+    if(s->producer)
+    {
+        frame_header(0, FRAME_DATA, 0, s->id);
+        m_out.resize(off + 9 + max);
+        int ret = s->producer->produce(&m_out[off + 9], max);
+        if(ret < 0 || ret > max)
+        {
+            m_out.resize(off);
+            reset_stream(s, INTERNAL_ERROR);
+            return;
+        }
+        n = ret;
+        end = (ret == 0);
+        m_out.resize(off + 9 + n);
+        m_out[off] = (char)(n >> 16);
+        m_out[off + 1] = (char)(n >> 8);
+        m_out[off + 2] = (char)n;
+        if(end)
+        {
+            m_out[off + 4] = FLAG_END_STREAM;
+        }
+        queue_internal(off, 9 + n);
+    }
+    else
+    {
+        n = s->body_len - s->body_off;
+        if(n > (size_t)max)
+        {
+            n = max;
+        }
+        end = (s->body_off + n == s->body_len);
+        frame_header(n, FRAME_DATA, end ? FLAG_END_STREAM : 0, s->id);
+
+        //小的帧和不能零拷贝的连接直接拷贝，其余的引用应答体所在的内存
+        if(m_copy_bodies || n <= 1024)
+        {
+            m_out.append(s->body + s->body_off, n);
+            queue_internal(off, 9 + n);
+        }
+        else
+        {
+            queue_internal(off, 9);
+            queue_external(s->body + s->body_off, n);
+        }
+        s->body_off += n;
+    }
+
+    s->send_window -= n;
+    m_send_window -= n;
+    m_vclock = s->vtime;
+    s->vtime += (uint64_t)(n + 1) * 256 / s->weight;
+
+    if(end)
+    {
+        s->end_local = true;
+        if(s->end_remote)
+        {
+            close_stream(s);
+        }
+        else if(s->reset_after_response)
+        {
+            queue_rst(s->id, NO_ERROR);
+            close_stream(s);
+        }
+    }
+}
+
+void http2_session::frame_header(int len, int type, int flags, uint32_t id)
+{
+    m_out.push_back((char)(len >> 16));
+    m_out.push_back((char)(len >> 8));
+    m_out.push_back((char)len);
+    m_out.push_back((char)type);
+    m_out.push_back((char)flags);
+    put_u32(m_out, id & 0x7fffffff);
+}
+
+void http2_session::queue_internal(size_t off, size_t len)
+{
+    //与上一段在m_out中相邻时合并
+    if(!m_queue.empty())
+    {
+        segment& last = m_queue.back();
+        if(!last.ext && last.off + last.len == off)
+        {
+            last.len += len;
+            m_queued += len;
+            return;
+        }
+    }
+    segment seg = {NULL, off, len};
+    m_queue.push_back(seg);
+    m_queued += len;
+}
+
+void http2_session::queue_external(const char* data, size_t len)
+{
+    segment seg = {data, 0, len};
+    m_queue.push_back(seg);
+    m_queued += len;
+}
+
+void http2_session::queue_rst(uint32_t id, ERROR_CODE code)
+{
+    size_t off = m_out.size();
+    frame_header(4, FRAME_RST_STREAM, 0, id);
+    put_u32(m_out, code);
+    queue_internal(off, 13);
+}
+
+void http2_session::queue_window_update(uint32_t id, uint32_t increment)
+{
+    size_t off = m_out.size();
+    frame_header(4, FRAME_WINDOW_UPDATE, 0, id);
+    put_u32(m_out, increment);
+    queue_internal(off, 13);
+}
+
+int http2_session::fill_iov(struct iovec* iov, int max)
+{
+    int count = 0;
+    size_t skip = m_queue_off;
+    for(std::deque<segment>::iterator it = m_queue.begin(); it != m_queue.end() && count < max; ++it)
+    {
+        const char* base = it->ext ? it->ext : m_out.data() + it->off;
+        iov[count].iov_base = (void*)(base + skip);
+        iov[count].iov_len = it->len - skip;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+void http2_session::consume(int len)
+{
+    m_queued -= len;
+    size_t n = len;
+    while(n > 0 && !m_queue.empty())
+    {
+        segment& seg = m_queue.front();
+        size_t left = seg.len - m_queue_off;
+        if(n < left)
+        {
+            m_queue_off += n;
+            break;
+        }
+        n -= left;
+        m_queue_off = 0;
+        m_queue.pop_front();
+    }
+
+    if(m_queue.empty())
+    {
+        //队列清空：内部缓冲区从头开始，已关闭的流不再被引用
+        m_out.clear();
+        for(size_t i = 0; i < m_closed.size(); i++)
+        {
+            free_stream(m_closed[i]);
+        }
+        m_closed.clear();
+        return;
+    }
+
+    //队列一直没有清空时，回收m_out中已经发送的前半部分
+    size_t start = m_out.size();
+    for(std::deque<segment>::iterator it = m_queue.begin(); it != m_queue.end(); ++it)
+    {
+        if(!it->ext)
+        {
+            start = it->off;
+            break;
+        }
+    }
+    if(start > 65536 && start > m_out.size() / 2)
+    {
+        m_out.erase(0, start);
+        for(std::deque<segment>::iterator it = m_queue.begin(); it != m_queue.end(); ++it)
+        {
+            if(!it->ext)
+            {
+                it->off -= start;
+            }
+        }
+    }
+}
+
+void http2_session::set_peer(uint32_t remote_addr, int remote_port, int server_port)
+{
+    m_remote_addr = remote_addr;
+    m_remote_port = remote_port;
+    m_server_port = server_port;
+}
+
+bool http2_session::finished() const
+{
+    if(m_queued > 0)
+    {
+        return false;
+    }
+    return m_goaway_sent || (m_goaway_received && m_streams.empty());
+}
+
+bool http2_sink::defer(deferred_response* deferred)
+{
+    m_stream->deferred = deferred;
+    m_session->m_deferred++;
+    return true;
+}
+
+bool http2_sink::status(int code, const char* title)
+{
+    m_session->begin_response(m_stream, code);
+    return true;
+}
+
+bool http2_sink::header(const char* name, const char* value)
+{
+    //HTTP/2的头部名必须是小写，连接相关的头部不允许出现
+    char lower[64];
+    int len = strlen(name);
+    if(len >= (int)sizeof(lower))
+    {
+        return false;
+    }
+    for(int i = 0; i <= len; i++)
+    {
+        lower[i] = tolower((unsigned char)name[i]);
+    }
+    if(strcmp(lower, "connection") == 0 || strcmp(lower, "keep-alive") == 0
+        || strcmp(lower, "transfer-encoding") == 0 || strcmp(lower, "upgrade") == 0)
+    {
+        return true;
+    }
+    m_session->m_encoder.encode(m_stream->block, lower, value);
+    return true;
+}
+
+bool http2_sink::body(const char* content_type, const char* data, int len)
+{
+    m_session->m_encoder.encode(m_stream->block, "content-type", content_type);
+    char length[16];
+    snprintf(length, sizeof(length), "%d", len);
+    m_session->m_encoder.encode(m_stream->block, "content-length", length);
+
+    m_stream->body_copy.assign(data, len);
+    m_stream->body = m_stream->body_copy.data();
+    m_stream->body_len = len;
+    m_session->queue_response(m_stream, false);
+    return true;
+}
+
+bool http2_sink::stream(const char* content_type, body_producer* producer)
+{
+    m_session->m_encoder.encode(m_stream->block, "content-type", content_type);
+    m_stream->producer = producer;
+    m_session->queue_response(m_stream, false);
+    return true;
+}
@@ -0,0 +1,233 @@
+#ifndef HTTP2_CONN_H__
+#define HTTP2_CONN_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include "router.h"
+#include "arena.h"
+#include "hpack.h"
+
+// HTTP/2(RFC 7540)会话：一个连接上的所有流共享一个socket
+// 进入方式：明文连接的prior-knowledge（以连接前言开头）、HTTP/1.1的Upgrade: h2c、TLS连接的ALPN h2
+//
+// 会话本身不做I/O：http_conn把读到的数据交给on_input，再用fill_iov/consume把输出写到socket。
+// 输出队列由若干段组成，控制帧和头部在内部缓冲区中，文件内容直接引用mmap的页，
+// 因此明文（或kTLS）连接上文件仍然通过writev零拷贝发送。
+// DATA帧只在队列中的数据少于HIGH_WATER时才生成，按流的优先级（依赖树+权重）在流之间分配。
+
+class http2_session;
+
+//一个流：客户端发起的一个请求和我们的应答
+struct h2_stream{
+    uint32_t id;
+    bool end_remote;            //客户端已经发送END_STREAM
+    bool end_local;             //我们已经发送END_STREAM
+    bool reset_after_response;  //请求体超限，应答后用RST_STREAM(NO_ERROR)结束客户端的请求体
+
+    //优先级
+    uint32_t parent;
+    int weight;                 //1~256
+    uint64_t vtime;             //虚拟时间，发送n字节前进 n*256/weight
+
+    int64_t send_window;
+    int64_t recv_window;
+    int recv_unacked;           //已经消费、还没有用WINDOW_UPDATE归还的字节数
+
+    //请求
+    std::string method;
+    std::string path;
+    std::string authority;
+    bool accept_gzip;           //accept-encoding含gzip
+    std::string headers;        //普通头部，每个"名: 值"以'\0'结尾，即req.headers
+    long long content_length;   //content-length头部，没有时为-1
+    long long body_received;
+    bool headers_done;          //第一个头部块已经收到，之后的HEADERS是trailer
+    request_handler* handler;
+    http_request req;
+    request_arena arena;        //req.arena，流关闭时释放
+    bool in_request;            //处理器已经接受请求但还没有handle
+
+    //应答
+    bool responded;             //HEADERS已经进入输出队列
+    int status;
+    std::string block;          //正在构造的应答头部块
+    const char* body;           //应答体：处理器的数据、mmap的文件或者静态的错误页面
+    size_t body_len;
+    size_t body_off;
+    std::string body_copy;
+    char* file_address;
+    size_t file_size;
+    body_producer* producer;
+    deferred_response* deferred;    //处理器推迟的应答，结果到达前不写HEADERS
+};
+
+// 处理器通过http_response向流写应答
+class http2_sink : public response_sink{
+
+public:
+    http2_sink(http2_session* session, h2_stream* stream) : m_session(session), m_stream(stream) {}
+
+    bool status(int code, const char* title);
+    bool header(const char* name, const char* value);
+    bool body(const char* content_type, const char* data, int len);
+    bool stream(const char* content_type, body_producer* producer);
+    bool defer(deferred_response* deferred);
+
+private:
+    http2_session* m_session;
+    h2_stream* m_stream;
+};
+
+class http2_session{
+
+public:
+    static const int MAX_FRAME_SIZE = 16384;            //我们接收的最大帧，即协议默认值
+    static const int MAX_CONCURRENT_STREAMS = 128;
+    static const int INITIAL_WINDOW_SIZE = 1 << 20;     //通告的每流接收窗口
+    static const int CONNECTION_WINDOW_SIZE = 16 << 20; //连接级接收窗口
+    static const int MAX_HEADER_BLOCK = 65536;          //HEADERS+CONTINUATION拼接后的上限
+    static const int HIGH_WATER = 256 * 1024;           //输出队列超过这个大小时不再生成DATA帧
+    static const int MAX_IOV = 64;
+
+    /*
+        错误码(RFC 7540 7)
+    */
+    enum ERROR_CODE {NO_ERROR = 0, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR, SETTINGS_TIMEOUT,
+                     STREAM_CLOSED, FRAME_SIZE_ERROR, REFUSED_STREAM, CANCEL, COMPRESSION_ERROR,
+                     CONNECT_ERROR, ENHANCE_YOUR_CALM, INADEQUATE_SECURITY, HTTP_1_1_REQUIRED};
+
+    enum FRAME_TYPE {FRAME_DATA = 0, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM, FRAME_SETTINGS,
+                     FRAME_PUSH_PROMISE, FRAME_PING, FRAME_GOAWAY, FRAME_WINDOW_UPDATE, FRAME_CONTINUATION};
+
+    //copy_bodies：没有kTLS的TLS连接上引用文件页也要经过SSL_write复制，不如直接拷贝成整帧
+    explicit http2_session(bool copy_bodies);
+    ~http2_session();
+
+    //排入服务端的SETTINGS和连接窗口的WINDOW_UPDATE
+    void start();
+
+    //h2c升级：settings是HTTP2-Settings头部（base64url），原来的HTTP/1.1请求成为流1
+    bool upgrade(const char* settings, int method, const char* url, const char* host);
+
+    //处理收到的数据（可以是任意片段），返回false表示连接错误，GOAWAY已经排入输出队列
+    bool on_input(const char* data, int len);
+
+    //按优先级生成DATA帧，直到队列达到HIGH_WATER或者没有可发送的流
+    void produce();
+
+    //把输出队列的开头填入iov，返回iov的个数；0表示没有数据要发送
+    int fill_iov(struct iovec* iov, int max);
+
+    //已经发送了len字节
+    void consume(int len);
+
+    //所有数据都已发出，且发送或收到了GOAWAY，连接可以关闭
+    bool finished() const;
+
+    //推迟的应答有了结果时调用的waker，连接用它重新处理会话（见http_conn的h2_waker）
+    void set_waker(body_waker* waker) { m_waker = waker; }
+
+    //连接的地址，交给处理器的http_request
+    void set_peer(uint32_t remote_addr, int remote_port, int server_port);
+
+private:
+    friend class http2_sink;
+
+    bool process_frame(int type, int flags, uint32_t id, const unsigned char* payload, int len);
+    bool on_data(int flags, uint32_t id, const unsigned char* payload, int len);
+    bool on_headers(int flags, uint32_t id, const unsigned char* payload, int len);
+    bool on_continuation(int flags, uint32_t id, const unsigned char* payload, int len);
+    bool on_priority(uint32_t id, const unsigned char* payload, int len);
+    bool on_rst_stream(uint32_t id, const unsigned char* payload, int len);
+    bool on_settings(int flags, uint32_t id, const unsigned char* payload, int len);
+    bool on_ping(int flags, uint32_t id, const unsigned char* payload, int len);
+    bool on_goaway(uint32_t id, const unsigned char* payload, int len);
+    bool on_window_update(uint32_t id, const unsigned char* payload, int len);
+    ERROR_CODE apply_settings(const unsigned char* payload, int len);
+    bool end_header_block();
+    bool connection_error(ERROR_CODE code);
+
+    //流的生命周期
+    h2_stream* open_stream(uint32_t id);
+    h2_stream* find_stream(uint32_t id);
+    void set_priority(h2_stream* s, uint32_t parent, int weight, bool exclusive);
+    void begin_request(h2_stream* s);
+    void finish_request(h2_stream* s);
+    void end_handler(h2_stream* s, bool ok);        //处理器（或推迟的应答）返回之后：没有应答时500，失败时重置流
+    void respond_deferred();                        //结果已经到达的推迟应答
+    bool deliver_body(h2_stream* s, const unsigned char* data, int len);
+    void reset_stream(h2_stream* s, ERROR_CODE code);
+    void close_stream(h2_stream* s);
+    void free_stream(h2_stream* s);
+
+    //应答
+    void respond_error(h2_stream* s, int status, const char* form);
+    void respond_file(h2_stream* s);
+    void begin_response(h2_stream* s, int status);
+    void queue_response(h2_stream* s, bool end_stream);
+    bool sendable(const h2_stream* s) const;
+    h2_stream* pick_stream();
+    void send_data(h2_stream* s);
+
+    //输出队列
+    void frame_header(int len, int type, int flags, uint32_t id);
+    void queue_internal(size_t off, size_t len);
+    void queue_external(const char* data, size_t len);
+    void queue_rst(uint32_t id, ERROR_CODE code);
+    void queue_window_update(uint32_t id, uint32_t increment);
+
+private:
+    struct segment{
+        const char* ext;        //为NULL时数据在m_out中的off处
+        size_t off;
+        size_t len;
+    };
+
+    bool m_copy_bodies;
+    bool m_preface;                 //已经收到客户端的连接前言
+    bool m_settings_received;       //前言之后的第一个帧必须是SETTINGS
+    bool m_goaway_sent;
+    bool m_goaway_received;
+
+    std::string m_in;               //还不是一个完整帧的输入
+
+    //正在接收的头部块（HEADERS后面跟着CONTINUATION）
+    std::string m_block;
+    uint32_t m_block_stream;        //0表示没有
+    bool m_block_end_stream;
+
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+
+    std::map<uint32_t, h2_stream*> m_streams;
+    std::vector<h2_stream*> m_closed;   //已关闭但输出队列中可能还引用着它的数据
+    uint32_t m_last_stream_id;          //客户端打开过的最大流ID
+    int m_active;                       //打开的流的个数
+    uint64_t m_vclock;                  //最近一次发送的流的虚拟时间，新加入调度的流从这里开始
+    int m_deferred;                     //有推迟应答的流的个数
+    body_waker* m_waker;
+
+    uint32_t m_remote_addr;
+    int m_remote_port;
+    int m_server_port;
+
+    //对端的设置和发送窗口
+    int64_t m_send_window;
+    int64_t m_peer_initial_window;
+    int m_peer_max_frame;
+
+    int64_t m_recv_window;
+    int m_recv_unacked;
+
+    std::string m_out;              //控制帧、头部块和拷贝的帧，队列清空或前半部分发送完后回收
+    std::deque<segment> m_queue;
+    size_t m_queue_off;             //队首的段已经发送的字节数
+    size_t m_queued;                //队列中待发送的字节数
+};
+
+#endif
@@ -1,7 +1,25 @@
 #include "http_conn.h"
+#include "file_cache.h"
+#include "http2_conn.h"
+#include "template_engine.h"
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 
 int http_conn::m_epollfd = -1;// 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
 int http_conn::m_user_count = 0;// 所有的客户数
+file_watcher* http_conn::m_watcher = NULL;
+router* http_conn::m_router = NULL;
+long long http_conn::m_max_body_size = 64 * 1024 * 1024;
+tls_context* http_conn::m_tls = NULL;
+ws_hub* http_conn::m_ws_hub = NULL;
+rate_limiter* http_conn::m_limiter = NULL;
+placement* http_conn::m_placement = NULL;
+traffic_capture* http_conn::m_capture = NULL;
+worker_slot* http_conn::m_worker_stats = NULL;
+threadpool<io_task>* http_conn::m_io_pool = NULL;
+int http_conn::m_write_quantum = 0;
+vhost_table* http_conn::m_vhosts = NULL;
+const socket_profile* http_conn::m_socket_profile = NULL;
  
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
@@ -13,6 +31,21 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_405_title = "Method Not Allowed";
+const char* error_405_form = "The requested method is not supported for this resource.\n";
+const char* error_413_title = "Payload Too Large";
+const char* error_413_form = "The request body exceeds the size limit of this server.\n";
+const char* error_426_title = "Upgrade Required";
+const char* error_426_form = "This server only supports WebSocket version 13.\n";
+
+const char* continue_100 = "HTTP/1.1 100 Continue\r\n\r\n";
+//限流的应答是固定的，直接从这里发送，不经过写缓冲区的格式化
+static const char too_many_requests_429[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\n"
+                                            "Content-Length: 0\r\nConnection: close\r\n\r\n";
+const char* switching_101 = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+static const char h2_client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const int H2_PREFACE_LEN = sizeof(h2_client_preface) - 1;
 
 //网站的根目录
 const char* doc_root = "/home/werther/vs_code/Webserver/resource";
@@ -68,39 +101,171 @@ void modfd(int epollfd, int fd, int ev){
 
 }
 
+http_conn::~http_conn()
+{
+    release_stream();
+    release_shared();
+    release_page();
+    release_body();
+    delete m_h2;
+    release_buffers();
+}
+
+bool http_conn::attach_buffers()
+{
+    int queue = m_placement ? m_queue : -1;
+    if(m_read_buf && m_buf_queue == queue)
+    {
+        return true;
+    }
+    release_buffers();
+
+    static_assert(READ_BUFFER_SIZE + WRITE_BUFFER_SIZE <= placement::BUFFER_SIZE, "buffers do not fit");
+    m_read_buf = (queue >= 0) ? m_placement->alloc_buffer(queue) : (char*)malloc(placement::BUFFER_SIZE);
+    if(!m_read_buf)
+    {
+        return false;
+    }
+    m_write_buf = m_read_buf + READ_BUFFER_SIZE;
+    m_buf_queue = queue;
+    return true;
+}
+
+void http_conn::release_buffers()
+{
+    if(!m_read_buf)
+    {
+        return;
+    }
+    if(m_buf_queue >= 0)
+    {
+        m_placement->free_buffer(m_read_buf, m_buf_queue);
+    }
+    else
+    {
+        free(m_read_buf);
+    }
+    m_read_buf = m_write_buf = NULL;
+}
+
 //关闭连接
 void http_conn::close_conn()
 {
     if(m_sockfd != -1)
     {
+        //请求进行到一半，让处理器释放资源
+        if(m_in_request)
+        {
+            m_handler->on_abort(m_request);
+            m_in_request = false;
+        }
+        if(m_pipefd[0] != -1)
+        {
+            close(m_pipefd[0]);
+            close(m_pipefd[1]);
+            m_pipefd[0] = m_pipefd[1] = -1;
+        }
+        release_stream();
+        release_shared();
+        release_page();
+        release_body();
+        //没有写完的请求也记录，超时和被对方断开的慢请求正是要找的
+        trace_finish();
+        if(m_capture_conn)
+        {
+            m_capture->on_close(m_capture_conn, m_bytes_sent);
+            m_capture_conn = 0;
+        }
+        //先停止其它线程的写，socket才能关闭
+        if(m_websocket)
+        {
+            m_ws.shutdown();
+            m_websocket = false;
+        }
+        if(m_h2)
+        {
+            delete m_h2;
+            m_h2 = NULL;
+        }
+        if(m_ssl)
+        {
+            tls_free(m_ssl);
+            m_ssl = NULL;
+        }
+        if(m_rate_tracked)
+        {
+            m_limiter->on_close(m_address.sin_addr.s_addr);
+            m_rate_tracked = false;
+        }
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
         m_user_count--;//关闭一个连接，将客户总数量-1
+        if(m_worker_stats)
+        {
+            m_worker_stats->count_close();
+        }
     }
 }
 
 // 初始化连接,外部调用初始化套接字地址
-void http_conn::init(int sockfd, const sockaddr_in & addr)
+void http_conn::init(int sockfd, const sockaddr_in & addr, int queue)
 {
+    m_queue = queue;
+    if(!attach_buffers())
+    {
+        if(m_limiter)
+        {
+            m_limiter->on_close(addr.sin_addr.s_addr);
+        }
+        if(m_worker_stats)
+        {
+            m_worker_stats->count_close();
+        }
+        close(sockfd);
+        return;
+    }
+
     m_sockfd = sockfd;
     m_address = addr;
+    sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    m_server_port = (getsockname(sockfd, (struct sockaddr*)&local, &local_len) == 0) ? ntohs(local.sin_port) : 0;
+    m_rate_tracked = (m_limiter != NULL);
 
-    //2MSL:主动关闭一方会有
-    /*端口复用：
-        在server的TCP连接没有完全断开之前不允许重新监听是不合理的。
-        因为，TCP连接没有完全断开指的是connfd（127.0.0.1:6666）没有完全断开，
-        而我们重新监听的是lis-tenfd（0.0.0.0:6666），虽然是占用同一个端口，但IP地址不同，
-        connfd对应的是与某个客户端通讯的一个具体的IP地址，而listenfd对应的是wildcard address。
-        解决这个问题的方法是使用setsockopt()设置socket描述符的选项SO_REUSEADDR为1，
-        表示允许创建端口号相同但IP地址不同的多个socket描述符。
-    */
-    int reuse = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    //SO_REUSEADDR只对监听socket有意义（见main），连接socket上按配置设置NODELAY、忙轮询和零拷贝
+    m_zerocopy = m_socket_profile && m_socket_profile->apply_conn(sockfd) && !m_tls;
+    m_zerocopy_sent = false;
+    m_corked = false;
 
     addfd(m_epollfd, m_sockfd, true);
 
     m_user_count++;
 
+    m_in_request = false;
+    m_pipefd[0] = m_pipefd[1] = -1;
+    m_h2 = NULL;
+    m_h2_busy = false;
+    m_h2_woken = false;
+    m_websocket = false;
+    m_trace_id = 0;
+    m_trace_queued = 0;
+    m_bytes_sent = 0;
+    m_requests = 0;
+    m_capture_conn = m_capture ? m_capture->on_open() : 0;
+
+    m_ssl = NULL;
+    m_tls_ready = false;
+    m_tls_want_write = false;
+    if(m_tls)
+    {
+        m_ssl = m_tls->accept(sockfd);
+        if(!m_ssl)
+        {
+            close_conn();
+            return;
+        }
+    }
+
     init();
 }
 
@@ -116,7 +281,31 @@ void http_conn::init()
     m_version = 0;
     m_linger = false;                       // 默认不保持链接  Connection : keep-alive保持连接
     m_host = 0;
+    m_accept_gzip = false;
+    m_encoding = NULL;
+    m_handler = 0;
+    m_path_len = 0;
     m_content_length = 0;
+    m_has_length = false;
+    m_chunked = false;
+    m_expect_continue = false;
+    m_continue_pending = false;
+    m_body_received = 0;
+    m_body_start = 0;
+    m_headers_start = 0;
+    m_headers_end = 0;
+    m_splicing = false;
+    m_upgrade_h2c = false;
+    m_h2_settings = 0;
+    m_upgrade_ws = false;
+    m_ws_key = 0;
+    m_ws_version_ok = false;
+    m_chunked_decoder.init();
+    memset(&m_request, 0, sizeof(m_request));
+    m_request.body_fd = -1;
+    m_arena.reset();
+    m_request.arena = &m_arena;
+    m_requests++;
 
     m_checked_index = 0;
     m_start_line = 0;
@@ -128,15 +317,54 @@ void http_conn::init()
     bzero(m_real_file, FILENAME_LEN);
 }
 
-// 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read()
 {
+    int start = m_read_idx;
+    bool ret;
+    if(!tracer::enabled() || m_trace_id || m_read_idx != 0 || m_check_state != CHECK_STATE_REQUESTLINE || m_h2 || m_websocket)
+    {
+        trace_scope span(m_trace_id, "read", m_sockfd, &m_trace_queued);
+        ret = recv_data();
+    }
+    else
+    {
+        //新请求的第一次读：读到数据后才决定是否采样，否则对方关闭空闲连接时的那次读也会占用采样名额
+        uint64_t begin = tracer::now();
+        ret = recv_data();
+        if(ret && m_read_idx > 0 && (m_trace_id = tracer::sample()) != 0)
+        {
+            m_trace_start = begin;
+            m_trace_queued = tracer::now();
+            tracer::record(m_trace_id, "read", m_sockfd, begin, m_trace_queued);
+        }
+    }
+
+    //读失败（比如对方发完请求就关闭）之前读到的数据也要录下来
+    if(m_capture_conn && m_read_idx > start)
+    {
+        m_capture->on_data(m_capture_conn, m_bytes_sent, m_read_buf + start, m_read_idx - start);
+    }
+    return ret;
+}
+
+// 循环读取客户数据，直到无数据可读或者对方关闭连接
+bool http_conn::recv_data()
+{
+    //请求体由工作线程直接从socket splice到文件，数据留在socket里
+    if(m_splicing)
+    {
+        return true;
+    }
     if(m_read_idx >= READ_BUFFER_SIZE)
     {
         return false;
     }
+    if(m_ssl)
+    {
+        return tls_recv();
+    }
     int read_bytes = 0;
-    while(true)
+    while(m_read_idx < READ_BUFFER_SIZE)
     {
         // 从m_read_buf + m_read_idx索引出开始保存数据，大小是READ_BUFFER_SIZE - m_read_idx
         read_bytes = recv(m_sockfd,m_read_buf + m_read_idx,
@@ -166,20 +394,107 @@ bool http_conn::read()
 //由线程池中的工作线程调用，这是处理HTTP请求的入口函数
 void http_conn::process()
 {
+    if(m_h2)
+    {
+        process_h2();
+        return;
+    }
+    if(m_websocket)
+    {
+        process_ws();
+        return;
+    }
+
+    alloc_scope guard("process", steady());
+
+    //prior-knowledge（明文）或ALPN h2（TLS）：连接以HTTP/2连接前言开头
+    if(m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == 0 && h2_preface())
+    {
+        if(m_read_idx < H2_PREFACE_LEN)
+        {
+            modfd(m_epollfd, m_sockfd, m_tls_want_write ? EPOLLOUT : EPOLLIN);
+            return;
+        }
+        start_h2();
+        process_h2();
+        return;
+    }
+
+    if(m_trace_id && m_trace_queued)
+    {
+        tracer::record(m_trace_id, "queue", m_sockfd, m_trace_queued, tracer::now());
+        m_trace_queued = 0;
+    }
+
     //解析HTTP请求
-    HTTP_CODE read_ret = process_read();
+    HTTP_CODE read_ret;
+    {
+        trace_scope span(m_trace_id, "parse", m_sockfd);
+        read_ret = process_read();
+    }
+    guard.steady = steady();
+
+    //OpenSSL里可能还留有已解密的数据，socket上不会再有事件通知我们
+    while(read_ret == NO_REQUEST && m_ssl && tls_pending(m_ssl) && m_read_idx < READ_BUFFER_SIZE)
+    {
+        if(!read())
+        {
+            close_conn();
+            return;
+        }
+        read_ret = process_read();
+    }
+    m_trace_queued = 0;
+
+    if(read_ret == H2_UPGRADE || read_ret == WS_UPGRADE)
+    {
+        //升级请求本身到此结束，之后的HTTP/2流和WebSocket消息不跟踪
+        trace_finish();
+    }
+    if(read_ret == H2_UPGRADE)
+    {
+        process_h2();
+        return;
+    }
+    if(read_ret == WS_UPGRADE)
+    {
+        process_ws();
+        return;
+    }
+
     if(read_ret == NO_REQUEST)
     {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);//请求不完整，需要继续接收，因此监听读事件
+        if(m_continue_pending)
+        {
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_idx;
+            m_iv_count = 1;
+            bytes_to_send = m_write_idx;
+            modfd(m_epollfd, m_sockfd, EPOLLOUT);
+            return;
+        }
+        //请求不完整，需要继续接收，因此监听读事件（TLS层要求可写时监听写事件）
+        modfd(m_epollfd, m_sockfd, m_tls_want_write ? EPOLLOUT : EPOLLIN);
         return;
     }
+    //100 Continue（如果有）在最终应答的前面，一起发送
+    m_continue_pending = false;
 
     //生成HTTP响应:根据解析结果进行响应
-    bool write_ret = process_write( read_ret );
+    bool write_ret;
+    {
+        trace_scope span(m_trace_id, "process_write", m_sockfd);
+        write_ret = process_write( read_ret );
+    }
     if(!write_ret)
     {
         close_conn();
     }
+    //文件不在页缓存里：先交给I/O线程读进来，读完由它注册写事件，主线程发送时不会因为缺页等磁盘
+    else if(defer_if_cold())
+    {
+        return;
+    }
     modfd(m_epollfd,m_sockfd,EPOLLOUT);
 
 }
@@ -198,38 +513,41 @@ http_conn::HTTP_CODE http_conn::process_read()
         text = get_line();//获取一行数据,下次函数的返回值 就指向  下一行数据的开头了
 
         m_start_line = m_checked_index;//一行的末尾
-        printf("got 1 http line : %s\n",text);
 
         switch (m_check_state)
         {
             case CHECK_STATE_REQUESTLINE:
             {
                 ret = parse_request_line(text);
-                if(ret == BAD_REQUEST){
-                    return BAD_REQUEST;
+                if(ret != NO_REQUEST){
+                    return ret;
                 }
                 break;
             }
             case CHECK_STATE_HEADER:
             {
                 ret = parse_headers(text);
-                if(ret == BAD_REQUEST)
+                if(ret == GET_REQUEST) //没有请求体时，HTTP请求 结束
                 {
-                    return BAD_REQUEST;
+                    return do_request();
                 }
-                else if(ret == GET_REQUEST) //没有请求体时，HTTP请求 结束
+                else if(ret != NO_REQUEST)
                 {
-                    return do_request();
+                    return ret;
                 }
                 break;
             }
             case CHECK_STATE_CONTENT:
             {
-              ret = parse_content(text);
+              ret = parse_content();
               if(ret == GET_REQUEST)   //有请求体时，HTTP请求 结束
                 {
                     return do_request();
                 }
+                else if(ret != NO_REQUEST)
+                {
+                    return ret;
+                }
 
                 line_status = LINE_OPEN;
                 break;
@@ -309,6 +627,14 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char * text)
     {
         m_method = GET;
     }
+    else if(strcasecmp(method,"POST") == 0)
+    {
+        m_method = POST;
+    }
+    else if(strcasecmp(method,"PUT") == 0)
+    {
+        m_method = PUT;
+    }
     else{
         return BAD_REQUEST;
     }
@@ -348,7 +674,27 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char * text)
         return BAD_REQUEST;
     }
 
+    //路径已知，先匹配路由，头部和请求体的处理可能依赖于处理器
+    m_path_len = strcspn(m_url, "?");
+    if(m_router)
+    {
+        m_handler = m_router->match(m_method, m_url, m_path_len);
+    }
+
+    if(m_worker_stats)
+    {
+        m_worker_stats->count_request();
+    }
+
+    //每个请求消耗一个令牌；超限时不再解析头部，应答429后关闭连接
+    if(m_limiter && !m_limiter->on_request(m_address.sin_addr.s_addr))
+    {
+        m_linger = false;
+        return TOO_MANY_REQUESTS;
+    }
+
     m_check_state = CHECK_STATE_HEADER; //主状态机变成： 检查状态请求头
+    m_headers_start = m_start_line;     //下一行是第一个头部
 
     return NO_REQUEST;
 
@@ -361,16 +707,8 @@ http_conn::HTTP_CODE http_conn::parse_headers(char * text)
     //遇到空行，表示头部信息解析完
     if(text[0] == '\0')
     {
-        //如果HTTP请求 有 请求体，则还需要读取 m_content_length字节的消息体
-        //主状态机 转移到 CHECK_STATE_CONTENT状态
-        if(m_content_length != 0)
-        {
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
-        }
-
-        //否则说明我们已经得到一个完整的HTTP请求
-        return GET_REQUEST;
+        m_headers_end = text - m_read_buf;
+        return end_headers();
     }
     else if(strncasecmp(text,"connection:",11) == 0 )
     {
@@ -395,7 +733,61 @@ http_conn::HTTP_CODE http_conn::parse_headers(char * text)
         text += strspn(text," \t");
         //函数名: atol
         //功 能: 把字符串转换成长整型数
-        m_content_length = atol(text);
+        char* end = NULL;
+        long long length = strtoll(text, &end, 10);
+        //重复的Content-Length值必须相同，否则前后两端对请求体的边界理解不一致
+        if(end == text || length < 0 || (m_has_length && length != m_content_length))
+        {
+            return BAD_REQUEST;
+        }
+        m_content_length = length;
+        m_has_length = true;
+    }
+    else if(strncasecmp(text,"Transfer-Encoding:",18) == 0)
+    {
+        text += 18;
+        text += strspn(text," \t");
+        if(strcasecmp(text,"chunked") != 0)
+        {
+            return BAD_REQUEST;     //只支持chunked
+        }
+        m_chunked = true;
+    }
+    else if(strncasecmp(text,"Expect:",7) == 0)
+    {
+        text += 7;
+        text += strspn(text," \t");
+        m_expect_continue = (strcasecmp(text,"100-continue") == 0);
+    }
+    else if(strncasecmp(text,"Upgrade:",8) == 0)
+    {
+        text += 8;
+        text += strspn(text," \t");
+        m_upgrade_h2c = (strcasecmp(text,"h2c") == 0);
+        m_upgrade_ws = (strcasecmp(text,"websocket") == 0);
+    }
+    else if(strncasecmp(text,"Sec-WebSocket-Key:",18) == 0)
+    {
+        text += 18;
+        text += strspn(text," \t");
+        m_ws_key = text;
+    }
+    else if(strncasecmp(text,"Sec-WebSocket-Version:",22) == 0)
+    {
+        text += 22;
+        text += strspn(text," \t");
+        m_ws_version_ok = (strcmp(text,"13") == 0);
+    }
+    else if(strncasecmp(text,"HTTP2-Settings:",15) == 0)
+    {
+        text += 15;
+        text += strspn(text," \t");
+        m_h2_settings = text;
+    }
+    else if(strncasecmp(text,"Accept-Encoding:",16) == 0)
+    {
+        //只看有没有gzip，不管q值
+        m_accept_gzip = strcasestr(text + 16, "gzip") != NULL;
     }
     else if(strncasecmp(text,"Host:",5) == 0)
     {
@@ -405,106 +797,421 @@ http_conn::HTTP_CODE http_conn::parse_headers(char * text)
         text += strspn(text," \t");
         m_host = text;
     }
-    else{
-        
-        printf("oop! unkown head %s",text);
-    }
     return NO_REQUEST;
 }
 
-//解析请求体：只是判断是否被完整的读入
-http_conn::HTTP_CODE http_conn::parse_content(char * text)
+//头部解析完：检查方法和大小限制，通知处理器，决定请求体怎么接收
+http_conn::HTTP_CODE http_conn::end_headers()
 {
-    if(m_read_idx >= (m_content_length + m_checked_index))
+    //只有没有请求体的请求才接受h2c升级；TLS连接只能通过ALPN协商
+    if(m_upgrade_h2c && m_h2_settings && !m_ssl && !m_chunked && m_content_length == 0)
+    {
+        return upgrade_h2c();
+    }
+    if(m_upgrade_ws && m_method == GET && m_handler && m_handler->websocket() && m_ws_hub)
+    {
+        return upgrade_ws();
+    }
+
+    //同时带Content-Length和chunked的请求是请求走私的典型手法，按RFC 7230 3.3.3拒绝
+    if(m_has_length && m_chunked)
+    {
+        m_linger = false;
+        return BAD_REQUEST;
+    }
+
+    //有请求体时拒绝的话请求体不会被读取，应答后只能关闭连接
+    if(m_method != GET && !m_handler)
+    {
+        m_linger = false;
+        return METHOD_NOT_ALLOWED;
+    }
+    //chunked的长度事先不知道，在parse_content里按解码后的字节数检查
+    if(m_content_length > m_max_body_size)
+    {
+        m_linger = false;
+        return PAYLOAD_TOO_LARGE;
+    }
+
+    if(m_handler)
+    {
+        fill_request();
+        if(!m_handler->on_headers(m_request))
+        {
+            m_linger = false;
+            return FORBIDDEN_REQUEST;
+        }
+        m_in_request = true;
+    }
+
+    if(!m_chunked && m_content_length == 0)
     {
-        m_read_buf[m_content_length] = '\0';
         return GET_REQUEST;
     }
+
+    //客户端在等我们同意后才发送请求体：100 Continue放进写缓冲区，由process注册写事件、主线程的write发出；
+    //请求体已经跟着到了的话它和最终的应答一起发送
+    if(m_expect_continue && add_response("%s", continue_100))
+    {
+        m_continue_pending = true;
+    }
+
+    //主状态机 转移到 CHECK_STATE_CONTENT状态
+    m_body_start = m_checked_index;
+    m_check_state = CHECK_STATE_CONTENT;
     return NO_REQUEST;
 }
 
-//当得到一个完整的、正确的HTTP请求时，我们就分析目标文件的属性，
-//如果目标文件存在、对所有用户可读，且不是目录，则
-//调用mmap，将其映射到内存地址 m_file_address处，告诉调用者获取文件成功
-http_conn::HTTP_CODE http_conn::do_request()
+void http_conn::fill_request()
 {
-    //   /home/werther/vs_code/Webserver/resource/index.html
-    //到服务器本地去寻找资源
-    //原型：char *strcpy(char *dest, const char *src)
-    //作用： strcpy函数的作用是把含有转义字符\0即空字符作为结束符，然后把src该字符串复制到dest
-    //doc_root = "/home/werther/vs_code/Webserver/resource";
-    strcpy(m_real_file, doc_root);
-    int len = strlen(doc_root);
-    // m_url = "/index.html\0";
-    //原型：char * strncpy ( char * destination, const char * source, size_t num );
-    //函数功能:将第source串的前n个字符拷贝到destination串
-    strncpy(m_real_file+len,m_url,FILENAME_LEN -len -1);
+    m_request.method = m_method;
+    m_request.path = m_url;
+    m_request.path_len = m_path_len;
+    m_request.query = (m_url[m_path_len] == '?') ? m_url + m_path_len + 1 : NULL;
+    m_request.host = m_host;
+    m_request.keep_alive = m_linger;
+    m_request.chunked = m_chunked;
+    m_request.content_length = m_chunked ? -1 : m_content_length;
+    m_request.headers = m_read_buf + m_headers_start;
+    m_request.headers_len = m_headers_end - m_headers_start;
+    m_request.remote_addr = m_address.sin_addr.s_addr;
+    m_request.remote_port = ntohs(m_address.sin_port);
+    m_request.server_port = m_server_port;
+}
 
-    //获取m_real_file文件的相关的状态信息， -1失败 ，0成功
-    /*
-        定义函数:    int stat(const char *file_name, struct stat *buf);
-        函数说明:    通过文件名filename获取文件信息，并保存在buf所指的结构体stat中
-        返回值:     执行成功则返回0，失败返回-1，错误代码存于errno
-    */
-    if(stat(m_real_file,&m_file_stat) < 0)
+//解析请求体：读缓冲区中已有的请求体数据交给处理器（或写入body_fd），随后回收这部分缓冲区，
+//因此任意大小的请求体都只占用固定的内存
+http_conn::HTTP_CODE http_conn::parse_content()
+{
+    if(m_splicing)
     {
-        return NO_RESOURCE;
+        return splice_content();
     }
 
-    //判断访问权限
-    if(!(m_file_stat.st_mode & S_IROTH))//其他用户具可读取权限
+    char* data = m_read_buf + m_checked_index;
+    int len = m_read_idx - m_checked_index;
+    int out_len = 0;
+    bool done = false;
+
+    if(m_chunked)
     {
-        return FORBIDDEN_REQUEST;
+        int consumed = 0;
+        chunked_decoder::RESULT result = m_chunked_decoder.decode(data, len, &consumed, &out_len);
+        if(result == chunked_decoder::CHUNK_ERROR)
+        {
+            m_linger = false;
+            return BAD_REQUEST;
+        }
+        m_checked_index += consumed;
+        done = (result == chunked_decoder::CHUNK_DONE);
+    }
+    else
+    {
+        long long left = m_content_length - m_body_received;
+        out_len = (len < left) ? len : (int)left;
+        m_checked_index += out_len;
+        done = (m_body_received + out_len == m_content_length);
     }
 
-    //判断是否是目录
-    if( S_ISDIR( m_file_stat.st_mode))// S_ISDIR (st_mode)    是否为目录
+    m_body_received += out_len;
+    if(m_body_received > m_max_body_size)
     {
-        return BAD_REQUEST;
+        m_linger = false;
+        return PAYLOAD_TOO_LARGE;
+    }
+    if(out_len > 0 && !deliver_body(data, out_len))
+    {
+        m_linger = false;
+        return INTERNAL_ERROR;
+    }
+    if(done)
+    {
+        return GET_REQUEST;
     }
 
-    //以只读方式打开文件
-    int fd = open(m_real_file,O_RDONLY);
-    //创建内存映射：把网页的数据映射到m_file_address上
-    //函数作用：mmap将一个文件或者其它对象映射进内存。文件被映射到多个页上，如果文件的大小不是所有页的大小之和，
-    //         最后一个页不被使用的空间将会清零。mmap在用户空间映射调用系统中作用很大。
-    //函数原型
-    //      void* mmap(void* start,size_t length,int prot,int flags,int fd,off_t offset);
-    
-    m_file_address = (char* )mmap(0,m_file_stat.st_size, PROT_READ,MAP_PRIVATE,fd,0);
-    close(fd);
-    return FILE_REQUEST;
+    //已交付的请求体不再需要；请求行和头部保留，m_request中的指针还指向它们
+    int remain = m_read_idx - m_checked_index;
+    memmove(m_read_buf + m_body_start, m_read_buf + m_checked_index, remain);
+    m_checked_index = m_body_start;
+    m_start_line = m_body_start;
+    m_read_idx = m_body_start + remain;
+
+    //剩下的定长请求体不再经过用户空间（TLS连接只有内核负责解密时才能splice）
+    //录制时请求体也要经过用户空间才能记下来
+    if(!m_chunked && m_request.body_fd >= 0 && !m_capture
+        && (!m_ssl || (tls_ktls_recv(m_ssl) && !tls_pending(m_ssl))))
+    {
+        m_splicing = true;
+        return splice_content();
+    }
+    return NO_REQUEST;
 }
 
-//对内存映射区执行 munmap操作
-void http_conn::unmap()
+//socket -> 管道 -> 文件，数据只在内核中移动；socket暂时没有数据时返回NO_REQUEST等待下一次EPOLLIN
+http_conn::HTTP_CODE http_conn::splice_content()
 {
-    if( m_file_address )
+    if(m_pipefd[0] == -1 && pipe2(m_pipefd, O_NONBLOCK | O_CLOEXEC) < 0)
     {
-        // 函数作用：munmap函数释放由mmap创建的这段内存空间
-        // 函数原型：int munmap(void* start,size_t length);
-        munmap(m_file_address, m_file_stat.st_size);
-        m_file_address = 0;
+        m_pipefd[0] = m_pipefd[1] = -1;
+        m_linger = false;
+        return INTERNAL_ERROR;
     }
-}
 
-//根据服务器处理HTTP请求的结果，决定返回给客户端的内容
-bool http_conn::process_write(HTTP_CODE ret)
-{
-    switch(ret)
+    while(m_body_received < m_content_length)
     {
-        case INTERNAL_ERROR:
-            add_status_line(500, error_500_title);
-            add_headers(strlen(error_500_form));
-            if(!add_content(error_500_form))
+        long long left = m_content_length - m_body_received;
+        size_t want = (left < 65536) ? left : 65536;    //不超过管道的默认容量
+        ssize_t n = splice(m_sockfd, NULL, m_pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n == 0)
+        {
+            return CLOSED_CONNECTION;
+        }
+        if(n < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                return false;
+                return NO_REQUEST;
             }
-            break;
-        case BAD_REQUEST:
-            add_status_line(400, error_400_title);
-            add_headers(strlen(error_400_form));
-            if(!add_content(error_400_form))
+            return CLOSED_CONNECTION;
+        }
+        m_body_received += n;
+
+        while(n > 0)
+        {
+            ssize_t written = splice(m_pipefd[0], NULL, m_request.body_fd, NULL, n, SPLICE_F_MOVE);
+            if(written <= 0)
+            {
+                //管道中残留了数据，连接不能再复用
+                m_linger = false;
+                return INTERNAL_ERROR;
+            }
+            n -= written;
+        }
+    }
+
+    m_splicing = false;
+    return GET_REQUEST;
+}
+
+//把一段请求体交给处理器；没有处理器（请求静态文件时带了请求体）则丢弃
+bool http_conn::deliver_body(const char* data, int len)
+{
+    if(!m_handler)
+    {
+        return true;
+    }
+    if(m_request.body_fd < 0)
+    {
+        return m_handler->on_body(m_request, data, len);
+    }
+
+    while(len > 0)
+    {
+        ssize_t n = ::write(m_request.body_fd, data, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+//当得到一个完整的、正确的HTTP请求时，我们就分析目标文件的属性，
+//如果目标文件存在、对所有用户可读，且不是目录，则
+//调用mmap，将其映射到内存地址 m_file_address处，告诉调用者获取文件成功
+http_conn::HTTP_CODE http_conn::do_request()
+{
+    trace_scope span(m_trace_id, "do_request", m_sockfd);
+    if(m_handler)
+    {
+        return do_handler();
+    }
+    dir_target dir;
+    dir.gzip_ok = m_accept_gzip;
+    HTTP_CODE ret = map_file(m_vhosts->lookup(m_host), m_url, m_real_file, &m_file_stat, &m_file_address, &dir);
+    m_encoding = dir.encoding;
+    if(ret == DIR_LISTING)
+    {
+        //目录列表是缓存的共享应答，和微缓存一样直接引用发送
+        m_shared = dir.listing;
+        return HANDLER_REQUEST;
+    }
+    return ret;
+}
+
+//路径里有没有".."段（/../、结尾的/..）；URL没有经过百分号解码，"%2e%2e"只是普通的文件名
+static bool has_dot_dot(const char* path, int len)
+{
+    for(int i = 0; i < len; i++)
+    {
+        if(path[i] == '/' && i + 2 < len && path[i + 1] == '.' && path[i + 2] == '.'
+            && (i + 3 == len || path[i + 3] == '/'))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+http_conn::HTTP_CODE http_conn::map_file(vhost* host, const char* url, char* real_file, struct stat* st, char** address, dir_target* dir)
+{
+    //   /home/werther/vs_code/Webserver/resource/index.html
+    //到服务器本地去寻找资源
+    //原型：char *strcpy(char *dest, const char *src)
+    //作用： strcpy函数的作用是把含有转义字符\0即空字符作为结束符，然后把src该字符串复制到dest
+    //根目录由虚拟主机决定，默认主机是doc_root = "/home/werther/vs_code/Webserver/resource";
+    host->requests.fetch_add(1, std::memory_order_relaxed);
+
+    //查询串不是文件名的一部分
+    //路径直接拼在根目录后面，带".."的路径能走出这个主机的根目录，读到别的站点甚至系统的文件，一律拒绝
+    int path_len = strcspn(url, "?");
+    if(url[0] != '/' || has_dot_dot(url, path_len))
+    {
+        return BAD_REQUEST;
+    }
+
+    strcpy(real_file, host->root);
+    int len = host->root_len;
+    dir->listing_ok = host->listing;
+    dir->root_len = len;
+    // url = "/index.html\0";
+    //原型：char * strncpy ( char * destination, const char * source, size_t num );
+    //函数功能:将第source串的前n个字符拷贝到destination串
+    if(path_len > FILENAME_LEN - len - 1)
+    {
+        path_len = FILENAME_LEN - len - 1;
+    }
+    memcpy(real_file + len, url, path_len);
+    real_file[len + path_len] = '\0';
+
+    //获取real_file文件的相关的状态信息， -1失败 ，0成功
+    /*
+        定义函数:    int stat(const char *file_name, struct stat *buf);
+        函数说明:    通过文件名filename获取文件信息，并保存在buf所指的结构体stat中
+        返回值:     执行成功则返回0，失败返回-1，错误代码存于errno
+    */
+    //有监视器时走线程私有的元数据缓存，命中（包括否定结果）不产生系统调用
+    int stat_ret = m_watcher ? file_cache::local(m_watcher)->stat(real_file, st)
+                             : stat(real_file, st);
+    if(stat_ret < 0)
+    {
+        return NO_RESOURCE;
+    }
+
+    //判断访问权限
+    if(!(st->st_mode & S_IROTH))//其他用户具可读取权限
+    {
+        return FORBIDDEN_REQUEST;
+    }
+
+    //判断是否是目录
+    if( S_ISDIR( st->st_mode))// S_ISDIR (st_mode)    是否为目录
+    {
+        //不以'/'结尾时先重定向，否则目录列表和索引页里的相对链接会少一级
+        if(path_len == 0 || url[path_len - 1] != '/')
+        {
+            return DIR_REDIRECT;
+        }
+        switch(dir_index::local(m_watcher)->resolve(real_file, FILENAME_LEN, st, dir))
+        {
+            case dir_index::INDEX_FILE:
+                break;
+            case dir_index::LISTING:
+                return DIR_LISTING;
+            default:
+                return NO_RESOURCE;
+        }
+    }
+
+    //以只读方式打开文件
+    int fd = open(real_file,O_RDONLY);
+    //创建内存映射：把网页的数据映射到address上
+    //函数作用：mmap将一个文件或者其它对象映射进内存。文件被映射到多个页上，如果文件的大小不是所有页的大小之和，
+    //         最后一个页不被使用的空间将会清零。mmap在用户空间映射调用系统中作用很大。
+    //函数原型
+    //      void* mmap(void* start,size_t length,int prot,int flags,int fd,off_t offset);
+    
+    *address = (char* )mmap(0,st->st_size, PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    return FILE_REQUEST;
+}
+
+//路由命中：请求视图在头部解析完时已经构造好，处理器直接向写缓冲区写应答，不访问文件系统
+http_conn::HTTP_CODE http_conn::do_handler()
+{
+    m_in_request = false;
+
+    http1_sink sink(this);
+    http_response resp(&sink);
+    if(!m_handler->handle(m_request, resp))
+    {
+        //丢弃处理器已经写了一部分的应答
+        m_write_idx = 0;
+        release_stream();
+        release_shared();
+        release_page();
+        release_body();
+        return INTERNAL_ERROR;
+    }
+    return HANDLER_REQUEST;
+}
+
+bool http_conn::respond_deferred()
+{
+    deferred_response* deferred = m_deferred;
+    m_deferred = NULL;
+
+    http1_sink sink(this);
+    http_response resp(&sink);
+    bool ok = deferred->respond(resp);
+    delete deferred;
+    if(!ok)
+    {
+        m_write_idx = 0;
+        release_stream();
+        release_shared();
+        release_page();
+        release_body();
+        return process_write(INTERNAL_ERROR);
+    }
+    return process_write(HANDLER_REQUEST);
+}
+
+//对内存映射区执行 munmap操作
+void http_conn::unmap()
+{
+    if( m_file_address )
+    {
+        // 函数作用：munmap函数释放由mmap创建的这段内存空间
+        // 函数原型：int munmap(void* start,size_t length);
+        munmap(m_file_address, m_file_stat.st_size);
+        m_file_address = 0;
+    }
+}
+
+//根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+bool http_conn::process_write(HTTP_CODE ret)
+{
+    switch(ret)
+    {
+        case INTERNAL_ERROR:
+            add_status_line(500, error_500_title);
+            add_headers(strlen(error_500_form));
+            if(!add_content(error_500_form))
+            {
+                return false;
+            }
+            break;
+        case BAD_REQUEST:
+            add_status_line(400, error_400_title);
+            add_headers(strlen(error_400_form));
+            if(!add_content(error_400_form))
             {
                 return false;
             }
@@ -517,16 +1224,45 @@ bool http_conn::process_write(HTTP_CODE ret)
                 return false;
             }
             break;
+        case METHOD_NOT_ALLOWED:
+            add_status_line(405, error_405_title);
+            add_headers(strlen(error_405_form));
+            if(!add_content(error_405_form))
+            {
+                return false;
+            }
+            break;
+        case PAYLOAD_TOO_LARGE:
+            add_status_line(413, error_413_title);
+            add_headers(strlen(error_413_form));
+            if(!add_content(error_413_form))
+            {
+                return false;
+            }
+            break;
         case FORBIDDEN_REQUEST:
-            add_status_line(404, error_403_title);
+            add_status_line(403, error_403_title);
             add_headers(strlen(error_403_form));
             if(!add_content(error_403_form))
             {
                 return false;
             }
             break;
+        case DIR_REDIRECT:
+            //查询串原样带上
+            add_status_line(301, "Moved Permanently");
+            if(!add_response("Location: %.*s/%s\r\n", m_path_len, m_url, m_url + m_path_len))
+            {
+                return false;
+            }
+            add_headers(0);
+            break;
         case FILE_REQUEST:
             add_status_line(200, ok_200_title);
+            if(m_encoding)
+            {
+                add_response("Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", m_encoding);
+            }
             add_headers(m_file_stat.st_size);
             m_iv[0].iov_base = m_write_buf;//第一块内存的地址
             m_iv[0].iov_len = m_write_idx;//第一块内存的长度
@@ -536,6 +1272,63 @@ bool http_conn::process_write(HTTP_CODE ret)
 
             bytes_to_send = m_write_idx + m_file_stat.st_size;
 
+            return true;
+        case HANDLER_REQUEST:
+            if(m_deferred)
+            {
+                //结果还没有到：write里等它，之前什么也不发送
+                m_iv_count = 0;
+                bytes_to_send = 0;
+                return true;
+            }
+            if(m_shared)
+            {
+                //缓存的应答：头部和应答体都直接引用缓存里的缓冲区，不拷贝到写缓冲区
+                const std::string& head = m_shared->head(m_linger);
+                m_iv[0].iov_base = (void*)head.data();
+                m_iv[0].iov_len = head.size();
+                m_iv[1].iov_base = (void*)m_shared->body().data();
+                m_iv[1].iov_len = m_shared->body().size();
+                m_iv_count = 2;
+                bytes_to_send = head.size() + m_shared->body().size();
+                return true;
+            }
+            if(!m_body.empty())
+            {
+                //大的应答体不拷贝进写缓冲区，和文件一样作为第二块内存发送
+                m_iv[0].iov_base = m_write_buf;
+                m_iv[0].iov_len = m_write_idx;
+                m_iv[1].iov_base = (void*)m_body.data();
+                m_iv[1].iov_len = m_body.size();
+                m_iv_count = 2;
+                bytes_to_send = m_write_idx + m_body.size();
+                return true;
+            }
+            if(m_page)
+            {
+                //模板页面：头部在写缓冲区里，页面的片段在write中接在后面
+                m_iv[0].iov_base = m_write_buf;
+                m_iv[0].iov_len = m_write_idx;
+                m_iv_count = 1;
+                m_page_idx = 0;
+                bytes_to_send = m_write_idx + m_page->size();
+                return true;
+            }
+            break;
+        case UPGRADE_REQUIRED:
+            add_status_line(426, error_426_title);
+            add_response("Sec-WebSocket-Version: 13\r\n");
+            add_headers(strlen(error_426_form));
+            if(!add_content(error_426_form))
+            {
+                return false;
+            }
+            break;
+        case TOO_MANY_REQUESTS:
+            m_iv[0].iov_base = (void*)too_many_requests_429;
+            m_iv[0].iov_len = sizeof(too_many_requests_429) - 1;
+            m_iv_count = 1;
+            bytes_to_send = sizeof(too_many_requests_429) - 1;
             return true;
         default:
             return false;
@@ -557,10 +1350,8 @@ bool http_conn::add_status_line(int status, const char* title)
 ////生成 HTTP应答的  响应头
 bool http_conn::add_headers(int content_len)
 {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+    return add_content_length(content_len) && add_content_type()
+        && add_linger() && add_blank_line();
 }
 
 //响应头 的  Content-Length  字段
@@ -625,25 +1416,150 @@ bool http_conn::add_response(const char* format,...)
 
 }
 
+void http_conn::reject(int sockfd)
+{
+    //TLS连接还没有握手，只能直接关闭
+    if(!m_tls)
+    {
+        send(sockfd, too_many_requests_429, sizeof(too_many_requests_429) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(sockfd);
+}
+
 //写 HTTP响应 到 socke
 bool http_conn::write()
 {
     int temp = 0;
 
+    if(m_h2)
+    {
+        return flush_h2();
+    }
+    //WebSocket的输出由ws_session自己发送，这里只可能是TLS层要求的写事件
+    if(m_websocket)
+    {
+        modfd(m_epollfd, m_sockfd, EPOLLIN);
+        return true;
+    }
+
+    alloc_scope guard("write", steady());
+
+    //TLS层在等待socket可写：握手没有完成，或者读的过程中需要发送数据
+    if(m_ssl && (!m_tls_ready || (m_tls_want_write && bytes_to_send == 0)))
+    {
+        m_tls_want_write = false;
+        if(!m_tls_ready && !tls_recv())
+        {
+            return false;
+        }
+        modfd(m_epollfd, m_sockfd, m_tls_want_write ? EPOLLOUT : EPOLLIN);
+        return true;
+    }
+
+    //推迟的应答：结果没到时不注册事件，等m_waker；到了就像处理器刚返回一样生成应答
+    while(m_deferred)
+    {
+        if(!m_deferred->ready(&m_waker))
+        {
+            return true;
+        }
+        if(!respond_deferred())
+        {
+            return false;
+        }
+    }
+
+    //生产者的数据到了：先生成下一段；还是没有（多余的唤醒）就继续等
+    if(m_stream_pending)
+    {
+        m_stream_pending = false;
+        if(!next_chunk())
+        {
+            return false;
+        }
+        if(m_stream_pending)
+        {
+            return true;
+        }
+    }
+
     if( bytes_to_send == 0)
     {
         //将要发送的字节数为0，这一次响应结束
+        trace_finish();
         modfd(m_epollfd,m_sockfd,EPOLLIN);
         init();
         return true;
     }
 
+    trace_scope span(m_trace_id, "write", m_sockfd);
+
+    //大文件和流式应答要发送多次：发送期间塞住socket只发满的报文段，写完再放开让最后一段立即发出；
+    //小应答一次writev就能发完，靠NODELAY立即发出
+    if(!m_corked && m_socket_profile && m_socket_profile->cork > 0
+        && (m_producer || bytes_to_send >= m_socket_profile->cork))
+    {
+        set_cork(true);
+    }
+
+    size_t sent = 0;
     while(1)
     {
+        if(defer_if_cold())
+        {
+            return true;
+        }
+
+        //这一次已经发满一个时间片：重新注册写事件，排到这一轮其它连接的后面，小应答不用等大文件发完
+        if(m_write_quantum > 0 && sent >= (size_t)m_write_quantum)
+        {
+            modfd(m_epollfd, m_sockfd, EPOLLOUT);
+            return true;
+        }
+
+        //大文件：头部照常拷贝（写缓冲区马上会被下一个应答复用），文件部分用MSG_ZEROCOPY，
+        //内核直接引用文件的页，发送完成后在错误队列里通知（见reap_zerocopy）；
+        //只用于mmap的文件，页缓存里的页不会被改写，堆上的缓冲区释放后可能被复用
+        int count = m_iv_count;
+        int flags = 0;
+        if(m_zerocopy && m_file_address && m_iv_count == 2 && m_iv[1].iov_len >= (size_t)m_socket_profile->zerocopy)
+        {
+            if(m_iv[0].iov_len > 0)
+            {
+                count = 1;
+                flags = MSG_MORE;
+            }
+            else
+            {
+                flags = MSG_ZEROCOPY;
+                m_zerocopy_sent = true;
+            }
+        }
+
         //分散写
         //writev将多个数据存储在一起，将驻留在两个或更多的不连接的缓冲区中的数据一次写出去
         //我们有两块分散的内存，m_write_buf 和  m_file_address
-        temp = writev(m_sockfd, m_iv,m_iv_count);
+        //文件一次最多发一个窗口，只碰检查过驻留情况的页
+        struct iovec iv[PAGE_BATCH];
+        memcpy(iv, m_iv, sizeof(m_iv));
+        if(m_io_pool && m_file_address && m_iv_count == 2 && iv[1].iov_len > file_io::WINDOW)
+        {
+            iv[1].iov_len = file_io::WINDOW;
+        }
+        if(m_write_quantum > 0 && count == 2)
+        {
+            size_t left = m_write_quantum - sent;
+            size_t room = left > iv[0].iov_len ? left - iv[0].iov_len : 0;
+            if(iv[1].iov_len > room)
+            {
+                iv[1].iov_len = room;
+            }
+        }
+        if(m_page)
+        {
+            count = page_batch(iv, sent);
+        }
+        temp = send_iov(iv, count, flags);
         if(temp <= -1)
         {
             //如果tcp写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间
@@ -658,23 +1574,60 @@ bool http_conn::write()
         }
         bytes_to_send -= temp;
         bytes_have_send += temp;
-
-        if(bytes_have_send >= m_iv[0].iov_len)
+        sent += temp;
+        if(m_page)
         {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);//条件满足时，bytes_have_send 和 m_write_idx 相等
-            m_iv[1].iov_len = bytes_to_send;
+            advance_page(temp);
         }
-        else{
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
+        else
+        {
+            advance_iov(temp);
         }
 
         if(bytes_to_send <= 0)
         {
+            //100 Continue发完了：请求还没有结束，回去读请求体
+            if(m_continue_pending)
+            {
+                m_continue_pending = false;
+                m_write_idx = 0;
+                modfd(m_epollfd, m_sockfd, EPOLLIN);
+                return true;
+            }
+
+            //流式应答：这一段发完了，socket仍然可写，生成下一段
+            if(m_producer && !m_stream_done)
+            {
+                if(!next_chunk())
+                {
+                    return false;
+                }
+                //生产者暂时没有数据：放开cork让已经生成的部分发出去，不注册事件，等waker
+                if(m_stream_pending)
+                {
+                    if(m_corked)
+                    {
+                        set_cork(false);
+                    }
+                    return true;
+                }
+                continue;
+            }
+            release_stream();
+            release_shared();
+            release_page();
+            release_body();
+            if(m_corked)
+            {
+                set_cork(false);
+            }
+
             //没有数据要发送了
             //发送 HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即
+            //零拷贝发送的页由内核持有引用，这里可以直接munmap
             unmap();
+            span.close();
+            trace_finish();
             modfd(m_epollfd,m_sockfd,EPOLLIN);
             if(m_linger)
             {
@@ -688,10 +1641,805 @@ bool http_conn::write()
         }
 
     }
-}  
+}
 
+bool http_conn::defer_if_cold()
+{
+    if(!m_io_pool || !m_file_address || m_iv_count != 2 || m_iv[1].iov_len == 0)
+    {
+        return false;
+    }
+    size_t len = m_iv[1].iov_len < file_io::WINDOW ? m_iv[1].iov_len : file_io::WINDOW;
+    bool cold = !file_io::resident((const char*)m_iv[1].iov_base, len);
+    file_io::count_probe(cold);
+    if(!cold)
+    {
+        return false;
+    }
+    //队列满了就照旧在这里发送
+    m_io_task.conn = this;
+    return m_io_pool->append(&m_io_task);
+}
 
+void http_conn::prefetch()
+{
+    const char* at = (const char*)m_iv[1].iov_base;
+    size_t left = m_iv[1].iov_len;
+    size_t len = left < file_io::WINDOW ? left : file_io::WINDOW;
+    file_io::fault_in(at, len);
+    //下一个窗口在发送这一个的时候读
+    left -= len;
+    file_io::readahead(at + len, left < file_io::WINDOW ? left : file_io::WINDOW);
+    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+}
+
+void io_task::process()
+{
+    conn->prefetch();
+}
+
+//只看请求行：GET的路径匹配到处理器算动态，否则按文件大小分；文件的元数据走主线程自己的缓存，
+//没有监视器时不在事件循环里stat，一律算小文件
+http_conn::LANE http_conn::lane()
+{
+    if(m_write_quantum == 0)
+    {
+        return LANE_SMALL;
+    }
+    if(m_h2 || m_websocket || m_check_state != CHECK_STATE_REQUESTLINE)
+    {
+        return LANE_DYNAMIC;
+    }
+
+    const char* end = m_read_buf + m_read_idx;
+    const char* url = (const char*)memchr(m_read_buf, ' ', m_read_idx);
+    if(!url)
+    {
+        return LANE_SMALL;          //请求行还不完整，工作线程只会重新注册读事件
+    }
+    if(url - m_read_buf != 3 || strncasecmp(m_read_buf, "GET", 3) != 0)
+    {
+        return LANE_DYNAMIC;
+    }
+    url++;
+    if(end - url > 7 && strncasecmp(url, "http://", 7) == 0)
+    {
+        url = (const char*)memchr(url + 7, '/', end - url - 7);
+        if(!url)
+        {
+            return LANE_SMALL;
+        }
+    }
+    const char* url_end = url;
+    while(url_end < end && *url_end != ' ' && *url_end != '?' && *url_end != '\r')
+    {
+        url_end++;
+    }
+    int len = url_end - url;
+
+    if(m_router && m_router->match(GET, url, len))
+    {
+        return LANE_DYNAMIC;
+    }
+    if(!m_watcher)
+    {
+        return LANE_SMALL;
+    }
+
+    //根目录按Host选择；头部还没读到时按默认主机估计
+    const char* host = (const char*)memmem(url_end, end - url_end, "\nHost:", 6);
+    const char* host_end = host ? (const char*)memchr(host + 6, '\r', end - host - 6) : NULL;
+    const vhost* vh = host_end ? m_vhosts->lookup(host + 6, host_end - host - 6) : m_vhosts->lookup(NULL);
+
+    char real_file[FILENAME_LEN];
+    int root_len = vh->root_len;
+    if(root_len + len >= FILENAME_LEN)
+    {
+        return LANE_SMALL;
+    }
+    memcpy(real_file, vh->root, root_len);
+    memcpy(real_file + root_len, url, len);
+    real_file[root_len + len] = '\0';
+    struct stat st;
+    if(file_cache::local(m_watcher)->stat(real_file, &st) < 0 || st.st_size <= SMALL_RESPONSE)
+    {
+        return LANE_SMALL;
+    }
+    return LANE_LARGE;
+}
+
+//请求结束，根span带上方法和URL
+void http_conn::trace_finish()
+{
+    if(!m_trace_id)
+    {
+        return;
+    }
+    static const char* methods[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT"};
+    char label[48];
+    snprintf(label, sizeof(label), "%s %s", methods[m_method], m_url ? m_url : "-");
+    tracer::finish(m_trace_id, m_sockfd, m_trace_start, label);
+    m_trace_id = 0;
+}
+
+//writev可能只写出一部分，跳过已经写出的字节
+void http_conn::advance_iov(int len)
+{
+    for(int i = 0; i < m_iv_count && len > 0; i++)
+    {
+        if((size_t)len >= m_iv[i].iov_len)
+        {
+            len -= m_iv[i].iov_len;
+            m_iv[i].iov_len = 0;
+        }
+        else
+        {
+            m_iv[i].iov_base = (char*)m_iv[i].iov_base + len;
+            m_iv[i].iov_len -= len;
+            len = 0;
+        }
+    }
+}
+
+//头部剩下的部分加上页面接下来的片段，不超过这次写事件的时间片
+int http_conn::page_batch(struct iovec* iv, size_t sent)
+{
+    size_t room = (m_write_quantum > 0) ? m_write_quantum - sent : SIZE_MAX;
+    int count = 0;
+    if(m_iv[0].iov_len > 0)
+    {
+        iv[count++] = m_iv[0];
+        room -= (m_iv[0].iov_len < room) ? m_iv[0].iov_len : room;
+    }
+    struct iovec* frag = m_page->iov();
+    for(int i = m_page_idx; i < m_page->iov_count() && count < PAGE_BATCH && room > 0; i++)
+    {
+        iv[count] = frag[i];
+        if(iv[count].iov_len > room)
+        {
+            iv[count].iov_len = room;
+        }
+        room -= iv[count].iov_len;
+        count++;
+    }
+
+    //用户态TLS每个iovec是一次SSL_write、一个记录，先拼成一块（部分写出后下一次从同样的位置重新拼，内容不变）
+    if(m_ssl && !tls_ktls_send(m_ssl) && count > 1)
+    {
+        if(!m_stream_buf)
+        {
+            m_stream_buf = new char[CHUNK_HEAD_LEN + STREAM_CHUNK_SIZE + 2];
+        }
+        size_t len = 0;
+        for(int i = 0; i < count && len < (size_t)STREAM_CHUNK_SIZE; i++)
+        {
+            size_t n = (iv[i].iov_len < STREAM_CHUNK_SIZE - len) ? iv[i].iov_len : STREAM_CHUNK_SIZE - len;
+            memcpy(m_stream_buf + len, iv[i].iov_base, n);
+            len += n;
+        }
+        iv[0].iov_base = m_stream_buf;
+        iv[0].iov_len = len;
+        count = 1;
+    }
+    return count;
+}
+
+void http_conn::advance_page(int len)
+{
+    int head = ((size_t)len < m_iv[0].iov_len) ? len : m_iv[0].iov_len;
+    advance_iov(head);
+    len -= head;
+
+    struct iovec* frag = m_page->iov();
+    while(len > 0 && m_page_idx < m_page->iov_count())
+    {
+        struct iovec& v = frag[m_page_idx];
+        if((size_t)len >= v.iov_len)
+        {
+            len -= v.iov_len;
+            v.iov_len = 0;
+            m_page_idx++;
+        }
+        else
+        {
+            v.iov_base = (char*)v.iov_base + len;
+            v.iov_len -= len;
+            len = 0;
+        }
+    }
+}
+
+void http_conn::release_page()
+{
+    if(m_page)
+    {
+        delete m_page;
+        m_page = NULL;
+    }
+}
+
+//向生产者要下一段数据并编码成一个块：数据写在预留的块大小行之后，块大小行从后往前填
+bool http_conn::next_chunk()
+{
+    if(!m_stream_buf)
+    {
+        m_stream_buf = new char[CHUNK_HEAD_LEN + STREAM_CHUNK_SIZE + 2];
+    }
+
+    char* data = m_stream_buf + CHUNK_HEAD_LEN;
+    int len = m_producer->produce(data, STREAM_CHUNK_SIZE);
+    if(len == body_producer::PENDING)
+    {
+        m_stream_pending = true;
+        m_iv_count = 0;
+        bytes_to_send = 0;
+        return true;
+    }
+    if(len < 0 || len > STREAM_CHUNK_SIZE)
+    {
+        return false;
+    }
+
+    if(len == 0)
+    {
+        //最后一个块
+        memcpy(m_stream_buf, "0\r\n\r\n", 5);
+        m_iv[0].iov_base = m_stream_buf;
+        m_iv[0].iov_len = 5;
+        m_stream_done = true;
+    }
+    else
+    {
+        char head[CHUNK_HEAD_LEN];
+        int head_len = snprintf(head, sizeof(head), "%x\r\n", len);
+        char* start = data - head_len;
+        memcpy(start, head, head_len);
+        memcpy(data + len, "\r\n", 2);
+        m_iv[0].iov_base = start;
+        m_iv[0].iov_len = head_len + len + 2;
+    }
+    m_iv_count = 1;
+    bytes_to_send = m_iv[0].iov_len;
+    return true;
+}
+
+void http_conn::release_stream()
+{
+    m_stream_pending = false;
+    if(m_deferred)
+    {
+        delete m_deferred;
+        m_deferred = NULL;
+    }
+    if(m_producer)
+    {
+        delete m_producer;
+        m_producer = NULL;
+    }
+    if(m_stream_buf)
+    {
+        delete[] m_stream_buf;
+        m_stream_buf = NULL;
+    }
+}
+
+//应答体可以是任意二进制数据（不能经过printf，遇到'\0'就截断了），也可以超过写缓冲区
+bool http_conn::add_bytes(const char* data, int len)
+{
+    if(len < 0)
+    {
+        return false;
+    }
+    if(m_write_idx + len <= WRITE_BUFFER_SIZE)
+    {
+        memcpy(m_write_buf + m_write_idx, data, len);
+        m_write_idx += len;
+        return true;
+    }
+    m_body.assign(data, len);
+    return true;
+}
+
+void http_conn::release_body()
+{
+    if(!m_body.empty())
+    {
+        std::string().swap(m_body);
+    }
+}
+
+void http_conn::release_shared()
+{
+    if(m_shared)
+    {
+        m_shared->unref();
+        m_shared = NULL;
+    }
+}
+
+//TLS连接的读：先完成握手，再把解密后的数据读入读缓冲区
+bool http_conn::tls_recv()
+{
+    TLS_RESULT result;
+    m_tls_want_write = false;
+
+    if(!m_tls_ready)
+    {
+        result = tls_handshake(m_ssl);
+        if(result == TLS_WANT_READ)
+        {
+            return true;
+        }
+        if(result == TLS_WANT_WRITE)
+        {
+            m_tls_want_write = true;
+            return true;
+        }
+        if(result != TLS_OK)
+        {
+            return false;
+        }
+        m_tls_ready = true;
+    }
+
+    while(m_read_idx < READ_BUFFER_SIZE)
+    {
+        int read_bytes = tls_read(m_ssl, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, &result);
+        if(read_bytes > 0)
+        {
+            m_read_idx += read_bytes;
+            continue;
+        }
+        if(result == TLS_WANT_READ)
+        {
+            break;
+        }
+        if(result == TLS_WANT_WRITE)
+        {
+            m_tls_want_write = true;
+            break;
+        }
+        return false;
+    }
+    return true;
+}
+
+int http_conn::send_iov(const struct iovec* iov, int count, int flags)
+{
+    if(!m_ssl)
+    {
+        int ret;
+        if(flags == 0)
+        {
+            ret = writev(m_sockfd, iov, count);
+        }
+        else
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = (struct iovec*)iov;
+            msg.msg_iovlen = count;
+            ret = sendmsg(m_sockfd, &msg, flags);
+            //未完成的零拷贝通知太多（超过optmem_max）时退回普通拷贝
+            if(ret < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+            {
+                ret = writev(m_sockfd, iov, count);
+            }
+        }
+        if(ret > 0)
+        {
+            m_bytes_sent += ret;
+        }
+        return ret;
+    }
+
+    TLS_RESULT result;
+    int ret = tls_writev(m_ssl, m_sockfd, iov, count, &result);
+    if(ret > 0)
+    {
+        m_bytes_sent += ret;
+        return ret;
+    }
+    //对调用者来说TLS的"需要重试"与EAGAIN一样，等待下一次EPOLLOUT
+    errno = (result == TLS_WANT_WRITE || result == TLS_WANT_READ) ? EAGAIN : EPIPE;
+    return -1;
+}
+
+void http_conn::set_cork(bool on)
+{
+    int cork = on ? 1 : 0;
+    setsockopt(m_sockfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    m_corked = on;
+}
+
+//零拷贝的完成通知和socket错误都在错误队列里，都以EPOLLERR报告；
+//取走全部通知，内核实际做了拷贝（如回环接口）时这个连接以后不再用零拷贝
+bool http_conn::reap_zerocopy(uint32_t events)
+{
+    if(!m_zerocopy_sent)
+    {
+        return false;
+    }
+    while(true)
+    {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(m_sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            break;
+        }
+        for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+            if(err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+            {
+                return false;
+            }
+            if(err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                m_zerocopy = false;
+            }
+        }
+    }
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if(error != 0)
+    {
+        return false;
+    }
+
+    //只有通知、没有别的事件：EPOLLONESHOT已经把连接摘掉了，按当前的状态重新注册
+    if(!(events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP)))
+    {
+        if(m_h2)
+        {
+            //主线程已经claim了这个连接，要经过flush_h2放开
+            return flush_h2();
+        }
+        modfd(m_epollfd, m_sockfd, bytes_to_send > 0 ? EPOLLOUT : EPOLLIN);
+    }
+    return true;
+}
+
+bool http_conn::send_raw(const char* data, int len)
+{
+    int ret;
+    if(!m_ssl)
+    {
+        ret = send(m_sockfd, data, len, MSG_NOSIGNAL);
+    }
+    else
+    {
+        struct iovec iv;
+        iv.iov_base = (void*)data;
+        iv.iov_len = len;
+        TLS_RESULT result;
+        ret = tls_writev(m_ssl, m_sockfd, &iv, 1, &result);
+    }
+    if(ret > 0)
+    {
+        m_bytes_sent += ret;
+    }
+    return ret == len;
+}
+
+bool http1_sink::status(int code, const char* title)
+{
+    return m_conn->add_status_line(code, title);
+}
+
+bool http1_sink::header(const char* name, const char* value)
+{
+    return m_conn->add_response("%s: %s\r\n", name, value);
+}
+
+bool http1_sink::body(const char* content_type, const char* data, int len)
+{
+    return m_conn->add_response("Content-Type: %s\r\n", content_type)
+        && m_conn->add_content_length(len)
+        && m_conn->add_linger()
+        && m_conn->add_blank_line()
+        && m_conn->add_bytes(data, len);
+}
+
+bool http1_sink::defer(deferred_response* deferred)
+{
+    m_conn->m_deferred = deferred;
+    return true;
+}
 
+bool http1_sink::shared(shared_response* resp)
+{
+    resp->ref();
+    m_conn->m_shared = resp;
+    return true;
+}
 
+bool http1_sink::page(const char* content_type, rendered_page* page)
+{
+    if(!(m_conn->add_response("Content-Type: %s\r\n", content_type)
+        && m_conn->add_response("Content-Length: %zu\r\n", page->size())
+        && m_conn->add_linger()
+        && m_conn->add_blank_line()))
+    {
+        return false;
+    }
+    m_conn->m_page = page;
+    return true;
+}
 
+bool http1_sink::stream(const char* content_type, body_producer* producer)
+{
+    if(!(m_conn->add_response("Content-Type: %s\r\n", content_type)
+        && m_conn->add_response("Transfer-Encoding: chunked\r\n")
+        && m_conn->add_linger()
+        && m_conn->add_blank_line()))
+    {
+        return false;
+    }
+
+    producer->set_waker(&m_conn->m_waker);
+    m_conn->m_producer = producer;
+    m_conn->m_stream_done = false;
+    return true;
+}
+
+//连接在等生产者期间没有注册任何事件，只有这里会重新注册
+void stream_waker::wake()
+{
+    modfd(http_conn::m_epollfd, m_conn->m_sockfd, EPOLLOUT);
+}
+
+//缓冲区开头是HTTP/2连接前言（可能还不完整）
+bool http_conn::h2_preface()
+{
+    int n = (m_read_idx < H2_PREFACE_LEN) ? m_read_idx : H2_PREFACE_LEN;
+    return n > 0 && memcmp(m_read_buf, h2_client_preface, n) == 0;
+}
+
+void http_conn::start_h2()
+{
+    //WINDOW_UPDATE、SETTINGS ACK这样的小帧要立即发出，不能等Nagle攒满
+    int nodelay = 1;
+    setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    //没有kTLS的TLS连接上数据总要经过SSL_write拷贝，文件内容直接拷进帧里
+    m_h2 = new http2_session(m_ssl && !tls_ktls_send(m_ssl));
+    m_h2->set_waker(&m_h2_waker);
+    m_h2->set_peer(m_address.sin_addr.s_addr, ntohs(m_address.sin_port), m_server_port);
+    m_h2->start();
+
+    //切换发生在处理这个连接的线程里，从现在起主线程的事件要经过claim
+    m_h2_lock.lock();
+    m_h2_busy = true;
+    m_h2_woken = false;
+    m_h2_lock.unlock();
+}
+
+//101之后是服务端的SETTINGS和流1的应答；请求之后已经读到的数据是客户端的连接前言
+http_conn::HTTP_CODE http_conn::upgrade_h2c()
+{
+    start_h2();
+    if(!m_h2->upgrade(m_h2_settings, m_method, m_url, m_host))
+    {
+        delete m_h2;
+        m_h2 = NULL;
+        m_linger = false;
+        return BAD_REQUEST;
+    }
+    if(!send_raw(switching_101, strlen(switching_101)))
+    {
+        return CLOSED_CONNECTION;
+    }
+
+    int rest = m_read_idx - m_checked_index;
+    memmove(m_read_buf, m_read_buf + m_checked_index, rest);
+    m_read_idx = rest;
+    return H2_UPGRADE;
+}
+
+//读到的数据全部交给会话，读缓冲区每次都从头开始使用
+void http_conn::process_h2()
+{
+    while(true)
+    {
+        bool ok = m_h2->on_input(m_read_buf, m_read_idx);
+        m_read_idx = 0;
+        //连接错误：GOAWAY已经在输出队列中，发送后关闭
+        if(!ok || !m_ssl || !tls_pending(m_ssl))
+        {
+            break;
+        }
+        if(!read())
+        {
+            close_conn();
+            return;
+        }
+    }
 
+    if(!flush_h2())
+    {
+        close_conn();
+    }
+}
+
+//生成并发送DATA帧，直到会话没有数据或者socket写满；返回false表示连接应当关闭
+bool http_conn::flush_h2()
+{
+    struct iovec iov[http2_session::MAX_IOV];
+    while(true)
+    {
+        int ev = 0;
+        while(true)
+        {
+            m_h2->produce();
+            int count = m_h2->fill_iov(iov, http2_session::MAX_IOV);
+            if(count == 0)
+            {
+                break;
+            }
+            int ret = send_iov(iov, count);
+            if(ret < 0)
+            {
+                if(errno == EAGAIN)
+                {
+                    //同时监听读事件，客户端的WINDOW_UPDATE和新请求不必等输出发完
+                    ev = EPOLLIN | EPOLLOUT;
+                    break;
+                }
+                return false;
+            }
+            m_h2->consume(ret);
+        }
+
+        if(ev == 0)
+        {
+            if(m_h2->finished())
+            {
+                return false;
+            }
+            ev = m_tls_want_write ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        }
+        if(park_h2(ev))
+        {
+            return true;
+        }
+
+        //处理期间推迟的应答有了结果，或者主线程跳过了事件：读走可能已经到达的数据，再处理一轮
+        if(!read())
+        {
+            return false;
+        }
+        m_h2->on_input(m_read_buf, m_read_idx);
+        m_read_idx = 0;
+    }
+}
+
+bool http_conn::park_h2(int ev)
+{
+    m_h2_lock.lock();
+    if(m_h2_woken)
+    {
+        m_h2_woken = false;
+        m_h2_lock.unlock();
+        return false;
+    }
+    m_h2_busy = false;
+    modfd(m_epollfd, m_sockfd, ev);
+    m_h2_lock.unlock();
+    return true;
+}
+
+bool http_conn::claim()
+{
+    if(!m_h2)
+    {
+        return true;
+    }
+    m_h2_lock.lock();
+    bool free = !m_h2_busy;
+    if(free)
+    {
+        m_h2_busy = true;
+    }
+    else
+    {
+        m_h2_woken = true;
+    }
+    m_h2_lock.unlock();
+    return free;
+}
+
+//连接空闲时（注册着读事件）直接加上写事件，flush_h2里的produce会应答就绪的流；
+//正在被处理时只做标记，处理者放开连接之前会再处理一轮
+void h2_waker::wake()
+{
+    m_conn->m_h2_lock.lock();
+    if(m_conn->m_h2_busy)
+    {
+        m_conn->m_h2_woken = true;
+    }
+    else
+    {
+        modfd(http_conn::m_epollfd, m_conn->m_sockfd, EPOLLIN | EPOLLOUT);
+    }
+    m_conn->m_h2_lock.unlock();
+}
+
+//握手请求不能带请求体；101之后连接上是WebSocket帧，请求之后已经读到的数据是客户端的第一批帧
+http_conn::HTTP_CODE http_conn::upgrade_ws()
+{
+    ws_endpoint* endpoint = m_handler->websocket();
+    m_linger = false;
+
+    //版本不对时按RFC 6455 4.4应答426，带上支持的版本，客户端可以换版本重试
+    if(!m_ws_version_ok)
+    {
+        return UPGRADE_REQUIRED;
+    }
+    //Sec-WebSocket-Key是16字节随机数的base64，固定24个字符
+    //其它线程会直接向socket写帧，TLS连接只有开启了kTLS发送时才能这样做
+    if(!m_ws_key || strlen(m_ws_key) != 24 || m_chunked || m_content_length != 0
+        || (m_ssl && !tls_ktls_send(m_ssl)))
+    {
+        return BAD_REQUEST;
+    }
+
+    //端点拒绝（如话题名为空或太长）说明握手请求本身不合法，不是权限问题
+    fill_request();
+    if(!endpoint->accept(m_request))
+    {
+        return BAD_REQUEST;
+    }
+
+    char accept_key[32];
+    ws_accept_key(m_ws_key, accept_key);
+    char reply[160];
+    int len = snprintf(reply, sizeof(reply), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                       "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept_key);
+    if(!send_raw(reply, len))
+    {
+        return CLOSED_CONNECTION;
+    }
+
+    //帧的发送都走TCP，小的控制帧和推送消息不等Nagle
+    int nodelay = 1;
+    setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    m_websocket = true;
+    m_ws.open(m_sockfd, endpoint, m_ws_hub);
+    endpoint->on_open(&m_ws, m_request);
+
+    int rest = m_read_idx - m_checked_index;
+    memmove(m_read_buf, m_read_buf + m_checked_index, rest);
+    m_read_idx = rest;
+    return WS_UPGRADE;
+}
+
+//读到的数据全部交给会话，读缓冲区每次都从头开始使用
+void http_conn::process_ws()
+{
+    while(true)
+    {
+        if(!m_ws.on_input(m_read_buf, m_read_idx))
+        {
+            close_conn();
+            return;
+        }
+        m_read_idx = 0;
+        if(!m_ssl || !tls_pending(m_ssl))
+        {
+            break;
+        }
+        if(!read())
+        {
+            close_conn();
+            return;
+        }
+    }
+    modfd(m_epollfd, m_sockfd, EPOLLIN);
+}
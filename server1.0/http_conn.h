@@ -20,18 +20,98 @@
 #include <errno.h>
 #include "locker.h"
 #include <sys/uio.h>
+#include "file_watcher.h"
+#include "dir_index.h"
+#include "vhost.h"
+#include "router.h"
+#include "chunked_decoder.h"
+#include "tls.h"
+#include "websocket.h"
+#include "rate_limiter.h"
+#include "placement.h"
+#include "tracer.h"
+#include "socket_profile.h"
+#include "micro_cache.h"
+#include "capture.h"
+#include "process_master.h"
+#include "file_io.h"
+#include "threadpool.h"
+#include "arena.h"
+#include "alloc_guard.h"
 
 
+class http_conn;
+class http2_session;
+class ws_hub;
+
+// HTTP/1.1的应答：直接格式化到连接的写缓冲区
+class http1_sink : public response_sink{
+
+public:
+    explicit http1_sink(http_conn* conn) : m_conn(conn) {}
+
+    bool status(int code, const char* title);
+    bool header(const char* name, const char* value);
+    bool body(const char* content_type, const char* data, int len);
+    bool stream(const char* content_type, body_producer* producer);
+    bool shared(shared_response* resp);
+    bool page(const char* content_type, rendered_page* page);
+    bool defer(deferred_response* deferred);
+    bool can_wait() const { return true; }
+
+private:
+    http_conn* m_conn;
+};
+
+// 流式应答的生产者没有数据时，数据到达后重新注册连接的写事件
+class stream_waker : public body_waker{
+
+public:
+    explicit stream_waker(http_conn* conn) : m_conn(conn) {}
+    void wake();
+
+private:
+    http_conn* m_conn;
+};
+
+// HTTP/2会话里推迟的应答有了结果：连接空闲时加上写事件，正在被处理时让处理者再处理一轮
+class h2_waker : public body_waker{
+
+public:
+    explicit h2_waker(http_conn* conn) : m_conn(conn) {}
+    void wake();
+
+private:
+    http_conn* m_conn;
+};
+
 class http_conn{
 
 public:
 
     static int m_epollfd;
     static int m_user_count;
+    static file_watcher* m_watcher;         //doc_root的监视器，为NULL时每次请求都直接stat
+    static router* m_router;                //进程内处理器的路由表，为NULL时所有请求都访问文件系统
+    static long long m_max_body_size;       //允许的最大请求体字节数，超过返回413
+    static tls_context* m_tls;              //不为NULL时所有连接都使用TLS
+    static ws_hub* m_ws_hub;                //WebSocket会话的写线程和心跳，为NULL时不接受WebSocket升级
+    static rate_limiter* m_limiter;         //按客户端IP限流，为NULL时不限制
+    static placement* m_placement;          //CPU/NUMA放置，不为NULL时读写缓冲区从连接所在节点的内存池分配
+    static traffic_capture* m_capture;      //流量录制，为NULL时不录制
+    static const socket_profile* m_socket_profile;  //连接socket的选项和发送策略，为NULL时不设置
+    static worker_slot* m_worker_stats;     //多进程模式下本工作进程的共享计数器，为NULL时不统计
+    static threadpool<io_task>* m_io_pool;  //把冷文件读进页缓存的I/O线程，为NULL时不检查驻留情况
+    static int m_write_quantum;             //每次写事件最多发送的字节数，0表示不限制、任务也不分优先级
+    static vhost_table* m_vhosts;           //虚拟主机，由main创建（只有doc_root时也有一个默认主机）
 
     static const int READ_BUFFER_SIZE = 2048;
     static const int WRITE_BUFFER_SIZE = 1024;
     static const int FILENAME_LEN = 200;        //文件名的最大长度
+    static const int STREAM_CHUNK_SIZE = 8192;  //流式应答每一段的最大长度
+    static const int CHUNK_HEAD_LEN = 10;       //块大小行（十六进制长度+\r\n）预留的空间
+    static const int SMALL_RESPONSE = 64 * 1024;    //不超过这个大小的文件算小文件，优先处理
+    static const int PAGE_BATCH = 64;           //模板页面一次writev最多的片段数
 
     /*
     从状态机的三种可能状态，即行的读取状态：
@@ -61,25 +141,64 @@ enum CHECK_STATE {CHECK_STATE_REQUESTLINE = 0,CHECK_STATE_HEADER,CHECK_STATE_CON
         FILE_REQUEST            :文件请求，获取文件成功
         INTERNAL_ERROR          :表示服务器内部错误
         CLOSED_CONNECTION       :表示客户端已经关闭连接了
+        HANDLER_REQUEST         :请求由进程内的处理器处理完毕，应答已经写入写缓冲区
+        METHOD_NOT_ALLOWED      :该路径不支持这个请求方法（静态文件只支持GET）
+        PAYLOAD_TOO_LARGE       :请求体超过了大小限制
+        H2_UPGRADE              :连接已经通过Upgrade: h2c切换到HTTP/2
+        WS_UPGRADE              :连接已经切换到WebSocket
+        TOO_MANY_REQUESTS       :客户端超过了请求速率限制
+        UPGRADE_REQUIRED        :WebSocket握手的Sec-WebSocket-Version不是13，应答426并告知支持的版本
 
     */
-enum HTTP_CODE {NO_REQUEST,GET_REQUEST,BAD_REQUEST,NO_RESOURCE,FORBIDDEN_REQUEST,FILE_REQUEST,INTERNAL_ERROR,CLOSED_CONNECTION};
+    /*
+        工作线程处理一个任务的优先级，数字越小越先处理（threadpool的lane）
+        LANE_SMALL      :小文件，一次写事件就能发完
+        LANE_DYNAMIC    :处理器、请求体、HTTP/2和WebSocket，耗时不确定
+        LANE_LARGE      :大文件，慢一点开始对总耗时影响不大
+    */
+enum LANE {LANE_SMALL = 0, LANE_DYNAMIC, LANE_LARGE};
+
+enum HTTP_CODE {NO_REQUEST,GET_REQUEST,BAD_REQUEST,NO_RESOURCE,FORBIDDEN_REQUEST,FILE_REQUEST,INTERNAL_ERROR,CLOSED_CONNECTION,HANDLER_REQUEST,
+                METHOD_NOT_ALLOWED,PAYLOAD_TOO_LARGE,H2_UPGRADE,WS_UPGRADE,
+                TOO_MANY_REQUESTS,DIR_REDIRECT,DIR_LISTING,UPGRADE_REQUIRED};
 
 public:
-    http_conn() {}
-    ~http_conn() {}
+    http_conn() : m_read_buf(NULL), m_write_buf(NULL), m_buf_queue(-1), m_producer(NULL), m_stream_buf(NULL), m_stream_pending(false), m_waker(this), m_deferred(NULL), m_shared(NULL), m_page(NULL), m_h2(NULL), m_h2_waker(this), m_trace_id(0), m_capture_conn(0) {}
+    ~http_conn();
 
 public:
 
-    void init(int sockfd, const sockaddr_in & addr);//初始化新接受的连接
+    void init(int sockfd, const sockaddr_in & addr, int queue = 0);//初始化新接受的连接，queue是处理它的节点的任务队列
     void process();                                 //处理客户端请求
     void close_conn();                              //关闭连接
     bool read();                                    //非阻塞读
     bool write();                                   //非阻塞写
+    bool reap_zerocopy(uint32_t events);            //EPOLLERR时取走零拷贝的完成通知，返回false表示是真正的错误
+    bool claim();                                   //主线程处理事件之前调用，返回false时跳过这次事件（HTTP/2连接正在被处理，见h2_waker）
+    int queue() const { return m_queue; }           //投递这个连接的任务时使用的队列
+    void prefetch();                                //I/O线程：把接下来要发送的文件窗口读进页缓存，然后注册写事件
+    LANE lane();                                    //主线程投递任务之前按读缓冲区里的请求行估计应答的大小
+    size_t remaining() const { return m_producer ? SIZE_MAX : bytes_to_send; }  //还没发送的字节数，流式应答算作无穷大
+    bool bulk_write() const { return m_write_quantum > 0 && remaining() > (size_t)m_write_quantum; }   //一次写事件发不完
+    //稳态路径（零分配检查）：连接上已经服务过请求，明文HTTP/1.1的静态文件GET
+    bool steady() const { return m_requests > 1 && !m_ssl && !m_h2 && !m_websocket && m_method == GET && !m_handler; }
+
+    //接受连接时被限流拒绝：明文连接发送预先生成的429后关闭
+    static void reject(int sockfd);
+
+    //host的文档根目录 + url 对应的文件：检查权限后只读mmap，返回FILE_REQUEST或NO_RESOURCE等错误
+    //HTTP/1.1和HTTP/2共用，real_file至少FILENAME_LEN字节，url的查询串被忽略；
+    //目录：不以'/'结尾返回DIR_REDIRECT，否则换成索引文件（FILE_REQUEST）或者目录列表（DIR_LISTING，在dir里）
+    static HTTP_CODE map_file(vhost* host, const char* url, char* real_file, struct stat* st, char** address, dir_target* dir);
 
 private:
 
+    friend class http1_sink;                        //处理器通过http_response写应答
+    friend class stream_waker;
+    friend class h2_waker;
+
     void init();                                    //初始化连接：变量初始化
+    bool recv_data();                               //read()去掉跟踪的部分
     HTTP_CODE process_read();                       //解析HTTP请求
     bool process_write(HTTP_CODE ret);              //填充HTTP应答
 
@@ -87,8 +206,13 @@ private:
 
     HTTP_CODE parse_request_line(char * text);
     HTTP_CODE parse_headers(char * text);
-    HTTP_CODE parse_content(char * text);
+    HTTP_CODE parse_content();
+    HTTP_CODE end_headers();        //头部解析完，决定如何接收请求体
+    void fill_request();            //用解析结果填充交给处理器的m_request
+    HTTP_CODE splice_content();     //定长请求体从socket经管道splice到文件
+    bool deliver_body(const char* data, int len);
     HTTP_CODE do_request(); //具体的处理HTTP内容 
+    HTTP_CODE do_handler(); //交给路由匹配到的处理器
     char * get_line() {return m_read_buf+m_start_line;}
     LINE_STATUS parse_line();
 
@@ -105,12 +229,56 @@ private:
 
     void unmap();
 
+    // 读写缓冲区：同一个fd再次使用时节点没变就沿用原来的
+    bool attach_buffers();
+    void release_buffers();
+
+    // 流式应答：socket可写时才向生产者要下一段，用chunked编码发送
+    bool next_chunk();
+    void release_stream();
+    void release_shared();
+    bool respond_deferred();                        //推迟的应答有了结果：像处理器刚返回一样写应答
+    void advance_iov(int len);                      //已发送len字节，调整m_iv
+
+    // 模板页面：头部在写缓冲区（m_iv[0]），之后是页面的片段，发送时原地调整页面的iovec
+    int page_batch(struct iovec* iv, size_t sent);  //这一次writev的iovec，sent是这次写事件已经发送的字节数
+    void advance_page(int len);
+    void release_page();
+
+    // 处理器的应答体：放得下就拷贝进写缓冲区，放不下的拷贝到m_body，作为第二块iovec发送
+    bool add_bytes(const char* data, int len);
+    void release_body();
+
+    // TLS：握手和读写都经过OpenSSL，开启kTLS后写直接交给内核
+    bool tls_recv();                                //握手或读取解密后的数据
+    int send_iov(const struct iovec* iov, int count, int flags = 0);   //writev或TLS写，-1且errno==EAGAIN表示需要等待可写
+    void set_cork(bool on);                         //大应答发送期间TCP_CORK
+    bool send_raw(const char* data, int len);       //直接发送一小段数据（101 Switching Protocols）
+
+    // HTTP/2：连接切换后读到的数据都交给会话，写事件只负责把会话的输出队列写到socket
+    bool h2_preface();                              //读缓冲区以HTTP/2连接前言开头
+    void start_h2();
+    HTTP_CODE upgrade_h2c();                        //Upgrade: h2c，原来的请求成为流1
+    void process_h2();
+    bool flush_h2();
+    bool park_h2(int ev);                           //处理完一轮：没有被唤醒过就注册事件、放开连接，返回true
+
+    // WebSocket：读到的数据交给m_ws解帧，写由ws_session在任何线程直接进行
+    HTTP_CODE upgrade_ws();
+    void process_ws();
+
+    // 跟踪：请求的根span从主线程第一次读开始，到响应写完（或连接关闭）结束
+    void trace_finish();
+
 private:
 
     int m_sockfd;                       //该HTTP连接的socket
     sockaddr_in m_address;              //通信的socket地址
+    int m_server_port;                  //接受连接的本地端口
+    bool m_rate_tracked;                //接受时计入了限流器的连接数，关闭时要归还
 
-    char m_read_buf[READ_BUFFER_SIZE];  //读缓冲区
+    int m_queue;                        //连接所在节点的任务队列
+    char * m_read_buf;                  //读缓冲区，READ_BUFFER_SIZE字节
     int m_read_idx;                     //标识读缓冲区中以及读入的客户端数据的最后一个字节的下一位置
     int m_checked_index;                //当前正在分析的字符在读缓冲区的位置
     int m_start_line;                   //当前正在解析的行的起始位置
@@ -118,16 +286,45 @@ private:
     CHECK_STATE m_check_state;          //主状态机当前所处的位置
     METHOD m_method;                    //请求方法
 
-    char m_real_file[200];              //客户请求的目标文件的完整路径，其内容等于 doc_root + m_url,doc_root是网站根目录
+    char m_real_file[200];              //客户请求的目标文件的完整路径，其内容等于 文档根目录 + m_url，根目录由Host选择的虚拟主机决定
   
     char * m_url;                       //请求目标文件的文件名
     char * m_version;                   //协议版本，只支持HTTP1.1   
     char * m_host;                      //主机名
+    bool m_accept_gzip;                 //Accept-Encoding含gzip，目录的索引文件可以发预压缩的变体
+    const char * m_encoding;            //发送的文件的Content-Encoding，NULL表示没有
+    request_handler * m_handler;        //请求行解析完后匹配到的处理器，NULL表示访问文件
+    int m_path_len;                     //m_url中路径部分(不含查询串)的长度
     bool m_linger;                      //HTTP请求是否要保持连接
-    int m_content_length;               //HTTP请求的消息体的字节数
+    long long m_content_length;         //HTTP请求的消息体的字节数
+    bool m_has_length;                  //出现过Content-Length
+    bool m_chunked;                     //Transfer-Encoding: chunked
+    bool m_expect_continue;             //Expect: 100-continue
+    bool m_continue_pending;            //写缓冲区里是还没发出的100 Continue，发完后继续读请求体
+    long long m_body_received;          //已经接收（解码后）的请求体字节数
+    int m_body_start;                   //请求体在读缓冲区中的起始位置，之前是请求行和头部
+    int m_headers_start;                //头部在读缓冲区中的位置（请求行之后到空行之前），交给处理器
+    int m_headers_end;
+    bool m_splicing;                    //请求体正在被splice，主线程不要从socket读
+    int m_pipefd[2];                    //splice用的管道，连接关闭时释放
+    chunked_decoder m_chunked_decoder;
+    http_request m_request;             //交给处理器的请求视图
+    request_arena m_arena;              //请求期间的临时内存，每个请求开始时回卷
+    int m_requests;                     //连接上开始过的请求数
+    bool m_in_request;                  //处理器已经接受了请求但还没有handle，中途关闭需要on_abort
+    bool m_upgrade_h2c;                 //Upgrade: h2c
+    char * m_h2_settings;               //HTTP2-Settings头部
+    bool m_upgrade_ws;                  //Upgrade: websocket
+    char * m_ws_key;                    //Sec-WebSocket-Key
+    bool m_ws_version_ok;               //Sec-WebSocket-Version: 13
+
+    SSL * m_ssl;                        //TLS连接，明文时为NULL
+    bool m_tls_ready;                   //握手已经完成
+    bool m_tls_want_write;              //TLS层需要socket可写才能继续（握手或密钥更新）
     
  
-    char m_write_buf[WRITE_BUFFER_SIZE];        //写缓冲区
+    char * m_write_buf;                         //写缓冲区，WRITE_BUFFER_SIZE字节，和读缓冲区在同一块内存中
+    int m_buf_queue;                            //缓冲区属于哪个节点的内存池，-1表示malloc
     int m_write_idx;                            //写缓冲区中待发送的字节数
     char * m_file_address;                      //客户端请求的目标文件被mmap到内存中的起始位置
     struct stat m_file_stat;                    //目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
@@ -135,7 +332,42 @@ private:
     int m_iv_count;                             //其中 m_iv_count 表示被写内存块的数量；
   
     int bytes_have_send;            //已经发送的字节数
-    int bytes_to_send;              //将要发送的字节数
+    int bytes_to_send;              //将要发送的字节数（流式应答时是当前这一段的）
+
+    body_producer * m_producer;     //流式应答的生产者，应答结束或连接关闭时释放
+    char * m_stream_buf;            //当前这一段的缓冲区：块大小行 + 数据 + \r\n
+    bool m_stream_done;             //最后一个块(0\r\n\r\n)已经生成
+    bool m_stream_pending;          //生产者暂时没有数据，没有注册任何事件，等它的waker
+    stream_waker m_waker;
+    deferred_response * m_deferred; //推迟的应答，结果到达之前没有注册任何事件，等m_waker
+    shared_response * m_shared;     //微缓存的应答，发送期间持有一个引用
+    std::string m_body;             //处理器写写缓冲区放不下的应答体（m_iv[1]），发送完释放
+    rendered_page * m_page;         //模板渲染出的页面，发送完或连接关闭时释放
+    int m_page_idx;                 //页面里第一个还没有发完的片段
+
+    http2_session * m_h2;           //切换到HTTP/2后的会话，为NULL时是HTTP/1.1
+    //推迟的应答会让别的线程（h2_waker）给HTTP/2连接加上事件，m_h2_busy期间到达的事件由主线程跳过（claim），
+    //处理者在重新注册事件之前发现m_h2_woken时再处理一轮
+    locker m_h2_lock;
+    bool m_h2_busy;                 //有线程正在处理这个HTTP/2连接
+    bool m_h2_woken;                //处理期间被唤醒过，或者跳过了事件
+    h2_waker m_h2_waker;
+    bool m_websocket;               //已经切换到WebSocket
+    ws_session m_ws;
+
+    uint64_t m_trace_id;            //当前请求被采样时的trace id，0表示不跟踪
+    uint64_t m_trace_start;         //请求开始（第一次读）的TSC
+    uint64_t m_trace_queued;        //投入线程池队列的TSC，工作线程据此记录排队时间
+
+    uint32_t m_capture_conn;        //录制时这个连接的编号
+    uint64_t m_bytes_sent;          //连接上已经发出的应答字节数（TLS是明文字节数），录制时用
+
+    bool m_zerocopy;                //socket开启了SO_ZEROCOPY，大文件用MSG_ZEROCOPY发送
+    bool m_zerocopy_sent;           //发过零拷贝的数据，EPOLLERR可能只是完成通知
+    bool m_corked;                  //当前应答发送期间塞住了socket
+
+    io_task m_io_task;              //交给I/O线程池的任务
+    bool defer_if_cold();           //接下来要发送的文件窗口不在页缓存里时交给I/O线程，返回true表示已经交出去了
 };
 
 
@@ -8,11 +8,27 @@
 #include <fcntl.h> 
 #include <sys/epoll.h>
 #include <libgen.h>
+#include <algorithm>
 #include "locker.h"
 #include "threadpool.h"
 #include <signal.h>
 #include <string.h>
 #include "http_conn.h"
+#include "file_watcher.h"
+#include "upload_handler.h"
+#include "ws_hub.h"
+#include "tls.h"
+#include "placement.h"
+#include "tracer.h"
+#include "capture.h"
+#include "co_conn.h"
+#include "socket_profile.h"
+#include "micro_cache.h"
+#include "process_master.h"
+#include "fcgi_gateway.h"
+#include "template_engine.h"
+#include "vhost.h"
+#include "profiler.h"
 
 #define MAX_FD 65535            //最大的文件描述符个数
 #define MAX_EVENT_NUMBRE 1000   //监听的最大的事件数量
@@ -27,17 +43,311 @@ void addsig(int sig, void(handler)(int)){
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
+//SIGUSR2：导出保留的慢请求跟踪，在主循环里做
+static volatile sig_atomic_t trace_dump_requested = 0;
+
+void request_trace_dump(int sig)
+{
+    trace_dump_requested = 1;
+}
+
+//SIGUSR1：开始一次采样，在主循环里做
+static volatile sig_atomic_t profile_requested = 0;
+
+void request_profile(int sig)
+{
+    profile_requested = 1;
+}
+
 extern void addfd(int epollfd, int fd, bool one_shot);
 
 extern void removefd(int epollfd, int fd);
 
+extern const char* doc_root;
+
+//健康检查：不访问文件系统，直接返回ok
+class health_handler : public request_handler{
+
+public:
+    bool handle(http_request& req, http_response& resp)
+    {
+        return resp.body("text/plain", "ok\n", 3);
+    }
+};
+
+health_handler health;
+
+//限流统计
+class limit_stats_handler : public request_handler{
+
+public:
+    bool handle(http_request& req, http_response& resp)
+    {
+        rate_limiter* limiter = http_conn::m_limiter;
+        char body[256];
+        int len = snprintf(body, sizeof(body),
+            "rejected_conns %llu\nrejected_requests %llu\nevictions %llu\nuntracked %llu\n",
+            (unsigned long long)limiter->rejected_conns(), (unsigned long long)limiter->rejected_requests(),
+            (unsigned long long)limiter->evictions(), (unsigned long long)limiter->untracked());
+        return resp.body("text/plain", body, len);
+    }
+};
+
+limit_stats_handler limit_stats;
+
+//线程放置和跨节点统计
+class placement_stats_handler : public request_handler{
+
+public:
+    bool handle(http_request& req, http_response& resp)
+    {
+        char body[4096];
+        int len = http_conn::m_placement->report(body, sizeof(body));
+        return resp.body("text/plain", body, len);
+    }
+};
+
+placement_stats_handler placement_stats;
+
+//按需导出跟踪
+class trace_dump_handler : public request_handler{
+
+public:
+    bool handle(http_request& req, http_response& resp)
+    {
+        char body[512];
+        int spans = tracer::dump();
+        int len = (spans < 0) ? snprintf(body, sizeof(body), "dump to %s failed\n", tracer::path())
+                              : snprintf(body, sizeof(body), "%d spans written to %s\n", spans, tracer::path());
+        return resp.body("text/plain", body, len);
+    }
+};
+
+trace_dump_handler trace_dump;
+
+//微缓存的命中统计
+class cache_stats_handler : public request_handler{
+
+public:
+    micro_cache* cache;
+
+    bool handle(http_request& req, http_response& resp)
+    {
+        char body[256];
+        int len = cache->report(body, sizeof(body));
+        return resp.body("text/plain", body, len);
+    }
+};
+
+cache_stats_handler cache_stats;
+
+//多进程模式下各工作进程的计数器和主进程的汇总
+class process_stats_handler : public request_handler{
+
+public:
+    process_master* master;
+
+    bool handle(http_request& req, http_response& resp)
+    {
+        char body[8192];
+        int len = master->report(body, sizeof(body));
+        return resp.body("text/plain", body, len);
+    }
+};
+
+process_stats_handler process_stats;
+
+//冷文件的检查和读入统计
+class io_stats_handler : public request_handler{
+
+public:
+    bool handle(http_request& req, http_response& resp)
+    {
+        char body[256];
+        int len = file_io::report(body, sizeof(body));
+        return resp.body("text/plain", body, len);
+    }
+};
+
+io_stats_handler io_stats;
+
+//线程池每个线程在做什么、卡住的统计；?stacks=1 同时抓取忙碌线程的调用栈
+class pool_stats_handler : public request_handler{
+
+public:
+    threadpool<http_conn>* pool;
+
+    //带调用栈时超过写缓冲区，做成共享应答直接发送
+    bool handle(http_request& req, http_response& resp)
+    {
+        std::vector<char> body(65536);
+        bool stacks = req.query && strstr(req.query, "stacks=1");
+        int len = pool->report(body.data(), body.size(), stacks);
+        shared_response* r = new shared_response(200, "OK", std::vector<shared_response::field>(), "text/plain", body.data(), len);
+        bool ok = resp.shared(r);
+        r->unref();
+        return ok;
+    }
+};
+
+pool_stats_handler pool_stats;
+
+//零分配检查（-DALLOC_CHECK编译）检查过的稳态区间数
+class alloc_stats_handler : public request_handler{
+
+public:
+    bool handle(http_request& req, http_response& resp)
+    {
+        char body[256];
+        int len = alloc_guard::report(body, sizeof(body));
+        return resp.body("text/plain", body, len);
+    }
+};
+
+alloc_stats_handler alloc_stats;
+
+//虚拟主机和各自的请求数
+class vhost_stats_handler : public request_handler{
+
+public:
+    vhost_table* vhosts;
+
+    bool handle(http_request& req, http_response& resp)
+    {
+        char body[4096];
+        int len = vhosts->report(body, sizeof(body));
+        return resp.body("text/plain", body, len);
+    }
+};
+
+vhost_stats_handler vhost_stats;
+
+//折叠栈可能有几MB，按socket可写逐段发送
+class text_producer : public body_producer{
+
+public:
+    explicit text_producer(const std::string& text) : m_text(text), m_sent(0) {}
+
+    int produce(char* buf, int len)
+    {
+        int n = std::min((size_t)len, m_text.size() - m_sent);
+        memcpy(buf, m_text.data() + m_sent, n);
+        m_sent += n;
+        return n;
+    }
+
+private:
+    std::string m_text;
+    size_t m_sent;
+};
+
+//?seconds=N&hz=H 开始一次采样；不带参数时返回最近一次的折叠栈，还没有结果或者正在采样时返回状态
+class profile_handler : public request_handler{
+
+public:
+    bool handle(http_request& req, http_response& resp)
+    {
+        char body[640];
+        if(req.query)
+        {
+            const char* p = strstr(req.query, "seconds=");
+            const char* q = strstr(req.query, "hz=");
+            int seconds = p ? atoi(p + 8) : 0;
+            int hz = q ? atoi(q + 3) : 0;
+            if(!profiler::start(seconds, hz))
+            {
+                int len = snprintf(body, sizeof(body), "a profile is already running\n");
+                return resp.body("text/plain", body, len);
+            }
+            int len = profiler::status(body, sizeof(body));
+            return resp.body("text/plain", body, len);
+        }
+        std::string folded = profiler::result();
+        if(profiler::running() || folded.empty())
+        {
+            int len = profiler::status(body, sizeof(body));
+            return resp.body("text/plain", body, len);
+        }
+        //stream失败时自己释放producer
+        return resp.stream("text/plain", new text_producer(folded));
+    }
+};
+
+profile_handler profile;
+
+//开启了微缓存时处理器的GET应答经过缓存
+static request_handler* cached(micro_cache* cache, request_handler* handler, int ttl_ms, int stale_ms)
+{
+    return cache ? cache->wrap(handler, ttl_ms, stale_ms) : handler;
+}
+
+//编译期声明的路由，构造出完美哈希表
+constexpr route_def static_route_defs[] = {
+    ROUTE(http_conn::GET, "/healthz", &health),
+};
+constexpr static_routes<sizeof(static_route_defs) / sizeof(static_route_defs[0])> static_route_table(static_route_defs);
+
 //extern void modfd(int epollfd, int fd, int ev);
 
 int main(int argc, char* argv[])
 {
-    if(argc <= 1)
+    const char* upload_dir = NULL;
+    const char* cert_file = NULL;
+    const char* key_file = NULL;
+    bool enable_ws = false;
+    const char* rate_spec = NULL;
+    char* affinity_spec = NULL;
+    bool steer = false;
+    char* trace_spec = NULL;
+    const char* capture_file = NULL;
+    int co_reactors = 0;
+    const char* socket_spec = "balanced";
+    const char* cache_spec = NULL;
+    int processes = 0;
+    int io_threads = 4;
+    const char* watchdog_spec = NULL;
+    int quantum_kb = 256;
+    std::vector<const char*> fcgi_specs;
+    const char* template_dir = NULL;
+    const char* index_names = NULL;
+    bool dir_listing = false;
+    std::vector<const char*> vhost_specs;
+    const char* profile_spec = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "u:c:k:wr:a:sT:C:K:S:M:P:I:W:Q:F:t:i:LV:p:")) != -1)
     {
-        printf("usage: %s port_number\n", basename(argv[0]));
+        switch(opt)
+        {
+            case 'u': upload_dir = optarg; break;
+            case 'c': cert_file = optarg; break;
+            case 'k': key_file = optarg; break;
+            case 'w': enable_ws = true; break;
+            case 'r': rate_spec = optarg; break;
+            case 'a': affinity_spec = optarg; break;
+            case 's': steer = true; break;
+            case 'T': trace_spec = optarg; break;
+            case 'C': capture_file = optarg; break;
+            case 'K': co_reactors = atoi(optarg); break;
+            case 'S': socket_spec = optarg; break;
+            case 'M': cache_spec = optarg; break;
+            case 'P': processes = atoi(optarg); break;
+            case 'I': io_threads = atoi(optarg); break;
+            case 'W': watchdog_spec = optarg; break;
+            case 'Q': quantum_kb = atoi(optarg); break;
+            case 'F': fcgi_specs.push_back(optarg); break;
+            case 't': template_dir = optarg; break;
+            case 'i': index_names = optarg; break;
+            case 'L': dir_listing = true; break;
+            case 'V': vhost_specs.push_back(optarg); break;
+            case 'p': profile_spec = optarg; break;
+            default: break;
+        }
+    }
+
+    if(optind >= argc || (cert_file == NULL) != (key_file == NULL))
+    {
+        printf("usage: %s [-u upload_dir] [-c cert.pem -k key.pem] [-w] [-r conn_rate,req_rate,max_conns] [-a reactor_cpus:worker_cpus [-s]] [-T sample_every:slow_ms:trace.json] [-C capture.log] [-K reactors] [-S compat|balanced|latency|throughput[,option=value...]] [-M ttl_ms[:stale_ms]] [-P processes] [-I io_threads] [-W stall_ms[:log|replace|shed]] [-Q quantum_kb] [-F prefix=socket[,socket...]]... [-t template_dir] [-i index.html,index.htm,...] [-L] [-V host[,host...]=doc_root[:listing]]... [-p seconds[:hz[:profile.folded]]] port_number\n", basename(argv[0]));
         /*
             1、exit用于结束正在运行的整个程序，它将参数返回给OS，把控制权交给操作系统；而return 是退出当前函数，返回函数值，把控制权交给调用函数。
             2. exit是系统调用级别，它表示一个进程的结束；而return 是语言级别的，它表示调用堆栈的返回。
@@ -45,44 +355,429 @@ int main(int argc, char* argv[])
         exit(-1);
     }
 
-    int port = atoi(argv[1]); //获取端口号
+    int port = atoi(argv[optind]); //获取端口号
+
+    //-S socket选项的配置，逗号后面可以覆盖单个选项（backlog、defer、fastopen、busy_poll、prefer_busy_poll、
+    //rcvbuf、sndbuf、nodelay、cork、zerocopy），如 -S throughput,zerocopy=65536
+    socket_profile sock_profile;
+    if(!socket_profile::parse(socket_spec, &sock_profile))
+    {
+        printf("bad socket profile: %s\n", socket_spec);
+        exit(-1);
+    }
+    sock_profile.print();
+    http_conn::m_socket_profile = &sock_profile;
+
+    //-K 协程模型：n个reactor线程，每个连接一个协程，不经过线程池；只处理明文HTTP/1.1
+    if(co_reactors > 0)
+    {
+#if defined(__cpp_impl_coroutine)
+        if(cert_file || enable_ws || affinity_spec || trace_spec || capture_file)
+        {
+            printf("-K cannot be combined with -c/-k, -w, -a, -T or -C\n");
+            exit(-1);
+        }
+#else
+        printf("-K requires a build with -std=c++20\n");
+        exit(-1);
+#endif
+    }
+
+    //-P 多进程：每个工作进程自己绑定CPU，也各自录制和导出跟踪、采样结果会写坏同一个文件
+    if(processes > 0 && (affinity_spec || trace_spec || capture_file || profile_spec))
+    {
+        printf("-P cannot be combined with -a/-s, -T, -C or -p\n");
+        exit(-1);
+    }
+
+    //指定了证书时启用TLS，所有连接都必须先握手
+    tls_context tls;
+    if(cert_file)
+    {
+        if(!tls.init(cert_file, key_file))
+        {
+            exit(-1);
+        }
+        http_conn::m_tls = &tls;
+    }
 
     addsig(SIGPIPE, SIG_IGN);
 
+    //-p 采样profiler：SIGUSR1或GET /profilez?seconds=N&hz=H 开始一次采样，结束后写出折叠栈；
+    //要在创建任何线程之前初始化，线程启动时才能登记
+    if(profile_spec)
+    {
+        if(!profiler::init(profile_spec))
+        {
+            printf("bad profile spec: %s\n", profile_spec);
+            exit(-1);
+        }
+        profiler::register_thread("main");
+        addsig(SIGUSR1, request_profile);
+    }
+
+    //-a 主线程和工作线程的CPU列表（如 0:1-7，留空表示所有在线CPU），每个工作CPU一个线程，每个NUMA节点一个任务队列
+    //-s 同时为每个节点开一个reuseport监听socket，由BPF按收包CPU分配连接
+    placement* place = NULL;
+    if(affinity_spec)
+    {
+        char* worker_cpus = strchr(affinity_spec, ':');
+        if(worker_cpus)
+        {
+            *worker_cpus++ = '\0';
+        }
+        place = new placement;
+        if(!place->init(*affinity_spec ? affinity_spec : NULL, (worker_cpus && *worker_cpus) ? worker_cpus : NULL))
+        {
+            printf("bad cpu list\n");
+            exit(-1);
+        }
+        place->pin_reactor();
+        http_conn::m_placement = place;
+    }
+
+    //开启转发时第i个监听socket上的连接属于第i个队列
+    std::vector<int> listenfds;
+    if(place && steer)
+    {
+        listenfds = place->open_steered_listeners(port, sock_profile.backlog);
+        for(size_t i = 0; i < listenfds.size(); i++)
+        {
+            sock_profile.apply_listener(listenfds[i]);
+        }
+    }
+
+    if(listenfds.empty())
+    {
+        int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+
+        //2MSL:主动关闭一方会有
+        /*端口复用：
+            在server的TCP连接没有完全断开之前不允许重新监听是不合理的。
+            因为，TCP连接没有完全断开指的是connfd（127.0.0.1:6666）没有完全断开，
+            而我们重新监听的是lis-tenfd（0.0.0.0:6666），虽然是占用同一个端口，但IP地址不同，
+            connfd对应的是与某个客户端通讯的一个具体的IP地址，而listenfd对应的是wildcard address。
+            解决这个问题的方法是使用setsockopt()设置socket描述符的选项SO_REUSEADDR为1，
+            表示允许创建端口号相同但IP地址不同的多个socket描述符。
+        */
+        int reuse = 1;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sock_profile.apply_listener(listenfd);
+
+        struct sockaddr_in seraddress;
+        seraddress.sin_family = AF_INET;
+        seraddress.sin_port = htons(port);
+        seraddress.sin_addr.s_addr = INADDR_ANY;
+
+        bind(listenfd, (struct sockaddr*)&seraddress, sizeof(seraddress));
+
+        listen(listenfd, sock_profile.backlog);
+        listenfds.push_back(listenfd);
+    }
+    
+    //-P 主进程创建好监听socket后fork工作进程，之后只负责重启退出的工作进程和汇总计数器；
+    //下面的线程（线程池、reactor、文件监视、WebSocket）都在fork之后才在工作进程里创建
+    process_master* master = NULL;
+    if(processes > 0)
+    {
+        master = new process_master;
+        if(!master->init(processes))
+        {
+            printf("bad process count: %d\n", processes);
+            exit(-1);
+        }
+        int worker = master->run();
+        if(worker < 0)
+        {
+            for(size_t i = 0; i < listenfds.size(); i++)
+            {
+                close(listenfds[i]);
+            }
+            delete master;
+            return 0;
+        }
+        http_conn::m_worker_stats = master->slot(worker);
+        process_stats.master = master;
+    }
+
     threadpool<http_conn> * pool = NULL;//防止内存泄露，先指空
-    //try/catch 语句用于处理代码中可能出现的错误信息。
-    try{
-        pool = new threadpool<http_conn>;//为pool分配内存空间
-    }catch(...){
+    threadpool<io_task> * io_pool = NULL;
+    http_conn* users = NULL;
+#if defined(__cpp_impl_coroutine)
+    std::vector<co_reactor*> reactors;
+    for(int i = 0; i < co_reactors; i++)
+    {
+        reactors.push_back(new co_reactor(co_conn::serve));
+        if(!reactors.back()->start())
+        {
+            exit(-1);
+        }
+    }
+    size_t next_reactor = 0;
+#endif
+    if(co_reactors == 0)
+    {
+        //try/catch 语句用于处理代码中可能出现的错误信息。
+        try{
+            //多进程模式下并发来自进程数，每个工作进程只要一个工作线程
+            pool = new threadpool<http_conn>(master ? 1 : 8, 10000, place);//为pool分配内存空间
+        }catch(...){
+            exit(-1);
+        }
+
+        users = new http_conn[MAX_FD];
+
+        //-W 工作线程的一个任务超过stall_ms毫秒算卡住：打印调用栈，log只记录，replace另起线程顶替，shed减载；/poolz 查看
+        if(watchdog_spec)
+        {
+            int stall_ms;
+            stall_watch::REACTION reaction;
+            if(!stall_watch::parse(watchdog_spec, &stall_ms, &reaction) || !pool->start_watchdog(stall_ms, reaction))
+            {
+                printf("bad watchdog spec: %s\n", watchdog_spec);
+                exit(-1);
+            }
+        }
+
+        //-I 把不在页缓存里的文件读进来的I/O线程数，0表示不检查（发送时缺页由主线程等磁盘）
+        if(io_threads > 0)
+        {
+            try{
+                io_pool = new threadpool<io_task>(io_threads, 10000, NULL, "io");
+            }catch(...){
+                exit(-1);
+            }
+            http_conn::m_io_pool = io_pool;
+        }
+    }
+
+    router routes;
+    routes.set_static(static_route_table.view());
+    http_conn::m_router = &routes;
+
+    //-M 处理器应答的微缓存：统计类接口的GET应答缓存ttl_ms毫秒，过期后stale_ms毫秒内重新计算期间继续返回旧的应答，
+    //相同的并发请求只计算一次；/cachez 查看命中统计
+    micro_cache* cache = NULL;
+    int cache_ttl = 0;
+    int cache_stale = 0;
+    if(cache_spec)
+    {
+        if(sscanf(cache_spec, "%d:%d", &cache_ttl, &cache_stale) < 1 || cache_ttl <= 0 || cache_stale < 0)
+        {
+            printf("bad cache spec: %s\n", cache_spec);
+            exit(-1);
+        }
+        cache = new micro_cache;
+        cache_stats.cache = cache;
+        routes.add(http_conn::GET, "/cachez", &cache_stats);
+    }
+
+    //指定了上传目录时启用 PUT/POST /upload/<文件名>
+    upload_handler* uploader = NULL;
+    if(upload_dir)
+    {
+        uploader = new upload_handler(upload_dir);
+        routes.add_prefix(http_conn::PUT, "/upload/", uploader);
+        routes.add_prefix(http_conn::POST, "/upload/", uploader);
+    }
+
+    //-w启用WebSocket广播：GET /ws/<主题> 订阅，POST/PUT /publish/<主题> 推送，GET /ws/ 查看统计
+    ws_hub* hub = NULL;
+    publish_handler* publisher = NULL;
+    if(enable_ws)
+    {
+        hub = new ws_hub("/ws/");
+        if(!hub->start())
+        {
+            exit(-1);
+        }
+        publisher = new publish_handler(hub, "/publish/");
+        routes.add_prefix(http_conn::GET, "/ws/", hub);
+        routes.add_prefix(http_conn::POST, "/publish/", publisher);
+        routes.add_prefix(http_conn::PUT, "/publish/", publisher);
+        http_conn::m_ws_hub = hub;
+    }
+
+    //-F <prefix>下的请求交给本机的FastCGI应用进程（每个Unix socket一个），可以指定多次；/fcgiz 查看每个应用进程的延迟
+    std::vector<fcgi_gateway*> gateways;
+    std::vector<fcgi_handler*> fcgi_handlers;
+    fcgi_stats_handler fcgi_stats;
+    for(size_t i = 0; i < fcgi_specs.size(); i++)
+    {
+        fcgi_gateway* gateway = new fcgi_gateway;
+        if(!gateway->configure(fcgi_specs[i]) || !gateway->start())
+        {
+            printf("bad fastcgi spec: %s\n", fcgi_specs[i]);
+            exit(-1);
+        }
+        fcgi_handler* handler = new fcgi_handler(gateway);
+        routes.add_prefix(http_conn::GET, gateway->prefix(), handler);
+        routes.add_prefix(http_conn::POST, gateway->prefix(), handler);
+        routes.add_prefix(http_conn::PUT, gateway->prefix(), handler);
+        gateways.push_back(gateway);
+        fcgi_handlers.push_back(handler);
+    }
+    if(!gateways.empty())
+    {
+        fcgi_stats.gateways = gateways;
+        routes.add(http_conn::GET, "/fcgiz", &fcgi_stats);
+    }
+
+    //-i 目录的索引文件名，按顺序找第一个存在的；-L 默认主机没有索引文件时生成目录列表
+    if(!dir_index::configure(index_names))
+    {
+        printf("bad index names\n");
         exit(-1);
     }
 
-    http_conn* users = new http_conn[MAX_FD];
+    //-V 虚拟主机：按Host选择文档根目录，如 -V example.com,www.example.com=/srv/example -V '*.example.org=/srv/org:listing'；
+    //"*"代替doc_root成为默认主机；/vhostz 查看每个主机的请求数
+    vhost_table vhosts(doc_root, dir_listing);
+    for(size_t i = 0; i < vhost_specs.size(); i++)
+    {
+        if(!vhosts.add(vhost_specs[i]))
+        {
+            printf("bad vhost spec: %s\n", vhost_specs[i]);
+            exit(-1);
+        }
+    }
+    vhosts.build();
+    http_conn::m_vhosts = &vhosts;
+    vhost_stats.vhosts = &vhosts;
+    if(!vhost_specs.empty())
+    {
+        routes.add(http_conn::GET, "/vhostz", &vhost_stats);
+    }
+
+    //-t 模板目录：GET /page/<name> 渲染<name>.html，模板修改后自动重新编译；/templatez 查看编译和命中统计
+    template_cache* templates = NULL;
+    template_handler* template_pages = NULL;
+    template_stats_handler template_stats;
+    if(template_dir)
+    {
+        templates = new template_cache;
+        if(!templates->init(template_dir))
+        {
+            exit(-1);
+        }
+        template_pages = new template_handler(templates, "/page/");
+        routes.add_prefix(http_conn::GET, "/page/", template_pages);
+        template_stats.cache = templates;
+        routes.add(http_conn::GET, "/templatez", &template_stats);
+    }
+
+    //-r 每个IP每秒的新连接数、每秒的请求数和同时打开的连接数，突发允许一秒的量；/24网段的限额是PREFIX_FACTOR倍
+    rate_limiter* limiter = NULL;
+    if(rate_spec)
+    {
+        rate_limiter::limits limits;
+        if(sscanf(rate_spec, "%f,%f,%d", &limits.conn_rate, &limits.req_rate, &limits.max_conns) != 3
+            || limits.conn_rate <= 0 || limits.req_rate <= 0 || limits.max_conns <= 0)
+        {
+            printf("bad rate limit: %s\n", rate_spec);
+            exit(-1);
+        }
+        limits.conn_burst = limits.conn_rate < 1 ? 1 : limits.conn_rate;
+        limits.req_burst = limits.req_rate < 1 ? 1 : limits.req_rate;
+        try{
+            limiter = new rate_limiter(limits);
+        }catch(...){
+            exit(-1);
+        }
+        http_conn::m_limiter = limiter;
+        routes.add(http_conn::GET, "/limitz", cached(cache, &limit_stats, cache_ttl, cache_stale));
+    }
+    if(master)
+    {
+        routes.add(http_conn::GET, "/procz", &process_stats);
+    }
+    if(io_pool)
+    {
+        routes.add(http_conn::GET, "/ioz", &io_stats);
+    }
+    if(pool)
+    {
+        pool_stats.pool = pool;
+        routes.add(http_conn::GET, "/poolz", &pool_stats);
+    }
+    if(place)
+    {
+        routes.add(http_conn::GET, "/placez", cached(cache, &placement_stats, cache_ttl, cache_stale));
+    }
+    if(alloc_guard::enabled())
+    {
+        routes.add(http_conn::GET, "/allocz", &alloc_stats);
+    }
+    if(profiler::enabled())
+    {
+        routes.add(http_conn::GET, "/profilez", &profile);
+    }
 
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    //-T 每sample_every个请求跟踪一个，耗时不少于slow_ms毫秒的保留；SIGUSR2或GET /tracez 写出Chrome trace格式的JSON
+    if(trace_spec)
+    {
+        int sample_every = 0, slow_ms = -1, n = 0;
+        if(sscanf(trace_spec, "%d:%d:%n", &sample_every, &slow_ms, &n) != 2 || n == 0
+            || !tracer::init(sample_every, slow_ms, trace_spec + n))
+        {
+            printf("bad trace spec: %s\n", trace_spec);
+            exit(-1);
+        }
+        addsig(SIGUSR2, request_trace_dump);
+        routes.add(http_conn::GET, "/tracez", &trace_dump);
+    }
 
-    //设置端口复用
-    int reuse = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    //-C 录制收到的请求字节、到达时间和连接的建立/关闭，用 tools/replay 重放
+    traffic_capture* capture = NULL;
+    if(capture_file)
+    {
+        capture = new traffic_capture;
+        if(!capture->open(capture_file))
+        {
+            exit(-1);
+        }
+        http_conn::m_capture = capture;
+    }
 
-    struct sockaddr_in seraddress;
-    seraddress.sin_family = AF_INET;
-    seraddress.sin_port = htons(port);
-    seraddress.sin_addr.s_addr = INADDR_ANY;
+    //监视网站根目录（每个虚拟主机的根目录），文件变化时通知各线程的元数据缓存失效
+    file_watcher watcher;
+    if(watcher.start(vhosts.roots()))
+    {
+        http_conn::m_watcher = &watcher;
+    }
 
-    bind(listenfd, (struct sockaddr*)&seraddress, sizeof(seraddress));
-   
-    listen(listenfd,5);
-    
     //创建epoll对象、事件数组
     epoll_event events[MAX_EVENT_NUMBRE];
 
     int epollfd = epoll_create(5);
 
-    addfd(epollfd, listenfd,false);//把  监听socket  挂上epoll
+    for(size_t i = 0; i < listenfds.size(); i++)
+    {
+        if(master)
+        {
+            //所有工作进程的epoll都在等同一个监听socket：EPOLLEXCLUSIVE只唤醒其中一个（或几个），没抢到的accept返回EAGAIN
+            epoll_event event;
+            event.data.fd = listenfds[i];
+            event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfds[i], &event);
+            fcntl(listenfds[i], F_SETFL, fcntl(listenfds[i], F_GETFL) | O_NONBLOCK);
+            continue;
+        }
+        addfd(epollfd, listenfds[i], false);//把  监听socket  挂上epoll
+    }
 
     http_conn::m_epollfd = epollfd;
 
+    //-Q 每个连接每次写事件最多发送quantum_kb，发不完的大应答放到这一批事件的最后、剩得少的先发；
+    //工作线程按请求行估计的大小先处理小文件。0表示按到达顺序处理、一次发到socket写满为止
+    if(quantum_kb < 0 || quantum_kb > 1024 * 1024)
+    {
+        printf("bad write quantum: %d\n", quantum_kb);
+        exit(-1);
+    }
+    http_conn::m_write_quantum = quantum_kb * 1024;
+    std::vector<int> bulk;
+
     while(true)
     {
         int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBRE, -1);
@@ -92,21 +787,97 @@ int main(int argc, char* argv[])
             break;
         }
 
+        if(trace_dump_requested)
+        {
+            trace_dump_requested = 0;
+            printf("trace: %d spans written to %s\n", tracer::dump(), tracer::path());
+        }
+
+        if(profile_requested)
+        {
+            profile_requested = 0;
+            if(profiler::start())
+            {
+                printf("profile: started, result in %s\n", profiler::path());
+            }
+        }
+
         for(int i = 0; i< num;i++)
         {
             int sockfd = events[i].data.fd;
 
-            if(sockfd == listenfd){
+            int listen_index = -1;
+            for(size_t j = 0; j < listenfds.size(); j++)
+            {
+                if(sockfd == listenfds[j])
+                {
+                    listen_index = j;
+                }
+            }
+
+            //HTTP/2连接正在被别的线程处理：跳过这个事件，处理者放开连接之前会再处理一轮
+            if(listen_index < 0 && !users[sockfd].claim())
+            {
+                continue;
+            }
+
+            //零拷贝发送的完成通知也以EPOLLERR报告：取走之后不算错误，按剩下的事件处理
+            if(listen_index < 0 && (events[i].events & EPOLLERR) && users[sockfd].reap_zerocopy(events[i].events))
+            {
+                events[i].events &= ~EPOLLERR;
+            }
+
+            if(listen_index >= 0){
                     struct sockaddr_in clinet_address;
                     socklen_t client_addrlen = sizeof(clinet_address);
-                    int confd = accept(listenfd, (struct sockaddr *)&clinet_address,&client_addrlen);
+                    int confd = accept(sockfd, (struct sockaddr *)&clinet_address,&client_addrlen);
+                    if(confd < 0)
+                    {
+                        continue;
+                    }
 
                     if(http_conn::m_user_count >= MAX_FD){
                         close(confd);
                         continue;
                     }
 
-                    users[confd].init(confd,clinet_address);
+                    //限流：这个IP（或网段）新建连接太快、或者打开的连接太多
+                    if(http_conn::m_limiter && !http_conn::m_limiter->on_accept(clinet_address.sin_addr.s_addr))
+                    {
+                        http_conn::reject(confd);
+                        continue;
+                    }
+                    if(http_conn::m_worker_stats)
+                    {
+                        http_conn::m_worker_stats->count_accept();
+                    }
+
+#if defined(__cpp_impl_coroutine)
+                    //协程模型：轮流交给各个reactor，之后这个连接的所有事件都在那个reactor上处理
+                    if(!reactors.empty())
+                    {
+                        if(confd >= co_reactor::FD_LIMIT)
+                        {
+                            close(confd);
+                            if(http_conn::m_worker_stats)
+                            {
+                                http_conn::m_worker_stats->count_close();
+                            }
+                            continue;
+                        }
+                        sock_profile.apply_conn(confd);
+                        reactors[next_reactor++ % reactors.size()]->adopt(confd, clinet_address);
+                        continue;
+                    }
+#endif
+
+                    //连接由收包CPU所在节点的工作线程处理
+                    int queue = 0;
+                    if(place)
+                    {
+                        queue = (listenfds.size() > 1) ? listen_index : place->incoming_queue(confd);
+                    }
+                    users[confd].init(confd,clinet_address,queue);
             }
             else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
@@ -114,9 +885,14 @@ int main(int argc, char* argv[])
             }
             else if(events[i].events & EPOLLIN) //连接socket 有  读事件
             {
+                alloc_scope guard("dispatch", users[sockfd].steady());
                 if(users[sockfd].read())
                 {
-                    pool->append(users+sockfd);
+                    //队列满了或者正在减载：连接没有重新注册事件，不关闭就再也不会被处理
+                    if(!pool->append(users+sockfd, users[sockfd].queue(), users[sockfd].lane()))
+                    {
+                        users[sockfd].close_conn();
+                    }
                 }
                 else{
                     users[sockfd].close_conn();
@@ -124,7 +900,11 @@ int main(int argc, char* argv[])
             }
             else if(events[i].events & EPOLLOUT)//连接socket 有  写事件
             {
-                if(!users[sockfd].write())
+                if(users[sockfd].bulk_write())
+                {
+                    bulk.push_back(sockfd);
+                }
+                else if(!users[sockfd].write())
                 {
                     users[sockfd].close_conn();
                 }
@@ -132,14 +912,44 @@ int main(int argc, char* argv[])
          
         }
 
+        //一次发不完的大应答：每个连接发一个时间片，剩下的字节少的先发
+        std::sort(bulk.begin(), bulk.end(), [users](int a, int b){ return users[a].remaining() < users[b].remaining(); });
+        for(size_t j = 0; j < bulk.size(); j++)
+        {
+            if(!users[bulk[j]].write())
+            {
+                users[bulk[j]].close_conn();
+            }
+        }
+        bulk.clear();
+
 
     }
 
     close(epollfd);
-    close(listenfd);
+    for(size_t i = 0; i < listenfds.size(); i++)
+    {
+        close(listenfds[i]);
+    }
 
     delete [] users;
     delete pool;
+    delete io_pool;
+    delete uploader;
+    delete publisher;
+    delete hub;
+    delete limiter;
+    delete place;
+    delete capture;
+    delete cache;
+    delete master;
+    delete template_pages;
+    delete templates;
+    for(size_t i = 0; i < gateways.size(); i++)
+    {
+        delete fcgi_handlers[i];
+        delete gateways[i];
+    }
 
     return 0;
 }
\ No newline at end of file
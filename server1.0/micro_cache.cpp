@@ -0,0 +1,377 @@
+#include "micro_cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+static const int METHOD_GET = 0;            //http_conn::GET
+
+shared_response::shared_response(int code, const char* title, const std::vector<field>& headers,
+                                 const char* content_type, const char* body, int len)
+    : m_refs(1), m_code(code), m_title(title), m_headers(headers), m_content_type(content_type), m_body(body, len) {
+
+    //与http1_sink逐字节相同，只有Connection头部不同
+    char line[256];
+    snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", code, title);
+    std::string head = line;
+    for(size_t i = 0; i < headers.size(); i++)
+    {
+        head += headers[i].name + ": " + headers[i].value + "\r\n";
+    }
+    head += std::string("Content-Type: ") + content_type + "\r\n";
+    snprintf(line, sizeof(line), "Content-Length: %d\r\n", len);
+    head += line;
+    m_head_keep = head + "Conection: keep-alive\r\n\r\n";
+    m_head_close = head + "Conection: close\r\n\r\n";
+}
+
+// 计算应答时代替真正的sink：记下状态、头部和应答体，应答完整时做成shared_response
+class recording_sink : public response_sink{
+
+public:
+    recording_sink() : m_code(200), m_title("OK"), m_content_type(NULL), m_body(NULL), m_len(0),
+                       m_done(false), m_producer(NULL), m_private(false) {}
+
+    bool status(int code, const char* title)
+    {
+        m_code = code;
+        m_title = title;
+        return true;
+    }
+
+    bool header(const char* name, const char* value)
+    {
+        shared_response::field f;
+        f.name = name;
+        f.value = value;
+        m_headers.push_back(f);
+        //处理器明确不让缓存的应答
+        if((strcasecmp(name, "Cache-Control") == 0 && (strstr(value, "no-store") || strstr(value, "private")))
+            || strcasecmp(name, "Set-Cookie") == 0)
+        {
+            m_private = true;
+        }
+        return true;
+    }
+
+    //data在handle返回之前一直有效
+    bool body(const char* content_type, const char* data, int len)
+    {
+        m_content_type = content_type;
+        m_body = data;
+        m_len = len;
+        m_done = true;
+        return true;
+    }
+
+    bool stream(const char* content_type, body_producer* producer)
+    {
+        m_content_type = content_type;
+        m_producer = producer;
+        return true;
+    }
+
+    //只缓存完整的、公开的成功应答和永久性的结果
+    bool cacheable() const
+    {
+        return m_done && !m_private && (m_code == 200 || m_code == 301 || m_code == 404 || m_code == 410);
+    }
+
+    shared_response* build() const
+    {
+        return new shared_response(m_code, m_title, m_headers, m_content_type, m_body, m_len);
+    }
+
+    //流式应答（或者没有写完的应答）原样交给真正的sink
+    bool replay(http_response& resp)
+    {
+        if(!resp.status(m_code, m_title))
+        {
+            return false;
+        }
+        for(size_t i = 0; i < m_headers.size(); i++)
+        {
+            if(!resp.header(m_headers[i].name.c_str(), m_headers[i].value.c_str()))
+            {
+                return false;
+            }
+        }
+        if(m_producer)
+        {
+            body_producer* producer = m_producer;
+            m_producer = NULL;
+            return resp.stream(m_content_type, producer);
+        }
+        return true;
+    }
+
+    bool done() const { return m_done; }
+    body_producer* producer() const { return m_producer; }
+
+    ~recording_sink()
+    {
+        delete m_producer;
+    }
+
+private:
+    int m_code;
+    const char* m_title;
+    std::vector<shared_response::field> m_headers;
+    const char* m_content_type;
+    const char* m_body;
+    int m_len;
+    bool m_done;
+    body_producer* m_producer;
+    bool m_private;
+};
+
+micro_cache::micro_cache()
+    : m_hits(0), m_stale_hits(0), m_coalesced(0), m_misses(0), m_entries(0) {
+
+}
+
+uint64_t micro_cache::now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+micro_cache::shard& micro_cache::shard_of(const std::string& key)
+{
+    return m_shards[std::hash<std::string>()(key) % SHARDS];
+}
+
+micro_cache::ROLE micro_cache::lookup(const std::string& key, shared_response** resp)
+{
+    shard& s = shard_of(key);
+    s.lock.lock();
+    uint64_t now = now_ms();
+    uint64_t deadline = now + WAIT_MS;
+    bool waited = false;
+    while(true)
+    {
+        std::unordered_map<std::string, entry>::iterator it = s.entries.find(key);
+        if(it == s.entries.end())
+        {
+            //缓存满了：先清掉这个分片里彻底过期的项，还是没有空间就不缓存这个键
+            if(m_entries.load(std::memory_order_relaxed) >= (uint64_t)MAX_ENTRIES)
+            {
+                for(it = s.entries.begin(); it != s.entries.end(); )
+                {
+                    if(!it->second.filling && it->second.stale_until <= now)
+                    {
+                        if(it->second.resp)
+                        {
+                            it->second.resp->unref();
+                        }
+                        it = s.entries.erase(it);
+                        m_entries.fetch_sub(1, std::memory_order_relaxed);
+                    }
+                    else
+                    {
+                        ++it;
+                    }
+                }
+                if(m_entries.load(std::memory_order_relaxed) >= (uint64_t)MAX_ENTRIES)
+                {
+                    s.lock.unlock();
+                    m_misses.fetch_add(1, std::memory_order_relaxed);
+                    return BYPASS;
+                }
+            }
+            entry e;
+            e.resp = NULL;
+            e.fresh_until = e.stale_until = 0;
+            e.filling = true;
+            s.entries.insert(std::make_pair(key, e));
+            m_entries.fetch_add(1, std::memory_order_relaxed);
+            s.lock.unlock();
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            return FILL;
+        }
+
+        entry& e = it->second;
+        if(e.resp && now < e.fresh_until)
+        {
+            e.resp->ref();
+            *resp = e.resp;
+            s.lock.unlock();
+            (waited ? m_coalesced : m_hits).fetch_add(1, std::memory_order_relaxed);
+            return HIT;
+        }
+        if(!e.filling)
+        {
+            //过期了（或者上一次计算被放弃）：这个请求负责重新计算
+            e.filling = true;
+            s.lock.unlock();
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            return FILL;
+        }
+        if(e.resp && now < e.stale_until)
+        {
+            //已经有人在重新计算，旧的应答还在允许的范围内
+            e.resp->ref();
+            *resp = e.resp;
+            s.lock.unlock();
+            m_stale_hits.fetch_add(1, std::memory_order_relaxed);
+            return HIT;
+        }
+
+        //没有可用的应答，等正在计算的请求
+        if(now >= deadline)
+        {
+            s.lock.unlock();
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            return BYPASS;
+        }
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        uint64_t wait = deadline - now;
+        t.tv_sec += wait / 1000;
+        t.tv_nsec += (wait % 1000) * 1000000L;
+        if(t.tv_nsec >= 1000000000L)
+        {
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000L;
+        }
+        s.filled.timedwait(s.lock.get(), t);
+        waited = true;
+        now = now_ms();
+    }
+}
+
+void micro_cache::fill(const std::string& key, shared_response* resp, int ttl_ms, int stale_ms)
+{
+    shard& s = shard_of(key);
+    s.lock.lock();
+    std::unordered_map<std::string, entry>::iterator it = s.entries.find(key);
+    if(it != s.entries.end())
+    {
+        entry& e = it->second;
+        if(e.resp)
+        {
+            e.resp->unref();
+        }
+        resp->ref();
+        e.resp = resp;
+        uint64_t now = now_ms();
+        e.fresh_until = now + ttl_ms;
+        e.stale_until = e.fresh_until + stale_ms;
+        e.filling = false;
+    }
+    s.filled.broadcast();
+    s.lock.unlock();
+}
+
+void micro_cache::abandon(const std::string& key)
+{
+    shard& s = shard_of(key);
+    s.lock.lock();
+    std::unordered_map<std::string, entry>::iterator it = s.entries.find(key);
+    if(it != s.entries.end())
+    {
+        it->second.filling = false;
+        if(!it->second.resp)
+        {
+            s.entries.erase(it);
+            m_entries.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    s.filled.broadcast();
+    s.lock.unlock();
+}
+
+request_handler* micro_cache::wrap(request_handler* inner, int ttl_ms, int stale_ms)
+{
+    request_handler* handler = new cached_handler(this, inner, ttl_ms, stale_ms);
+    m_wrappers.push_back(handler);
+    return handler;
+}
+
+micro_cache::~micro_cache()
+{
+    for(size_t i = 0; i < m_wrappers.size(); i++)
+    {
+        delete m_wrappers[i];
+    }
+    for(int i = 0; i < SHARDS; i++)
+    {
+        std::unordered_map<std::string, entry>::iterator it;
+        for(it = m_shards[i].entries.begin(); it != m_shards[i].entries.end(); ++it)
+        {
+            if(it->second.resp)
+            {
+                it->second.resp->unref();
+            }
+        }
+    }
+}
+
+int micro_cache::report(char* buf, int len) const
+{
+    return snprintf(buf, len, "hits %llu\nstale_hits %llu\ncoalesced %llu\nmisses %llu\nentries %llu\n",
+                    (unsigned long long)m_hits.load(std::memory_order_relaxed),
+                    (unsigned long long)m_stale_hits.load(std::memory_order_relaxed),
+                    (unsigned long long)m_coalesced.load(std::memory_order_relaxed),
+                    (unsigned long long)m_misses.load(std::memory_order_relaxed),
+                    (unsigned long long)m_entries.load(std::memory_order_relaxed));
+}
+
+bool cached_handler::handle(http_request& req, http_response& resp)
+{
+    if(req.method != METHOD_GET)
+    {
+        return m_inner->handle(req, resp);
+    }
+
+    std::string key;
+    if(req.host)
+    {
+        key = req.host;
+    }
+    key += ' ';
+    key.append(req.path, req.path_len);
+    if(req.query)
+    {
+        key += '?';
+        key += req.query;
+    }
+
+    shared_response* cached = NULL;
+    micro_cache::ROLE role = m_cache->lookup(key, &cached);
+    if(role == micro_cache::HIT)
+    {
+        bool ok = resp.shared(cached);
+        cached->unref();
+        return ok;
+    }
+
+    recording_sink rec;
+    http_response inner_resp(&rec);
+    bool ok = m_inner->handle(req, inner_resp);
+    if(!ok || !rec.done())
+    {
+        if(role == micro_cache::FILL)
+        {
+            m_cache->abandon(key);
+        }
+        return ok && rec.replay(resp);
+    }
+
+    shared_response* r = rec.build();
+    if(role == micro_cache::FILL)
+    {
+        if(rec.cacheable())
+        {
+            m_cache->fill(key, r, m_ttl_ms, m_stale_ms);
+        }
+        else
+        {
+            m_cache->abandon(key);
+        }
+    }
+    ok = resp.shared(r);
+    r->unref();
+    return ok;
+}
@@ -0,0 +1,139 @@
+#ifndef MICRO_CACHE_H__
+#define MICRO_CACHE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "locker.h"
+#include "router.h"
+
+// 处理器应答的微缓存（-M ttl_ms[:stale_ms]）
+// 以 Host + 路径 + 查询串 为键缓存GET请求的应答，TTL可以短到一秒：热点URL的突发请求只计算一次。
+//      新鲜期内直接命中；
+//      过期后的stale_ms内（stale-while-revalidate）第一个请求负责重新计算，同时到达的请求继续拿旧的应答；
+//      没有可用的应答时第一个请求计算，同时到达的相同请求等它的结果（合并回源），不重复计算。
+// 缓存的应答是不可变的、带引用计数的头部+应答体缓冲区，HTTP/1.1连接用writev直接发送，不拷贝到连接的写缓冲区。
+
+// 一个缓存的应答：创建后不再修改，最后一个引用释放时删除
+class shared_response{
+
+public:
+    struct field{
+        std::string name;
+        std::string value;
+    };
+
+    shared_response(int code, const char* title, const std::vector<field>& headers,
+                    const char* content_type, const char* body, int len);
+
+    void ref() { m_refs.fetch_add(1, std::memory_order_relaxed); }
+    void unref()
+    {
+        if(m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete this;
+        }
+    }
+
+    //HTTP/1.1的状态行和头部（含Connection和空行），按连接是否keep-alive选择
+    const std::string& head(bool keep_alive) const { return keep_alive ? m_head_keep : m_head_close; }
+    const std::string& body() const { return m_body; }
+
+    //按status/header/body重放给其它协议的sink
+    int code() const { return m_code; }
+    const char* title() const { return m_title.c_str(); }
+    const std::vector<field>& headers() const { return m_headers; }
+    const char* content_type() const { return m_content_type.c_str(); }
+
+private:
+    ~shared_response() {}
+
+private:
+    std::atomic<int> m_refs;
+    int m_code;
+    std::string m_title;
+    std::vector<field> m_headers;
+    std::string m_content_type;
+    std::string m_head_keep;
+    std::string m_head_close;
+    std::string m_body;
+};
+
+class micro_cache{
+
+public:
+    static const int SHARDS = 16;
+    static const int MAX_ENTRIES = 4096;        //所有分片合计，满了以后新的键不再缓存
+    static const int WAIT_MS = 1000;            //等待别人计算的最长时间，超时后自己计算
+
+    //lookup的结果
+    enum ROLE{
+        HIT,        //返回了可以直接发送的应答（已经加了引用）
+        FILL,       //调用者计算应答，之后必须调用fill或abandon
+        BYPASS      //调用者计算应答，不写入缓存（缓存已满或者等待超时）
+    };
+
+    micro_cache();
+    ~micro_cache();
+
+    ROLE lookup(const std::string& key, shared_response** resp);
+    void fill(const std::string& key, shared_response* resp, int ttl_ms, int stale_ms);
+    void abandon(const std::string& key);
+
+    //包装一个处理器，它的GET应答按ttl_ms/stale_ms缓存；返回的处理器由缓存持有
+    request_handler* wrap(request_handler* inner, int ttl_ms, int stale_ms);
+
+    int report(char* buf, int len) const;
+
+private:
+    struct entry{
+        shared_response* resp;      //最近一次的应答，NULL表示还没有
+        uint64_t fresh_until;       //毫秒
+        uint64_t stale_until;
+        bool filling;               //有请求正在计算
+    };
+
+    struct alignas(64) shard{
+        locker lock;
+        cond filled;                //计算完成（或放弃）时广播
+        std::unordered_map<std::string, entry> entries;
+    };
+
+    shard& shard_of(const std::string& key);
+    static uint64_t now_ms();
+
+private:
+    shard m_shards[SHARDS];
+    std::vector<request_handler*> m_wrappers;
+
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_stale_hits;
+    std::atomic<uint64_t> m_coalesced;      //等到了别人计算的结果
+    std::atomic<uint64_t> m_misses;         //自己计算（FILL和BYPASS）
+    std::atomic<uint64_t> m_entries;
+};
+
+// 缓存包装的处理器：GET请求先查缓存，其余方法和请求体原样交给内部的处理器
+class cached_handler : public request_handler{
+
+public:
+    cached_handler(micro_cache* cache, request_handler* inner, int ttl_ms, int stale_ms)
+        : m_cache(cache), m_inner(inner), m_ttl_ms(ttl_ms), m_stale_ms(stale_ms) {}
+
+    bool on_headers(http_request& req) { return m_inner->on_headers(req); }
+    bool on_body(http_request& req, const char* data, int len) { return m_inner->on_body(req, data, len); }
+    void on_abort(http_request& req) { m_inner->on_abort(req); }
+    ws_endpoint* websocket() { return m_inner->websocket(); }
+
+    bool handle(http_request& req, http_response& resp);
+
+private:
+    micro_cache* m_cache;
+    request_handler* m_inner;
+    int m_ttl_ms;
+    int m_stale_ms;
+};
+
+#endif
@@ -0,0 +1,413 @@
+#include "placement.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+//不依赖libnuma，直接用系统调用
+#define PLACEMENT_MPOL_PREFERRED 1
+
+placement::placement():
+    m_nodes(1), m_pools(NULL),
+    m_local_conns(0), m_remote_conns(0), m_unknown_conns(0), m_local_tasks(0), m_stolen_tasks(0),
+    m_local_pages(0), m_remote_pages(0) {
+
+}
+
+placement::~placement()
+{
+    for(int i = 0; m_pools && i < queues(); i++)
+    {
+        for(size_t j = 0; j < m_pools[i].chunks.size(); j++)
+        {
+            munmap(m_pools[i].chunks[j], (size_t)CHUNK_BUFFERS * BUFFER_SIZE);
+        }
+    }
+    delete[] m_pools;
+}
+
+//"0-3,8,10-11"
+bool placement::parse_cpulist(const char* list, std::vector<int>& cpus)
+{
+    cpus.clear();
+    const char* p = list;
+    while(*p && *p != '\n')
+    {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if(end == p || first < 0 || first >= MAX_CPUS)
+        {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if(*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if(end == p + 1 || last < first || last >= MAX_CPUS)
+            {
+                return false;
+            }
+            p = end;
+        }
+        for(long cpu = first; cpu <= last; cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+        if(*p == ',')
+        {
+            p++;
+        }
+        else if(*p && *p != '\n')
+        {
+            return false;
+        }
+    }
+    return !cpus.empty();
+}
+
+static bool read_line(const char* path, char* buf, int len)
+{
+    FILE* fp = fopen(path, "r");
+    if(!fp)
+    {
+        return false;
+    }
+    bool ok = fgets(buf, len, fp) != NULL;
+    fclose(fp);
+    return ok;
+}
+
+//在线的CPU和每个节点的CPU；没有NUMA信息时所有CPU都在节点0
+bool placement::discover()
+{
+    char buf[4096];
+    std::vector<int> online;
+    if(!read_line("/sys/devices/system/cpu/online", buf, sizeof(buf)) || !parse_cpulist(buf, online))
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        online.clear();
+        for(long i = 0; i < n && i < MAX_CPUS; i++)
+        {
+            online.push_back(i);
+        }
+    }
+    if(online.empty())
+    {
+        return false;
+    }
+
+    m_cpu_node.assign(online.back() + 1, -1);
+    for(size_t i = 0; i < online.size(); i++)
+    {
+        m_cpu_node[online[i]] = 0;
+    }
+
+    m_nodes = 1;
+    for(int node = 0; node < MAX_NODES; node++)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        std::vector<int> cpus;
+        if(!read_line(path, buf, sizeof(buf)) || !parse_cpulist(buf, cpus))
+        {
+            continue;
+        }
+        for(size_t i = 0; i < cpus.size(); i++)
+        {
+            if(cpus[i] < (int)m_cpu_node.size() && m_cpu_node[cpus[i]] >= 0)
+            {
+                m_cpu_node[cpus[i]] = node;
+            }
+        }
+        if(node + 1 > m_nodes)
+        {
+            m_nodes = node + 1;
+        }
+    }
+    return true;
+}
+
+bool placement::init(const char* reactor_cpus, const char* worker_cpus)
+{
+    if(!discover())
+    {
+        return false;
+    }
+
+    std::vector<int> online;
+    for(size_t cpu = 0; cpu < m_cpu_node.size(); cpu++)
+    {
+        if(m_cpu_node[cpu] >= 0)
+        {
+            online.push_back(cpu);
+        }
+    }
+
+    m_reactor_cpus = online;
+    m_worker_cpus = online;
+    if((reactor_cpus && !parse_cpulist(reactor_cpus, m_reactor_cpus))
+        || (worker_cpus && !parse_cpulist(worker_cpus, m_worker_cpus)))
+    {
+        return false;
+    }
+    for(size_t i = 0; i < m_reactor_cpus.size(); i++)
+    {
+        if(node_of_cpu(m_reactor_cpus[i]) < 0)
+        {
+            return false;
+        }
+    }
+    for(size_t i = 0; i < m_worker_cpus.size(); i++)
+    {
+        if(node_of_cpu(m_worker_cpus[i]) < 0)
+        {
+            return false;
+        }
+    }
+
+    //有工作线程的节点各一个队列，按节点编号排列
+    m_node_queue.assign(m_nodes, -1);
+    for(int node = 0; node < m_nodes; node++)
+    {
+        for(size_t i = 0; i < m_worker_cpus.size(); i++)
+        {
+            if(node_of_cpu(m_worker_cpus[i]) == node)
+            {
+                m_node_queue[node] = m_queue_nodes.size();
+                m_queue_nodes.push_back(node);
+                break;
+            }
+        }
+    }
+    m_pools = new pool[m_queue_nodes.size()];
+    return true;
+}
+
+int placement::node_of_cpu(int cpu) const
+{
+    return (cpu >= 0 && cpu < (int)m_cpu_node.size()) ? m_cpu_node[cpu] : -1;
+}
+
+int placement::queue_of_node(int node) const
+{
+    return (node >= 0 && node < m_nodes && m_node_queue[node] >= 0) ? m_node_queue[node] : 0;
+}
+
+static bool pin_to(const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(size_t i = 0; i < cpus.size(); i++)
+    {
+        CPU_SET(cpus[i], &set);
+    }
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(ret != 0)
+    {
+        printf("pthread_setaffinity_np failure: %s\n", strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+bool placement::pin_reactor()
+{
+    return pin_to(m_reactor_cpus);
+}
+
+bool placement::pin_worker(int i)
+{
+    return pin_to(std::vector<int>(1, m_worker_cpus[i]));
+}
+
+int placement::worker_queue(int i) const
+{
+    return queue_of_node(node_of_cpu(m_worker_cpus[i]));
+}
+
+int placement::incoming_queue(int sockfd)
+{
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if(getsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || node_of_cpu(cpu) < 0)
+    {
+        m_unknown_conns.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+    int node = node_of_cpu(cpu);
+    if(m_node_queue[node] < 0)
+    {
+        m_remote_conns.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+    m_local_conns.fetch_add(1, std::memory_order_relaxed);
+    return m_node_queue[node];
+}
+
+//reuseport组中的socket按加入（listen）的顺序编号，BPF程序返回的就是这个编号：
+//    A = 收包的CPU; 逐个比较，命中时返回该CPU所在节点的队列; 都不命中返回0
+std::vector<int> placement::open_steered_listeners(int port, int backlog)
+{
+    std::vector<int> fds;
+    for(int q = 0; q < queues(); q++)
+    {
+        int fd = socket(PF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        {
+            close(fd);
+            break;
+        }
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = INADDR_ANY;
+        if(bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, backlog) < 0)
+        {
+            close(fd);
+            break;
+        }
+        fds.push_back(fd);
+    }
+
+    std::vector<struct sock_filter> code;
+    struct sock_filter load = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+    code.push_back(load);
+    for(size_t cpu = 0; cpu < m_cpu_node.size(); cpu++)
+    {
+        if(m_cpu_node[cpu] < 0)
+        {
+            continue;
+        }
+        struct sock_filter test = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpu, 0, 1);
+        struct sock_filter ret = BPF_STMT(BPF_RET | BPF_K, (uint32_t)queue_of_node(m_cpu_node[cpu]));
+        code.push_back(test);
+        code.push_back(ret);
+    }
+    struct sock_filter fallback = BPF_STMT(BPF_RET | BPF_K, 0);
+    code.push_back(fallback);
+
+    struct sock_fprog prog;
+    prog.len = code.size();
+    prog.filter = &code[0];
+    if((int)fds.size() != queues()
+        || setsockopt(fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+    {
+        printf("reuseport steering unavailable: %s\n", strerror(errno));
+        for(size_t i = 0; i < fds.size(); i++)
+        {
+            close(fds[i]);
+        }
+        fds.clear();
+    }
+    return fds;
+}
+
+//内存池每次申请一大块，mbind到节点后立即访问让页分配下来，再用move_pages确认页实际所在的节点
+char* placement::alloc_buffer(int queue)
+{
+    pool& p = m_pools[queue];
+    p.lock.lock();
+    if(p.free.empty())
+    {
+        size_t len = (size_t)CHUNK_BUFFERS * BUFFER_SIZE;
+        char* chunk = (char*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(chunk == MAP_FAILED)
+        {
+            p.lock.unlock();
+            return NULL;
+        }
+        int node = m_queue_nodes[queue];
+        unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        syscall(SYS_mbind, chunk, len, PLACEMENT_MPOL_PREFERRED, mask, MAX_NODES + 1, 0);
+        memset(chunk, 0, len);
+
+        int pages = len / getpagesize();
+        std::vector<void*> addrs(pages);
+        std::vector<int> status(pages, -1);
+        for(int i = 0; i < pages; i++)
+        {
+            addrs[i] = chunk + (size_t)i * getpagesize();
+        }
+        if(syscall(SYS_move_pages, 0, pages, &addrs[0], NULL, &status[0], 0) == 0)
+        {
+            int local = 0;
+            for(int i = 0; i < pages; i++)
+            {
+                local += (status[i] == node);
+            }
+            m_local_pages.fetch_add(local, std::memory_order_relaxed);
+            m_remote_pages.fetch_add(pages - local, std::memory_order_relaxed);
+        }
+
+        p.chunks.push_back(chunk);
+        for(int i = CHUNK_BUFFERS - 1; i >= 0; i--)
+        {
+            p.free.push_back(chunk + (size_t)i * BUFFER_SIZE);
+        }
+    }
+    char* buf = p.free.back();
+    p.free.pop_back();
+    p.lock.unlock();
+    return buf;
+}
+
+void placement::free_buffer(char* buf, int queue)
+{
+    pool& p = m_pools[queue];
+    p.lock.lock();
+    p.free.push_back(buf);
+    p.lock.unlock();
+}
+
+static int append_cpus(char* buf, int len, const char* name, const std::vector<int>& cpus)
+{
+    int n = snprintf(buf, len, "%s", name);
+    for(size_t i = 0; i < cpus.size() && n < len; i++)
+    {
+        n += snprintf(buf + n, len - n, "%s%d", i ? "," : " ", cpus[i]);
+    }
+    if(n < len)
+    {
+        n += snprintf(buf + n, len - n, "\n");
+    }
+    return n < len ? n : len;
+}
+
+int placement::report(char* buf, int len) const
+{
+    int n = snprintf(buf, len, "nodes %d\nqueues %d\n", m_nodes, queues());
+    n += append_cpus(buf + n, len - n, "reactor_cpus", m_reactor_cpus);
+    n += append_cpus(buf + n, len - n, "worker_cpus", m_worker_cpus);
+    n += snprintf(buf + n, len - n,
+        "conns_local %llu\nconns_remote %llu\nconns_unknown %llu\n"
+        "tasks_local %llu\ntasks_stolen %llu\npages_local %llu\npages_remote %llu\n",
+        (unsigned long long)m_local_conns.load(std::memory_order_relaxed),
+        (unsigned long long)m_remote_conns.load(std::memory_order_relaxed),
+        (unsigned long long)m_unknown_conns.load(std::memory_order_relaxed),
+        (unsigned long long)m_local_tasks.load(std::memory_order_relaxed),
+        (unsigned long long)m_stolen_tasks.load(std::memory_order_relaxed),
+        (unsigned long long)m_local_pages.load(std::memory_order_relaxed),
+        (unsigned long long)m_remote_pages.load(std::memory_order_relaxed));
+    return n < len ? n : len - 1;
+}
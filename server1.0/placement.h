@@ -0,0 +1,93 @@
+#ifndef PLACEMENT_H__
+#define PLACEMENT_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "locker.h"
+
+// CPU/NUMA感知的线程与连接放置
+// 启动时从sysfs读取拓扑（在线CPU、每个NUMA节点的CPU），主线程（reactor）和工作线程绑定到配置的CPU集合。
+// 每个有工作线程的节点一个任务队列：接受连接时用SO_INCOMING_CPU得到网卡队列把这个连接的包交给了哪个CPU，
+// 连接的任务投递到该CPU所在节点的队列；开启reuseport转发时每个节点一个监听socket，
+// 由附加在reuseport组上的BPF程序按收包CPU选择监听socket，连接在accept之前就已经分好了节点。
+// 连接的读写缓冲区从所在节点的内存池分配（mbind到该节点）。
+
+class placement{
+
+public:
+    static const int MAX_CPUS = 1024;
+    static const int MAX_NODES = 64;
+    static const int BUFFER_SIZE = 4096;        //每个连接的读写缓冲区，按页对齐
+    static const int CHUNK_BUFFERS = 256;       //内存池每次向内核申请的缓冲区个数
+
+    placement();
+    ~placement();
+
+    //reactor_cpus/worker_cpus是CPU列表（如"0-3,8"），NULL表示所有在线CPU
+    //读取拓扑失败时退化为一个节点；CPU列表不合法返回false
+    bool init(const char* reactor_cpus, const char* worker_cpus);
+
+    int nodes() const { return m_nodes; }
+    int node_of_cpu(int cpu) const;
+
+    //把调用线程绑定到reactor的CPU集合
+    bool pin_reactor();
+
+    //工作线程：个数等于worker CPU的个数，第i个绑定到第i个CPU，取它所在节点的队列
+    int workers() const { return m_worker_cpus.size(); }
+    bool pin_worker(int i);
+    int worker_queue(int i) const;
+
+    //任务队列的个数（有工作线程的节点数）和节点对应的队列；没有工作线程的节点映射到第一个队列
+    int queues() const { return m_queue_nodes.size(); }
+    int queue_of_node(int node) const;
+    int node_of_queue(int queue) const { return m_queue_nodes[queue]; }
+
+    //刚accept的连接由哪个节点处理（SO_INCOMING_CPU），统计本地/跨节点
+    int incoming_queue(int sockfd);
+
+    //reuseport转发：为每个队列创建一个监听socket（同一端口），附加BPF程序
+    //返回的socket按队列编号排列；失败返回空
+    std::vector<int> open_steered_listeners(int port, int backlog);
+
+    //连接的读写缓冲区，从queue对应节点的内存池分配
+    char* alloc_buffer(int queue);
+    void free_buffer(char* buf, int queue);
+
+    //统计，GET /placez
+    int report(char* buf, int len) const;
+
+    void count_stolen() { m_stolen_tasks.fetch_add(1, std::memory_order_relaxed); }
+    void count_local_task() { m_local_tasks.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+    bool discover();
+    static bool parse_cpulist(const char* list, std::vector<int>& cpus);
+
+private:
+    struct pool{
+        locker lock;
+        std::vector<char*> free;
+        std::vector<char*> chunks;
+    };
+
+    int m_nodes;
+    std::vector<int> m_cpu_node;        //CPU -> 节点，-1表示不在线
+    std::vector<int> m_reactor_cpus;
+    std::vector<int> m_worker_cpus;
+    std::vector<int> m_queue_nodes;     //队列 -> 节点
+    std::vector<int> m_node_queue;      //节点 -> 队列
+    pool* m_pools;                      //每个队列一个
+
+    //统计
+    std::atomic<uint64_t> m_local_conns;    //收包CPU所在节点有自己的队列
+    std::atomic<uint64_t> m_remote_conns;   //收包CPU所在节点没有工作线程，交给了别的节点
+    std::atomic<uint64_t> m_unknown_conns;  //内核没有给出收包CPU
+    std::atomic<uint64_t> m_local_tasks;    //工作线程处理本节点队列的任务
+    std::atomic<uint64_t> m_stolen_tasks;   //工作线程处理其它节点队列的任务（跨节点访问连接的内存）
+    std::atomic<uint64_t> m_local_pages;    //内存池的页实际落在目标节点
+    std::atomic<uint64_t> m_remote_pages;   //mbind没能生效，页在别的节点
+};
+
+#endif
@@ -0,0 +1,271 @@
+#include "process_master.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <new>
+#include <vector>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int>::is_always_lock_free,
+              "counters in shared memory must be lock-free");
+
+process_master::process_master()
+    : m_workers(0), m_master_pid(0), m_shm(NULL), m_last_requests(0) {
+
+}
+
+process_master::~process_master()
+{
+    if(m_shm)
+    {
+        munmap(m_shm, sizeof(segment));
+    }
+}
+
+uint64_t process_master::now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool process_master::init(int workers)
+{
+    if(workers <= 0 || workers > MAX_WORKERS)
+    {
+        return false;
+    }
+    m_workers = workers;
+    m_master_pid = getpid();
+
+    //匿名共享映射：fork出来的进程看到的是同一块物理内存，初始全0
+    void* p = mmap(NULL, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+    {
+        printf("mmap shared counters: %s\n", strerror(errno));
+        return false;
+    }
+    m_shm = new(p) segment;
+
+    //工作进程按顺序绑定到主进程允许使用的CPU上，进程比CPU多时轮流
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if(CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    for(int i = 0; i < m_workers; i++)
+    {
+        m_shm->slots[i].cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        m_started_at[i] = 0;
+        m_restart_at[i] = 0;
+    }
+    return true;
+}
+
+pid_t process_master::spawn(int i)
+{
+    worker_slot& s = m_shm->slots[i];
+    //缓冲区里还没写出的内容会被复制到子进程里再写一遍
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        printf("fork worker %d: %s\n", i, strerror(errno));
+        m_restart_at[i] = now_ms() + 1000;
+        return -1;
+    }
+    if(pid == 0)
+    {
+        sigprocmask(SIG_SETMASK, &m_old_mask, NULL);
+        //主进程没了工作进程也退出，不留下占着端口的孤儿
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if(getppid() != m_master_pid)
+        {
+            _exit(0);
+        }
+        if(s.cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(s.cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+        s.pid.store(getpid(), std::memory_order_relaxed);
+        return 0;
+    }
+
+    s.pid.store(pid, std::memory_order_relaxed);
+    s.starts.fetch_add(1, std::memory_order_relaxed);
+    m_started_at[i] = now_ms();
+    printf("worker %d started, pid %d, cpu %d\n", i, (int)pid, s.cpu);
+    fflush(stdout);
+    return pid;
+}
+
+void process_master::reap()
+{
+    int status;
+    pid_t pid;
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for(int i = 0; i < m_workers; i++)
+        {
+            worker_slot& s = m_shm->slots[i];
+            if(s.pid.load(std::memory_order_relaxed) != pid)
+            {
+                continue;
+            }
+            if(WIFSIGNALED(status))
+            {
+                printf("worker %d (pid %d) killed by signal %d, restarting\n", i, (int)pid, WTERMSIG(status));
+            }
+            else
+            {
+                printf("worker %d (pid %d) exited with status %d, restarting\n", i, (int)pid, WEXITSTATUS(status));
+            }
+            fflush(stdout);
+            //连接随进程一起没了
+            s.closed.store(s.accepted.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            s.pid.store(0, std::memory_order_relaxed);
+            //刚启动就退出的多半还会再退出，等一秒，避免fork风暴
+            uint64_t now = now_ms();
+            m_restart_at[i] = (now - m_started_at[i] < 1000) ? m_started_at[i] + 1000 : now;
+        }
+    }
+}
+
+void process_master::aggregate()
+{
+    uint64_t requests = 0, accepted = 0, active = 0, restarts = 0;
+    int running = 0;
+    for(int i = 0; i < m_workers; i++)
+    {
+        const worker_slot& s = m_shm->slots[i];
+        uint64_t a = s.accepted.load(std::memory_order_relaxed);
+        uint64_t c = s.closed.load(std::memory_order_relaxed);
+        uint64_t starts = s.starts.load(std::memory_order_relaxed);
+        requests += s.requests.load(std::memory_order_relaxed);
+        accepted += a;
+        active += (a > c) ? a - c : 0;
+        restarts += (starts > 1) ? starts - 1 : 0;
+        running += (s.pid.load(std::memory_order_relaxed) != 0);
+    }
+    totals& t = m_shm->sum;
+    t.requests.store(requests, std::memory_order_relaxed);
+    t.requests_per_sec.store(requests - m_last_requests, std::memory_order_relaxed);
+    t.accepted.store(accepted, std::memory_order_relaxed);
+    t.active.store(active, std::memory_order_relaxed);
+    t.restarts.store(restarts, std::memory_order_relaxed);
+    t.running.store(running, std::memory_order_relaxed);
+    m_last_requests = requests;
+}
+
+void process_master::stop()
+{
+    for(int i = 0; i < m_workers; i++)
+    {
+        pid_t pid = m_shm->slots[i].pid.load(std::memory_order_relaxed);
+        if(pid > 0)
+        {
+            kill(pid, SIGTERM);
+        }
+    }
+    while(waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+    {
+    }
+}
+
+int process_master::run()
+{
+    //SIGCHLD和退出信号在主循环里用sigtimedwait同步处理；工作进程fork之后恢复原来的信号屏蔽
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigprocmask(SIG_BLOCK, &set, &m_old_mask);
+
+    for(int i = 0; i < m_workers; i++)
+    {
+        if(spawn(i) == 0)
+        {
+            return i;
+        }
+    }
+
+    uint64_t next_tick = now_ms() + 1000;
+    while(true)
+    {
+        uint64_t now = now_ms();
+        uint64_t wait = (next_tick > now) ? next_tick - now : 0;
+        struct timespec timeout;
+        timeout.tv_sec = wait / 1000;
+        timeout.tv_nsec = (wait % 1000) * 1000000L;
+        int sig = sigtimedwait(&set, NULL, &timeout);
+        if(sig == SIGTERM || sig == SIGINT)
+        {
+            break;
+        }
+        if(sig == SIGCHLD)
+        {
+            reap();
+        }
+
+        now = now_ms();
+        for(int i = 0; i < m_workers; i++)
+        {
+            if(m_shm->slots[i].pid.load(std::memory_order_relaxed) == 0 && now >= m_restart_at[i])
+            {
+                if(spawn(i) == 0)
+                {
+                    return i;
+                }
+            }
+        }
+        if(now >= next_tick)
+        {
+            aggregate();
+            next_tick = now + 1000;
+        }
+    }
+
+    printf("master: stopping %d workers\n", m_workers);
+    stop();
+    sigprocmask(SIG_SETMASK, &m_old_mask, NULL);
+    return -1;
+}
+
+int process_master::report(char* buf, int len) const
+{
+    const totals& t = m_shm->sum;
+    int n = snprintf(buf, len, "workers %d\nrunning %d\nrequests %llu\nrequests_per_sec %llu\naccepted %llu\nactive %llu\nrestarts %llu\n",
+                     m_workers, t.running.load(std::memory_order_relaxed),
+                     (unsigned long long)t.requests.load(std::memory_order_relaxed),
+                     (unsigned long long)t.requests_per_sec.load(std::memory_order_relaxed),
+                     (unsigned long long)t.accepted.load(std::memory_order_relaxed),
+                     (unsigned long long)t.active.load(std::memory_order_relaxed),
+                     (unsigned long long)t.restarts.load(std::memory_order_relaxed));
+    for(int i = 0; i < m_workers && n < len; i++)
+    {
+        const worker_slot& s = m_shm->slots[i];
+        n += snprintf(buf + n, len - n, "worker %d pid %d cpu %d starts %llu accepted %llu closed %llu requests %llu\n",
+                      i, s.pid.load(std::memory_order_relaxed), s.cpu,
+                      (unsigned long long)s.starts.load(std::memory_order_relaxed),
+                      (unsigned long long)s.accepted.load(std::memory_order_relaxed),
+                      (unsigned long long)s.closed.load(std::memory_order_relaxed),
+                      (unsigned long long)s.requests.load(std::memory_order_relaxed));
+    }
+    return (n < len) ? n : len - 1;
+}
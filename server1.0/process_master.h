@@ -0,0 +1,82 @@
+#ifndef PROCESS_MASTER_H__
+#define PROCESS_MASTER_H__
+
+#include <stdint.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <atomic>
+
+// 多进程模式（-P n）：主进程创建好监听socket之后fork出n个工作进程，第i个绑定到第i个可用CPU。
+// 每个工作进程有自己的epoll循环、线程池（或协程reactor）、内存分配器和锁，一个进程崩溃只丢掉它自己的连接；
+// 监听socket由所有工作进程共享，用EPOLLEXCLUSIVE避免一个连接唤醒所有进程。
+// 主进程不处理连接：工作进程退出后重新fork（启动不到一秒就退出的等一秒再fork），每秒汇总一次计数器。
+// 计数器放在fork之前MAP_SHARED映射的匿名内存里：每个工作进程只写自己的槽，主进程写汇总，GET /procz 查看。
+
+// 一个工作进程的计数器，独占缓存行；进程内的多个线程都会写，所以用原子操作
+struct alignas(64) worker_slot{
+    std::atomic<int> pid;               //0表示没有在运行
+    int cpu;                            //绑定的CPU，-1表示没有绑定
+    std::atomic<uint64_t> starts;       //fork的次数，大于1说明重启过
+    std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> closed;
+    std::atomic<uint64_t> requests;
+
+    void count_accept() { accepted.fetch_add(1, std::memory_order_relaxed); }
+    void count_close() { closed.fetch_add(1, std::memory_order_relaxed); }
+    void count_request() { requests.fetch_add(1, std::memory_order_relaxed); }
+};
+
+class process_master{
+
+public:
+    static const int MAX_WORKERS = 64;
+
+    process_master();
+    ~process_master();
+
+    //映射共享内存、读取可用的CPU；workers超出范围返回false
+    bool init(int workers);
+
+    //fork工作进程并监管它们：在工作进程里返回它的编号；
+    //主进程收到SIGTERM/SIGINT后结束所有工作进程，返回-1
+    int run();
+
+    worker_slot* slot(int i) { return &m_shm->slots[i]; }
+
+    //各工作进程的计数器和主进程的汇总，GET /procz
+    int report(char* buf, int len) const;
+
+private:
+    //主进程每秒写一次
+    struct alignas(64) totals{
+        std::atomic<uint64_t> requests;
+        std::atomic<uint64_t> requests_per_sec;
+        std::atomic<uint64_t> accepted;
+        std::atomic<uint64_t> active;
+        std::atomic<uint64_t> restarts;
+        std::atomic<int> running;
+    };
+
+    struct segment{
+        totals sum;
+        worker_slot slots[MAX_WORKERS];
+    };
+
+    //返回0表示在新的工作进程里，否则是在主进程里（fork失败时下一秒再试）
+    pid_t spawn(int i);
+    void reap();
+    void aggregate();
+    void stop();
+    static uint64_t now_ms();
+
+private:
+    int m_workers;
+    pid_t m_master_pid;
+    segment* m_shm;
+    uint64_t m_started_at[MAX_WORKERS];     //只在主进程里用
+    uint64_t m_restart_at[MAX_WORKERS];
+    uint64_t m_last_requests;
+    sigset_t m_old_mask;
+};
+
+#endif
@@ -0,0 +1,410 @@
+#include "profiler.h"
+#include "locker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/syscall.h>
+#include <cxxabi.h>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+enum {SLOT_FREE = 0, SLOT_USED};
+
+int profiler::m_seconds = 0;
+int profiler::m_hz = 99;
+char profiler::m_path[256];
+
+profiler::thread_slot profiler::m_slots[MAX_THREADS];
+std::atomic<bool> profiler::m_running(false);
+std::atomic<bool> profiler::m_sampling(false);
+std::atomic<int> profiler::m_in_handler(0);
+profiler::sample* profiler::m_samples = NULL;
+int profiler::m_capacity = 0;
+std::atomic<int> profiler::m_next(0);
+std::atomic<uint64_t> profiler::m_dropped(0);
+
+static __thread int t_slot = -1;
+
+//最近一次的结果，只在会话线程写、处理器读
+static locker s_result_lock;
+static std::string s_result;
+static char s_summary[512] = "no profile yet\n";
+
+bool profiler::init(const char* spec)
+{
+    char path[256] = "";
+    int n = sscanf(spec, "%d:%d:%255s", &m_seconds, &m_hz, path);
+    if(n < 1 || m_seconds <= 0 || m_seconds > MAX_SECONDS || (n >= 2 && (m_hz <= 0 || m_hz > MAX_HZ)))
+    {
+        m_seconds = 0;
+        return false;
+    }
+    if(n < 2)
+    {
+        m_hz = 99;
+    }
+    if(path[0])
+    {
+        snprintf(m_path, sizeof(m_path), "%s", path);
+    }
+    else
+    {
+        snprintf(m_path, sizeof(m_path), "/tmp/profile-%d.folded", (int)getpid());
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_sample;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(SIGPROF, &sa, NULL) == 0;
+}
+
+void profiler::register_thread(const char* role)
+{
+    if(!enabled() || t_slot >= 0)
+    {
+        return;
+    }
+    for(int i = 0; i < MAX_THREADS; i++)
+    {
+        int expected = SLOT_FREE;
+        thread_slot& slot = m_slots[i];
+        if(slot.state.load(std::memory_order_relaxed) != SLOT_FREE
+            || !slot.state.compare_exchange_strong(expected, SLOT_USED))
+        {
+            continue;
+        }
+        slot.role = role;
+        slot.tid = syscall(SYS_gettid);
+        slot.stack_lo = slot.stack_hi = 0;
+        pthread_attr_t attr;
+        if(pthread_getattr_np(pthread_self(), &attr) == 0)
+        {
+            void* addr;
+            size_t size;
+            if(pthread_attr_getstack(&attr, &addr, &size) == 0)
+            {
+                slot.stack_lo = (uintptr_t)addr;
+                slot.stack_hi = (uintptr_t)addr + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+        if(pthread_getcpuclockid(pthread_self(), &slot.clock) != 0)
+        {
+            slot.state.store(SLOT_FREE);
+            return;
+        }
+        t_slot = i;
+        return;
+    }
+}
+
+void profiler::unregister_thread()
+{
+    if(t_slot >= 0)
+    {
+        m_slots[t_slot].state.store(SLOT_FREE);
+        t_slot = -1;
+    }
+}
+
+bool profiler::start(int seconds, int hz)
+{
+    bool expected = false;
+    if(!enabled() || !m_running.compare_exchange_strong(expected, true))
+    {
+        return false;
+    }
+    seconds = (seconds > 0 && seconds <= MAX_SECONDS) ? seconds : m_seconds;
+    hz = (hz > 0 && hz <= MAX_HZ) ? hz : m_hz;
+
+    //缓冲区在采样开始前一次分配好：每个线程每秒最多hz个样本
+    int threads = 0;
+    for(int i = 0; i < MAX_THREADS; i++)
+    {
+        threads += m_slots[i].state.load() == SLOT_USED;
+    }
+    long long want = (long long)seconds * hz * (threads > 0 ? threads : 1);
+    m_capacity = want < MAX_SAMPLES ? (int)want : MAX_SAMPLES;
+    m_samples = new sample[m_capacity];
+    for(int i = 0; i < m_capacity; i++)
+    {
+        m_samples[i].ready.store(0, std::memory_order_relaxed);
+    }
+    m_next = 0;
+    m_dropped = 0;
+
+    int* arg = new int[2];
+    arg[0] = seconds;
+    arg[1] = hz;
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, session, arg) != 0)
+    {
+        delete[] arg;
+        delete[] m_samples;
+        m_samples = NULL;
+        m_running = false;
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+void* profiler::session(void* p)
+{
+    int seconds = ((int*)p)[0];
+    int hz = ((int*)p)[1];
+    delete[] (int*)p;
+
+    //每个线程一个按它自己的CPU时间计时、到期时只向它发信号的定时器
+    timer_t timers[MAX_THREADS];
+    int count = 0;
+    m_sampling = true;
+    for(int i = 0; i < MAX_THREADS; i++)
+    {
+        thread_slot& slot = m_slots[i];
+        if(slot.state.load() != SLOT_USED)
+        {
+            continue;
+        }
+        struct sigevent ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.sigev_notify = SIGEV_THREAD_ID;
+        ev.sigev_signo = SIGPROF;
+        ev._sigev_un._tid = slot.tid;
+        if(timer_create(slot.clock, &ev, &timers[count]) != 0)
+        {
+            continue;
+        }
+        struct itimerspec its;
+        its.it_interval.tv_sec = 0;
+        its.it_interval.tv_nsec = 1000000000L / hz;
+        its.it_value = its.it_interval;
+        timer_settime(timers[count], 0, &its, NULL);
+        count++;
+    }
+
+    struct timespec t = {seconds, 0};
+    while(nanosleep(&t, &t) != 0 && errno == EINTR)
+    {
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        timer_delete(timers[i]);
+    }
+    //已经进入处理函数的样本写完之后才能读缓冲区，晚到的信号看到m_sampling为false直接返回
+    m_sampling = false;
+    while(m_in_handler.load() > 0)
+    {
+        sched_yield();
+    }
+
+    int taken = m_next.load();
+    int samples = taken < m_capacity ? taken : m_capacity;
+    std::string folded = fold(samples);
+    delete[] m_samples;
+    m_samples = NULL;
+
+    bool written = false;
+    FILE* fp = fopen(m_path, "w");
+    if(fp)
+    {
+        written = fwrite(folded.data(), 1, folded.size(), fp) == folded.size();
+        written = (fclose(fp) == 0) && written;
+    }
+
+    s_result_lock.lock();
+    s_result.swap(folded);
+    snprintf(s_summary, sizeof(s_summary), "last profile: %d s at %d Hz, %d threads, %d samples, %llu dropped, %s %s\n",
+             seconds, hz, count, samples, (unsigned long long)m_dropped.load(), written ? "written to" : "could not write", m_path);
+    s_result_lock.unlock();
+    printf("%s", s_summary);
+
+    m_running = false;
+    return NULL;
+}
+
+//只用原子操作和栈上的变量，可以在任何时刻打断任何代码
+//回溯读的是别的函数的栈帧，其中有ASan的红区，不让它检查这个函数
+__attribute__((no_sanitize_address))
+void profiler::on_sample(int sig, siginfo_t* info, void* context)
+{
+    int saved_errno = errno;
+    m_in_handler.fetch_add(1);
+    int self = t_slot;
+    if(self >= 0 && m_sampling.load())
+    {
+        int index = m_next.fetch_add(1, std::memory_order_relaxed);
+        if(index >= m_capacity)
+        {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            sample& s = m_samples[index];
+            const thread_slot& slot = m_slots[self];
+            ucontext_t* uc = (ucontext_t*)context;
+            uintptr_t pc = 0, fp = 0;
+#if defined(__x86_64__)
+            pc = uc->uc_mcontext.gregs[REG_RIP];
+            fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+            pc = uc->uc_mcontext.pc;
+            fp = uc->uc_mcontext.regs[29];
+#endif
+            int depth = 0;
+            s.frames[depth++] = pc;
+            //帧指针链：[fp]是上一帧的fp，[fp+8]是返回地址；必须在线程栈内并且向高地址走
+            while(depth < MAX_FRAMES && fp >= slot.stack_lo && fp + 2 * sizeof(uintptr_t) <= slot.stack_hi
+                  && (fp & (sizeof(uintptr_t) - 1)) == 0)
+            {
+                const uintptr_t* frame = (const uintptr_t*)fp;
+                uintptr_t ret = frame[1];
+                uintptr_t next = frame[0];
+                if(ret == 0)
+                {
+                    break;
+                }
+                s.frames[depth++] = ret;
+                if(next <= fp)
+                {
+                    break;
+                }
+                fp = next;
+            }
+            s.slot = self;
+            s.depth = depth;
+            s.ready.store(1, std::memory_order_release);
+        }
+    }
+    m_in_handler.fetch_sub(1);
+    errno = saved_errno;
+}
+
+//函数名：去掉参数表；查不到时是[模块+偏移]
+void profiler::symbolize(uintptr_t addr, std::string* out)
+{
+    Dl_info info;
+    if(dladdr((void*)addr, &info) == 0)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "[0x%lx]", (unsigned long)addr);
+        *out = buf;
+        return;
+    }
+    if(info.dli_sname)
+    {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+        *out = (status == 0 && demangled) ? demangled : info.dli_sname;
+        free(demangled);
+        //最后一对括号是参数表
+        if(!out->empty() && (*out)[out->size() - 1] == ')')
+        {
+            int level = 0;
+            for(size_t i = out->size(); i-- > 0; )
+            {
+                level += ((*out)[i] == ')') - ((*out)[i] == '(');
+                if(level == 0)
+                {
+                    out->erase(i);
+                    break;
+                }
+            }
+        }
+    }
+    else
+    {
+        const char* module = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+        module = module ? module + 1 : (info.dli_fname ? info.dli_fname : "?");
+        char buf[320];
+        snprintf(buf, sizeof(buf), "[%s+0x%lx]", module, (unsigned long)(addr - (uintptr_t)info.dli_fbase));
+        *out = buf;
+    }
+    //';'是折叠格式的分隔符
+    for(size_t i = 0; i < out->size(); i++)
+    {
+        if((*out)[i] == ';')
+        {
+            (*out)[i] = ':';
+        }
+    }
+}
+
+//角色;最外层;...;最内层 次数，按次数从多到少
+std::string profiler::fold(int samples)
+{
+    std::unordered_map<uintptr_t, std::string> names;
+    std::map<std::string, int> stacks;
+    std::string key, name;
+    for(int i = 0; i < samples; i++)
+    {
+        const sample& s = m_samples[i];
+        if(!s.ready.load(std::memory_order_acquire))
+        {
+            continue;
+        }
+        const char* role = m_slots[s.slot].role;
+        key = role ? role : "thread";
+        for(int j = s.depth - 1; j >= 0; j--)
+        {
+            //返回地址减一才落在调用指令里（函数最后一条指令是call时返回地址已经是下一个函数）
+            uintptr_t addr = j > 0 ? s.frames[j] - 1 : s.frames[j];
+            std::unordered_map<uintptr_t, std::string>::iterator it = names.find(addr);
+            if(it == names.end())
+            {
+                symbolize(addr, &name);
+                it = names.insert(std::make_pair(addr, name)).first;
+            }
+            key += ';';
+            key += it->second;
+        }
+        stacks[key]++;
+    }
+
+    std::vector<std::pair<int, const std::string*> > order;
+    for(std::map<std::string, int>::iterator it = stacks.begin(); it != stacks.end(); ++it)
+    {
+        order.push_back(std::make_pair(-it->second, &it->first));
+    }
+    std::sort(order.begin(), order.end());
+    std::string out;
+    char count[24];
+    for(size_t i = 0; i < order.size(); i++)
+    {
+        snprintf(count, sizeof(count), " %d\n", -order[i].first);
+        out += *order[i].second;
+        out += count;
+    }
+    return out;
+}
+
+int profiler::status(char* buf, int len)
+{
+    if(running())
+    {
+        return snprintf(buf, len, "profiling, %d samples so far\n", m_next.load(std::memory_order_relaxed));
+    }
+    s_result_lock.lock();
+    int n = snprintf(buf, len, "%s", s_summary);
+    s_result_lock.unlock();
+    return n < len ? n : len - 1;
+}
+
+std::string profiler::result()
+{
+    s_result_lock.lock();
+    std::string out = s_result;
+    s_result_lock.unlock();
+    return out;
+}
@@ -0,0 +1,84 @@
+#ifndef PROFILER_H__
+#define PROFILER_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <signal.h>
+#include <atomic>
+#include <string>
+
+// 进程内的采样profiler（-p seconds[:hz[:path]]），不需要在线上机器上附加外部工具
+// 由SIGUSR1或者 GET /profilez?seconds=N&hz=H 触发，运行N秒：
+// 每个登记过的线程（主线程、reactor、线程池、I/O线程池等）有一个按它自己CPU时间计时的定时器，
+// 到期时向它发SIGPROF，信号处理函数沿帧指针回溯，把调用栈写进开始时一次分配好的缓冲区（满了就丢弃并计数），
+// 不加锁也不分配内存；只在线程占用CPU时采样，空闲的线程没有开销。
+// 结束后按线程角色折叠成 "角色;最外层函数;...;最内层函数 次数" 的文本（flamegraph.pl可以直接画），
+// 写到path，GET /profilez 返回最近一次的结果。
+// 回溯依赖帧指针：用 -fno-omit-frame-pointer 编译栈才完整；函数名用dladdr查，需要 -rdynamic 链接，
+// 查不到的（static函数等）输出为 [模块+偏移]，可以用addr2line还原。
+class profiler{
+
+public:
+    static const int MAX_THREADS = 256;
+    static const int MAX_FRAMES = 32;
+    static const int MAX_SAMPLES = 65536;       //一次采样最多保留的栈
+    static const int MAX_HZ = 1000;
+    static const int MAX_SECONDS = 300;
+
+    //解析 -p seconds[:hz[:path]]，hz默认99（避开和其它定时任务同步），path默认/tmp/profile-<pid>.folded
+    static bool init(const char* spec);
+    static bool enabled() { return m_seconds > 0; }
+
+    //线程启动时登记，role是静态字符串；退出前注销
+    static void register_thread(const char* role);
+    static void unregister_thread();
+
+    //开始一次seconds秒、每秒hz次的采样，0表示用-p的配置；已经在采样返回false
+    static bool start(int seconds = 0, int hz = 0);
+    static bool running() { return m_running.load(std::memory_order_acquire); }
+
+    //采样状态或者最近一次的折叠栈
+    static int status(char* buf, int len);
+    static std::string result();
+
+    static const char* path() { return m_path; }
+
+private:
+    struct thread_slot{
+        std::atomic<int> state;             //SLOT_FREE、SLOT_USED
+        const char* role;
+        pid_t tid;
+        clockid_t clock;                    //线程的CPU时钟
+        uintptr_t stack_lo;                 //线程栈的范围，回溯时帧指针必须在里面
+        uintptr_t stack_hi;
+    };
+
+    struct sample{
+        std::atomic<int> ready;             //写好了
+        int slot;
+        int depth;
+        uintptr_t frames[MAX_FRAMES];       //frames[0]是被打断的指令，之后是返回地址
+    };
+
+    static void* session(void* arg);
+    static void on_sample(int sig, siginfo_t* info, void* context);
+    static std::string fold(int samples);
+    static void symbolize(uintptr_t addr, std::string* out);
+
+private:
+    static int m_seconds;
+    static int m_hz;
+    static char m_path[256];
+
+    static thread_slot m_slots[MAX_THREADS];
+    static std::atomic<bool> m_running;
+    static std::atomic<bool> m_sampling;        //信号处理函数只在这期间写缓冲区
+    static std::atomic<int> m_in_handler;       //正在执行的信号处理函数，停止时等它们退出
+    static sample* m_samples;
+    static int m_capacity;
+    static std::atomic<int> m_next;
+    static std::atomic<uint64_t> m_dropped;
+};
+
+#endif
@@ -0,0 +1,278 @@
+#include "rate_limiter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <exception>
+
+//murmur3的最后一步，IP的低位变化要扩散到分片号（高位）和槽位（低位）
+static inline uint32_t mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+//网段掩码，网络字节序
+static inline uint32_t prefix_mask()
+{
+    return htonl(~0u << (32 - rate_limiter::PREFIX_BITS));
+}
+
+//临界区只有几十纳秒，先自旋；持有者被调度出去时（线程数多于CPU）让出CPU而不是空转整个时间片
+static inline void spin_lock(std::atomic<bool>& lock)
+{
+    while(lock.exchange(true, std::memory_order_acquire))
+    {
+        int spins = 0;
+        while(lock.load(std::memory_order_relaxed))
+        {
+            if(++spins > 64)
+            {
+                sched_yield();
+                spins = 0;
+            }
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+}
+
+static inline void spin_unlock(std::atomic<bool>& lock)
+{
+    lock.store(false, std::memory_order_release);
+}
+
+rate_limiter::table::table():
+    m_evictions(NULL), m_untracked(NULL) {
+
+    memset(&m_limits, 0, sizeof(m_limits));
+    for(int i = 0; i < SHARDS; i++)
+    {
+        m_shards[i].lock.store(false, std::memory_order_relaxed);
+        m_shards[i].slots = NULL;
+    }
+}
+
+rate_limiter::table::~table()
+{
+    for(int i = 0; i < SHARDS; i++)
+    {
+        free(m_shards[i].slots);
+    }
+}
+
+void rate_limiter::table::init(const limits& l, std::atomic<uint64_t>* evictions, std::atomic<uint64_t>* untracked)
+{
+    m_limits = l;
+    if(m_limits.conn_burst * CONN_SCALE > 65535)
+    {
+        m_limits.conn_burst = 65535 / CONN_SCALE;
+    }
+    if(m_limits.max_conns > 65535)
+    {
+        m_limits.max_conns = 65535;
+    }
+    m_evictions = evictions;
+    m_untracked = untracked;
+
+    for(int i = 0; i < SHARDS; i++)
+    {
+        m_shards[i].slots = (bucket*)aligned_alloc(64, SLOTS_PER_SHARD * sizeof(bucket));
+        if(!m_shards[i].slots)
+        {
+            throw std::exception();
+        }
+        memset(m_shards[i].slots, 0, SLOTS_PER_SHARD * sizeof(bucket));
+    }
+}
+
+//在探测窗口内查找key；create时找不到就占用空槽，或淘汰最久没有访问的空闲槽位
+rate_limiter::bucket* rate_limiter::table::find(shard& s, uint32_t key, uint32_t hash, bool create)
+{
+    bucket* empty = NULL;
+    bucket* oldest = NULL;
+    uint32_t idx = hash & (SLOTS_PER_SHARD - 1);
+    for(int i = 0; i < PROBE; i++)
+    {
+        bucket* b = &s.slots[(idx + i) & (SLOTS_PER_SHARD - 1)];
+        if(b->stamp == 0)
+        {
+            if(!empty)
+            {
+                empty = b;
+            }
+            continue;
+        }
+        if(b->key == key)
+        {
+            return b;
+        }
+        if(b->active == 0 && (!oldest || (int32_t)(b->stamp - oldest->stamp) < 0))
+        {
+            oldest = b;
+        }
+    }
+    if(!create)
+    {
+        return NULL;
+    }
+
+    bucket* b = empty;
+    if(!b)
+    {
+        if(!oldest)
+        {
+            //窗口内的客户端都有打开的连接：不跟踪这个客户端
+            m_untracked->fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+        m_evictions->fetch_add(1, std::memory_order_relaxed);
+        b = oldest;
+    }
+
+    //新客户端从满桶开始
+    b->key = key;
+    b->stamp = 0;
+    b->active = 0;
+    b->conn_tokens = (uint16_t)(m_limits.conn_burst * CONN_SCALE);
+    b->req_tokens = m_limits.req_burst;
+    return b;
+}
+
+void rate_limiter::table::refill(bucket* b, uint32_t now)
+{
+    if(b->stamp == 0)
+    {
+        b->stamp = now;
+        return;
+    }
+    uint32_t elapsed = now - b->stamp;
+    if(elapsed == 0)
+    {
+        return;
+    }
+
+    //连接令牌是整数的定点单位，按经过的时间换算再截断的话，检查得频繁时每次补充都不足一个单位，桶永远补不回来。
+    //改为按绝对时间的刻度累积：(stamp, now] 内补充的单位数是两个时刻的刻度数之差，相邻两次的差相加不会丢失零头，
+    //stamp 可以照常前移（被拒绝的检查也一样）
+    double per_ms = (double)m_limits.conn_rate * CONN_SCALE / 1000.0;
+    double units = floor(((double)b->stamp + elapsed) * per_ms) - floor((double)b->stamp * per_ms);
+    b->stamp = now;
+
+    //不超过桶的容量
+    double conn = b->conn_tokens + units;
+    double conn_max = m_limits.conn_burst * CONN_SCALE;
+    b->conn_tokens = (uint16_t)(conn < conn_max ? conn : conn_max);
+
+    float req = b->req_tokens + elapsed * m_limits.req_rate / 1000.0f;
+    b->req_tokens = req < m_limits.req_burst ? req : m_limits.req_burst;
+}
+
+bool rate_limiter::table::check(uint32_t key, MODE mode, uint32_t now)
+{
+    uint32_t hash = mix(key);
+    shard& s = m_shards[hash >> 26];        //SHARDS == 64
+
+    spin_lock(s.lock);
+    bucket* b = find(s, key, hash, mode != CLOSE);
+    bool ok = true;
+    if(b)
+    {
+        switch(mode)
+        {
+            case ACCEPT:
+                refill(b, now);
+                if(b->active >= m_limits.max_conns || b->conn_tokens < CONN_SCALE)
+                {
+                    ok = false;
+                    break;
+                }
+                b->conn_tokens -= CONN_SCALE;
+                b->active++;
+                break;
+            case CLOSE:
+                if(b->active > 0)
+                {
+                    b->active--;
+                }
+                break;
+            case REQUEST:
+                refill(b, now);
+                if(b->req_tokens < 1.0f)
+                {
+                    ok = false;
+                    break;
+                }
+                b->req_tokens -= 1.0f;
+                break;
+        }
+    }
+    spin_unlock(s.lock);
+    return ok;
+}
+
+rate_limiter::rate_limiter(const limits& ip_limits):
+    m_rejected_conns(0), m_rejected_requests(0), m_evictions(0), m_untracked(0) {
+
+    m_ip.init(ip_limits, &m_evictions, &m_untracked);
+
+    limits prefix_limits = ip_limits;
+    prefix_limits.conn_rate *= PREFIX_FACTOR;
+    prefix_limits.conn_burst *= PREFIX_FACTOR;
+    prefix_limits.req_rate *= PREFIX_FACTOR;
+    prefix_limits.req_burst *= PREFIX_FACTOR;
+    prefix_limits.max_conns *= PREFIX_FACTOR;
+    m_prefix.init(prefix_limits, &m_evictions, &m_untracked);
+}
+
+//粗粒度时钟（vDSO，不进内核），从1开始，0留给空槽
+uint32_t rate_limiter::now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint32_t ms = (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+    return ms ? ms : 1;
+}
+
+//ip是网络字节序
+bool rate_limiter::on_accept(uint32_t ip)
+{
+    uint32_t now = now_ms();
+    if(!m_ip.check(ip, ACCEPT, now))
+    {
+        m_rejected_conns.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if(!m_prefix.check(ip & prefix_mask(), ACCEPT, now))
+    {
+        m_ip.check(ip, CLOSE, now);
+        m_rejected_conns.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void rate_limiter::on_close(uint32_t ip)
+{
+    uint32_t now = now_ms();
+    m_ip.check(ip, CLOSE, now);
+    m_prefix.check(ip & prefix_mask(), CLOSE, now);
+}
+
+bool rate_limiter::on_request(uint32_t ip)
+{
+    uint32_t now = now_ms();
+    if(!m_ip.check(ip, REQUEST, now) || !m_prefix.check(ip & prefix_mask(), REQUEST, now))
+    {
+        m_rejected_requests.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,99 @@
+#ifndef RATE_LIMITER_H__
+#define RATE_LIMITER_H__
+
+#include <stdint.h>
+#include <atomic>
+
+// 按客户端限流：每个IP（以及它所在的/24网段）一个令牌桶
+// 新连接和请求各有一个桶，令牌在检查时按经过的时间惰性补充；另外限制每个IP同时打开的连接数。
+//
+// 桶保存在分片的开放寻址哈希表中：每个分片一个自旋锁，槽位16字节，线性探测最多PROBE个槽位（两个缓存行），
+// 探测窗口内没有空槽时淘汰其中最久没有访问、且没有打开连接的槽位（近似LRU）。
+// 表满时放行而不是拒绝：限流器只用来挡住滥用者，不能因为自身容量误伤正常客户端。
+
+class rate_limiter{
+
+public:
+    static const int SHARDS = 64;
+    static const int SLOTS_PER_SHARD = 1024;    //必须是2的幂
+    static const int PROBE = 8;
+    static const int PREFIX_BITS = 24;          //网段的前缀长度
+    static const int PREFIX_FACTOR = 16;        //网段的限额是单个IP的倍数
+    static const int CONN_SCALE = 16;           //连接令牌的定点精度，突发上限 65535/CONN_SCALE
+
+    struct limits{
+        float conn_rate;        //每秒新连接数
+        float conn_burst;
+        float req_rate;         //每秒请求数
+        float req_burst;
+        int max_conns;          //同时打开的连接数
+    };
+
+    explicit rate_limiter(const limits& ip_limits);
+
+    //接受连接时调用（主线程），返回false表示应当拒绝；返回true时必须在连接关闭时调用on_close
+    bool on_accept(uint32_t ip);
+    void on_close(uint32_t ip);
+
+    //请求行解析完时调用（工作线程），返回false表示应答429
+    bool on_request(uint32_t ip);
+
+    //统计
+    uint64_t rejected_conns() const { return m_rejected_conns.load(std::memory_order_relaxed); }
+    uint64_t rejected_requests() const { return m_rejected_requests.load(std::memory_order_relaxed); }
+    uint64_t evictions() const { return m_evictions.load(std::memory_order_relaxed); }
+    uint64_t untracked() const { return m_untracked.load(std::memory_order_relaxed); }
+
+private:
+    //一个客户端（IP或网段）的状态，16字节，一个缓存行4个
+    struct bucket{
+        uint32_t key;
+        uint32_t stamp;         //上次补充令牌的时间（毫秒），0表示空槽
+        uint16_t active;        //打开的连接数
+        uint16_t conn_tokens;   //新连接令牌，定点数（1/CONN_SCALE个）
+        float req_tokens;
+    };
+
+    struct alignas(64) shard{
+        std::atomic<bool> lock;
+        bucket* slots;
+    };
+
+    enum MODE {ACCEPT = 0, CLOSE, REQUEST};
+
+    //一张表：IP或者网段
+    class table{
+
+    public:
+        table();
+        ~table();
+
+        void init(const limits& l, std::atomic<uint64_t>* evictions, std::atomic<uint64_t>* untracked);
+
+        //ACCEPT消耗连接令牌并增加连接数，CLOSE减少连接数，REQUEST消耗请求令牌
+        bool check(uint32_t key, MODE mode, uint32_t now);
+
+    private:
+        bucket* find(shard& s, uint32_t key, uint32_t hash, bool create);
+        void refill(bucket* b, uint32_t now);
+
+    private:
+        shard m_shards[SHARDS];
+        limits m_limits;
+        std::atomic<uint64_t>* m_evictions;
+        std::atomic<uint64_t>* m_untracked;
+    };
+
+    static uint32_t now_ms();
+
+private:
+    table m_ip;
+    table m_prefix;
+
+    std::atomic<uint64_t> m_rejected_conns;
+    std::atomic<uint64_t> m_rejected_requests;
+    std::atomic<uint64_t> m_evictions;
+    std::atomic<uint64_t> m_untracked;
+};
+
+#endif
@@ -0,0 +1,243 @@
+#include "router.h"
+#include "micro_cache.h"
+#include "template_engine.h"
+
+router::router():
+    m_has_static(false), m_count(0), m_prefix_count(0) {
+
+    memset(&m_static, 0, sizeof(m_static));
+    memset(m_slots, 0, sizeof(m_slots));
+}
+
+void router::set_static(const static_route_view& table)
+{
+    m_static = table;
+    m_has_static = true;
+}
+
+bool router::add(int method, const char* path, request_handler* handler)
+{
+    //保持装载因子不超过1/2
+    if(m_count >= CAPACITY / 2 || !handler)
+    {
+        return false;
+    }
+
+    int len = strlen(path);
+    uint32_t hash = route_hash(0, method, path, len);
+    for(int i = 0; i < CAPACITY; i++)
+    {
+        slot& s = m_slots[(hash + i) & (CAPACITY - 1)];
+        if(!s.def.handler)
+        {
+            s.hash = hash;
+            s.def.method = method;
+            s.def.path = path;
+            s.def.len = len;
+            s.def.handler = handler;
+            m_count++;
+            return true;
+        }
+        if(s.hash == hash && route_equal(s.def, method, path, len))
+        {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool router::add_prefix(int method, const char* prefix, request_handler* handler)
+{
+    if(m_prefix_count >= MAX_PREFIX || !handler)
+    {
+        return false;
+    }
+    route_def& def = m_prefix[m_prefix_count++];
+    def.method = method;
+    def.path = prefix;
+    def.len = strlen(prefix);
+    def.handler = handler;
+    return true;
+}
+
+request_handler* router::match(int method, const char* path, int len) const
+{
+    if(m_has_static)
+    {
+        const route_def* def = m_static.match(method, path, len);
+        if(def)
+        {
+            return def->handler;
+        }
+    }
+
+    if(m_count > 0)
+    {
+        uint32_t hash = route_hash(0, method, path, len);
+        for(int i = 0; i < CAPACITY; i++)
+        {
+            const slot& s = m_slots[(hash + i) & (CAPACITY - 1)];
+            if(!s.def.handler)
+            {
+                break;
+            }
+            if(s.hash == hash && s.def.len == len && s.def.method == method
+                && memcmp(s.def.path, path, len) == 0)
+            {
+                return s.def.handler;
+            }
+        }
+    }
+
+    const route_def* best = NULL;
+    for(int i = 0; i < m_prefix_count; i++)
+    {
+        const route_def& def = m_prefix[i];
+        if(def.method == method && def.len <= len && memcmp(def.path, path, def.len) == 0
+            && (!best || def.len > best->len))
+        {
+            best = &def;
+        }
+    }
+    return best ? best->handler : NULL;
+}
+
+bool http_response::status(int code, const char* title)
+{
+    m_status_written = true;
+    return m_sink->status(code, title);
+}
+
+bool http_response::header(const char* name, const char* value)
+{
+    if(!m_status_written && !status(200, "OK"))
+    {
+        return false;
+    }
+    return m_sink->header(name, value);
+}
+
+bool http_response::body(const char* content_type, const char* data, int len)
+{
+    if(!m_status_written && !status(200, "OK"))
+    {
+        return false;
+    }
+    return m_sink->body(content_type, data, len);
+}
+
+bool http_response::stream(const char* content_type, body_producer* producer)
+{
+    if(!producer)
+    {
+        return false;
+    }
+    if((!m_status_written && !status(200, "OK")) || !m_sink->stream(content_type, producer))
+    {
+        delete producer;
+        return false;
+    }
+    return true;
+}
+
+bool http_response::shared(shared_response* resp)
+{
+    m_status_written = true;
+    return m_sink->shared(resp);
+}
+
+bool response_sink::shared(shared_response* resp)
+{
+    if(!status(resp->code(), resp->title()))
+    {
+        return false;
+    }
+    for(size_t i = 0; i < resp->headers().size(); i++)
+    {
+        if(!header(resp->headers()[i].name.c_str(), resp->headers()[i].value.c_str()))
+        {
+            return false;
+        }
+    }
+    return body(resp->content_type(), resp->body().data(), resp->body().size());
+}
+
+bool http_response::page(const char* content_type, rendered_page* page)
+{
+    if(!page)
+    {
+        return false;
+    }
+    if((!m_status_written && !status(200, "OK")) || !m_sink->page(content_type, page))
+    {
+        delete page;
+        return false;
+    }
+    return true;
+}
+
+bool response_sink::page(const char* content_type, rendered_page* page)
+{
+    std::string data;
+    page->flatten(&data);
+    if(!body(content_type, data.data(), data.size()))
+    {
+        return false;
+    }
+    delete page;
+    return true;
+}
+
+bool http_response::defer(deferred_response* deferred)
+{
+    if(!deferred)
+    {
+        return false;
+    }
+    if(m_status_written || !m_sink->defer(deferred))
+    {
+        delete deferred;
+        return false;
+    }
+    m_status_written = true;
+    return true;
+}
+
+bool next_header(const http_request& req, int* pos, const char** name, int* name_len, const char** value)
+{
+    if(!req.headers)
+    {
+        return false;
+    }
+    const char* end = req.headers + req.headers_len;
+    const char* p = req.headers + *pos;
+    while(p < end)
+    {
+        //行之间是解析时留下的'\0'和换行符
+        if(*p == '\0' || *p == '\r' || *p == '\n')
+        {
+            p++;
+            continue;
+        }
+        const char* line_end = p + strnlen(p, end - p);
+        const char* colon = (const char*)memchr(p, ':', line_end - p);
+        if(colon && colon != p && line_end < end)
+        {
+            *pos = line_end - req.headers;
+            *name = p;
+            *name_len = colon - p;
+            *value = colon + 1 + strspn(colon + 1, " \t");
+            return true;
+        }
+        p = line_end;
+    }
+    *pos = req.headers_len;
+    return false;
+}
+
+bool http_response::redirect(int code, const char* location)
+{
+    return status(code, code == 301 ? "Moved Permanently" : "Found")
+        && header("Location", location)
+        && body("text/html", "", 0);
+}
@@ -0,0 +1,345 @@
+#ifndef ROUTER_H__
+#define ROUTER_H__
+
+#include <stdint.h>
+#include <string.h>
+
+// 请求路由：把 方法+路径 映射到进程内的处理器（健康检查、小型JSON接口、重定向等），
+// 命中路由的请求不访问文件系统。
+// 路由既可以在编译期声明（static_routes，constexpr构造的完美哈希表），
+// 也可以在启动时注册（router::add / add_prefix）。
+
+class http_conn;
+class ws_endpoint;
+class shared_response;
+class rendered_page;
+class request_arena;
+
+// 解析完成的请求的视图，所有指针都指向连接的读缓冲区，不做拷贝
+// 请求头解析完成时构造，在整个请求（包括请求体）期间有效
+struct http_request{
+    int method;                 //http_conn::METHOD
+    const char* path;           //不含查询串，不以'\0'结尾，长度为path_len
+    int path_len;
+    const char* query;          //'?'之后的部分，没有时为NULL
+    const char* host;           //Host头部，没有时为NULL
+    bool keep_alive;
+    bool chunked;               //请求体使用 Transfer-Encoding: chunked
+    long long content_length;   //Content-Length，chunked时为-1
+    const char* headers;        //请求头部的原文，每行"名: 值"以'\0'结尾，用next_header逐个取出；没有时为NULL
+    int headers_len;
+    uint32_t remote_addr;       //客户端的IPv4地址，网络字节序
+    int remote_port;
+    int server_port;            //接受这个连接的本地端口
+
+    void* context;              //处理器自己的每请求状态，初始为NULL
+    int body_fd;                //处理器在on_headers中设置后，请求体直接写入这个文件（Content-Length方式用splice零拷贝）
+    request_arena* arena;       //请求期间的临时内存，请求结束后整体回收（见arena.h）
+};
+
+//逐个取出请求头部：*pos从0开始；name不以'\0'结尾，value已经去掉了前导空白。没有更多头部时返回false
+bool next_header(const http_request& req, int* pos, const char** name, int* name_len, const char** value);
+
+// 数据由别的线程产生的生产者暂时没有数据时，用它通知连接：数据到达（或结束、出错）后调用一次wake，可以在任何线程调用
+class body_waker{
+
+public:
+    virtual ~body_waker() {}
+    virtual void wake() = 0;
+};
+
+// 流式应答体的生产者，由处理器创建（new），连接在应答结束或关闭时delete
+// 只有当socket可写、上一段已经全部发出时才会被要求生成下一段，因此内存占用是固定的一段
+class body_producer{
+
+public:
+    static const int PENDING = -2;      //暂时没有数据，之后会调用waker
+
+    body_producer() : m_waker(NULL) {}
+    virtual ~body_producer() {}
+
+    //向buf写入最多len字节，返回写入的字节数；返回0表示应答体结束，返回-1表示出错（连接将被关闭）
+    //在主线程的写事件中调用，不应阻塞；只有设置了waker时才可以返回PENDING
+    virtual int produce(char* buf, int len) = 0;
+
+    //支持等待的连接（response_sink::can_wait）在第一次produce之前设置
+    void set_waker(body_waker* waker) { m_waker = waker; }
+
+protected:
+    body_waker* m_waker;
+};
+
+class http_response;
+
+// 应答要等别的线程的结果（如FastCGI应用进程的CGI头部）才能开始写时，处理器用http_response::defer交出它，
+// handle立即返回，不占着线程等待。连接调用ready询问结果到了没有：没有到时ready记下waker并返回false，
+// 结果到达（或者出错）后waker被调用一次；ready返回true后连接调用respond，像handle一样写应答，然后delete它
+class deferred_response{
+
+public:
+    virtual ~deferred_response() {}
+
+    virtual bool ready(body_waker* waker) = 0;
+    //返回false表示处理失败，和handle一样
+    virtual bool respond(http_response& resp) = 0;
+};
+
+// 应答的去向：HTTP/1.1连接直接格式化到写缓冲区，HTTP/2流编码成HEADERS/DATA帧
+class response_sink{
+
+public:
+    virtual ~response_sink() {}
+
+    virtual bool status(int code, const char* title) = 0;
+    virtual bool header(const char* name, const char* value) = 0;
+    virtual bool body(const char* content_type, const char* data, int len) = 0;
+    //失败时不负责释放producer
+    virtual bool stream(const char* content_type, body_producer* producer) = 0;
+
+    //stream的生产者可以返回PENDING（连接会等它的waker），否则生产者必须随时给出数据
+    virtual bool can_wait() const { return false; }
+
+    //完整的、不可变的共享应答（微缓存）：默认按status/header/body重放，
+    //HTTP/1.1连接直接引用它的缓冲区发送；需要保留时自己加引用
+    virtual bool shared(shared_response* resp);
+
+    //模板渲染出的页面：默认拼接成一块按body发送，HTTP/1.1连接用writev直接发送它的iovec；
+    //成功时接管page，失败时不负责释放
+    virtual bool page(const char* content_type, rendered_page* page);
+
+    //推迟的应答：成功时接管它，失败时不负责释放；默认不支持
+    virtual bool defer(deferred_response* deferred) { return false; }
+};
+
+// 处理器写应答用的接口，与具体协议无关
+class http_response{
+
+public:
+    explicit http_response(response_sink* sink) : m_sink(sink), m_status_written(false) {}
+
+    bool status(int code, const char* title);
+    bool header(const char* name, const char* value);
+
+    //写入Content-Type/Content-Length/Connection、空行和应答体，应答到此结束
+    bool body(const char* content_type, const char* data, int len);
+
+    //长度未知或超过写缓冲区的应答体：写入头部（Transfer-Encoding: chunked），
+    //应答体随socket可写由producer逐段生成。连接接管producer的所有权
+    bool stream(const char* content_type, body_producer* producer);
+
+    //便捷函数：302/301等重定向
+    bool redirect(int code, const char* location);
+
+    //整个应答是缓存里的共享应答，之前不能写过任何东西
+    bool shared(shared_response* resp);
+
+    //应答体是渲染好的模板页面，写入Content-Type/Content-Length，连接接管page的所有权
+    bool page(const char* content_type, rendered_page* page);
+
+    //整个应答推迟到deferred的结果到达后再写，之前不能写过任何东西。连接接管deferred的所有权，失败时直接释放它
+    bool defer(deferred_response* deferred);
+
+    //stream的生产者是否可以返回PENDING
+    bool can_wait() const { return m_sink->can_wait(); }
+
+private:
+    response_sink* m_sink;
+    bool m_status_written;
+};
+
+// 处理器接口
+// 调用顺序：on_headers -> on_body（零次或多次，随数据到达增量调用）-> handle；
+// 连接在请求中途出错或关闭时调用on_abort代替handle
+class request_handler{
+
+public:
+    virtual ~request_handler() {}
+
+    //请求头解析完成，返回false拒绝该请求（403，不读取请求体）
+    virtual bool on_headers(http_request& req) { return true; }
+
+    //一段请求体数据（已去掉chunked编码）；设置了body_fd时不会调用
+    virtual bool on_body(http_request& req, const char* data, int len) { return true; }
+
+    //请求完整，写应答。返回false表示处理失败，连接将返回500
+    virtual bool handle(http_request& req, http_response& resp) = 0;
+
+    //请求没有完成，释放context/body_fd等资源
+    virtual void on_abort(http_request& req) {}
+
+    //WebSocket端点返回自己，带Upgrade: websocket的GET请求据此升级
+    virtual ws_endpoint* websocket() { return NULL; }
+};
+
+struct route_def{
+    int method;
+    const char* path;
+    int len;
+    request_handler* handler;
+};
+
+#define ROUTE(method, path, handler) { (method), (path), (int)sizeof(path) - 1, (handler) }
+
+//FNV-1a，把方法也混入哈希，seed用于编译期搜索完美哈希
+constexpr uint32_t route_hash(uint32_t seed, int method, const char* path, int len)
+{
+    uint32_t h = 2166136261u ^ seed;
+    h = (h ^ (uint32_t)method) * 16777619u;
+    for(int i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+constexpr bool route_equal(const route_def& def, int method, const char* path, int len)
+{
+    if(def.method != method || def.len != len)
+    {
+        return false;
+    }
+    for(int i = 0; i < len; i++)
+    {
+        if(def.path[i] != path[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 类型擦除后的静态路由表，供router在运行时查询
+struct static_route_view{
+    const route_def* defs;
+    const int16_t* slots;
+    uint32_t mask;
+    uint32_t seed;
+
+    const route_def* match(int method, const char* path, int len) const
+    {
+        int16_t idx = slots[route_hash(seed, method, path, len) & mask];
+        if(idx < 0)
+        {
+            return NULL;
+        }
+        const route_def& def = defs[idx];
+        if(def.method != method || def.len != len || memcmp(def.path, path, len) != 0)
+        {
+            return NULL;
+        }
+        return &def;
+    }
+};
+
+//表大小取不小于4N的2的幂，槽位足够稀疏，seed很快就能找到
+constexpr uint32_t route_table_size(int n)
+{
+    uint32_t size = 4;
+    while(size < (uint32_t)n * 4)
+    {
+        size <<= 1;
+    }
+    return size;
+}
+
+/*
+    编译期路由表：在构造时（constexpr）搜索一个seed，使所有路由的哈希值在表中互不冲突，
+    查询时只需要一次哈希、一次比较。找不到合适的seed会导致编译错误。
+    用法：
+        constexpr route_def defs[] = { ROUTE(http_conn::GET, "/healthz", &health) };
+        constexpr static_routes<1> table(defs);
+*/
+template<int N>
+class static_routes{
+
+public:
+    static const uint32_t SIZE = route_table_size(N);
+
+    constexpr static_routes(const route_def (&defs)[N]) : m_defs(), m_slots(), m_seed(0)
+    {
+        for(int i = 0; i < N; i++)
+        {
+            m_defs[i] = defs[i];
+        }
+
+        for(uint32_t seed = 1; seed < 100000; seed++)
+        {
+            if(try_seed(seed))
+            {
+                m_seed = seed;
+                return;
+            }
+        }
+        throw "static_routes: no perfect hash seed found";
+    }
+
+    static_route_view view() const
+    {
+        static_route_view v = { m_defs, m_slots, SIZE - 1, m_seed };
+        return v;
+    }
+
+private:
+    constexpr bool try_seed(uint32_t seed)
+    {
+        for(uint32_t i = 0; i < SIZE; i++)
+        {
+            m_slots[i] = -1;
+        }
+        for(int i = 0; i < N; i++)
+        {
+            uint32_t slot = route_hash(seed, m_defs[i].method, m_defs[i].path, m_defs[i].len) & (SIZE - 1);
+            if(m_slots[slot] >= 0)
+            {
+                //同一条路由被声明了两次
+                if(route_equal(m_defs[m_slots[slot]], m_defs[i].method, m_defs[i].path, m_defs[i].len))
+                {
+                    throw "static_routes: duplicate route";
+                }
+                return false;
+            }
+            m_slots[slot] = i;
+        }
+        return true;
+    }
+
+private:
+    route_def m_defs[N];
+    int16_t m_slots[SIZE];
+    uint32_t m_seed;
+};
+
+// 路由器：先查编译期路由表，再查启动时注册的精确路由，最后按最长前缀匹配前缀路由
+class router{
+
+public:
+    static const int CAPACITY = 256;        //启动时注册的精确路由的槽位数，必须是2的幂
+    static const int MAX_PREFIX = 32;
+
+    router();
+
+    void set_static(const static_route_view& table);
+
+    //只应在启动阶段、工作线程开始处理请求之前调用
+    bool add(int method, const char* path, request_handler* handler);
+    bool add_prefix(int method, const char* prefix, request_handler* handler);
+
+    request_handler* match(int method, const char* path, int len) const;
+
+private:
+    struct slot{
+        uint32_t hash;
+        route_def def;
+    };
+
+    bool m_has_static;
+    static_route_view m_static;
+
+    slot m_slots[CAPACITY];
+    int m_count;
+
+    route_def m_prefix[MAX_PREFIX];
+    int m_prefix_count;
+};
+
+#endif
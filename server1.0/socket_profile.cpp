@@ -0,0 +1,154 @@
+#include "socket_profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+//旧的头文件里没有这几个常量，数值是内核ABI的一部分
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 23
+#endif
+
+static const socket_profile profiles[] = {
+    //name          backlog defer  tfo  busy  prefer  rcvbuf sndbuf nodelay cork        zerocopy
+    {"compat",      5,      0,     0,   0,    false,  0,     0,     false,  0,          0},
+    {"balanced",    1024,   5,     256, 0,    false,  0,     0,     true,   64 * 1024,  0},
+    {"latency",     1024,   5,     256, 50,   true,   0,     0,     true,   0,          0},
+    {"throughput",  4096,   5,     256, 0,    false,  0,     0,     true,   64 * 1024,  256 * 1024},
+};
+
+bool socket_profile::parse(const char* spec, socket_profile* profile)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    char* save = NULL;
+    char* name = strtok_r(buf, ",", &save);
+    if(!name)
+    {
+        return false;
+    }
+    bool found = false;
+    for(size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        if(strcmp(profiles[i].name, name) == 0)
+        {
+            *profile = profiles[i];
+            found = true;
+        }
+    }
+    if(!found)
+    {
+        return false;
+    }
+
+    //逗号后面是对单个选项的覆盖，如 balanced,backlog=4096,sndbuf=1048576
+    char* item;
+    while((item = strtok_r(NULL, ",", &save)) != NULL)
+    {
+        char* value = strchr(item, '=');
+        if(!value)
+        {
+            return false;
+        }
+        *value++ = '\0';
+        char* end;
+        long v = strtol(value, &end, 10);
+        if(*value == '\0' || *end != '\0' || v < 0)
+        {
+            return false;
+        }
+
+        if(strcmp(item, "backlog") == 0)                profile->backlog = v;
+        else if(strcmp(item, "defer") == 0)             profile->defer_accept = v;
+        else if(strcmp(item, "fastopen") == 0)          profile->fastopen = v;
+        else if(strcmp(item, "busy_poll") == 0)         profile->busy_poll = v;
+        else if(strcmp(item, "prefer_busy_poll") == 0)  profile->prefer_busy_poll = (v != 0);
+        else if(strcmp(item, "rcvbuf") == 0)            profile->rcvbuf = v;
+        else if(strcmp(item, "sndbuf") == 0)            profile->sndbuf = v;
+        else if(strcmp(item, "nodelay") == 0)           profile->nodelay = (v != 0);
+        else if(strcmp(item, "cork") == 0)              profile->cork = v;
+        else if(strcmp(item, "zerocopy") == 0)          profile->zerocopy = v;
+        else
+        {
+            return false;
+        }
+    }
+    return profile->backlog > 0;
+}
+
+//失败时打印出来；连接上的选项每个连接都会失败，只在reported为false时打印一次
+static bool set_option(int fd, int level, int name, int value, const char* label, bool* reported = NULL)
+{
+    if(setsockopt(fd, level, name, &value, sizeof(value)) == 0)
+    {
+        return true;
+    }
+    if(!reported || !*reported)
+    {
+        printf("socket profile: %s: %s\n", label, strerror(errno));
+        if(reported)
+        {
+            *reported = true;
+        }
+    }
+    return false;
+}
+
+void socket_profile::apply_listener(int fd) const
+{
+    if(defer_accept > 0)
+    {
+        set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_accept, "TCP_DEFER_ACCEPT");
+    }
+    if(fastopen > 0)
+    {
+        set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, fastopen, "TCP_FASTOPEN");
+    }
+    //缓冲区要在listen之前设置，窗口扩大因子在握手时按它确定
+    if(rcvbuf > 0)
+    {
+        set_option(fd, SOL_SOCKET, SO_RCVBUF, rcvbuf, "SO_RCVBUF");
+    }
+    if(sndbuf > 0)
+    {
+        set_option(fd, SOL_SOCKET, SO_SNDBUF, sndbuf, "SO_SNDBUF");
+    }
+}
+
+//只在主线程（accept的线程）调用
+bool socket_profile::apply_conn(int fd) const
+{
+    static bool reported = false;
+    if(nodelay)
+    {
+        set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", &reported);
+    }
+    if(busy_poll > 0)
+    {
+        //超过net.core.busy_read需要CAP_NET_ADMIN
+        set_option(fd, SOL_SOCKET, SO_BUSY_POLL, busy_poll, "SO_BUSY_POLL", &reported);
+        if(prefer_busy_poll)
+        {
+            set_option(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1, "SO_PREFER_BUSY_POLL", &reported);
+        }
+    }
+    return zerocopy > 0 && set_option(fd, SOL_SOCKET, SO_ZEROCOPY, 1, "SO_ZEROCOPY", &reported);
+}
+
+void socket_profile::print() const
+{
+    printf("socket profile %s: backlog %d, defer_accept %d s, fastopen %d, busy_poll %d us%s, rcvbuf %d, sndbuf %d, "
+           "nodelay %d, cork >= %d, zerocopy >= %d\n",
+           name, backlog, defer_accept, fastopen, busy_poll, prefer_busy_poll ? " (preferred)" : "",
+           rcvbuf, sndbuf, nodelay ? 1 : 0, cork, zerocopy);
+}
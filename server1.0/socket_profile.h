@@ -0,0 +1,41 @@
+#ifndef SOCKET_PROFILE_H__
+#define SOCKET_PROFILE_H__
+
+// socket选项的性能配置（-S 配置名[,选项=值...]）
+// 监听socket：listen队列长度、TCP_DEFER_ACCEPT（连接上有数据才交给accept，主线程不会为空连接醒来）、
+// TCP_FASTOPEN、收发缓冲区（accept出来的连接继承）；
+// 连接socket：TCP_NODELAY、SO_BUSY_POLL/SO_PREFER_BUSY_POLL、SO_ZEROCOPY；
+// 发送策略：小应答靠NODELAY立即发出，大文件和流式应答发送期间TCP_CORK，只发满的报文段，写完再放开。
+//
+// 预置的配置：
+//      compat      原来的行为：listen(5)，不设置任何选项
+//      balanced    默认：大的listen队列、延迟accept、TFO、NODELAY，大应答CORK
+//      latency     balanced + 忙轮询，不CORK
+//      throughput  balanced + 更大的listen队列，大文件MSG_ZEROCOPY
+
+struct socket_profile{
+    char name[16];
+    int backlog;                //listen队列长度，内核再按net.core.somaxconn截断
+    int defer_accept;           //TCP_DEFER_ACCEPT秒数，0关闭
+    int fastopen;               //TCP_FASTOPEN队列长度，0关闭；服务端还需要sysctl net.ipv4.tcp_fastopen的第2位
+    int busy_poll;              //SO_BUSY_POLL微秒，0关闭
+    bool prefer_busy_poll;      //SO_PREFER_BUSY_POLL
+    int rcvbuf;                 //监听socket的SO_RCVBUF/SO_SNDBUF，0表示由内核自动调整
+    int sndbuf;
+    bool nodelay;               //连接关闭Nagle
+    int cork;                   //应答不小于这么多字节（或者是流式应答）时发送期间TCP_CORK，0关闭
+    int zerocopy;               //文件不小于这么多字节时用MSG_ZEROCOPY发送，0关闭
+
+    //解析 -S 参数，失败返回false
+    static bool parse(const char* spec, socket_profile* profile);
+
+    //bind之前（或listen之后）调用；设置失败的选项打印出来，不影响启动
+    void apply_listener(int fd) const;
+
+    //accept之后调用，返回SO_ZEROCOPY是否已经开启
+    bool apply_conn(int fd) const;
+
+    void print() const;
+};
+
+#endif
@@ -0,0 +1,789 @@
+#include "template_engine.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static const size_t MAX_TEMPLATE_SIZE = 4 * 1024 * 1024;
+
+//FNV-1a
+static uint32_t name_hash(const char* name, int len)
+{
+    uint32_t h = 2166136261u;
+    for(int i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+//需要转义的字符在表里是替换串的下标加一
+static const char* const escapes[] = { "&amp;", "&lt;", "&gt;", "&quot;", "&#39;" };
+static const unsigned char escape_lens[] = { 5, 4, 4, 6, 5 };
+
+struct escape_table{
+    unsigned char index[256];
+
+    escape_table()
+    {
+        memset(index, 0, sizeof(index));
+        index[(unsigned char)'&'] = 1;
+        index[(unsigned char)'<'] = 2;
+        index[(unsigned char)'>'] = 3;
+        index[(unsigned char)'"'] = 4;
+        index[(unsigned char)'\''] = 5;
+    }
+};
+
+static const escape_table html_escape;
+
+//out至少有6 * len字节，返回写入的长度
+static size_t escape_html(char* out, const char* p, size_t len)
+{
+    char* start = out;
+    for(size_t i = 0; i < len; i++)
+    {
+        unsigned char e = html_escape.index[(unsigned char)p[i]];
+        if(!e)
+        {
+            *out++ = p[i];
+            continue;
+        }
+        memcpy(out, escapes[e - 1], escape_lens[e - 1]);
+        out += escape_lens[e - 1];
+    }
+    return out - start;
+}
+
+template_context::~template_context()
+{
+    for(size_t i = 0; i < m_values.size(); i++)
+    {
+        for(size_t j = 0; j < m_values[i].items.size(); j++)
+        {
+            delete m_values[i].items[j];
+        }
+    }
+}
+
+const template_context::value* template_context::find(uint32_t hash, const char* name, int len) const
+{
+    for(size_t i = 0; i < m_values.size(); i++)
+    {
+        const value& v = m_values[i];
+        if(v.hash == hash && (int)v.name.size() == len && memcmp(v.name.data(), name, len) == 0)
+        {
+            return &v;
+        }
+    }
+    return NULL;
+}
+
+//名字已经有值时换成新的类型
+template_context::value* template_context::slot(const char* name, int kind)
+{
+    int len = strlen(name);
+    uint32_t hash = name_hash(name, len);
+    value* v = const_cast<value*>(find(hash, name, len));
+    if(!v)
+    {
+        m_values.push_back(value());
+        v = &m_values.back();
+        v->hash = hash;
+        v->name.assign(name, len);
+        v->kind = kind;
+        v->flag = false;
+    }
+    if(v->kind != kind)
+    {
+        for(size_t i = 0; i < v->items.size(); i++)
+        {
+            delete v->items[i];
+        }
+        v->items.clear();
+        v->text.clear();
+        v->kind = kind;
+    }
+    return v;
+}
+
+void template_context::set(const char* name, const char* value, int len)
+{
+    slot(name, TEXT)->text.assign(value, len < 0 ? strlen(value) : (size_t)len);
+}
+
+void template_context::set_int(const char* name, long long value)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%lld", value);
+    set(name, buf, len);
+}
+
+void template_context::set_flag(const char* name, bool value)
+{
+    slot(name, FLAG)->flag = value;
+}
+
+template_context* template_context::add(const char* name)
+{
+    template_context* item = new template_context;
+    slot(name, LIST)->items.push_back(item);
+    return item;
+}
+
+compiled_template* compiled_template::compile(const std::string& source, std::string* error)
+{
+    if(source.size() > MAX_TEMPLATE_SIZE)
+    {
+        *error = "template too large";
+        return NULL;
+    }
+
+    compiled_template* t = new compiled_template;
+    t->m_source = source;
+    const char* src = t->m_source.data();
+    size_t n = t->m_source.size();
+
+    uint32_t open[MAX_DEPTH];       //还没有结束的区块的指令下标
+    int depth = 0;
+    size_t pos = 0;
+    const char* why = NULL;
+    size_t where = 0;
+
+    while(pos < n)
+    {
+        size_t tag = t->m_source.find("{{", pos);
+        if(tag == std::string::npos)
+        {
+            tag = n;
+        }
+        if(tag > pos)
+        {
+            op o = { OP_TEXT, (uint32_t)pos, (uint32_t)(tag - pos), 0, 0 };
+            t->m_ops.push_back(o);
+        }
+        if(tag == n)
+        {
+            break;
+        }
+
+        where = tag;
+        bool triple = tag + 2 < n && src[tag + 2] == '{';
+        size_t inner = tag + (triple ? 3 : 2);
+        size_t close = t->m_source.find(triple ? "}}}" : "}}", inner);
+        if(close == std::string::npos)
+        {
+            why = "unclosed tag";
+            break;
+        }
+        pos = close + (triple ? 3 : 2);
+
+        char kind = triple ? '{' : src[inner];
+        if(!triple && kind && strchr("#^/&!", kind))
+        {
+            inner++;
+        }
+        else if(!triple)
+        {
+            kind = 0;
+        }
+        if(kind == '!')
+        {
+            continue;
+        }
+
+        //去掉名字两边的空白
+        while(inner < close && (src[inner] == ' ' || src[inner] == '\t'))
+        {
+            inner++;
+        }
+        size_t end = close;
+        while(end > inner && (src[end - 1] == ' ' || src[end - 1] == '\t'))
+        {
+            end--;
+        }
+        if(end == inner)
+        {
+            why = "empty tag";
+            break;
+        }
+
+        op o = { OP_VAR, (uint32_t)inner, (uint32_t)(end - inner), name_hash(src + inner, end - inner), 0 };
+        if(kind == '#' || kind == '^')
+        {
+            if(depth == MAX_DEPTH)
+            {
+                why = "sections nested too deep";
+                break;
+            }
+            o.code = (kind == '#') ? OP_SECTION : OP_INVERTED;
+            open[depth++] = t->m_ops.size();
+        }
+        else if(kind == '/')
+        {
+            const op* start = depth > 0 ? &t->m_ops[open[depth - 1]] : NULL;
+            if(!start || start->len != o.len || memcmp(src + start->off, src + o.off, o.len) != 0)
+            {
+                why = "unmatched section end";
+                break;
+            }
+            o.code = OP_END;
+            o.jump = open[--depth];
+            t->m_ops[o.jump].jump = t->m_ops.size();
+        }
+        else if(kind == '{' || kind == '&')
+        {
+            o.code = OP_RAW;
+        }
+        t->m_ops.push_back(o);
+    }
+
+    if(!why && depth > 0)
+    {
+        why = "unclosed section";
+        where = t->m_ops[open[depth - 1]].off;
+    }
+    if(why)
+    {
+        int line = 1;
+        for(size_t i = 0; i < where && i < n; i++)
+        {
+            line += (src[i] == '\n');
+        }
+        char buf[128];
+        snprintf(buf, sizeof(buf), "line %d: %s", line, why);
+        *error = buf;
+        t->unref();
+        return NULL;
+    }
+    return t;
+}
+
+//从最里层的上下文往外找
+const template_context::value* compiled_template::lookup(const op& o, const template_context** stack, int depth) const
+{
+    const char* name = m_source.data() + o.off;
+    for(int i = depth - 1; i >= 0; i--)
+    {
+        const template_context::value* v = stack[i]->find(o.hash, name, o.len);
+        if(v)
+        {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+void compiled_template::render_range(size_t begin, size_t end, const template_context** stack, int depth, rendered_page* page) const
+{
+    for(size_t i = begin; i < end; i++)
+    {
+        const op& o = m_ops[i];
+        switch(o.code)
+        {
+            case OP_TEXT:
+                page->add_static(m_source.data() + o.off, o.len);
+                break;
+            case OP_VAR:
+            case OP_RAW:
+            {
+                const template_context::value* v = lookup(o, stack, depth);
+                if(v && v->kind == template_context::TEXT)
+                {
+                    page->add_dynamic(v->text.data(), v->text.size(), o.code == OP_VAR);
+                }
+                break;
+            }
+            case OP_SECTION:
+            case OP_INVERTED:
+            {
+                const template_context::value* v = lookup(o, stack, depth);
+                bool on = v && ((v->kind == template_context::TEXT && !v->text.empty())
+                                || (v->kind == template_context::FLAG && v->flag)
+                                || (v->kind == template_context::LIST && !v->items.empty()));
+                if(o.code == OP_INVERTED)
+                {
+                    if(!on)
+                    {
+                        render_range(i + 1, o.jump, stack, depth, page);
+                    }
+                }
+                else if(on && v->kind == template_context::LIST)
+                {
+                    //编译时限制了嵌套层数，stack有MAX_DEPTH + 1个位置
+                    for(size_t j = 0; j < v->items.size(); j++)
+                    {
+                        stack[depth] = v->items[j];
+                        render_range(i + 1, o.jump, stack, depth + 1, page);
+                    }
+                }
+                else if(on)
+                {
+                    render_range(i + 1, o.jump, stack, depth, page);
+                }
+                i = o.jump;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+rendered_page* compiled_template::render(const template_context& ctx)
+{
+    rendered_page* page = new rendered_page(this);
+    const template_context* stack[MAX_DEPTH + 1];
+    stack[0] = &ctx;
+    render_range(0, m_ops.size(), stack, 1, page);
+    page->finish();
+    return page;
+}
+
+rendered_page::rendered_page(compiled_template* tpl):
+    m_tpl(tpl), m_buf(NULL), m_len(0), m_cap(0), m_size(0) {
+
+    m_tpl->ref();
+}
+
+char* rendered_page::reserve(size_t len)
+{
+    if(m_len + len > m_cap)
+    {
+        size_t cap = m_cap ? m_cap * 2 : 1024;
+        while(cap < m_len + len)
+        {
+            cap *= 2;
+        }
+        m_buf = (char*)realloc(m_buf, cap);
+        m_cap = cap;
+    }
+    return m_buf + m_len;
+}
+
+void rendered_page::add_static(const char* data, size_t len)
+{
+    if(len == 0)
+    {
+        return;
+    }
+    if(len < SMALL_TEXT)
+    {
+        add_dynamic(data, len, false);
+        return;
+    }
+    fragment f = { false, data, 0, len };
+    m_fragments.push_back(f);
+    m_size += len;
+}
+
+//缓冲区只追加，上一个片段也是动态的时候新的字节一定紧接在它后面
+void rendered_page::add_dynamic(const char* data, size_t len, bool escape)
+{
+    if(len == 0)
+    {
+        return;
+    }
+    size_t off = m_len;
+    size_t added;
+    if(escape)
+    {
+        added = escape_html(reserve(len * 6), data, len);
+    }
+    else
+    {
+        memcpy(reserve(len), data, len);
+        added = len;
+    }
+    m_len += added;
+    if(!m_fragments.empty() && m_fragments.back().dynamic)
+    {
+        m_fragments.back().len += added;
+    }
+    else
+    {
+        fragment f = { true, NULL, off, added };
+        m_fragments.push_back(f);
+    }
+    m_size += added;
+}
+
+void rendered_page::finish()
+{
+    m_iov.resize(m_fragments.size());
+    for(size_t i = 0; i < m_fragments.size(); i++)
+    {
+        const fragment& f = m_fragments[i];
+        m_iov[i].iov_base = (void*)(f.dynamic ? m_buf + f.off : f.data);
+        m_iov[i].iov_len = f.len;
+    }
+    std::vector<fragment>().swap(m_fragments);
+}
+
+// 线程私有的 名字->模板 表，cursor是它对应的监视事件序号，有新事件就整个清空
+struct local_templates{
+    uint64_t cursor;
+    std::unordered_map<std::string, compiled_template*> templates;
+};
+
+static __thread local_templates* t_local = NULL;
+
+template_cache::template_cache():
+    m_watching(false), m_cursor(0), m_local_hits(0), m_shared_hits(0), m_compiles(0), m_errors(0), m_reloads(0) {
+}
+
+template_cache::~template_cache()
+{
+    for(std::unordered_map<std::string, entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+    {
+        if(it->second.tpl)
+        {
+            it->second.tpl->unref();
+        }
+    }
+}
+
+bool template_cache::init(const char* dir)
+{
+    struct stat st;
+    if(stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        printf("template dir %s: %s\n", dir, strerror(S_ISDIR(st.st_mode) ? errno : ENOTDIR));
+        return false;
+    }
+    m_dir = dir;
+    while(m_dir.size() > 1 && m_dir[m_dir.size() - 1] == '/')
+    {
+        m_dir.erase(m_dir.size() - 1);
+    }
+    m_cursor = m_watcher.channel()->head();
+    m_watching = m_watcher.start(m_dir.c_str());
+    return true;
+}
+
+compiled_template* template_cache::get(const char* name, int len, std::string* error)
+{
+    if(len <= 0 || len >= NAME_LEN)
+    {
+        return NULL;
+    }
+    std::string key(name, len);
+
+    //先记下序号再去全局表取：取的过程中来了新事件，下一次会清空私有表
+    uint64_t head = 0;
+    if(m_watching)
+    {
+        head = m_watcher.channel()->head();
+        if(!t_local)
+        {
+            t_local = new local_templates;
+            t_local->cursor = head;
+        }
+        if(t_local->cursor != head)
+        {
+            for(std::unordered_map<std::string, compiled_template*>::iterator it = t_local->templates.begin();
+                it != t_local->templates.end(); ++it)
+            {
+                it->second->unref();
+            }
+            t_local->templates.clear();
+            t_local->cursor = head;
+        }
+        std::unordered_map<std::string, compiled_template*>::iterator it = t_local->templates.find(key);
+        if(it != t_local->templates.end())
+        {
+            m_local_hits.fetch_add(1, std::memory_order_relaxed);
+            it->second->ref();
+            return it->second;
+        }
+    }
+
+    m_lock.lock();
+    compiled_template* tpl = load(key, error);
+    m_lock.unlock();
+
+    if(tpl && m_watching)
+    {
+        tpl->ref();
+        t_local->templates[key] = tpl;
+    }
+    return tpl;
+}
+
+compiled_template* template_cache::load(const std::string& name, std::string* error)
+{
+    std::string path = m_dir + "/" + name;
+    struct stat st;
+
+    if(m_watching)
+    {
+        sync();
+    }
+    std::unordered_map<std::string, entry>::iterator it = m_entries.find(name);
+    if(it != m_entries.end() && !m_watching)
+    {
+        //没有监视器：文件还是原来那个、没有被修改过才能用
+        const entry& e = it->second;
+        if(::stat(path.c_str(), &st) != 0 || st.st_dev != e.dev || st.st_ino != e.ino || st.st_size != e.size
+            || st.st_mtim.tv_sec != e.mtime.tv_sec || st.st_mtim.tv_nsec != e.mtime.tv_nsec)
+        {
+            drop(it);
+            m_reloads.fetch_add(1, std::memory_order_relaxed);
+            it = m_entries.end();
+        }
+    }
+    if(it != m_entries.end())
+    {
+        if(!it->second.tpl)
+        {
+            if(error)
+            {
+                *error = it->second.error;
+            }
+            return NULL;
+        }
+        m_shared_hits.fetch_add(1, std::memory_order_relaxed);
+        it->second.tpl->ref();
+        return it->second.tpl;
+    }
+
+    //不存在的模板不缓存，每次都到文件系统去找
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+    std::string source;
+    bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if(ok && (size_t)st.st_size <= MAX_TEMPLATE_SIZE)
+    {
+        source.resize(st.st_size);
+        size_t got = 0;
+        while(got < source.size())
+        {
+            ssize_t n = read(fd, &source[got], source.size() - got);
+            if(n <= 0)
+            {
+                break;
+            }
+            got += n;
+        }
+        source.resize(got);
+    }
+    close(fd);
+    if(!ok)
+    {
+        return NULL;
+    }
+
+    entry e;
+    e.tpl = compiled_template::compile(source, &e.error);
+    e.dev = st.st_dev;
+    e.ino = st.st_ino;
+    e.size = st.st_size;
+    e.mtime = st.st_mtim;
+    m_compiles.fetch_add(1, std::memory_order_relaxed);
+    if(!e.tpl)
+    {
+        m_errors.fetch_add(1, std::memory_order_relaxed);
+        printf("template %s: %s\n", path.c_str(), e.error.c_str());
+        if(error)
+        {
+            *error = e.error;
+        }
+    }
+    m_entries[name] = e;
+    if(e.tpl)
+    {
+        e.tpl->ref();
+    }
+    return e.tpl;
+}
+
+void template_cache::drop(std::unordered_map<std::string, entry>::iterator it)
+{
+    if(it->second.tpl)
+    {
+        it->second.tpl->unref();
+    }
+    m_entries.erase(it);
+}
+
+// 和file_cache::sync一样：落后太多或者整棵树失效时全部丢掉
+void template_cache::sync()
+{
+    inval_channel* channel = m_watcher.channel();
+    uint64_t head = channel->head();
+    if(head == m_cursor)
+    {
+        return;
+    }
+
+    bool all = head - m_cursor > (uint64_t)inval_channel::CAPACITY;
+    int type;
+    char path[256];
+    for(uint64_t seq = m_cursor + 1; !all && seq <= head; seq++)
+    {
+        if(!channel->read(seq, type, path, sizeof(path)) || type == INVAL_ALL)
+        {
+            all = true;
+            break;
+        }
+        if(strncmp(path, m_dir.c_str(), m_dir.size()) == 0 && path[m_dir.size()] == '/')
+        {
+            std::unordered_map<std::string, entry>::iterator it = m_entries.find(path + m_dir.size() + 1);
+            if(it != m_entries.end())
+            {
+                drop(it);
+                m_reloads.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+    if(all)
+    {
+        m_reloads.fetch_add(m_entries.size(), std::memory_order_relaxed);
+        while(!m_entries.empty())
+        {
+            drop(m_entries.begin());
+        }
+    }
+    m_cursor = head;
+}
+
+int template_cache::report(char* buf, int len)
+{
+    int n = snprintf(buf, len, "dir %s (%s)\nlocal_hits %llu\nshared_hits %llu\ncompiles %llu\nerrors %llu\nreloads %llu\n",
+                     m_dir.c_str(), m_watching ? "inotify" : "stat",
+                     (unsigned long long)m_local_hits.load(), (unsigned long long)m_shared_hits.load(),
+                     (unsigned long long)m_compiles.load(), (unsigned long long)m_errors.load(),
+                     (unsigned long long)m_reloads.load());
+    m_lock.lock();
+    for(std::unordered_map<std::string, entry>::iterator it = m_entries.begin(); it != m_entries.end() && n < len; ++it)
+    {
+        if(it->second.tpl)
+        {
+            n += snprintf(buf + n, len - n, "%s ops %d\n", it->first.c_str(), it->second.tpl->op_count());
+        }
+        else
+        {
+            n += snprintf(buf + n, len - n, "%s error %s\n", it->first.c_str(), it->second.error.c_str());
+        }
+    }
+    m_lock.unlock();
+    return n < len ? n : len - 1;
+}
+
+template_handler::template_handler(template_cache* cache, const char* prefix):
+    m_cache(cache), m_prefix_len(strlen(prefix)) {
+}
+
+static int hex_value(char c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+//查询串里的%XX和'+'
+//解码后的参数只在这次请求里用，放在请求的arena里
+static void url_decode(const char* p, int len, arena_string& out)
+{
+    out.reserve(len);
+    for(int i = 0; i < len; i++)
+    {
+        if(p[i] == '+')
+        {
+            out.push_back(' ');
+        }
+        else if(p[i] == '%' && i + 2 < len && hex_value(p[i + 1]) >= 0 && hex_value(p[i + 2]) >= 0)
+        {
+            out.push_back((char)(hex_value(p[i + 1]) * 16 + hex_value(p[i + 2])));
+            i += 2;
+        }
+        else
+        {
+            out.push_back(p[i]);
+        }
+    }
+}
+
+bool template_handler::handle(http_request& req, http_response& resp)
+{
+    //<prefix><name> -> <name>.html，不允许跳出模板目录
+    int name_len = req.path_len - m_prefix_len;
+    const char* name = req.path + m_prefix_len;
+    char file[template_cache::NAME_LEN];
+    if(name_len <= 0 || name_len + 5 >= (int)sizeof(file) || name[0] == '/'
+        || memmem(name, name_len, "..", 2) != NULL)
+    {
+        return resp.status(404, "Not Found") && resp.body("text/plain", "no such template\n", 17);
+    }
+    memcpy(file, name, name_len);
+    memcpy(file + name_len, ".html", 5);
+
+    std::string error;
+    compiled_template* tpl = m_cache->get(file, name_len + 5, &error);
+    if(!tpl)
+    {
+        if(error.empty())
+        {
+            return resp.status(404, "Not Found") && resp.body("text/plain", "no such template\n", 17);
+        }
+        error = "template error: " + error + "\n";
+        return resp.status(500, "Internal Error") && resp.body("text/plain", error.data(), error.size());
+    }
+
+    template_context ctx;
+    ctx.set("path", req.path, req.path_len);
+    if(req.host)
+    {
+        ctx.set("host", req.host);
+    }
+    char now[32];
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    ctx.set("time", now, strftime(now, sizeof(now), "%Y-%m-%d %H:%M:%S", &tm));
+
+    //查询参数：同时作为单独的名字和params列表
+    for(const char* p = req.query; p && *p; )
+    {
+        const char* amp = strchr(p, '&');
+        int len = amp ? amp - p : strlen(p);
+        const char* eq = (const char*)memchr(p, '=', len);
+        int key_len = eq ? eq - p : len;
+        if(key_len > 0)
+        {
+            arena_string key((arena_allocator<char>(req.arena)));
+            arena_string value((arena_allocator<char>(req.arena)));
+            url_decode(p, key_len, key);
+            if(eq)
+            {
+                url_decode(eq + 1, len - key_len - 1, value);
+            }
+            template_context* item = ctx.add("params");
+            item->set("name", key.data(), key.size());
+            item->set("value", value.data(), value.size());
+            ctx.set(key.c_str(), value.data(), value.size());
+        }
+        p = amp ? amp + 1 : NULL;
+    }
+
+    rendered_page* page = tpl->render(ctx);
+    tpl->unref();
+    return resp.page("text/html; charset=utf-8", page);
+}
+
+bool template_stats_handler::handle(http_request& req, http_response& resp)
+{
+    char body[1024];
+    int len = cache->report(body, sizeof(body));
+    return resp.body("text/plain", body, len);
+}
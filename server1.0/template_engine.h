@@ -0,0 +1,252 @@
+#ifndef TEMPLATE_ENGINE_H__
+#define TEMPLATE_ENGINE_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "locker.h"
+#include "file_watcher.h"
+#include "router.h"
+
+// 服务端HTML模板（-t template_dir）
+// 语法是mustache的子集：
+//      {{name}}                转义后输出（& < > " '）
+//      {{{name}}} 或 {{&name}}  原样输出
+//      {{#name}}...{{/name}}   值为真时输出一次，是列表时每一项输出一次（项里找不到的名字再到外层找）
+//      {{^name}}...{{/name}}   值为假、空串、空列表或者没有这个名字时输出
+//      {{! 注释}}
+// 模板文件只解析一次，编译成指令数组，静态文本是指向不可变源缓冲区的(偏移,长度)；
+// 渲染不拼接字符串，结果是一组iovec：静态片段直接指向模板的源，动态的值转义后追加到页面自己的缓冲区，
+// 很短的静态片段拷贝进缓冲区和相邻的值合并，减少iovec的个数。HTTP/1.1连接用writev直接发送这组iovec。
+// 模板被修改后下一次使用时重新编译，正在发送的页面仍然引用旧的版本。
+
+// 处理器填写的渲染上下文：名字 -> 文本、真假或者子上下文的列表
+class template_context{
+
+public:
+    template_context() {}
+    ~template_context();
+
+    void set(const char* name, const char* value, int len = -1);
+    void set(const char* name, const std::string& value) { set(name, value.data(), value.size()); }
+    void set_int(const char* name, long long value);
+    void set_flag(const char* name, bool value);
+
+    //向列表name追加一项并返回它，项归上下文所有
+    template_context* add(const char* name);
+
+private:
+    friend class compiled_template;
+
+    enum KIND {TEXT, FLAG, LIST};
+
+    struct value{
+        uint32_t hash;
+        std::string name;
+        int kind;
+        std::string text;
+        bool flag;
+        std::vector<template_context*> items;
+    };
+
+    value* slot(const char* name, int kind);
+    const value* find(uint32_t hash, const char* name, int len) const;
+
+    template_context(const template_context&);
+    template_context& operator=(const template_context&);
+
+private:
+    std::vector<value> m_values;        //一般只有几个到十几个，线性查找比哈希表快
+};
+
+class rendered_page;
+
+// 编译好的模板：创建后不再修改，最后一个引用释放时删除
+class compiled_template{
+
+public:
+    static const int MAX_DEPTH = 16;        //区块的最大嵌套层数
+
+    //编译失败返回NULL，error里是原因和行号
+    static compiled_template* compile(const std::string& source, std::string* error);
+
+    void ref() { m_refs.fetch_add(1, std::memory_order_relaxed); }
+    void unref()
+    {
+        if(m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete this;
+        }
+    }
+
+    //渲染成一个新的页面，页面持有模板的一个引用
+    rendered_page* render(const template_context& ctx);
+
+    int op_count() const { return m_ops.size(); }
+
+private:
+    /*
+        指令
+        OP_TEXT     :输出源里的[off, off+len)
+        OP_VAR      :输出名字为源里[off, off+len)的值，转义
+        OP_RAW      :同上，不转义
+        OP_SECTION  :区块，jump是对应OP_END的下标
+        OP_INVERTED :反向区块，jump是对应OP_END的下标
+        OP_END      :区块结束
+    */
+    enum OP {OP_TEXT, OP_VAR, OP_RAW, OP_SECTION, OP_INVERTED, OP_END};
+
+    struct op{
+        uint8_t code;
+        uint32_t off;
+        uint32_t len;
+        uint32_t hash;          //名字的哈希
+        uint32_t jump;
+    };
+
+    compiled_template() : m_refs(1) {}
+    ~compiled_template() {}
+
+    void render_range(size_t begin, size_t end, const template_context** stack, int depth, rendered_page* page) const;
+    const template_context::value* lookup(const op& o, const template_context** stack, int depth) const;
+
+private:
+    std::atomic<int> m_refs;
+    std::string m_source;
+    std::vector<op> m_ops;
+};
+
+// 一次渲染的结果：一组iovec，静态片段指向模板的源，动态片段指向m_buf
+// 由处理器交给http_response::page，之后归连接所有；HTTP/1.1连接发送时原地调整iovec
+class rendered_page{
+
+public:
+    static const size_t SMALL_TEXT = 48;    //短于这个长度的静态片段拷贝进缓冲区
+
+    explicit rendered_page(compiled_template* tpl);
+    //析构和flatten是router.cpp里response_sink::page的默认实现要用的，放在头文件里，
+    //只用路由和微缓存的程序（tools/cache_bench）不需要链接模板引擎和文件监视器
+    ~rendered_page()
+    {
+        free(m_buf);
+        m_tpl->unref();
+    }
+
+    struct iovec* iov() { return m_iov.data(); }
+    int iov_count() const { return m_iov.size(); }
+    size_t size() const { return m_size; }
+
+    //拼接成一块（不能直接发送iovec的连接使用）
+    void flatten(std::string* out) const
+    {
+        out->reserve(out->size() + m_size);
+        for(size_t i = 0; i < m_iov.size(); i++)
+        {
+            out->append((const char*)m_iov[i].iov_base, m_iov[i].iov_len);
+        }
+    }
+
+private:
+    friend class compiled_template;
+
+    void add_static(const char* data, size_t len);
+    void add_dynamic(const char* data, size_t len, bool escape);
+    void finish();
+    char* reserve(size_t len);              //保证m_buf在m_len之后至少还有len字节
+
+    //渲染期间m_buf会扩容，动态片段先记偏移，finish时换成指针
+    struct fragment{
+        bool dynamic;
+        const char* data;       //静态片段
+        size_t off;             //动态片段在m_buf里的偏移
+        size_t len;
+    };
+
+private:
+    compiled_template* m_tpl;
+    char* m_buf;                //动态片段和拷贝进来的短静态片段，只追加
+    size_t m_len;
+    size_t m_cap;
+    std::vector<fragment> m_fragments;
+    std::vector<struct iovec> m_iov;
+    size_t m_size;
+};
+
+// 模板目录的缓存，所有线程共享
+// 目录上有自己的文件监视器，模板文件的修改、替换、删除都会让缓存的版本失效；
+// 每个线程还有一份私有的 名字->模板 表，没有新的监视事件时命中不加锁（一个进程只有一个模板缓存）；
+// inotify不可用时每次使用都stat比较修改时间
+class template_cache{
+
+public:
+    static const int NAME_LEN = 128;
+
+    template_cache();
+    ~template_cache();
+
+    bool init(const char* dir);
+
+    //返回加了引用的模板，不存在或者编译失败返回NULL（编译失败时error是原因）
+    compiled_template* get(const char* name, int len, std::string* error = NULL);
+
+    int report(char* buf, int len);
+
+private:
+    struct entry{
+        compiled_template* tpl;     //编译失败时为NULL，保留错误直到文件再次变化
+        std::string error;
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+    };
+
+    compiled_template* load(const std::string& name, std::string* error);     //持有m_lock时调用，返回加了引用的模板
+    void sync();                                            //持有m_lock时调用，取出监视器的新事件
+    void drop(std::unordered_map<std::string, entry>::iterator it);
+
+private:
+    std::string m_dir;
+    file_watcher m_watcher;
+    bool m_watching;
+
+    locker m_lock;
+    uint64_t m_cursor;                                  //全局表已经处理到的监视事件序号
+    std::unordered_map<std::string, entry> m_entries;
+
+    std::atomic<uint64_t> m_local_hits;     //线程私有表命中
+    std::atomic<uint64_t> m_shared_hits;    //全局表命中
+    std::atomic<uint64_t> m_compiles;
+    std::atomic<uint64_t> m_errors;
+    std::atomic<uint64_t> m_reloads;        //因为文件变化丢掉的版本
+};
+
+// GET <prefix><name>：渲染模板目录下的<name>.html
+// 上下文是请求本身：查询串的每个参数（{{参数名}}）、{{#params}}{{name}}={{value}}{{/params}}、{{path}}、{{host}}、{{time}}
+class template_handler : public request_handler{
+
+public:
+    template_handler(template_cache* cache, const char* prefix);
+
+    bool handle(http_request& req, http_response& resp);
+
+private:
+    template_cache* m_cache;
+    int m_prefix_len;
+};
+
+// GET /templatez
+class template_stats_handler : public request_handler{
+
+public:
+    template_cache* cache;
+
+    bool handle(http_request& req, http_response& resp);
+};
+
+#endif
@@ -2,29 +2,94 @@
 #define THREADPOOL_H__
 
 #include <pthread.h>
-#include <list>
 #include "locker.h"
 #include <stdio.h>
+#include <unistd.h>
 #include <exception>
+#include "placement.h"
+#include "watchdog.h"
+#include "profiler.h"
 
 // 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类
+// 指定了placement时每个NUMA节点一个请求队列，工作线程绑定到各自的CPU，优先处理本节点队列的任务，
+// 空闲时才去处理其它节点积压的任务
+// 开启看门狗（start_watchdog）后每个工作线程的任务开始/结束都记在状态槽里，卡住的线程按配置记录、顶替或者减载
+// 每个队列分LANES个优先级（0最高）：取任务时先取优先级高的，但低优先级队首等待超过AGING_MS后照样轮到它，不会饿死
 
 template<typename T>
 class threadpool{
 
 public:
     /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量*/
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    /*指定了place时线程数量由它决定（每个worker CPU一个）*/
+    /*role是工作线程在profiler里的名字*/
+    threadpool(int thread_number = 8, int max_requests = 10000, placement* place = NULL, const char* role = "worker");
     ~threadpool();
 
-    //添加任务请求
-    bool append(T* request);
+    //添加任务请求，queue是处理这个请求的节点的队列，lane是优先级；队列满了（或者正在减载）返回false，调用者要自己处理这个任务
+    bool append(T* request, int queue = 0, int lane = 0);
 
+    //任务运行超过stall_ms算卡住，按reaction处理；只能调用一次
+    bool start_watchdog(int stall_ms, stall_watch::REACTION reaction);
+
+    //每个线程的状态和卡住的统计；stacks为true时抓取所有忙碌线程的调用栈
+    int report(char* buf, int len, bool stacks);
+
+    static const int STEAL_INTERVAL_MS = 1;    //本节点空闲这么久后检查其它节点的队列
+    static const int SHED_BACKLOG = 4;          //减载期间每个正常的线程最多积压这么多任务
+    static const int LANES = 3;                 //优先级的个数
+    static const int AGING_MS = 20;             //低优先级的任务最多被插队这么久
 
 private:
+    //锁和信号量各占一个缓存行：主线程post的时候不会把工作线程正在读的队列所在的行弄失效
+    struct queued_task{
+        T* request;
+        uint64_t since_ms;      //入队时间，用来防止低优先级饿死
+    };
+
+    //定长的环形队列，构造时一次分配好，入队出队都不分配内存
+    struct task_ring{
+        queued_task* slots;
+        size_t capacity;
+        size_t head;
+        size_t size;
+
+        bool empty() const { return size == 0; }
+        queued_task& front() { return slots[head]; }
+        void push_back(const queued_task& task)
+        {
+            slots[(head + size) % capacity] = task;
+            size++;
+        }
+        void pop_front()
+        {
+            head = (head + 1) % capacity;
+            size--;
+        }
+    };
+
+    struct work_queue{
+        task_ring tasks[LANES];                 //请求队列，每个优先级一条
+        size_t count;                           //所有优先级的任务数
+        cache_aligned<futex_locker> lock;   //保护请求队列的互斥锁，临界区只有队列操作，先自旋再挂起
+        cache_aligned<futex_sem> stat;      //是否有任务需要处理的信号量，没有线程在等时post不进内核
+    };
+
+    struct worker_arg{
+        threadpool* pool;
+        int index;
+    };
+
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void* worker(void * arg);
-    void run();
+    void run(int index);
+    T* take(work_queue& q);
+    bool spawn(int slot, int home);
+
+    static void* watchdog(void* arg);
+    void watch();
+    void on_stall(int slot, uint64_t age_ms);
+    size_t queued();
 
 private:
     
@@ -34,43 +99,87 @@ private:
 
     int m_max_requests;//请求队列中最多允许的、等待处理的请求的数量
 
-    std::list< T*> m_workqueue;//请求队列
+    int m_queue_count;
+
+    work_queue* m_queues;//每个节点一个请求队列，没有placement时只有一个
+
+    worker_arg* m_args;
 
-    locker m_queuelocker;//保护请求队列的互斥锁
+    placement* m_placement;
 
-    sem m_queuestat;//是否有任务需要处理的信号量
+    const char* m_role;
 
     bool m_stop;//是否结束线程
 
+    //看门狗：槽的个数是线程数的两倍，多出来的给顶替卡住线程的新线程
+    int m_slots;
+    worker_status* m_status;
+    std::atomic<int> m_stall_ms;            //0表示没有开启看门狗
+    std::atomic<stall_watch::REACTION> m_reaction;
+    std::atomic<int> m_stuck;               //当前卡住的线程数
+    std::atomic<uint64_t> m_stalls;         //发现的卡住次数
+    std::atomic<uint64_t> m_stall_ms_total; //卡住的任务最终花掉的时间
+    std::atomic<uint64_t> m_stall_ms_max;
+    std::atomic<uint64_t> m_replacements;
+    std::atomic<uint64_t> m_shed;           //减载拒绝的任务
+    std::atomic<uint64_t> m_rejected;       //队列满拒绝的任务
+
+    std::atomic<uint64_t> m_lane_tasks[LANES];  //每个优先级处理的任务数
+    std::atomic<uint64_t> m_aged;               //因为等太久而插到高优先级前面的任务数
+
 };
 
 template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests):
-    m_thread_number(thread_number), m_max_requests(max_requests),
-    m_stop(false), m_threads(NULL) {
+threadpool<T>::threadpool(int thread_number, int max_requests, placement* place, const char* role):
+    m_thread_number(place ? place->workers() : thread_number), m_threads(NULL), m_max_requests(max_requests),
+    m_queue_count(place ? place->queues() : 1), m_placement(place), m_role(role), m_stop(false),
+    m_stall_ms(0), m_reaction(stall_watch::LOG), m_stuck(0), m_stalls(0), m_stall_ms_total(0), m_stall_ms_max(0),
+    m_replacements(0), m_shed(0), m_rejected(0) {
 
-        if((thread_number <= 0) || (max_requests <= 0))
+        if((m_thread_number <= 0) || (max_requests <= 0))
         {
             throw std::exception();
         }
 
-        m_threads = new pthread_t[m_thread_number];
-        if(!m_threads)
+        m_slots = m_thread_number * 2;
+        m_threads = new pthread_t[m_slots];
+        m_args = new worker_arg[m_slots];
+        m_queues = new work_queue[m_queue_count];
+        for(int i = 0; i < m_queue_count; i++)
         {
-            throw std::exception();
+            m_queues[i].count = 0;
+            //append在count超过m_max_requests之前都接受，一个优先级最多可能有m_max_requests + 1个任务
+            for(int j = 0; j < LANES; j++)
+            {
+                task_ring& ring = m_queues[i].tasks[j];
+                ring.capacity = m_max_requests + 1;
+                ring.slots = new queued_task[ring.capacity];
+                ring.head = ring.size = 0;
+            }
+        }
+        for(int i = 0; i < LANES; i++)
+        {
+            m_lane_tasks[i] = 0;
+        }
+        m_aged = 0;
+        m_status = new worker_status[m_slots];
+        for(int i = 0; i < m_slots; i++)
+        {
+            m_status[i].epoch = 0;
+            m_status[i].used = false;
+            m_status[i].tid = 0;
+            m_status[i].retire = false;
+            m_status[i].reported_epoch = 0;
+            m_status[i].depth = 0;
+            m_status[i].stack_seq = 0;
         }
 
         //// 创建thread_number 个线程，并将他们设置为脱离线程
-        for(int i = 0; i < thread_number; i++)
+        for(int i = 0; i < m_thread_number; i++)
         {
             printf("create the %dth thread\n",i);
 
-            if(pthread_create(m_threads+i ,NULL, worker, this) != 0){
-                delete[] m_threads;
-                throw std::exception();
-            }
-
-            if(pthread_detach(m_threads[i])){
+            if(!spawn(i, i)){
                 delete[] m_threads;
                 throw std::exception();
             }
@@ -79,6 +188,25 @@ threadpool<T>::threadpool(int thread_number, int max_requests):
 
     }
 
+//在槽slot上创建一个工作线程，home决定它绑定的CPU和取任务的队列
+template<typename T>
+bool threadpool<T>::spawn(int slot, int home){
+
+    m_args[slot].pool = this;
+    m_args[slot].index = slot;
+    m_status[slot].home = home;
+    m_status[slot].retire.store(false, std::memory_order_relaxed);
+    m_status[slot].used.store(true, std::memory_order_release);
+    if(pthread_create(m_threads+slot ,NULL, worker, m_args + slot) != 0){
+        m_status[slot].used.store(false, std::memory_order_release);
+        return false;
+    }
+    if(pthread_detach(m_threads[slot])){
+        return false;
+    }
+    return true;
+}
+
 template<typename T>
 threadpool<T>::~threadpool(){
 
@@ -88,18 +216,41 @@ threadpool<T>::~threadpool(){
 }
 
 template<typename T>
-bool threadpool<T>::append(T* request){
+bool threadpool<T>::append(T* request, int queue, int lane){
+
+    work_queue& q = m_queues[(queue >= 0 && queue < m_queue_count) ? queue : 0];
+    if(lane < 0 || lane >= LANES)
+    {
+        lane = LANES - 1;
+    }
+    uint64_t now = stall_watch::now_ms();
 
     //// 操作工作队列时一定要加锁，因为它被所有线程共享
-    m_queuelocker.lock();
-    if(m_workqueue.size() > m_max_requests){
-        m_queuelocker.unlock();
+    q.lock.lock();
+    //构造函数保证了 m_max_requests > 0
+    if(q.count > (size_t)m_max_requests){
+        q.lock.unlock();
+        m_rejected.fetch_add(1, std::memory_order_relaxed);
         return false;
     }
 
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    //有线程卡住时不让任务排在它们后面越积越多：只保留正常线程很快就能处理掉的积压
+    int stuck = m_stuck.load(std::memory_order_relaxed);
+    if(stuck > 0 && m_reaction.load(std::memory_order_relaxed) == stall_watch::SHED)
+    {
+        int healthy = m_thread_number - stuck;
+        if((int)q.count >= (healthy > 0 ? healthy : 0) * SHED_BACKLOG)
+        {
+            q.lock.unlock();
+            m_shed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+
+    q.tasks[lane].push_back({request, now});
+    q.count++;
+    q.lock.unlock();
+    q.stat.post();
     return true;
 
 }
@@ -107,41 +258,303 @@ bool threadpool<T>::append(T* request){
 template<typename T>
 void* threadpool<T>::worker(void * arg){
 
-    threadpool * pool = (threadpool *)arg;// this
-    pool->run();
+    worker_arg * warg = (worker_arg *)arg;
+    threadpool * pool = warg->pool;// this
+    pool->run(warg->index);
 
     return pool;
 }
 
+//调用者已经通过信号量认领了一个任务，队列里一定有
+//取优先级最高的非空队列的队首；低优先级的队首已经等了AGING_MS以上、并且比它更早入队时先取低优先级的
 template<typename T>
-void threadpool<T>::run(){
+T* threadpool<T>::take(work_queue& q){
 
-    while(!m_stop)
+    uint64_t now = stall_watch::now_ms();
+    q.lock.lock();
+    int first = -1, pick = -1;
+    for(int i = 0; i < LANES; i++)
     {
-
-        m_queuestat.wait();
-        m_queuelocker.lock();
-
-        if(m_workqueue.empty())
+        if(q.tasks[i].empty())
+        {
+            continue;
+        }
+        if(pick < 0)
         {
-            m_queuelocker.unlock();
+            first = pick = i;
             continue;
         }
+        uint64_t since = q.tasks[i].front().since_ms;
+        if(now >= since + AGING_MS && since < q.tasks[pick].front().since_ms)
+        {
+            pick = i;
+        }
+    }
+    T* request = NULL;
+    if(pick >= 0)
+    {
+        if(pick != first)
+        {
+            m_aged.fetch_add(1, std::memory_order_relaxed);
+        }
+        request = q.tasks[pick].front().request;
+        q.tasks[pick].pop_front();
+        q.count--;
+        m_lane_tasks[pick].fetch_add(1, std::memory_order_relaxed);
+    }
+    q.lock.unlock();
+    return request;
+}
+
+template<typename T>
+void threadpool<T>::run(int index){
+
+    worker_status& status = m_status[index];
+    stall_watch::bind(&status);
+    profiler::register_thread(m_role);
+
+    int home = 0;
+    if(m_placement)
+    {
+        m_placement->pin_worker(status.home);
+        home = m_placement->worker_queue(status.home);
+    }
 
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
+    while(!m_stop)
+    {
+        T* request = NULL;
+        if(m_queue_count == 1)
+        {
+            m_queues[0].stat.wait();
+            request = take(m_queues[0]);
+            if(m_placement)
+            {
+                m_placement->count_local_task();
+            }
+        }
+        else if(m_queues[home].stat.timedwait(STEAL_INTERVAL_MS))
+        {
+            request = take(m_queues[home]);
+            m_placement->count_local_task();
+        }
+        else
+        {
+            //本节点没有任务：帮其它节点处理积压的请求（跨节点访问连接的内存）
+            for(int i = 1; i < m_queue_count && !request; i++)
+            {
+                work_queue& q = m_queues[(home + i) % m_queue_count];
+                if(q.stat.trywait())
+                {
+                    request = take(q);
+                    m_placement->count_stolen();
+                }
+            }
+        }
 
         if(!request)
         {
             continue;
         }
 
+        status.begin(request);
         request->process();
+        status.end();
 
+        int stall_ms = m_stall_ms.load(std::memory_order_relaxed);
+        if(stall_ms > 0)
+        {
+            uint64_t took = stall_watch::now_ms() - status.since_ms.load(std::memory_order_relaxed);
+            if(took >= (uint64_t)stall_ms)
+            {
+                m_stall_ms_total.fetch_add(took, std::memory_order_relaxed);
+                uint64_t max = m_stall_ms_max.load(std::memory_order_relaxed);
+                while(took > max && !m_stall_ms_max.compare_exchange_weak(max, took, std::memory_order_relaxed))
+                {
+                }
+            }
+            //已经有线程顶替了：退出，把槽让出来
+            if(status.retire.load(std::memory_order_acquire))
+            {
+                printf("threadpool: stalled worker %d finished after %llu ms, exiting\n", index, (unsigned long long)took);
+                profiler::unregister_thread();
+                stall_watch::unbind(&status);
+                status.used.store(false, std::memory_order_release);
+                return;
+            }
+        }
+
+    }
+
+}
+
+template<typename T>
+bool threadpool<T>::start_watchdog(int stall_ms, stall_watch::REACTION reaction){
+
+    if(m_stall_ms.load() > 0 || stall_ms <= 0)
+    {
+        return false;
+    }
+    m_reaction.store(reaction);
+    m_stall_ms.store(stall_ms);
+
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, watchdog, this) != 0)
+    {
+        m_stall_ms.store(0);
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+template<typename T>
+void* threadpool<T>::watchdog(void* arg){
+
+    ((threadpool*)arg)->watch();
+    return NULL;
+}
+
+//每stall_ms/4扫描一次，卡住的时间最多多算四分之一
+template<typename T>
+void threadpool<T>::watch(){
+
+    int stall_ms = m_stall_ms.load();
+    int interval = stall_ms / 4;
+    if(interval < 10)
+    {
+        interval = 10;
+    }
+    while(!m_stop)
+    {
+        usleep(interval * 1000);
 
+        uint64_t now = stall_watch::now_ms();
+        int stuck = 0;
+        for(int i = 0; i < m_slots; i++)
+        {
+            worker_status& w = m_status[i];
+            if(!w.used.load(std::memory_order_acquire))
+            {
+                continue;
+            }
+            uint64_t epoch = w.epoch.load(std::memory_order_acquire);
+            if(!(epoch & 1))
+            {
+                continue;
+            }
+            uint64_t since = w.since_ms.load(std::memory_order_relaxed);
+            if(now < since || now - since < (uint64_t)stall_ms)
+            {
+                continue;
+            }
+            //已经被顶替的不再算在正常线程的缺口里
+            if(!w.retire.load(std::memory_order_relaxed))
+            {
+                stuck++;
+            }
+            if(w.reported_epoch != epoch)
+            {
+                w.reported_epoch = epoch;
+                on_stall(i, now - since);
+            }
+        }
+        m_stuck.store(stuck, std::memory_order_relaxed);
     }
+}
 
+template<typename T>
+void threadpool<T>::on_stall(int slot, uint64_t age_ms){
+
+    worker_status& w = m_status[slot];
+    m_stalls.fetch_add(1, std::memory_order_relaxed);
+    printf("threadpool: worker %d stuck for %llu ms on task %p (reaction %s)\n", slot, (unsigned long long)age_ms,
+           w.task.load(std::memory_order_relaxed), stall_watch::reaction_name(m_reaction.load()));
+    if(stall_watch::capture(&w, 100))
+    {
+        char stack[4096];
+        stall_watch::format_stack(&w, stack, sizeof(stack));
+        printf("%s", stack);
+    }
+    fflush(stdout);
+
+    if(m_reaction.load() != stall_watch::REPLACE)
+    {
+        return;
+    }
+    for(int i = 0; i < m_slots; i++)
+    {
+        if(!m_status[i].used.load(std::memory_order_acquire))
+        {
+            if(spawn(i, w.home))
+            {
+                w.retire.store(true, std::memory_order_release);
+                m_replacements.fetch_add(1, std::memory_order_relaxed);
+                printf("threadpool: worker %d replaces stalled worker %d\n", i, slot);
+            }
+            return;
+        }
+    }
+    printf("threadpool: no free slot to replace stalled worker %d\n", slot);
+}
+
+template<typename T>
+size_t threadpool<T>::queued(){
+
+    size_t n = 0;
+    for(int i = 0; i < m_queue_count; i++)
+    {
+        m_queues[i].lock.lock();
+        n += m_queues[i].count;
+        m_queues[i].lock.unlock();
+    }
+    return n;
+}
+
+template<typename T>
+int threadpool<T>::report(char* buf, int len, bool stacks){
+
+    uint64_t now = stall_watch::now_ms();
+    int n = snprintf(buf, len, "threads %d\nstall_ms %d\nreaction %s\nqueued %zu\nstuck %d\nstalls %llu\n"
+                     "stall_ms_total %llu\nstall_ms_max %llu\nreplacements %llu\nshed %llu\nrejected %llu\n",
+                     m_thread_number, m_stall_ms.load(), stall_watch::reaction_name(m_reaction.load()), queued(),
+                     m_stuck.load(std::memory_order_relaxed),
+                     (unsigned long long)m_stalls.load(std::memory_order_relaxed),
+                     (unsigned long long)m_stall_ms_total.load(std::memory_order_relaxed),
+                     (unsigned long long)m_stall_ms_max.load(std::memory_order_relaxed),
+                     (unsigned long long)m_replacements.load(std::memory_order_relaxed),
+                     (unsigned long long)m_shed.load(std::memory_order_relaxed),
+                     (unsigned long long)m_rejected.load(std::memory_order_relaxed));
+    for(int i = 0; i < LANES && n < len; i++)
+    {
+        n += snprintf(buf + n, len - n, "lane %d tasks %llu\n", i,
+                      (unsigned long long)m_lane_tasks[i].load(std::memory_order_relaxed));
+    }
+    if(n < len)
+    {
+        n += snprintf(buf + n, len - n, "aged %llu\n", (unsigned long long)m_aged.load(std::memory_order_relaxed));
+    }
+    for(int i = 0; i < m_slots && n < len; i++)
+    {
+        worker_status& w = m_status[i];
+        if(!w.used.load(std::memory_order_acquire))
+        {
+            continue;
+        }
+        if(!w.busy())
+        {
+            n += snprintf(buf + n, len - n, "worker %d idle\n", i);
+            continue;
+        }
+        uint64_t since = w.since_ms.load(std::memory_order_relaxed);
+        n += snprintf(buf + n, len - n, "worker %d busy %llu ms task %p%s\n", i,
+                      (unsigned long long)(now > since ? now - since : 0), w.task.load(std::memory_order_relaxed),
+                      w.retire.load(std::memory_order_relaxed) ? " (replaced)" : "");
+        if(stacks && n < len && stall_watch::capture(&w, 100))
+        {
+            n += stall_watch::format_stack(&w, buf + n, len - n);
+        }
+    }
+    return (n < len) ? n : len - 1;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,280 @@
+#include "tls.h"
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef USE_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+//服务端的偏好顺序：h2优先
+static const unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+
+//ALPN：按我们的偏好选择客户端也支持的协议，都不支持时不协商
+static int alpn_select(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+                       const unsigned char* in, unsigned int inlen, void* arg)
+{
+    if(SSL_select_next_proto((unsigned char**)out, outlen, alpn_protos, sizeof(alpn_protos) - 1,
+                             in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+tls_context::tls_context():m_ctx(NULL)
+{
+
+}
+
+tls_context::~tls_context()
+{
+    if(m_ctx)
+    {
+        SSL_CTX_free(m_ctx);
+    }
+}
+
+bool tls_context::init(const char* cert_file, const char* key_file)
+{
+    m_ctx = SSL_CTX_new(TLS_server_method());
+    if(!m_ctx)
+    {
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+
+    //写的时候允许只发送一部分、重试时缓冲区地址可以变化，与writev的用法一致
+    SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                            | SSL_MODE_RELEASE_BUFFERS);
+
+    //握手完成后由OpenSSL尝试开启内核TLS（需要内核tls模块和AES-GCM等内核支持的套件）
+    SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_ciphersuites(m_ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+
+    //会话恢复：进程内所有连接共享的服务端会话缓存，TLS1.3再发一张会话票据
+    static const unsigned char sid_ctx[] = "webserver";
+    SSL_CTX_set_session_id_context(m_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(m_ctx, 20480);
+    SSL_CTX_set_timeout(m_ctx, 3600);
+    SSL_CTX_set_num_tickets(m_ctx, 1);
+
+    SSL_CTX_set_alpn_select_cb(m_ctx, alpn_select, NULL);
+
+    if(SSL_CTX_use_certificate_chain_file(m_ctx, cert_file) != 1
+        || SSL_CTX_use_PrivateKey_file(m_ctx, key_file, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(m_ctx) != 1)
+    {
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(m_ctx);
+        m_ctx = NULL;
+        return false;
+    }
+    return true;
+}
+
+SSL* tls_context::accept(int sockfd)
+{
+    SSL* ssl = SSL_new(m_ctx);
+    if(!ssl)
+    {
+        return NULL;
+    }
+    if(SSL_set_fd(ssl, sockfd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+//把SSL_get_error转换成TLS_RESULT
+static TLS_RESULT tls_error(SSL* ssl, int ret)
+{
+    switch(SSL_get_error(ssl, ret))
+    {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        case SSL_ERROR_ZERO_RETURN:
+            return TLS_CLOSED;
+        case SSL_ERROR_SYSCALL:
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return TLS_WANT_READ;
+            }
+            ERR_clear_error();
+            return TLS_ERROR;
+        default:
+            ERR_clear_error();
+            return TLS_ERROR;
+    }
+}
+
+TLS_RESULT tls_handshake(SSL* ssl)
+{
+    int ret = SSL_do_handshake(ssl);
+    if(ret == 1)
+    {
+        return TLS_OK;
+    }
+    return tls_error(ssl, ret);
+}
+
+int tls_read(SSL* ssl, char* buf, int len, TLS_RESULT* result)
+{
+    int ret = SSL_read(ssl, buf, len);
+    if(ret > 0)
+    {
+        *result = TLS_OK;
+        return ret;
+    }
+    *result = tls_error(ssl, ret);
+    return ret;
+}
+
+int tls_writev(SSL* ssl, int sockfd, const struct iovec* iov, int iov_count, TLS_RESULT* result)
+{
+    //内核加密：和明文一样直接writev，mmap的文件页不经过用户空间加密
+    if(tls_ktls_send(ssl))
+    {
+        int ret = writev(sockfd, iov, iov_count);
+        if(ret < 0)
+        {
+            *result = (errno == EAGAIN || errno == EWOULDBLOCK) ? TLS_WANT_WRITE : TLS_ERROR;
+            return ret;
+        }
+        *result = TLS_OK;
+        return ret;
+    }
+
+    int total = 0;
+    for(int i = 0; i < iov_count; i++)
+    {
+        if(iov[i].iov_len == 0)
+        {
+            continue;
+        }
+        int ret = SSL_write(ssl, iov[i].iov_base, iov[i].iov_len);
+        if(ret <= 0)
+        {
+            *result = tls_error(ssl, ret);
+            //已经发送了一部分，先返回已发送的字节数
+            if(total > 0 && (*result == TLS_WANT_READ || *result == TLS_WANT_WRITE))
+            {
+                *result = TLS_OK;
+                return total;
+            }
+            return ret;
+        }
+        total += ret;
+        if((size_t)ret < iov[i].iov_len)
+        {
+            break;
+        }
+    }
+    *result = TLS_OK;
+    return total;
+}
+
+bool tls_ktls_send(SSL* ssl)
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+}
+
+bool tls_ktls_recv(SSL* ssl)
+{
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0;
+}
+
+bool tls_pending(SSL* ssl)
+{
+    return SSL_pending(ssl) > 0;
+}
+
+bool tls_session_reused(SSL* ssl)
+{
+    return SSL_session_reused(ssl) == 1;
+}
+
+void tls_free(SSL* ssl)
+{
+    //非阻塞socket上不等待对方的close_notify
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    ERR_clear_error();
+}
+
+#else
+
+// 没有定义USE_TLS：只提供占位实现，服务器只支持明文
+
+tls_context::tls_context():m_ctx(NULL)
+{
+
+}
+
+tls_context::~tls_context()
+{
+
+}
+
+bool tls_context::init(const char* cert_file, const char* key_file)
+{
+    printf("TLS is not available: rebuild with -DUSE_TLS -lssl -lcrypto\n");
+    return false;
+}
+
+SSL* tls_context::accept(int sockfd)
+{
+    return NULL;
+}
+
+TLS_RESULT tls_handshake(SSL* ssl)
+{
+    return TLS_ERROR;
+}
+
+int tls_read(SSL* ssl, char* buf, int len, TLS_RESULT* result)
+{
+    *result = TLS_ERROR;
+    return -1;
+}
+
+int tls_writev(SSL* ssl, int sockfd, const struct iovec* iov, int iov_count, TLS_RESULT* result)
+{
+    *result = TLS_ERROR;
+    return -1;
+}
+
+bool tls_ktls_send(SSL* ssl)
+{
+    return false;
+}
+
+bool tls_ktls_recv(SSL* ssl)
+{
+    return false;
+}
+
+bool tls_pending(SSL* ssl)
+{
+    return false;
+}
+
+bool tls_session_reused(SSL* ssl)
+{
+    return false;
+}
+
+void tls_free(SSL* ssl)
+{
+
+}
+
+#endif
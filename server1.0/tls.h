@@ -0,0 +1,61 @@
+#ifndef TLS_H__
+#define TLS_H__
+
+#include <sys/uio.h>
+#include <sys/types.h>
+
+// TLS终止：基于OpenSSL的非阻塞TLS，嵌入http_conn的读写流程
+// 编译时定义 USE_TLS 并链接 -lssl -lcrypto 才启用，否则tls_context::init总是失败，服务器只支持明文
+//
+// 握手完成后尝试开启内核TLS(kTLS)：发送方向开启后，socket上的writev直接由内核加密，
+// mmap文件的零拷贝发送路径在加密连接上照常工作；接收方向开启后请求体仍然可以splice。
+// 会话恢复：服务端会话缓存（一个SSL_CTX由所有线程共享）+ 会话票据
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+/*
+    TLS操作的结果
+    TLS_OK          :完成
+    TLS_WANT_READ   :需要等socket可读后重试
+    TLS_WANT_WRITE  :需要等socket可写后重试
+    TLS_CLOSED      :对方关闭了TLS连接
+    TLS_ERROR       :出错，连接应当关闭
+*/
+enum TLS_RESULT {TLS_OK = 0, TLS_WANT_READ, TLS_WANT_WRITE, TLS_CLOSED, TLS_ERROR};
+
+class tls_context{
+
+public:
+    tls_context();
+    ~tls_context();
+
+    //加载证书链和私钥，配置会话缓存、票据和kTLS
+    bool init(const char* cert_file, const char* key_file);
+
+    //为新接受的连接创建SSL对象（服务端模式），失败返回NULL
+    SSL* accept(int sockfd);
+
+private:
+    SSL_CTX* m_ctx;
+};
+
+//非阻塞握手，可能需要多次调用
+TLS_RESULT tls_handshake(SSL* ssl);
+
+//返回读到的字节数；<=0时result说明原因
+int tls_read(SSL* ssl, char* buf, int len, TLS_RESULT* result);
+
+//依次发送iov中的数据，返回发送的字节数（可能只发送了一部分）；<=0时result说明原因
+//开启了kTLS发送时直接对socket执行writev
+int tls_writev(SSL* ssl, int sockfd, const struct iovec* iov, int iov_count, TLS_RESULT* result);
+
+bool tls_ktls_send(SSL* ssl);       //发送方向是否由内核加密
+bool tls_ktls_recv(SSL* ssl);       //接收方向是否由内核解密
+bool tls_pending(SSL* ssl);         //OpenSSL内部是否还有已解密但未读取的数据
+bool tls_session_reused(SSL* ssl);
+
+//尽力发送close_notify并释放
+void tls_free(SSL* ssl);
+
+#endif
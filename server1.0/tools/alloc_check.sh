@@ -0,0 +1,73 @@
+#!/bin/sh
+# 稳态零分配的回归检查：用 -DALLOC_CHECK 编译服务器，起一个临时站点压测，稳态路径上有分配时服务器会打印调用栈并abort
+#
+# 用法（在 server1.0 目录下）：tools/alloc_check.sh [port] [extra server options...]
+#      额外的选项原样交给服务器，如 tools/alloc_check.sh 9400 -Q 0；检查区间只在线程池模型里，-K 没有可检查的区间
+#      编译服务器和 conn_bench，依次压测小文件、大文件、404、目录重定向和目录列表；
+#      服务器中途退出、或者 /allocz 显示没有检查过任何稳态区间（检查没有真正在进行）时返回非0
+set -u
+
+PORT=${1:-9400}
+[ $# -gt 0 ] && shift
+
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d /tmp/alloc_check.XXXXXX)
+SERVER_PID=
+
+cleanup()
+{
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "alloc_check: FAIL: $*"
+    if [ -f "$WORK/server.log" ]; then
+        echo "---- server log ----"
+        tail -n 60 "$WORK/server.log"
+    fi
+    exit 1
+}
+
+echo "alloc_check: building"
+g++ -std=c++20 -O2 -DALLOC_CHECK -rdynamic "$DIR"/*.cpp -pthread -o "$WORK/server" 2> "$WORK/build.log" \
+    || { cat "$WORK/build.log"; fail "server build failed"; }
+g++ -O2 "$DIR/tools/conn_bench.cpp" -o "$WORK/conn_bench" || fail "conn_bench build failed"
+
+#站点：小文件、超过写缓冲区的大文件、有索引的目录和没有索引的目录
+mkdir -p "$WORK/site/docs" "$WORK/site/files"
+echo "<html><body>alloc check</body></html>" > "$WORK/site/index.html"
+echo "<html><body>docs</body></html>" > "$WORK/site/docs/index.html"
+head -c 1048576 /dev/zero > "$WORK/site/big.bin"
+for i in 1 2 3 4 5; do echo "$i" > "$WORK/site/files/f$i.txt"; done
+
+"$WORK/server" -V "*=$WORK/site:listing" "$@" "$PORT" > "$WORK/server.log" 2>&1 &
+SERVER_PID=$!
+
+#等服务器开始监听
+i=0
+while ! "$WORK/conn_bench" "$PORT" 1 1 / > /dev/null 2>&1; do
+    kill -0 "$SERVER_PID" 2>/dev/null || fail "server exited during startup"
+    i=$((i + 1))
+    [ $i -ge 50 ] && fail "server did not start listening on $PORT"
+    sleep 0.1
+done
+
+for path in / /index.html /big.bin /missing.html /docs /docs/ /files/; do
+    echo "alloc_check: load $path"
+    "$WORK/conn_bench" "$PORT" 16 500 "$path" > "$WORK/bench.log" 2>&1
+    kill -0 "$SERVER_PID" 2>/dev/null || fail "server died while serving $path (steady-state allocation?)"
+done
+
+#conn_bench 不输出应答体，/allocz 用curl读
+command -v curl > /dev/null || fail "curl is required to read /allocz"
+report=$(curl -s "http://127.0.0.1:$PORT/allocz") || fail "GET /allocz failed"
+kill -0 "$SERVER_PID" 2>/dev/null || fail "server died"
+regions=$(echo "$report" | awk '$1 == "steady_regions" {print $2}')
+echo "$report"
+[ -n "$regions" ] && [ "$regions" -gt 0 ] || fail "no steady-state regions were checked"
+
+echo "alloc_check: PASS"
+exit 0
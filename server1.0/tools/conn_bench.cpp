@@ -0,0 +1,293 @@
+// 连接模型压测：N个keep-alive连接，每个连接发一个请求、收完应答再发下一个（闭环），比较线程池模型和 -K 协程模型
+//
+// 编译：g++ -O2 conn_bench.cpp -o conn_bench
+// 服务器：  ./server 10000        或者  ./server -K 2 10000
+// 用法：
+//      conn_bench <port> <connections> <requests_per_conn> <path> [server_pid]
+//      输出建立全部连接的耗时（listen队列太短时SYN被丢弃，要等1秒后重传）、吞吐量和延迟分布；给出服务器pid时还输出服务器的常驻内存（VmRSS）：
+//      建立连接之前、所有连接都空闲地建立之后、每个连接完成第一个请求之后，以及折算到每个连接的增量
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static uint64_t now_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//服务器的VmRSS，单位KB；读不到返回-1
+static long server_rss(int pid)
+{
+    if(pid <= 0)
+    {
+        return -1;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE* fp = fopen(path, "r");
+    if(!fp)
+    {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    while(fgets(line, sizeof(line), fp))
+    {
+        if(strncmp(line, "VmRSS:", 6) == 0)
+        {
+            kb = atol(line + 6);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+struct client{
+    int fd;
+    int done;               //已经完成的请求数
+    uint64_t start;         //当前请求的发送时刻
+    std::string in;         //当前应答已经收到的部分
+    long need;              //当前应答的总长度，头部还没收齐时为-1
+};
+
+static int connect_to(int port)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+//头部收齐后算出整个应答的长度
+static long response_length(const std::string& in)
+{
+    size_t end = in.find("\r\n\r\n");
+    if(end == std::string::npos)
+    {
+        return -1;
+    }
+    long body = 0;
+    const char* p = strcasestr(in.c_str(), "\r\nContent-Length:");
+    if(p && p < in.c_str() + end)
+    {
+        body = atol(p + 17);
+    }
+    return end + 4 + body;
+}
+
+//每个连接不停地发请求直到完成requests个，全部应答收完才返回
+static bool run_round(int epollfd, std::vector<client>& clients, const std::string& request,
+                      int requests, std::vector<uint32_t>& latency, long long& errors)
+{
+    int pending = 0;
+    for(size_t i = 0; i < clients.size(); i++)
+    {
+        client& c = clients[i];
+        if(c.fd < 0 || c.done >= requests)
+        {
+            continue;
+        }
+        c.start = now_usec();
+        c.in.clear();
+        c.need = -1;
+        if(write(c.fd, request.data(), request.size()) != (ssize_t)request.size())
+        {
+            close(c.fd);
+            c.fd = -1;
+            errors++;
+            continue;
+        }
+        pending++;
+    }
+
+    epoll_event events[256];
+    char buf[1 << 16];
+    while(pending > 0)
+    {
+        int num = epoll_wait(epollfd, events, 256, 5000);
+        if(num == 0)
+        {
+            fprintf(stderr, "no response for 5 s, %d requests outstanding\n", pending);
+            return false;
+        }
+        for(int i = 0; i < num; i++)
+        {
+            client& c = clients[events[i].data.u32];
+            if(c.fd < 0)
+            {
+                continue;
+            }
+            bool closed = false;
+            while(true)
+            {
+                int n = recv(c.fd, buf, sizeof(buf), 0);
+                if(n > 0)
+                {
+                    c.in.append(buf, n);
+                    continue;
+                }
+                if(n == 0 || errno != EAGAIN)
+                {
+                    closed = true;
+                }
+                break;
+            }
+            if(c.need < 0)
+            {
+                c.need = response_length(c.in);
+            }
+            if(c.need >= 0 && (long)c.in.size() >= c.need)
+            {
+                latency.push_back(now_usec() - c.start);
+                c.done++;
+                pending--;
+                if(c.done < requests)
+                {
+                    c.start = now_usec();
+                    c.in.clear();
+                    c.need = -1;
+                    if(write(c.fd, request.data(), request.size()) == (ssize_t)request.size())
+                    {
+                        pending++;
+                        continue;
+                    }
+                    closed = true;
+                    pending++;
+                }
+            }
+            if(closed)
+            {
+                //连接提前断开：这个连接剩下的请求都算失败
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, c.fd, NULL);
+                close(c.fd);
+                c.fd = -1;
+                errors += requests - c.done;
+                pending--;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 5)
+    {
+        printf("usage: %s <port> <connections> <requests_per_conn> <path> [server_pid]\n", argv[0]);
+        return 1;
+    }
+    int port = atoi(argv[1]);
+    int connections = atoi(argv[2]);
+    int requests = atoi(argv[3]);
+    const char* path = argv[4];
+    int pid = (argc > 5) ? atoi(argv[5]) : 0;
+
+    struct rlimit rl;
+    rl.rlim_cur = rl.rlim_max = connections + 64;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    char req[512];
+    snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n", path);
+    std::string request(req);
+
+    long rss_before = server_rss(pid);
+
+    int epollfd = epoll_create1(0);
+    std::vector<client> clients(connections);
+    uint64_t connect_start = now_usec();
+    uint32_t slowest_connect = 0;
+    for(int i = 0; i < connections; i++)
+    {
+        client& c = clients[i];
+        c.done = 0;
+        c.need = -1;
+        uint64_t t = now_usec();
+        c.fd = connect_to(port);
+        slowest_connect = std::max(slowest_connect, (uint32_t)(now_usec() - t));
+        if(c.fd < 0)
+        {
+            fprintf(stderr, "connect %d failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+        epoll_event ev;
+        ev.data.u32 = i;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+    printf("connect  %d connections in %.3f s, slowest %u us\n",
+           connections, (now_usec() - connect_start) / 1e6, slowest_connect);
+    //让服务器把所有连接都接受下来
+    usleep(200 * 1000);
+    long rss_idle = server_rss(pid);
+
+    std::vector<uint32_t> latency;
+    latency.reserve((size_t)connections * requests);
+    long long errors = 0;
+
+    //第一个请求单独一轮，之后每个连接都已经分配了处理一个请求需要的全部内存
+    uint64_t start = now_usec();
+    if(!run_round(epollfd, clients, request, 1, latency, errors))
+    {
+        return 1;
+    }
+    long rss_active = server_rss(pid);
+    if(!run_round(epollfd, clients, request, requests, latency, errors))
+    {
+        return 1;
+    }
+    double elapsed = (now_usec() - start) / 1e6;
+
+    std::sort(latency.begin(), latency.end());
+    size_t n = latency.size();
+    printf("requests %zu ok, %lld failed, %d connections, %.3f s, %.0f req/s\n",
+           n, errors, connections, elapsed, n / elapsed);
+    if(n > 0)
+    {
+        printf("latency  p50 %u us, p99 %u us, p99.9 %u us, max %u us\n",
+               latency[n / 2], latency[n * 99 / 100], latency[n * 999 / 1000], latency[n - 1]);
+    }
+    if(rss_before >= 0 && rss_idle >= 0 && rss_active >= 0)
+    {
+        printf("server rss  before %ld KB, idle %ld KB, active %ld KB; per connection idle %.2f KB, active %.2f KB\n",
+               rss_before, rss_idle, rss_active,
+               (double)(rss_idle - rss_before) / connections, (double)(rss_active - rss_before) / connections);
+    }
+
+    for(int i = 0; i < connections; i++)
+    {
+        if(clients[i].fd >= 0)
+        {
+            close(clients[i].fd);
+        }
+    }
+    close(epollfd);
+    return 0;
+}
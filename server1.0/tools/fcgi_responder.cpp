@@ -0,0 +1,311 @@
+// 测试FastCGI网关用的应用进程（responder）
+//
+// 编译：g++ -O2 -std=c++17 fcgi_responder.cpp -pthread -o fcgi_responder
+// 用法：fcgi_responder <socket_path> [max_reqs]
+//      监听Unix socket，回答FCGI_GET_VALUES（支持多路复用，最多max_reqs个并发请求，默认100），
+//      同一条连接上的请求各用一个线程处理，应答交错写回。查询串控制应答：
+//          delay=毫秒      开始应答前等待
+//          size=字节       应答体的长度（分成多个FCGI_STDOUT），不指定时返回CGI变量和请求体长度
+//          gap=毫秒        size的每16KB之间等待，用来观察流式转发
+//          status=码       Status头部
+//          stderr=1        同时写一条FCGI_STDERR
+//      FCGI_ABORT_REQUEST会让正在等待的请求提前结束。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <chrono>
+
+enum {
+    BEGIN_REQUEST = 1, ABORT_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT, STDERR,
+    DATA, GET_VALUES, GET_VALUES_RESULT
+};
+
+static int g_max_reqs = 100;
+
+struct request{
+    std::string params;
+    std::string body;
+    std::atomic<bool> aborted;
+    request() : aborted(false) {}
+};
+
+//一条连接：读线程解析记录，请求线程在锁内写应答，最后一个引用释放时关闭
+struct connection{
+    int fd;
+    pthread_mutex_t lock;
+    std::map<int, std::shared_ptr<request> > requests;     //只在读线程访问，id被新的请求复用时替换
+
+    explicit connection(int f) : fd(f) { pthread_mutex_init(&lock, NULL); }
+    ~connection() { close(fd); }
+
+    void send_record(int type, int id, const char* data, size_t len)
+    {
+        pthread_mutex_lock(&lock);
+        size_t off = 0;
+        do
+        {
+            size_t n = len - off < 32768 ? len - off : 32768;
+            unsigned char head[8] = {1, (unsigned char)type, (unsigned char)(id >> 8), (unsigned char)id,
+                                     (unsigned char)(n >> 8), (unsigned char)n, 0, 0};
+            write_all((const char*)head, 8);
+            write_all(data + off, n);
+            off += n;
+        }while(off < len);
+        pthread_mutex_unlock(&lock);
+    }
+
+    void write_all(const char* p, size_t len)
+    {
+        while(len > 0)
+        {
+            ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+            if(n <= 0)
+            {
+                return;
+            }
+            p += n;
+            len -= n;
+        }
+    }
+};
+
+static bool read_all(int fd, char* p, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if(n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static size_t get_length(const unsigned char*& p)
+{
+    if(!(*p & 0x80))
+    {
+        return *p++;
+    }
+    size_t len = ((size_t)(p[0] & 0x7f) << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+    p += 4;
+    return len;
+}
+
+static void put_pair(std::string& out, const std::string& name, const std::string& value)
+{
+    out.push_back((char)name.size());
+    out.push_back((char)value.size());
+    out += name;
+    out += value;
+}
+
+static std::map<std::string, std::string> parse_params(const std::string& s)
+{
+    std::map<std::string, std::string> params;
+    const unsigned char* p = (const unsigned char*)s.data();
+    const unsigned char* end = p + s.size();
+    while(p < end)
+    {
+        size_t n = get_length(p);
+        size_t v = get_length(p);
+        params[std::string((const char*)p, n)] = std::string((const char*)p + n, v);
+        p += n + v;
+    }
+    return params;
+}
+
+static long query_value(const std::string& query, const char* name, long def)
+{
+    std::string key = std::string(name) + "=";
+    size_t pos = 0;
+    while((pos = query.find(key, pos)) != std::string::npos)
+    {
+        if(pos == 0 || query[pos - 1] == '&')
+        {
+            return atol(query.c_str() + pos + key.size());
+        }
+        pos++;
+    }
+    return def;
+}
+
+//等待ms毫秒，期间被取消就提前返回false
+static bool pause_ms(request* r, long ms)
+{
+    for(long waited = 0; waited < ms; waited += 5)
+    {
+        if(r->aborted)
+        {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms - waited < 5 ? ms - waited : 5));
+    }
+    return !r->aborted;
+}
+
+static void respond(std::shared_ptr<connection> c, int id, std::shared_ptr<request> r)
+{
+    std::map<std::string, std::string> params = parse_params(r->params);
+    std::string query = params["QUERY_STRING"];
+    long delay = query_value(query, "delay", 0);
+    long size = query_value(query, "size", -1);
+    long gap = query_value(query, "gap", 0);
+    long status = query_value(query, "status", 200);
+
+    bool ok = pause_ms(r.get(), delay);
+    if(ok)
+    {
+        if(query_value(query, "stderr", 0))
+        {
+            static const char msg[] = "fcgi_responder: stderr requested\n";
+            c->send_record(STDERR, id, msg, sizeof(msg) - 1);
+        }
+        char head[128];
+        int n = snprintf(head, sizeof(head), "Status: %ld %s\r\nContent-Type: text/plain\r\nX-Backend-Pid: %d\r\n\r\n",
+                         status, status == 200 ? "OK" : "Custom", getpid());
+        if(size < 0)
+        {
+            std::string body(head, n);
+            for(std::map<std::string, std::string>::iterator it = params.begin(); it != params.end(); ++it)
+            {
+                body += it->first + "=" + it->second + "\n";
+            }
+            body += "STDIN_BYTES=" + std::to_string(r->body.size()) + "\n";
+            c->send_record(STDOUT, id, body.data(), body.size());
+        }
+        else
+        {
+            c->send_record(STDOUT, id, head, n);
+            std::string chunk(16384, 'x');
+            for(long sent = 0; ok && sent < size; sent += chunk.size())
+            {
+                size_t len = size - sent < (long)chunk.size() ? size - sent : chunk.size();
+                c->send_record(STDOUT, id, chunk.data(), len);
+                if(gap > 0 && sent + (long)len < size)
+                {
+                    ok = pause_ms(r.get(), gap);
+                }
+            }
+        }
+        c->send_record(STDOUT, id, NULL, 0);
+    }
+    unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    c->send_record(END_REQUEST, id, (const char*)end, sizeof(end));
+}
+
+static void serve(int fd)
+{
+    std::shared_ptr<connection> c(new connection(fd));
+    unsigned char head[8];
+    std::string content;
+    while(read_all(fd, (char*)head, 8))
+    {
+        int type = head[1];
+        int id = (head[2] << 8) | head[3];
+        size_t len = (head[4] << 8) | head[5];
+        content.resize(len + head[6]);
+        if(!read_all(fd, &content[0], content.size()))
+        {
+            break;
+        }
+        content.resize(len);
+
+        switch(type)
+        {
+            case GET_VALUES:
+            {
+                std::string result;
+                put_pair(result, "FCGI_MPXS_CONNS", "1");
+                put_pair(result, "FCGI_MAX_REQS", std::to_string(g_max_reqs));
+                c->send_record(GET_VALUES_RESULT, 0, result.data(), result.size());
+                break;
+            }
+            case BEGIN_REQUEST:
+                c->requests[id] = std::make_shared<request>();
+                break;
+            case PARAMS:
+                if(c->requests.count(id))
+                {
+                    c->requests[id]->params += content;
+                }
+                break;
+            case STDIN:
+                if(!c->requests.count(id))
+                {
+                    break;
+                }
+                if(len > 0)
+                {
+                    c->requests[id]->body += content;
+                    break;
+                }
+                //请求体结束：交给一个线程处理，同一连接上的请求互不等待
+                std::thread(respond, c, id, c->requests[id]).detach();
+                break;
+            case ABORT_REQUEST:
+                //正在处理的请求由它自己的线程发现后结束
+                if(c->requests.count(id))
+                {
+                    c->requests[id]->aborted = true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        printf("usage: %s socket_path [max_reqs]\n", argv[0]);
+        return 1;
+    }
+    if(argc > 2)
+    {
+        g_max_reqs = atoi(argv[2]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    unlink(argv[1]);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0)
+    {
+        printf("listen %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    printf("fcgi_responder pid %d listening on %s\n", getpid(), argv[1]);
+    fflush(stdout);
+
+    while(true)
+    {
+        int conn = accept(fd, NULL, NULL);
+        if(conn < 0)
+        {
+            continue;
+        }
+        std::thread(serve, conn).detach();
+    }
+    return 0;
+}
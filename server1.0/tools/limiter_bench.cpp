@@ -0,0 +1,161 @@
+// 限流器的单次检查耗时：多个线程对随机IP调用on_request（和on_accept/on_close）
+//
+// 编译：g++ -O2 -std=c++17 -I.. limiter_bench.cpp ../rate_limiter.cpp -pthread -o limiter_bench
+// 用法：limiter_bench <threads> <distinct_ips> <checks_per_thread>
+//      distinct_ips 大于表的容量（SHARDS*SLOTS_PER_SHARD）时可以看到淘汰的开销
+//      limiter_bench refill
+//      检查低速率的令牌桶能按配置的速率补充：每毫秒尝试一次新连接（大部分被拒绝），数放行的个数，偏差太大时返回非0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "rate_limiter.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//两个阶段之间同步，主线程据此统计总吞吐（线程数多于CPU时单线程的耗时没有意义）
+static pthread_barrier_t barrier;
+
+struct worker_arg{
+    rate_limiter* limiter;
+    int ips;
+    long checks;
+    unsigned seed;
+    long allowed;
+    double request_ns;
+    double accept_ns;
+};
+
+static void* worker(void* p)
+{
+    worker_arg* arg = (worker_arg*)p;
+    std::vector<uint32_t> keys(1 << 16);
+    for(size_t i = 0; i < keys.size(); i++)
+    {
+        keys[i] = 0x0A000000u + rand_r(&arg->seed) % arg->ips;
+    }
+
+    long allowed = 0;
+    pthread_barrier_wait(&barrier);
+    double start = now();
+    for(long i = 0; i < arg->checks; i++)
+    {
+        allowed += arg->limiter->on_request(keys[i & 0xFFFF]);
+    }
+    arg->request_ns = (now() - start) * 1e9 / arg->checks;
+
+    pthread_barrier_wait(&barrier);
+    start = now();
+    for(long i = 0; i < arg->checks; i++)
+    {
+        uint32_t ip = keys[i & 0xFFFF];
+        if(arg->limiter->on_accept(ip))
+        {
+            arg->limiter->on_close(ip);
+        }
+    }
+    arg->accept_ns = (now() - start) * 1e9 / arg->checks;
+    arg->allowed = allowed;
+    pthread_barrier_wait(&barrier);
+    return NULL;
+}
+
+//每秒10个新连接、突发1个：一毫秒只补充0.16个定点单位，检查得比一个单位的时间更频繁
+static int refill_test()
+{
+    rate_limiter::limits limits = {10, 1, 1000, 1000, 64};
+    rate_limiter limiter(limits);
+    uint32_t ip = 0x0100007Fu;
+
+    //先把突发额度用完
+    while(limiter.on_accept(ip))
+    {
+        limiter.on_close(ip);
+    }
+
+    const double seconds = 2.0;
+    long accepted = 0, attempts = 0;
+    double start = now();
+    while(now() - start < seconds)
+    {
+        if(limiter.on_accept(ip))
+        {
+            limiter.on_close(ip);
+            accepted++;
+        }
+        attempts++;
+        usleep(1000);
+    }
+
+    double expect = limits.conn_rate * seconds;
+    bool ok = accepted >= expect * 0.8 && accepted <= expect * 1.2 + 1;
+    printf("refill: %ld of %ld attempts accepted in %.0f s, expected about %.0f: %s\n",
+           accepted, attempts, seconds, expect, ok ? "ok" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc == 2 && strcmp(argv[1], "refill") == 0)
+    {
+        return refill_test();
+    }
+    if(argc < 4)
+    {
+        printf("usage: %s <threads> <distinct_ips> <checks_per_thread>\n       %s refill\n", argv[0], argv[0]);
+        return 1;
+    }
+    int threads = atoi(argv[1]);
+    int ips = atoi(argv[2]);
+    long checks = atol(argv[3]);
+
+    rate_limiter::limits limits = {100, 100, 1000, 1000, 64};
+    rate_limiter limiter(limits);
+
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    std::vector<pthread_t> tids(threads);
+    std::vector<worker_arg> args(threads);
+    for(int i = 0; i < threads; i++)
+    {
+        args[i].limiter = &limiter;
+        args[i].ips = ips;
+        args[i].checks = checks;
+        args[i].seed = i + 1;
+        pthread_create(&tids[i], NULL, worker, &args[i]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    double t0 = now();
+    pthread_barrier_wait(&barrier);
+    double t1 = now();
+    pthread_barrier_wait(&barrier);
+    double t2 = now();
+
+    double request_ns = 0, accept_ns = 0;
+    long allowed = 0;
+    for(int i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+        request_ns += args[i].request_ns;
+        accept_ns += args[i].accept_ns;
+        allowed += args[i].allowed;
+    }
+    double total = (double)checks * threads;
+    printf("on_request         %.1f ns/check per thread, %.1f ns/check aggregate (%ld of %.0f allowed)\n",
+           request_ns / threads, (t1 - t0) * 1e9 / total, allowed, total);
+    printf("on_accept+on_close %.1f ns/pair per thread, %.1f ns/pair aggregate\n",
+           accept_ns / threads, (t2 - t1) * 1e9 / total);
+    printf("evictions %llu untracked %llu rejected_requests %llu rejected_conns %llu\n",
+           (unsigned long long)limiter.evictions(), (unsigned long long)limiter.untracked(),
+           (unsigned long long)limiter.rejected_requests(), (unsigned long long)limiter.rejected_conns());
+    return 0;
+}
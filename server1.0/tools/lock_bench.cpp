@@ -0,0 +1,157 @@
+// locker.h里几种锁和信号量的竞争开销
+//
+// 编译：g++ -O2 -std=c++17 -I.. lock_bench.cpp -pthread -o lock_bench
+// 用法：lock_bench [millis_per_case]
+//      锁：线程数 1/2/4/8/16 × 临界区长度 0/50/500（每单位是一次对共享数据的读改写），临界区外做固定量的本地计算，
+//          输出每秒加锁次数（百万）；
+//      信号量：两个线程互相post/wait传球，输出每次交接的平均耗时
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+#include "locker.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//临界区里改写的共享数据，和锁不在同一个缓存行
+struct alignas(64) shared_data{
+    uint64_t v[8];
+};
+
+template<typename L>
+struct lock_case{
+    cache_aligned<L> lock;
+    shared_data data;
+    int cs;
+    int outside;
+    std::atomic<bool> stop;
+};
+
+template<typename L>
+struct lock_arg{
+    lock_case<L>* c;
+    uint64_t ops;
+};
+
+template<typename L>
+static void* lock_worker(void* p)
+{
+    lock_arg<L>* arg = (lock_arg<L>*)p;
+    lock_case<L>* c = arg->c;
+    uint64_t local = (uint64_t)p;
+    uint64_t ops = 0;
+    while(!c->stop.load(std::memory_order_relaxed))
+    {
+        c->lock.lock();
+        for(int i = 0; i < c->cs; i++)
+        {
+            c->data.v[i & 7] = c->data.v[i & 7] * 6364136223846793005ULL + 1;
+        }
+        c->lock.unlock();
+        for(int i = 0; i < c->outside; i++)
+        {
+            local = local * 6364136223846793005ULL + 1;
+            asm volatile("" : "+r"(local));
+        }
+        ops++;
+    }
+    arg->ops = ops;
+    return NULL;
+}
+
+template<typename L>
+static double run_lock(int threads, int cs, int millis)
+{
+    lock_case<L> c;
+    c.cs = cs;
+    c.outside = 100;
+    c.stop = false;
+    std::vector<lock_arg<L> > args(threads);
+    std::vector<pthread_t> tids(threads);
+    for(int i = 0; i < threads; i++)
+    {
+        args[i].c = &c;
+        args[i].ops = 0;
+        pthread_create(&tids[i], NULL, lock_worker<L>, &args[i]);
+    }
+    double start = now();
+    struct timespec t = {millis / 1000, (millis % 1000) * 1000000L};
+    nanosleep(&t, NULL);
+    c.stop = true;
+    uint64_t total = 0;
+    for(int i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+        total += args[i].ops;
+    }
+    return total / (now() - start) / 1e6;
+}
+
+template<typename S>
+struct pingpong{
+    cache_aligned<S> ping;
+    cache_aligned<S> pong;
+    int rounds;
+};
+
+template<typename S>
+static void* pong_worker(void* p)
+{
+    pingpong<S>* pp = (pingpong<S>*)p;
+    for(int i = 0; i < pp->rounds; i++)
+    {
+        pp->ping.wait();
+        pp->pong.post();
+    }
+    return NULL;
+}
+
+template<typename S>
+static double run_sem(int rounds)
+{
+    pingpong<S> pp;
+    pp.rounds = rounds;
+    pthread_t tid;
+    pthread_create(&tid, NULL, pong_worker<S>, &pp);
+    double start = now();
+    for(int i = 0; i < rounds; i++)
+    {
+        pp.ping.post();
+        pp.pong.wait();
+    }
+    double elapsed = now() - start;
+    pthread_join(tid, NULL);
+    return elapsed / rounds / 2 * 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    int millis = (argc > 1) ? atoi(argv[1]) : 300;
+    static const int threads[] = {1, 2, 4, 8, 16};
+    static const int cs[] = {0, 50, 500};
+
+    printf("cpus %d, %d ms per case, Mops/s (lock+unlock+100 units outside)\n", get_nprocs(), millis);
+    printf("%-8s %-6s %12s %12s %12s\n", "threads", "cs", "locker", "futex_locker", "mcs_locker");
+    for(size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+    {
+        for(size_t j = 0; j < sizeof(cs) / sizeof(cs[0]); j++)
+        {
+            double a = run_lock<locker>(threads[i], cs[j], millis);
+            double b = run_lock<futex_locker>(threads[i], cs[j], millis);
+            double m = run_lock<mcs_locker>(threads[i], cs[j], millis);
+            printf("%-8d %-6d %12.2f %12.2f %12.2f\n", threads[i], cs[j], a, b, m);
+        }
+    }
+
+    int rounds = 100000;
+    printf("semaphore handoff: sem %.0f ns, futex_sem %.0f ns\n", run_sem<sem>(rounds), run_sem<futex_sem>(rounds));
+    return 0;
+}
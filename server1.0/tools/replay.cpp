@@ -0,0 +1,480 @@
+// 重放服务器 -C 录下的流量：按原来的连接、原来的分段和原来的时间间隔把请求字节重新发给服务器
+//
+// 编译：g++ -O2 -std=c++17 -I.. replay.cpp -pthread -o replay
+// 用法：replay [-s speed] [-H host] <capture.log> <port>
+//      speed 1 按原速（默认），2 两倍速，0.5 半速，0 不等待时间、只保持因果关系尽快发送
+//
+// 每个连接的每个事件（建立、发送一段数据、关闭）在 max(开始 + 原时刻/speed, 该连接上一个事件的实际时刻 + 原间隔/speed)
+// 执行：服务器变慢时整体推迟，但同一个连接内的间隔（客户端的思考时间）保持不变。
+// 发送一段数据前要先收到录制时那一刻服务器已经发出的应答字节数，关闭前要收完原来的应答，
+// 所以原来等应答的客户端不会变成流水线。结束时输出事件延迟（实际时刻 - 计划时刻）和应答延迟的分布，
+// 以及应答字节数与录制时不一致的连接（服务器的行为变了，或者静态文件变了）。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+#include "capture.h"
+
+static const int IDLE_MS = 2000;           //等应答时这么久没有收到数据就放弃
+
+static uint64_t now_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct event{
+    uint64_t usec;
+    int type;
+    uint64_t sent;
+    const char* data;
+    uint32_t len;
+};
+
+struct connection{
+    std::vector<event> events;
+    size_t next;                //下一个要执行的事件
+    int fd;
+    uint32_t offset;            //当前这段数据已经发出的字节数
+    bool sending;
+    bool scheduled;             //已经在定时堆里
+    bool eof;
+    bool done;
+    uint64_t received;
+    uint64_t last_actual;       //上一个事件实际执行的时刻
+    uint64_t last_orig;         //上一个事件录制时的时刻
+    uint64_t last_recv;         //最后一次收到数据的时刻
+    uint64_t request_at;        //最后一段数据发完的时刻，用于应答延迟
+    uint64_t response_target;   //收到这么多字节时应答完成，0表示不在等
+};
+
+static struct sockaddr_in server_addr;
+static double speed = 1.0;
+static uint64_t start_at;
+static int epollfd;
+static std::vector<connection> conns;
+typedef std::pair<uint64_t, uint32_t> timer;
+static std::priority_queue<timer, std::vector<timer>, std::greater<timer> > timers;
+static std::vector<uint64_t> lags;
+static std::vector<uint64_t> latencies;
+static long active = 0, finished = 0, errors = 0, mismatched = 0, segments = 0;
+static uint64_t bytes_sent = 0, bytes_received = 0, bytes_expected = 0;
+
+static void finish(connection& c, bool error)
+{
+    if(c.fd != -1)
+    {
+        close(c.fd);
+        c.fd = -1;
+        active--;
+    }
+    if(error)
+    {
+        errors++;
+    }
+    c.done = true;
+    finished++;
+}
+
+static uint64_t due_of(connection& c, const event& e)
+{
+    if(speed <= 0)
+    {
+        return 0;
+    }
+    uint64_t absolute = start_at + (uint64_t)(e.usec / speed);
+    if(c.next == 0)
+    {
+        return absolute;
+    }
+    uint64_t relative = c.last_actual + (uint64_t)((e.usec - c.last_orig) / speed);
+    return std::max(absolute, relative);
+}
+
+static void schedule(uint32_t id, uint64_t due)
+{
+    if(!conns[id].scheduled)
+    {
+        conns[id].scheduled = true;
+        timers.push(timer(due, id));
+    }
+}
+
+//发送当前这段数据，发完返回true
+static bool send_pending(connection& c)
+{
+    const event& e = c.events[c.next];
+    while(c.offset < e.len)
+    {
+        ssize_t n = send(c.fd, e.data + c.offset, e.len - c.offset, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                c.sending = true;
+                return false;
+            }
+            return false;
+        }
+        c.offset += n;
+        bytes_sent += n;
+    }
+    c.sending = false;
+    return true;
+}
+
+//一个事件执行完：记录延迟，后面的事件以它为基准
+static void step(connection& c, uint64_t now, uint64_t due)
+{
+    if(speed > 0)
+    {
+        lags.push_back(now - due);
+    }
+    c.last_actual = now;
+    c.last_orig = c.events[c.next].usec;
+    c.next++;
+}
+
+//一段数据发完：下一个事件等的应答字节数就是这段数据的应答
+static void data_sent(connection& c, uint64_t now)
+{
+    c.offset = 0;
+    c.request_at = now;
+    c.response_target = 0;
+    if(c.next + 1 < c.events.size() && c.events[c.next + 1].sent > c.received)
+    {
+        c.response_target = c.events[c.next + 1].sent;
+    }
+}
+
+//执行这个连接上所有已经到时间、依赖已经满足的事件
+static void advance(uint32_t id)
+{
+    connection& c = conns[id];
+    while(!c.done && !c.sending && c.next < c.events.size())
+    {
+        const event& e = c.events[c.next];
+        uint64_t due = due_of(c, e);
+        uint64_t now = now_usec();
+        if(now < due)
+        {
+            schedule(id, due);
+            return;
+        }
+
+        //应答还没收完：收到数据时再来，空闲太久放弃（发数据之前是出错，关闭之前算作不一致）
+        if(e.type != traffic_capture::OPEN && c.received < e.sent && !c.eof)
+        {
+            uint64_t idle_since = std::max(c.last_recv, due);
+            if(now - idle_since < (uint64_t)IDLE_MS * 1000)
+            {
+                schedule(id, idle_since + IDLE_MS * 1000);
+                return;
+            }
+        }
+        if(e.type == traffic_capture::DATA && c.received < e.sent)
+        {
+            finish(c, true);
+            return;
+        }
+
+        if(e.type == traffic_capture::OPEN)
+        {
+            c.fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            int one = 1;
+            setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if(connect(c.fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS)
+            {
+                finish(c, true);
+                return;
+            }
+            epoll_event ev;
+            ev.data.u32 = id;
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+            active++;
+            c.last_recv = now;
+        }
+        else if(e.type == traffic_capture::DATA)
+        {
+            if(c.offset == 0)
+            {
+                segments++;
+            }
+            if(!send_pending(c))
+            {
+                if(!c.sending)
+                {
+                    finish(c, true);
+                }
+                return;     //等EPOLLOUT
+            }
+            data_sent(c, now_usec());
+        }
+        else if(e.type == traffic_capture::CLOSE)
+        {
+            if(e.sent != ~0ULL)
+            {
+                bytes_expected += e.sent;
+                if(c.received != e.sent)
+                {
+                    mismatched++;
+                }
+            }
+            finish(c, false);
+        }
+        step(c, now, due);
+    }
+}
+
+static void on_readable(uint32_t id)
+{
+    connection& c = conns[id];
+    char buf[65536];
+    while(c.fd != -1)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if(n > 0)
+        {
+            c.received += n;
+            bytes_received += n;
+            c.last_recv = now_usec();
+            continue;
+        }
+        if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            c.eof = true;
+        }
+        break;
+    }
+    if(c.response_target && c.received >= c.response_target)
+    {
+        latencies.push_back(now_usec() - c.request_at);
+        c.response_target = 0;
+    }
+}
+
+static bool load(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(capture_header))
+    {
+        printf("cannot read %s\n", path);
+        return false;
+    }
+    const char* base = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED || memcmp(base, traffic_capture::MAGIC, sizeof(traffic_capture::MAGIC)) != 0)
+    {
+        printf("%s is not a capture log\n", path);
+        return false;
+    }
+
+    std::unordered_map<uint32_t, uint32_t> index;
+    const char* p = base + sizeof(capture_header);
+    const char* end = base + st.st_size;
+    uint64_t last = 0;
+    while(p + sizeof(capture_record) <= end)
+    {
+        capture_record rec;
+        memcpy(&rec, p, sizeof(rec));
+        uint32_t len = rec.type_len & 0xFFFFFF;
+        if(p + sizeof(rec) + len > end)
+        {
+            break;      //录制时被中断，最后一条不完整
+        }
+        event e;
+        e.usec = rec.usec;
+        e.type = rec.type_len >> 24;
+        e.sent = rec.sent;
+        e.data = p + sizeof(rec);
+        e.len = len;
+        p += sizeof(rec) + len;
+        last = rec.usec;
+
+        if(e.type == traffic_capture::OPEN)
+        {
+            index[rec.conn] = conns.size();
+            conns.push_back(connection());
+        }
+        std::unordered_map<uint32_t, uint32_t>::iterator it = index.find(rec.conn);
+        if(it == index.end())
+        {
+            continue;   //录制开始前就建立的连接
+        }
+        conns[it->second].events.push_back(e);
+    }
+
+    //录制结束时还没关闭的连接：收完应答（空闲IDLE_MS）后关闭，不计入不一致
+    for(size_t i = 0; i < conns.size(); i++)
+    {
+        connection& c = conns[i];
+        if(c.events.back().type != traffic_capture::CLOSE)
+        {
+            event e = c.events.back();
+            e.type = traffic_capture::CLOSE;
+            e.len = 0;
+            e.sent = ~0ULL;
+            c.events.push_back(e);
+        }
+        c.next = 0;
+        c.fd = -1;
+        c.offset = 0;
+        c.sending = c.scheduled = c.eof = c.done = false;
+        c.received = c.last_actual = c.last_orig = c.last_recv = c.request_at = c.response_target = 0;
+    }
+    printf("%zu connections, %.3f s of traffic\n", conns.size(), last / 1e6);
+    return true;
+}
+
+static void print_distribution(const char* name, std::vector<uint64_t>& v)
+{
+    if(v.empty())
+    {
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    double sum = 0;
+    for(size_t i = 0; i < v.size(); i++)
+    {
+        sum += v[i];
+    }
+    printf("%-16s mean %.1f us  p50 %llu  p90 %llu  p99 %llu  max %llu\n", name, sum / v.size(),
+           (unsigned long long)v[v.size() / 2], (unsigned long long)v[v.size() * 9 / 10],
+           (unsigned long long)v[v.size() * 99 / 100], (unsigned long long)v.back());
+}
+
+int main(int argc, char* argv[])
+{
+    const char* host = "127.0.0.1";
+    int opt;
+    while((opt = getopt(argc, argv, "s:H:")) != -1)
+    {
+        switch(opt)
+        {
+            case 's': speed = atof(optarg); break;
+            case 'H': host = optarg; break;
+            default: break;
+        }
+    }
+    if(argc - optind < 2)
+    {
+        printf("usage: %s [-s speed] [-H host] <capture.log> <port>\n", argv[0]);
+        return 1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[optind + 1]));
+    if(inet_pton(AF_INET, host, &server_addr.sin_addr) != 1)
+    {
+        printf("bad host %s\n", host);
+        return 1;
+    }
+    if(!load(argv[optind]))
+    {
+        return 1;
+    }
+
+    //同时打开的连接可能很多
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    epollfd = epoll_create1(0);
+    start_at = now_usec();
+    for(size_t i = 0; i < conns.size(); i++)
+    {
+        advance(i);
+    }
+
+    epoll_event events[1024];
+    while(finished < (long)conns.size())
+    {
+        int timeout = 100;
+        if(!timers.empty())
+        {
+            uint64_t now = now_usec();
+            uint64_t due = timers.top().first;
+            timeout = due > now ? std::min<uint64_t>((due - now + 999) / 1000, 100) : 0;
+        }
+        int num = epoll_wait(epollfd, events, 1024, timeout);
+        for(int i = 0; i < num; i++)
+        {
+            uint32_t id = events[i].data.u32;
+            connection& c = conns[id];
+            if(c.done)
+            {
+                continue;
+            }
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                on_readable(id);
+            }
+            if(c.sending && (events[i].events & EPOLLOUT))
+            {
+                if(send_pending(c))
+                {
+                    //这段数据发完了，接着执行后面的事件
+                    uint64_t now = now_usec();
+                    uint64_t due = due_of(c, c.events[c.next]);
+                    data_sent(c, now);
+                    step(c, now, due);
+                }
+                else if(!c.sending)
+                {
+                    finish(c, true);
+                    continue;
+                }
+            }
+            advance(id);
+        }
+
+        uint64_t now = now_usec();
+        while(!timers.empty() && timers.top().first <= now)
+        {
+            uint32_t id = timers.top().second;
+            timers.pop();
+            conns[id].scheduled = false;
+            advance(id);
+        }
+    }
+
+    double elapsed = (now_usec() - start_at) / 1e6;
+    if(speed > 0)
+    {
+        printf("replayed in %.3f s (speed x%g)\n", elapsed, speed);
+    }
+    else
+    {
+        printf("replayed in %.3f s (max speed)\n", elapsed);
+    }
+    printf("segments %ld  sent %llu bytes  received %llu of %llu bytes  mismatched %ld  errors %ld\n",
+           segments, (unsigned long long)bytes_sent, (unsigned long long)bytes_received,
+           (unsigned long long)bytes_expected, mismatched, errors);
+    print_distribution("event lag", lags);
+    print_distribution("response", latencies);
+    return 0;
+}
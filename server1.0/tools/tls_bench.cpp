@@ -0,0 +1,157 @@
+// TLS回环压测：握手速率（完整握手/会话恢复）和大文件吞吐
+//
+// 编译：g++ -O2 tls_bench.cpp -lssl -lcrypto -o tls_bench
+// 自签名证书：openssl req -x509 -newkey rsa:2048 -nodes -keyout key.pem -out cert.pem -days 30 -subj /CN=localhost
+// 服务器：  ./server -c cert.pem -k key.pem 10000
+// 用法：
+//      tls_bench handshake <port> <count> [resume]     每个连接只握手；resume时每个连接再做一次请求，用上一个连接的会话票据恢复
+//      tls_bench bulk <port> <path> <count>            每个连接GET一次path，统计吞吐
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(int port)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        exit(-1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static SSL* tls_connect(SSL_CTX* ctx, int fd, SSL_SESSION* session)
+{
+    SSL* ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    if(session)
+    {
+        SSL_set_session(ssl, session);
+    }
+    if(SSL_connect(ssl) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        exit(-1);
+    }
+    return ssl;
+}
+
+static void bench_handshake(SSL_CTX* ctx, int port, int count, bool resume)
+{
+    SSL_SESSION* session = NULL;
+    int reused = 0;
+    double start = now();
+
+    for(int i = 0; i < count; i++)
+    {
+        int fd = connect_to(port);
+        SSL* ssl = tls_connect(ctx, fd, session);
+        reused += SSL_session_reused(ssl);
+
+        //TLS1.3的会话票据在握手之后才到达，而且只能使用一次：
+        //每个连接做一次请求让新票据被处理，下一个连接用它恢复
+        if(resume)
+        {
+            const char* req = "GET /healthz HTTP/1.1\r\n\r\n";
+            char buf[1024];
+            SSL_write(ssl, req, strlen(req));
+            SSL_read(ssl, buf, sizeof(buf));
+            if(session)
+            {
+                SSL_SESSION_free(session);
+            }
+            session = SSL_get1_session(ssl);
+        }
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        close(fd);
+    }
+
+    double elapsed = now() - start;
+    printf("handshakes: %d in %.3fs, %.0f/s, resumed %d\n", count, elapsed, count / elapsed, reused);
+    if(session)
+    {
+        SSL_SESSION_free(session);
+    }
+}
+
+static void bench_bulk(SSL_CTX* ctx, int port, const char* path, int count)
+{
+    char req[512];
+    snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+
+    static char buf[1 << 16];
+    long long total = 0;
+    double start = now();
+
+    for(int i = 0; i < count; i++)
+    {
+        int fd = connect_to(port);
+        SSL* ssl = tls_connect(ctx, fd, NULL);
+        SSL_write(ssl, req, strlen(req));
+
+        //服务器没有keep-alive时发完应答就关闭连接，读到结束为止
+        int n;
+        while((n = SSL_read(ssl, buf, sizeof(buf))) > 0)
+        {
+            total += n;
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+
+    double elapsed = now() - start;
+    printf("bulk: %d responses, %lld bytes in %.3fs, %.1f MB/s\n",
+           count, total, elapsed, total / elapsed / (1024 * 1024));
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 4)
+    {
+        printf("usage: %s handshake <port> <count> [resume]\n"
+               "       %s bulk <port> <path> <count>\n", argv[0], argv[0]);
+        return -1;
+    }
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+    int port = atoi(argv[2]);
+    if(strcmp(argv[1], "handshake") == 0)
+    {
+        bench_handshake(ctx, port, atoi(argv[3]), argc > 4 && strcmp(argv[4], "resume") == 0);
+    }
+    else if(strcmp(argv[1], "bulk") == 0 && argc > 4)
+    {
+        bench_bulk(ctx, port, argv[3], atoi(argv[4]));
+    }
+
+    SSL_CTX_free(ctx);
+    return 0;
+}
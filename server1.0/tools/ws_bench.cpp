@@ -0,0 +1,236 @@
+// WebSocket广播压测：N个订阅者 + 一个发布者，测扇出速率和慢消费者断开
+//
+// 编译：g++ -O2 ws_bench.cpp -pthread -o ws_bench
+// 服务器：  ./server -w 10000
+// 用法：
+//      ws_bench <port> <topic> <subscribers> <messages> <size> [slow]
+//      发布者用一个keep-alive连接逐条POST /publish/<topic>；subscribers个订阅者由读线程统计收到的字节，
+//      全部收齐后输出耗时；slow个订阅者只握手从不读取，应当被服务器当作慢消费者断开
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(int port, int rcvbuf)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(rcvbuf > 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        exit(-1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+//读到空行为止，返回空行之后多读到的字节数（留在buf开头）
+static int read_head(int fd, char* buf, int size, int* head_len)
+{
+    int len = 0;
+    while(true)
+    {
+        int n = read(fd, buf + len, size - 1 - len);
+        if(n <= 0)
+        {
+            return -1;
+        }
+        len += n;
+        buf[len] = '\0';
+        char* end = strstr(buf, "\r\n\r\n");
+        if(end)
+        {
+            *head_len = end + 4 - buf;
+            return len;
+        }
+    }
+}
+
+static int ws_connect(int port, const char* topic, int rcvbuf)
+{
+    int fd = connect_to(port, rcvbuf);
+    char req[256];
+    int len = snprintf(req, sizeof(req), "GET /ws/%s HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                       "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                       "Sec-WebSocket-Version: 13\r\n\r\n", topic);
+    if(write(fd, req, len) != len)
+    {
+        perror("write");
+        exit(-1);
+    }
+    char buf[1024];
+    int head_len;
+    if(read_head(fd, buf, sizeof(buf), &head_len) < 0 || strncmp(buf, "HTTP/1.1 101", 12) != 0
+        || !strstr(buf, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="))
+    {
+        fprintf(stderr, "handshake failed\n");
+        exit(-1);
+    }
+    return fd;
+}
+
+struct reader_state{
+    std::vector<int> fds;
+    long long expect;               //每个订阅者应当收到的字节数
+    std::vector<long long> got;
+    double done_time;
+};
+
+static void* reader(void* arg)
+{
+    reader_state* st = (reader_state*)arg;
+    int epfd = epoll_create1(0);
+    for(size_t i = 0; i < st->fds.size(); i++)
+    {
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, st->fds[i], &ev);
+    }
+
+    size_t finished = 0;
+    static char buf[1 << 16];
+    epoll_event events[256];
+    while(finished < st->fds.size())
+    {
+        int num = epoll_wait(epfd, events, 256, 10000);
+        if(num <= 0)
+        {
+            fprintf(stderr, "reader timed out, %zu/%zu subscribers complete\n", finished, st->fds.size());
+            break;
+        }
+        for(int i = 0; i < num; i++)
+        {
+            int idx = events[i].data.u32;
+            int n = read(st->fds[idx], buf, sizeof(buf));
+            if(n <= 0)
+            {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, st->fds[idx], NULL);
+                continue;
+            }
+            st->got[idx] += n;
+            if(st->got[idx] == st->expect)
+            {
+                finished++;
+            }
+        }
+    }
+    st->done_time = now();
+    close(epfd);
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 6)
+    {
+        printf("usage: %s <port> <topic> <subscribers> <messages> <size> [slow]\n", argv[0]);
+        return 1;
+    }
+    int port = atoi(argv[1]);
+    const char* topic = argv[2];
+    int subscribers = atoi(argv[3]);
+    int messages = atoi(argv[4]);
+    int size = atoi(argv[5]);
+    int slow = (argc > 6) ? atoi(argv[6]) : 0;
+
+    reader_state st;
+    st.fds.resize(subscribers);
+    st.got.assign(subscribers, 0);
+    for(int i = 0; i < subscribers; i++)
+    {
+        st.fds[i] = ws_connect(port, topic, 0);
+    }
+    std::vector<int> slow_fds(slow);
+    for(int i = 0; i < slow; i++)
+    {
+        slow_fds[i] = ws_connect(port, topic, 4096);
+    }
+    int head = (size < 126) ? 2 : (size < 65536) ? 4 : 10;
+    st.expect = (long long)messages * (head + size);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, reader, &st);
+
+    int pub = connect_to(port, 0);
+    std::string payload(size, 'x');
+    char req[256];
+    int req_len = snprintf(req, sizeof(req), "POST /publish/%s HTTP/1.1\r\nHost: localhost\r\n"
+                           "Connection: keep-alive\r\nContent-Length: %d\r\n\r\n", topic, size);
+    std::string request = std::string(req, req_len) + payload;
+
+    double start = now();
+    long long delivered = 0;
+    for(int i = 0; i < messages; i++)
+    {
+        if(write(pub, request.data(), request.size()) != (ssize_t)request.size())
+        {
+            perror("publish");
+            return 1;
+        }
+        char buf[1024];
+        int head_len;
+        int len = read_head(pub, buf, sizeof(buf), &head_len);
+        if(len < 0)
+        {
+            fprintf(stderr, "publisher connection closed\n");
+            return 1;
+        }
+        //应答体只有几个字节，和头部一起到达
+        delivered += atoi(buf + head_len);
+    }
+    double published = now();
+    pthread_join(tid, NULL);
+
+    double elapsed = st.done_time - start;
+    printf("publish  %d messages of %d bytes in %.3f s (%.0f msg/s)\n", messages, size, published - start, messages / (published - start));
+    printf("fan-out  %lld deliveries in %.3f s (%.0f deliveries/s, %.1f MB/s)\n",
+           delivered, elapsed, delivered / elapsed, (double)subscribers * st.expect / elapsed / 1e6);
+
+    //慢消费者：服务器断开后这里读完缓冲区的数据会读到EOF或ECONNRESET
+    if(slow > 0)
+    {
+        int dropped = 0;
+        for(int i = 0; i < slow; i++)
+        {
+            static char buf[1 << 16];
+            int n;
+            while((n = recv(slow_fds[i], buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            {
+            }
+            if(n == 0 || (n < 0 && errno != EAGAIN))
+            {
+                dropped++;
+            }
+        }
+        printf("slow     %d/%d slow subscribers were dropped\n", dropped, slow);
+    }
+    return 0;
+}
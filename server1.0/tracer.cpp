@@ -0,0 +1,235 @@
+#include "tracer.h"
+#include "locker.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <vector>
+#include <unordered_set>
+
+int tracer::m_sample_every = 0;
+uint64_t tracer::m_threshold_ticks = 0;
+double tracer::m_ticks_per_us = 1000.0;
+uint64_t tracer::m_base = 0;
+char tracer::m_path[256] = "";
+
+// 每个线程一个环形缓冲区，第一次记录时创建，挂到全局列表上供导出时遍历，线程退出后也不释放
+struct trace_ring{
+    trace_span spans[tracer::RING_SPANS];
+    uint64_t head;          //只有所属线程写
+    int tid;
+};
+
+static locker rings_lock;
+static std::vector<trace_ring*> rings;
+
+// 保留的请求id，超过MAX_KEPT后覆盖最旧的
+static locker kept_lock;
+static uint64_t kept[tracer::MAX_KEPT];
+static uint64_t kept_count = 0;
+
+static std::atomic<uint64_t> next_trace_id(1);
+static thread_local trace_ring* local_ring = NULL;
+static thread_local uint32_t sample_counter = 0;
+
+uint64_t tracer::now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool tracer::init(int sample_every, int threshold_ms, const char* path)
+{
+    if(sample_every <= 0 || threshold_ms < 0 || !path || strlen(path) >= sizeof(m_path))
+    {
+        return false;
+    }
+    FILE* fp = fopen(path, "w");
+    if(!fp)
+    {
+        return false;
+    }
+    fclose(fp);
+    strcpy(m_path, path);
+
+    //用CLOCK_MONOTONIC标定TSC的频率
+    uint64_t ns0 = now_ns(), t0 = now();
+    struct timespec ts = {0, 20 * 1000000L};
+    nanosleep(&ts, NULL);
+    uint64_t ns1 = now_ns(), t1 = now();
+    m_ticks_per_us = (double)(t1 - t0) * 1000.0 / (double)(ns1 - ns0);
+    if(m_ticks_per_us <= 0)
+    {
+        m_ticks_per_us = 1000.0;
+    }
+    m_base = t1;
+    m_threshold_ticks = (uint64_t)(threshold_ms * 1000.0 * m_ticks_per_us);
+    m_sample_every = sample_every;
+    return true;
+}
+
+uint64_t tracer::sample()
+{
+    if(m_sample_every <= 0)
+    {
+        return 0;
+    }
+    if(++sample_counter < (uint32_t)m_sample_every)
+    {
+        return 0;
+    }
+    sample_counter = 0;
+    return next_trace_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+void tracer::record(uint64_t trace_id, const char* name, int fd, uint64_t begin, uint64_t end, const char* label)
+{
+    trace_ring* ring = local_ring;
+    if(!ring)
+    {
+        ring = new trace_ring;
+        memset((void*)ring, 0, sizeof(*ring));
+        ring->tid = syscall(SYS_gettid);
+        rings_lock.lock();
+        rings.push_back(ring);
+        rings_lock.unlock();
+        local_ring = ring;
+    }
+
+    trace_span& s = ring->spans[ring->head & (RING_SPANS - 1)];
+    ring->head++;
+    uint32_t seq = s.seq.load(std::memory_order_relaxed);
+    s.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.trace_id = trace_id;
+    s.name = name;
+    s.fd = fd;
+    s.begin = begin;
+    s.end = end;
+    if(label)
+    {
+        strncpy(s.label, label, sizeof(s.label) - 1);
+        s.label[sizeof(s.label) - 1] = '\0';
+    }
+    else
+    {
+        s.label[0] = '\0';
+    }
+    s.seq.store(seq + 2, std::memory_order_release);
+}
+
+void tracer::finish(uint64_t trace_id, int fd, uint64_t begin, const char* label)
+{
+    uint64_t end = now();
+    record(trace_id, "request", fd, begin, end, label);
+    if(end - begin >= m_threshold_ticks)
+    {
+        kept_lock.lock();
+        kept[kept_count % MAX_KEPT] = trace_id;
+        kept_count++;
+        kept_lock.unlock();
+    }
+}
+
+// 写JSON字符串，转义引号、反斜杠和控制字符
+static void write_escaped(FILE* fp, const char* s)
+{
+    for(; *s; s++)
+    {
+        unsigned char c = *s;
+        if(c == '"' || c == '\\')
+        {
+            fprintf(fp, "\\%c", c);
+        }
+        else if(c < 0x20 || c >= 0x7f)
+        {
+            fprintf(fp, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, fp);
+        }
+    }
+}
+
+int tracer::dump()
+{
+    if(m_sample_every <= 0)
+    {
+        return -1;
+    }
+
+    std::unordered_set<uint64_t> ids;
+    kept_lock.lock();
+    uint64_t n = kept_count < (uint64_t)MAX_KEPT ? kept_count : MAX_KEPT;
+    for(uint64_t i = 0; i < n; i++)
+    {
+        ids.insert(kept[i]);
+    }
+    kept_lock.unlock();
+
+    rings_lock.lock();
+    std::vector<trace_ring*> all = rings;
+    rings_lock.unlock();
+
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m_path);
+    FILE* fp = fopen(tmp, "w");
+    if(!fp)
+    {
+        return -1;
+    }
+
+    int pid = getpid();
+    int count = 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for(size_t r = 0; r < all.size() && !ids.empty(); r++)
+    {
+        for(int i = 0; i < RING_SPANS; i++)
+        {
+            trace_span& s = all[r]->spans[i];
+            //seqlock：读之前和读之后序号相同且为偶数，说明这期间没有被所属线程改写
+            uint32_t seq0 = s.seq.load(std::memory_order_acquire);
+            if(seq0 == 0 || (seq0 & 1))
+            {
+                continue;
+            }
+            uint64_t trace_id = s.trace_id;
+            const char* name = s.name;
+            int fd = s.fd;
+            uint64_t begin = s.begin, end = s.end;
+            char label[sizeof(s.label)];
+            memcpy(label, s.label, sizeof(label));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(s.seq.load(std::memory_order_relaxed) != seq0 || !ids.count(trace_id))
+            {
+                continue;
+            }
+            label[sizeof(label) - 1] = '\0';
+
+            //开始时间早于标定点的span（理论上没有）按0处理
+            double ts = begin > m_base ? (begin - m_base) / m_ticks_per_us : 0;
+            double dur = end > begin ? (end - begin) / m_ticks_per_us : 0;
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":%llu,\"fd\":%d",
+                    count ? "," : "", name, ts, dur, pid, all[r]->tid, (unsigned long long)trace_id, fd);
+            if(label[0])
+            {
+                fprintf(fp, ",\"url\":\"");
+                write_escaped(fp, label);
+                fputc('"', fp);
+            }
+            fprintf(fp, "}}");
+            count++;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    if(fclose(fp) != 0 || rename(tmp, m_path) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return count;
+}
@@ -0,0 +1,101 @@
+#ifndef TRACER_H__
+#define TRACER_H__
+
+#include <stdint.h>
+#include <atomic>
+
+// 按请求采样的跟踪：每个被采样的请求有一个trace id，各阶段（主线程读、在线程池队列中等待、解析、
+// do_request、写）记录为一个span，写入当前线程私有的环形缓冲区，时间戳用TSC，记录一个span只有几十纳秒。
+// 请求结束时决定是否保留（尾部采样）：耗时超过阈值的请求的id进入保留列表，
+// 导出时从所有线程的环形缓冲区中找出这些请求的span，写成Chrome/Perfetto可以打开的trace JSON。
+// 环形缓冲区会覆盖旧的span，太久以前的慢请求可能已经不完整。
+
+struct trace_span{
+    std::atomic<uint32_t> seq;      //奇数表示正在写入，导出时据此丢弃被并发覆盖的记录
+    int fd;
+    uint64_t trace_id;
+    const char* name;               //静态字符串
+    uint64_t begin;                 //TSC
+    uint64_t end;
+    char label[48];                 //只有请求的根span有：方法和URL
+};
+
+class tracer{
+
+public:
+    static const int RING_SPANS = 8192;         //每个线程的环形缓冲区，必须是2的幂
+    static const int MAX_KEPT = 4096;           //保留的请求id，超过后最旧的被挤出
+
+    //每sample_every个请求采样一个，耗时不少于threshold_ms的保留；path是导出文件
+    static bool init(int sample_every, int threshold_ms, const char* path);
+
+    static bool enabled() { return m_sample_every > 0; }
+
+    //新请求是否采样，返回trace id，0表示不采样
+    static uint64_t sample();
+
+    static inline uint64_t now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        return now_ns();
+#endif
+    }
+
+    static void record(uint64_t trace_id, const char* name, int fd, uint64_t begin, uint64_t end, const char* label = 0);
+
+    //请求结束：记录根span，耗时超过阈值时保留
+    static void finish(uint64_t trace_id, int fd, uint64_t begin, const char* label);
+
+    //把保留的请求写到init指定的文件，返回写出的span个数，-1表示失败
+    static int dump();
+    static const char* path() { return m_path; }
+
+private:
+    static uint64_t now_ns();
+
+private:
+    static int m_sample_every;
+    static uint64_t m_threshold_ticks;
+    static double m_ticks_per_us;
+    static uint64_t m_base;
+    static char m_path[256];
+};
+
+// 作用域span：构造时记录开始时间，析构或close()时写入（没有采样时什么也不做）
+// end不为NULL时把结束时间也存到那里，供下一个阶段作为开始时间
+class trace_scope{
+
+public:
+    trace_scope(uint64_t trace_id, const char* name, int fd, uint64_t* end = 0):
+        m_trace_id(trace_id), m_name(name), m_fd(fd), m_begin(trace_id ? tracer::now() : 0), m_end(end) {}
+
+    ~trace_scope()
+    {
+        close();
+    }
+
+    void close()
+    {
+        if(m_trace_id)
+        {
+            uint64_t end = tracer::now();
+            tracer::record(m_trace_id, m_name, m_fd, m_begin, end);
+            if(m_end)
+            {
+                *m_end = end;
+            }
+            m_trace_id = 0;
+        }
+    }
+
+private:
+    uint64_t m_trace_id;
+    const char* m_name;
+    int m_fd;
+    uint64_t m_begin;
+    uint64_t* m_end;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#include "upload_handler.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+upload_handler::upload_handler(const char* dir)
+{
+    strncpy(m_dir, dir, sizeof(m_dir) - 1);
+    m_dir[sizeof(m_dir) - 1] = '\0';
+}
+
+bool upload_handler::target_path(const http_request& req, char* path, int len) const
+{
+    const char* name = req.path + req.path_len;
+    while(name > req.path && name[-1] != '/')
+    {
+        name--;
+    }
+    int name_len = req.path + req.path_len - name;
+    if(name_len == 0 || name[0] == '.')
+    {
+        return false;
+    }
+    for(int i = 0; i < name_len; i++)
+    {
+        char c = name[i];
+        if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+            || c == '.' || c == '_' || c == '-'))
+        {
+            return false;
+        }
+    }
+    return snprintf(path, len, "%s/%.*s", m_dir, name_len, name) < len;
+}
+
+bool upload_handler::on_headers(http_request& req)
+{
+    char path[256];
+    if(!target_path(req, path, sizeof(path)))
+    {
+        return false;
+    }
+
+    req.body_fd = open(m_dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    return req.body_fd >= 0;
+}
+
+bool upload_handler::handle(http_request& req, http_response& resp)
+{
+    char path[256];
+    char proc_path[64];
+    target_path(req, path, sizeof(path));
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", req.body_fd);
+
+    //覆盖已有的同名文件
+    unlink(path);
+    int ret = linkat(AT_FDCWD, proc_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+    close(req.body_fd);
+    req.body_fd = -1;
+
+    if(ret < 0)
+    {
+        return false;
+    }
+    return resp.status(201, "Created") && resp.body("text/plain", "created\n", 8);
+}
+
+void upload_handler::on_abort(http_request& req)
+{
+    //匿名文件没有名字，关闭后自动释放
+    if(req.body_fd >= 0)
+    {
+        close(req.body_fd);
+        req.body_fd = -1;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef UPLOAD_HANDLER_H__
+#define UPLOAD_HANDLER_H__
+
+#include "router.h"
+
+// 上传处理器：PUT/POST /upload/<文件名> 把请求体保存为 dir/<文件名>
+// 请求体写入O_TMPFILE匿名文件（定长请求体由http_conn用splice零拷贝写入），
+// 完整接收后才链接到目标文件名，中途断开不会留下不完整的文件
+
+class upload_handler : public request_handler{
+
+public:
+    explicit upload_handler(const char* dir);
+
+    bool on_headers(http_request& req);
+    bool handle(http_request& req, http_response& resp);
+    void on_abort(http_request& req);
+
+private:
+    //取路径最后一段作为文件名，只允许字母、数字和 . _ -，不能以.开头
+    bool target_path(const http_request& req, char* path, int len) const;
+
+private:
+    char m_dir[200];
+};
+
+#endif
@@ -0,0 +1,270 @@
+#include "vhost.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+//FNV-1a
+static uint32_t name_hash(const char* name, int len)
+{
+    uint32_t h = 2166136261u;
+    for(int i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+vhost_table::vhost_table(const char* default_root, bool listing):
+    m_slots(NULL), m_capacity(0) {
+
+    m_default = create(default_root, strlen(default_root), listing);
+}
+
+vhost_table::~vhost_table()
+{
+    for(size_t i = 0; i < m_hosts.size(); i++)
+    {
+        delete m_hosts[i];
+    }
+    delete[] m_slots;
+}
+
+vhost* vhost_table::create(const char* root, int root_len, bool listing)
+{
+    //根目录末尾的'/'去掉，URL本身以'/'开头
+    while(root_len > 1 && root[root_len - 1] == '/')
+    {
+        root_len--;
+    }
+    if(root_len <= 0 || root_len >= vhost::ROOT_LEN)
+    {
+        return NULL;
+    }
+    vhost* host = new vhost;
+    memcpy(host->root, root, root_len);
+    host->root[root_len] = '\0';
+    host->root_len = root_len;
+    host->listing = listing;
+    host->requests = 0;
+    m_hosts.push_back(host);
+    return host;
+}
+
+// name[,name...]=root[:listing]
+bool vhost_table::add(const char* spec)
+{
+    const char* eq = strchr(spec, '=');
+    if(!eq || eq == spec || (int)m_hosts.size() >= MAX_HOSTS)
+    {
+        return false;
+    }
+    const char* root = eq + 1;
+    int root_len = strlen(root);
+    bool listing = false;
+    if(root_len > 8 && strcmp(root + root_len - 8, ":listing") == 0)
+    {
+        listing = true;
+        root_len -= 8;
+    }
+    std::string path(root, root_len);
+    struct stat st;
+    if(root[0] != '/' || stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        printf("vhost root is not a directory: %s\n", path.c_str());
+        return false;
+    }
+    vhost* host = create(root, root_len, listing);
+    if(!host)
+    {
+        return false;
+    }
+    host->names.assign(spec, eq - spec);
+
+    const char* p = spec;
+    while(p < eq)
+    {
+        int len = strcspn(p, ",=");
+        std::string name(p, len);
+        for(size_t i = 0; i < name.size(); i++)
+        {
+            name[i] = tolower((unsigned char)name[i]);
+        }
+        if(!name.empty() && name[name.size() - 1] == '.')
+        {
+            name.erase(name.size() - 1);
+        }
+        //'*'只能是整个名字或者开头的"*."
+        size_t star = name.find('*');
+        if(name.empty() || len >= NAME_LEN
+            || (star != std::string::npos && !(name == "*" || (star == 0 && name.size() > 2 && name[1] == '.'
+                                                             && name.find('*', 1) == std::string::npos))))
+        {
+            printf("bad vhost name: %s\n", name.c_str());
+            return false;
+        }
+        if(name == "*")
+        {
+            m_default = host;
+        }
+        else
+        {
+            for(size_t i = 0; i < m_names.size(); i++)
+            {
+                if(m_names[i].first == name)
+                {
+                    printf("duplicate vhost name: %s\n", name.c_str());
+                    return false;
+                }
+            }
+            m_names.push_back(std::make_pair(name, host));
+        }
+        p += len;
+        if(*p == ',')
+        {
+            p++;
+        }
+    }
+    return true;
+}
+
+void vhost_table::build()
+{
+    m_capacity = 16;
+    while(m_capacity < (int)m_names.size() * 2)
+    {
+        m_capacity *= 2;
+    }
+    m_slots = new name_slot[m_capacity];
+    memset(m_slots, 0, sizeof(name_slot) * m_capacity);
+    for(size_t i = 0; i < m_names.size(); i++)
+    {
+        const std::string& name = m_names[i].first;
+        uint32_t hash = name_hash(name.data(), name.size());
+        name_slot* slot = m_slots + (hash & (m_capacity - 1));
+        while(slot->host)
+        {
+            slot = (slot + 1 == m_slots + m_capacity) ? m_slots : slot + 1;
+        }
+        slot->hash = hash;
+        slot->len = name.size();
+        memcpy(slot->name, name.data(), name.size());
+        slot->host = m_names[i].second;
+    }
+    m_names.clear();
+}
+
+vhost* vhost_table::find(const char* name, int len) const
+{
+    uint32_t hash = name_hash(name, len);
+    for(int i = 0; i < m_capacity; i++)
+    {
+        const name_slot& slot = m_slots[(hash + i) & (m_capacity - 1)];
+        if(!slot.host)
+        {
+            return NULL;
+        }
+        if(slot.hash == hash && slot.len == len && memcmp(slot.name, name, len) == 0)
+        {
+            return slot.host;
+        }
+    }
+    return NULL;
+}
+
+vhost* vhost_table::lookup(const char* host, int len) const
+{
+    if(!host || m_capacity == 0)
+    {
+        return m_default;
+    }
+    const char* end = host + (len < 0 ? strlen(host) : len);
+    const char* p = host;
+    while(p < end && (*p == ' ' || *p == '\t'))
+    {
+        p++;
+    }
+    //去掉端口（IPv6字面量在方括号里）和末尾的'.'
+    const char* stop = p;
+    if(stop < end && *stop == '[')
+    {
+        stop = (const char*)memchr(stop, ']', end - stop);
+        stop = stop ? stop + 1 : end;
+    }
+    else
+    {
+        while(stop < end && *stop != ':' && *stop != ' ' && *stop != '\t' && *stop != '\r')
+        {
+            stop++;
+        }
+    }
+    if(stop > p && stop[-1] == '.')
+    {
+        stop--;
+    }
+    int n = stop - p;
+    if(n <= 0 || n >= NAME_LEN)
+    {
+        return m_default;
+    }
+
+    //key[1..n]是小写的名字，key[0]留给通配符的'*'
+    char key[NAME_LEN + 1] = "*";
+    for(int i = 0; i < n; i++)
+    {
+        key[i + 1] = tolower((unsigned char)p[i]);
+    }
+    vhost* found = find(key + 1, n);
+    if(found)
+    {
+        return found;
+    }
+
+    //依次去掉最左边的一个标签，找"*.后缀"
+    for(int i = 1; i <= n; i++)
+    {
+        if(key[i] == '.')
+        {
+            key[i - 1] = '*';
+            found = find(key + i - 1, n - i + 2);
+            if(found)
+            {
+                return found;
+            }
+        }
+    }
+    return m_default;
+}
+
+std::vector<const char*> vhost_table::roots() const
+{
+    std::vector<const char*> roots;
+    for(size_t i = 0; i < m_hosts.size(); i++)
+    {
+        //配置了"*"以后doc_root不会再被用到
+        bool seen = (i == 0 && m_default != m_hosts[0]);
+        for(size_t j = 0; j < roots.size() && !seen; j++)
+        {
+            seen = strcmp(roots[j], m_hosts[i]->root) == 0;
+        }
+        if(!seen)
+        {
+            roots.push_back(m_hosts[i]->root);
+        }
+    }
+    return roots;
+}
+
+int vhost_table::report(char* buf, int len) const
+{
+    int n = 0;
+    for(size_t i = (m_default == m_hosts[0]) ? 0 : 1; i < m_hosts.size() && n < len; i++)
+    {
+        const vhost* host = m_hosts[i];
+        n += snprintf(buf + n, len - n, "%s %s%s%s requests %llu\n", host->names.empty() ? "-" : host->names.c_str(),
+                      host->root, host->listing ? " listing" : "", host == m_default ? " default" : "",
+                      (unsigned long long)host->requests.load(std::memory_order_relaxed));
+    }
+    return n < len ? n : len - 1;
+}
@@ -0,0 +1,69 @@
+#ifndef VHOST_H__
+#define VHOST_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// 基于名字的虚拟主机（-V name[,name...]=doc_root[:listing]，可以重复）
+// 按Host头部（HTTP/2是:authority）选择文档根目录和目录列表的设置，许多低流量的站点共用一个进程的连接数组、reactor和线程池。
+// 名字可以是完整的主机名、以"*."开头的通配符（*.example.com匹配a.example.com和a.b.example.com，后缀最长的优先），
+// 或者"*"：什么都不匹配时的默认主机，不配置时是编译进来的doc_root（-L决定它的目录列表）。
+// 启动时把所有名字放进一张开放寻址的哈希表，之后只读，查找不加锁；比较前去掉端口和末尾的'.'，不区分大小写。
+// 共享的缓存里不同主机的条目天然分开：文件元数据缓存和目录索引按完整路径作键，微缓存按Host+路径作键。
+struct vhost{
+    static const int ROOT_LEN = 128;
+
+    char root[ROOT_LEN];                //文档根目录，不以'/'结尾
+    int root_len;
+    bool listing;                       //没有索引文件时生成目录列表
+    std::string names;                  //配置的名字，/vhostz显示
+    std::atomic<uint64_t> requests;     //访问文件系统的请求数
+};
+
+class vhost_table{
+
+public:
+    static const int MAX_HOSTS = 256;
+    static const int NAME_LEN = 128;
+
+    vhost_table(const char* default_root, bool listing);
+    ~vhost_table();
+
+    //解析一条-V，启动时在build之前调用
+    bool add(const char* spec);
+    //所有add之后调用一次，生成名字的哈希表
+    void build();
+
+    //host是Host头部的值（可以带端口），为NULL时返回默认主机；len为-1时以'\0'结尾
+    vhost* lookup(const char* host, int len = -1) const;
+
+    //去重后的文档根目录，交给文件监视器
+    std::vector<const char*> roots() const;
+
+    int report(char* buf, int len) const;
+
+private:
+    struct name_slot{
+        uint32_t hash;
+        int len;
+        char name[NAME_LEN];
+        vhost* host;                    //NULL表示空槽
+    };
+
+    vhost* create(const char* root, int root_len, bool listing);
+    vhost* find(const char* name, int len) const;
+
+    vhost_table(const vhost_table&);
+    vhost_table& operator=(const vhost_table&);
+
+private:
+    std::vector<vhost*> m_hosts;                                //m_hosts[0]是doc_root
+    vhost* m_default;
+    std::vector<std::pair<std::string, vhost*> > m_names;       //build之前收集的名字
+    name_slot* m_slots;
+    int m_capacity;                                             //2的幂，至少是名字数的两倍
+};
+
+#endif
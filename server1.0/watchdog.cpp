@@ -0,0 +1,163 @@
+#include "watchdog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+
+//抓取调用栈用的信号；SIGUSR2已经给了跟踪导出
+#define STACK_SIGNAL (SIGRTMIN + 1)
+
+static thread_local worker_status* t_self = NULL;
+
+void worker_status::begin(const void* t)
+{
+    since_ms.store(stall_watch::now_ms(), std::memory_order_relaxed);
+    task.store(t, std::memory_order_relaxed);
+    epoch.fetch_add(1, std::memory_order_release);
+}
+
+void worker_status::end()
+{
+    task.store(NULL, std::memory_order_relaxed);
+    epoch.fetch_add(1, std::memory_order_release);
+}
+
+uint64_t stall_watch::now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool stall_watch::parse(const char* spec, int* stall_ms, REACTION* reaction)
+{
+    char* end;
+    long ms = strtol(spec, &end, 10);
+    if(end == spec || ms <= 0)
+    {
+        return false;
+    }
+    *stall_ms = ms;
+    *reaction = LOG;
+    if(*end == '\0')
+    {
+        return true;
+    }
+    if(*end != ':')
+    {
+        return false;
+    }
+    end++;
+    if(strcmp(end, "log") == 0)
+    {
+        *reaction = LOG;
+    }
+    else if(strcmp(end, "replace") == 0)
+    {
+        *reaction = REPLACE;
+    }
+    else if(strcmp(end, "shed") == 0)
+    {
+        *reaction = SHED;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+const char* stall_watch::reaction_name(REACTION reaction)
+{
+    switch(reaction)
+    {
+        case REPLACE: return "replace";
+        case SHED: return "shed";
+        default: return "log";
+    }
+}
+
+//backtrace第一次调用时会加载libgcc（要分配内存），先在普通上下文里调用一次
+void stall_watch::bind(worker_status* self)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, [](){
+        void* frames[2];
+        backtrace(frames, 2);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(STACK_SIGNAL, &sa, NULL);
+    });
+    t_self = self;
+    self->tid.store(syscall(SYS_gettid), std::memory_order_release);
+}
+
+void stall_watch::unbind(worker_status* self)
+{
+    self->tid.store(0, std::memory_order_release);
+    t_self = NULL;
+}
+
+void stall_watch::on_signal(int sig)
+{
+    worker_status* self = t_self;
+    if(!self)
+    {
+        return;
+    }
+    int saved = errno;
+    self->depth.store(backtrace(self->frames, worker_status::MAX_FRAMES), std::memory_order_relaxed);
+    self->stack_seq.fetch_add(1, std::memory_order_release);
+    errno = saved;
+}
+
+bool stall_watch::capture(worker_status* w, int timeout_ms)
+{
+    //分离的线程随时可能退出，对已经退出的线程pthread_kill是未定义行为；
+    //按tid发信号最坏是发给了复用这个tid的本进程线程，处理函数没有绑定状态槽时什么都不做
+    pid_t tid = w->tid.load(std::memory_order_acquire);
+    if(!w->used.load(std::memory_order_acquire) || tid == 0)
+    {
+        return false;
+    }
+    uint64_t seq = w->stack_seq.load(std::memory_order_acquire);
+    if(syscall(SYS_tgkill, getpid(), tid, STACK_SIGNAL) != 0)
+    {
+        return false;
+    }
+    for(int waited = 0; waited < timeout_ms; waited++)
+    {
+        if(w->stack_seq.load(std::memory_order_acquire) != seq)
+        {
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+int stall_watch::format_stack(const worker_status* w, char* buf, int len)
+{
+    int depth = w->depth.load(std::memory_order_relaxed);
+    if(depth <= 0 || len <= 0)
+    {
+        return 0;
+    }
+    //前两帧是信号处理函数和内核的信号跳板
+    char** symbols = backtrace_symbols((void* const*)w->frames, depth);
+    int n = 0;
+    for(int i = 2; i < depth && n < len; i++)
+    {
+        n += snprintf(buf + n, len - n, "    #%d %s\n", i - 2, symbols ? symbols[i] : "?");
+    }
+    free(symbols);
+    return (n < len) ? n : len - 1;
+}
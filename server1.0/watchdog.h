@@ -0,0 +1,73 @@
+#ifndef WATCHDOG_H__
+#define WATCHDOG_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <atomic>
+
+// 线程池的看门狗（-W stall_ms[:log|replace|shed]）
+// 每个工作线程有一个状态槽：开始和结束一个任务时epoch各加一（奇数表示正在运行），同时记下任务和开始时间。
+// 看门狗线程定期扫描，任务运行超过stall_ms的工作线程算卡住：打印它的调用栈（向它发信号，
+// 由它自己在信号处理函数里backtrace），按配置的反应处理：
+//      log      只记录
+//      replace  另起一个工作线程顶替，卡住的线程做完手上的任务后退出
+//      shed     有线程卡住期间队列只保留很短的积压，多出来的请求直接拒绝（连接关闭），而不是排在卡住的线程后面
+// GET /poolz 查看每个线程在做什么、卡住的次数和时长，/poolz?stacks=1 同时抓取所有忙碌线程的调用栈。
+// 抓栈的信号带SA_RESTART，但nanosleep、poll这类调用仍然会提前返回EINTR；符号名需要用-rdynamic链接，否则只有偏移（可以用addr2line还原）。
+
+// 一个工作线程的状态，独占缓存行
+struct alignas(64) worker_status{
+    static const int MAX_FRAMES = 32;
+
+    std::atomic<uint64_t> epoch;        //奇数表示正在运行任务
+    std::atomic<uint64_t> since_ms;     //当前任务的开始时间
+    std::atomic<const void*> task;      //当前任务
+    std::atomic<bool> used;             //这个槽上有线程
+    std::atomic<bool> retire;           //已经有线程顶替，做完当前任务后退出
+    std::atomic<pid_t> tid;             //线程的内核tid，bind时写入、退出前清零；抓栈用tgkill发给它
+    int home;                           //绑定CPU和取任务时使用的工作线程编号（顶替的线程沿用被顶替的）
+    uint64_t reported_epoch;            //看门狗已经报告过卡住的epoch，只在看门狗线程里访问
+
+    //调用栈：由线程自己在信号处理函数里写，stack_seq加一表示写好了
+    void* frames[MAX_FRAMES];
+    std::atomic<int> depth;
+    std::atomic<uint64_t> stack_seq;
+
+    void begin(const void* t);
+    void end();
+    bool busy() const { return epoch.load(std::memory_order_acquire) & 1; }
+};
+
+// 与任务类型无关的部分
+class stall_watch{
+
+public:
+    enum REACTION{
+        LOG,
+        REPLACE,
+        SHED
+    };
+
+    static uint64_t now_ms();
+
+    //解析 -W stall_ms[:log|replace|shed]
+    static bool parse(const char* spec, int* stall_ms, REACTION* reaction);
+    static const char* reaction_name(REACTION reaction);
+
+    //工作线程启动时调用：之后它可以响应抓取调用栈的信号
+    static void bind(worker_status* self);
+    //工作线程退出前调用，之后不会再向它发信号
+    static void unbind(worker_status* self);
+
+    //让线程w记录调用栈，最多等timeout_ms；线程已经退出或者没有响应时返回false
+    static bool capture(worker_status* w, int timeout_ms);
+
+    //把记录的调用栈格式化成每帧一行
+    static int format_stack(const worker_status* w, char* buf, int len);
+
+private:
+    static void on_signal(int sig);
+};
+
+#endif
@@ -0,0 +1,659 @@
+#include "websocket.h"
+#include "ws_hub.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+ws_message* ws_message::create(int opcode, const char* payload, int payload_len)
+{
+    int head = (payload_len < 126) ? 2 : (payload_len < 65536) ? 4 : 10;
+    ws_message* msg = (ws_message*)malloc(sizeof(ws_message) + head + payload_len);
+    if(!msg)
+    {
+        return NULL;
+    }
+    new (&msg->refs) std::atomic<int>(1);
+    msg->len = head + payload_len;
+
+    unsigned char* p = (unsigned char*)msg->data;
+    p[0] = 0x80 | opcode;
+    if(head == 2)
+    {
+        p[1] = payload_len;
+    }
+    else if(head == 4)
+    {
+        p[1] = 126;
+        p[2] = payload_len >> 8;
+        p[3] = payload_len;
+    }
+    else
+    {
+        p[1] = 127;
+        for(int i = 0; i < 8; i++)
+        {
+            p[2 + i] = (uint64_t)payload_len >> (56 - 8 * i);
+        }
+    }
+    memcpy(p + head, payload, payload_len);
+    return msg;
+}
+
+void ws_message::unref()
+{
+    if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        free(this);
+    }
+}
+
+bool ws_endpoint::handle(http_request& req, http_response& resp)
+{
+    static const char body[] = "This resource requires a WebSocket upgrade.\n";
+    return resp.status(426, "Upgrade Required")
+        && resp.header("Upgrade", "websocket")
+        && resp.body("text/plain", body, sizeof(body) - 1);
+}
+
+//客户端发来的每一帧都带掩码，负载逐字节与4字节掩码循环异或；按向量宽度成块处理
+void ws_unmask(unsigned char* data, size_t len, const unsigned char mask[4], size_t offset)
+{
+    unsigned char key[4];
+    for(int i = 0; i < 4; i++)
+    {
+        key[i] = mask[(offset + i) & 3];
+    }
+    uint32_t key32;
+    memcpy(&key32, key, 4);
+
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i k256 = _mm256_set1_epi32(key32);
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(v, k256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i k128 = _mm_set1_epi32(key32);
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(v, k128));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t k128 = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+    for(; i + 16 <= len; i += 16)
+    {
+        vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), k128));
+    }
+#endif
+    uint64_t key64 = ((uint64_t)key32 << 32) | key32;
+    for(; i + 8 <= len; i += 8)
+    {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        v ^= key64;
+        memcpy(data + i, &v, 8);
+    }
+    for(; i < len; i++)
+    {
+        data[i] ^= key[i & 3];
+    }
+}
+
+//SHA-1只用于握手，不追求速度
+static void sha1(const unsigned char* data, size_t len, unsigned char out[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    std::string msg((const char*)data, len);
+    msg.push_back((char)0x80);
+    while(msg.size() % 64 != 56)
+    {
+        msg.push_back(0);
+    }
+    uint64_t bits = (uint64_t)len * 8;
+    for(int i = 7; i >= 0; i--)
+    {
+        msg.push_back((char)(bits >> (i * 8)));
+    }
+
+    for(size_t chunk = 0; chunk < msg.size(); chunk += 64)
+    {
+        const unsigned char* p = (const unsigned char*)msg.data() + chunk;
+        uint32_t w[80];
+        for(int i = 0; i < 16; i++)
+        {
+            w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) | ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+        }
+        for(int i = 16; i < 80; i++)
+        {
+            uint32_t v = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (v << 1) | (v >> 31);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for(int i = 0; i < 80; i++)
+        {
+            uint32_t f, k;
+            if(i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+            else if(i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+            else if(i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else            { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+            uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for(int i = 0; i < 5; i++)
+    {
+        out[i * 4] = h[i] >> 24;
+        out[i * 4 + 1] = h[i] >> 16;
+        out[i * 4 + 2] = h[i] >> 8;
+        out[i * 4 + 3] = h[i];
+    }
+}
+
+void ws_accept_key(const char* key, char* out)
+{
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string s(key, strcspn(key, " \t"));
+    s += guid;
+    unsigned char digest[20];
+    sha1((const unsigned char*)s.data(), s.size(), digest);
+
+    //20字节 -> 28个base64字符（最后一组补一个'='）
+    int o = 0;
+    for(int i = 0; i < 20; i += 3)
+    {
+        uint32_t v = digest[i] << 16;
+        if(i + 1 < 20) v |= digest[i + 1] << 8;
+        if(i + 2 < 20) v |= digest[i + 2];
+        out[o++] = table[(v >> 18) & 63];
+        out[o++] = table[(v >> 12) & 63];
+        out[o++] = (i + 1 < 20) ? table[(v >> 6) & 63] : '=';
+        out[o++] = (i + 2 < 20) ? table[v & 63] : '=';
+    }
+    out[o] = '\0';
+}
+
+bool ws_utf8_valid(const unsigned char* s, int len)
+{
+    int i = 0;
+    while(i < len)
+    {
+        unsigned char c = s[i];
+        if(c < 0x80)
+        {
+            i++;
+            continue;
+        }
+        int n;
+        uint32_t cp;
+        if((c & 0xE0) == 0xC0)      { n = 1; cp = c & 0x1F; }
+        else if((c & 0xF0) == 0xE0) { n = 2; cp = c & 0x0F; }
+        else if((c & 0xF8) == 0xF0) { n = 3; cp = c & 0x07; }
+        else return false;
+        if(i + n >= len)
+        {
+            return false;
+        }
+        for(int j = 1; j <= n; j++)
+        {
+            if((s[i + j] & 0xC0) != 0x80)
+            {
+                return false;
+            }
+            cp = (cp << 6) | (s[i + j] & 0x3F);
+        }
+        if((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000)
+            || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        {
+            return false;
+        }
+        i += n + 1;
+    }
+    return true;
+}
+
+ws_session::ws_session():
+    context(NULL), m_sockfd(-1), m_generation(0), m_closing(false), m_armed(false), m_registered(false),
+    m_queue_head(0), m_queue_off(0), m_queued_bytes(0),
+    m_endpoint(NULL), m_hub(NULL), m_message_opcode(0), m_close_received(false), m_last_seen(0)
+{
+
+}
+
+ws_session::~ws_session()
+{
+    release_queue_locked();
+}
+
+void ws_session::open(int sockfd, ws_endpoint* endpoint, ws_hub* hub)
+{
+    m_lock.lock();
+    m_sockfd = sockfd;
+    if(++m_generation == 0)
+    {
+        m_generation = 1;
+    }
+    m_closing = false;
+    m_armed = false;
+    m_registered = false;
+    m_lock.unlock();
+
+    m_endpoint = endpoint;
+    m_hub = hub;
+    m_in.clear();
+    m_message.clear();
+    m_message_opcode = 0;
+    m_close_received = false;
+    m_last_seen.store(now_ms(), std::memory_order_relaxed);
+    context = NULL;
+    topic.clear();
+
+    m_hub->attach(this);
+}
+
+bool ws_session::on_input(const char* data, int len)
+{
+    if(len > 0)
+    {
+        m_last_seen.store(now_ms(), std::memory_order_relaxed);
+    }
+    if(m_close_received)
+    {
+        //关闭握手之后的数据丢弃
+        return true;
+    }
+    m_in.append(data, len);
+
+    size_t pos = 0;
+    while(m_in.size() - pos >= 2)
+    {
+        unsigned char* p = (unsigned char*)&m_in[pos];
+        size_t avail = m_in.size() - pos;
+        bool fin = (p[0] & 0x80) != 0;
+        int opcode = p[0] & 0x0F;
+        uint64_t payload_len = p[1] & 0x7F;
+        size_t head = 2;
+
+        //保留位必须为0，客户端的帧必须带掩码
+        if((p[0] & 0x70) || !(p[1] & 0x80))
+        {
+            close(1002);
+            return true;
+        }
+        if(payload_len == 126)
+        {
+            if(avail < 4)
+            {
+                break;
+            }
+            payload_len = (p[2] << 8) | p[3];
+            head = 4;
+        }
+        else if(payload_len == 127)
+        {
+            if(avail < 10)
+            {
+                break;
+            }
+            payload_len = 0;
+            for(int i = 0; i < 8; i++)
+            {
+                payload_len = (payload_len << 8) | p[2 + i];
+            }
+            head = 10;
+        }
+        if(payload_len > (uint64_t)MAX_MESSAGE)
+        {
+            close(1009);
+            return true;
+        }
+        head += 4;
+        if(avail < head + payload_len)
+        {
+            break;
+        }
+
+        unsigned char* payload = p + head;
+        ws_unmask(payload, payload_len, p + head - 4, 0);
+        pos += head + payload_len;
+        if(!process_frame(opcode, fin, payload, (int)payload_len))
+        {
+            return true;
+        }
+    }
+    m_in.erase(0, pos);
+    return true;
+}
+
+//处理一个完整的帧，返回false表示不再处理后面的输入（已经开始关闭）
+bool ws_session::process_frame(int opcode, bool fin, unsigned char* payload, int len)
+{
+    if(opcode & 0x8)
+    {
+        //控制帧不能分片，负载不超过125字节，可以插在分片消息中间
+        if(!fin || len > 125)
+        {
+            close(1002);
+            return false;
+        }
+        switch(opcode)
+        {
+            case WS_CLOSE:
+            {
+                m_close_received = true;
+                int code = 1000;
+                if(len == 1)
+                {
+                    code = 1002;
+                }
+                else if(len >= 2)
+                {
+                    code = (payload[0] << 8) | payload[1];
+                    if(code < 1000 || code == 1004 || code == 1005 || code == 1006 || (code > 1011 && code < 3000)
+                        || code >= 5000 || !ws_utf8_valid(payload + 2, len - 2))
+                    {
+                        code = 1002;
+                    }
+                }
+                close(code);
+                return false;
+            }
+            case WS_PING:
+            {
+                ws_message* pong = ws_message::create(WS_PONG, (const char*)payload, len);
+                if(pong)
+                {
+                    send(pong);
+                    pong->unref();
+                }
+                return true;
+            }
+            case WS_PONG:
+                //心跳的应答，m_last_seen已经更新
+                return true;
+            default:
+                close(1002);
+                return false;
+        }
+    }
+
+    if(opcode == WS_CONTINUATION)
+    {
+        if(m_message_opcode == 0)
+        {
+            close(1002);
+            return false;
+        }
+        if(m_message.size() + len > (size_t)MAX_MESSAGE)
+        {
+            close(1009);
+            return false;
+        }
+        m_message.append((const char*)payload, len);
+        if(!fin)
+        {
+            return true;
+        }
+        opcode = m_message_opcode;
+        m_message_opcode = 0;
+        payload = (unsigned char*)&m_message[0];
+        len = m_message.size();
+    }
+    else if(opcode == WS_TEXT || opcode == WS_BINARY)
+    {
+        if(m_message_opcode != 0)
+        {
+            close(1002);
+            return false;
+        }
+        if(!fin)
+        {
+            m_message_opcode = opcode;
+            m_message.assign((const char*)payload, len);
+            return true;
+        }
+    }
+    else
+    {
+        close(1002);
+        return false;
+    }
+
+    //完整的消息：未分片的直接使用输入缓冲区中的负载，不拷贝
+    if(opcode == WS_TEXT && !ws_utf8_valid(payload, len))
+    {
+        close(1007);
+        return false;
+    }
+    m_endpoint->on_message(this, opcode, (const char*)payload, len);
+    m_message.clear();
+    return true;
+}
+
+bool ws_session::send(ws_message* msg, uint32_t generation)
+{
+    m_lock.lock();
+    if(m_sockfd < 0 || m_closing || (generation && generation != m_generation))
+    {
+        m_lock.unlock();
+        return false;
+    }
+
+    //对方读得太慢，消息在队列中越积越多：断开它而不是无限缓存
+    size_t pending = m_queue.size() - m_queue_head;
+    if(pending >= (size_t)MAX_QUEUE_MESSAGES || m_queued_bytes + msg->len > (size_t)MAX_QUEUE_BYTES)
+    {
+        drop_locked();
+        m_lock.unlock();
+        return false;
+    }
+
+    msg->ref();
+    m_queue.push_back(msg);
+    m_queued_bytes += msg->len;
+
+    //正在等待EPOLLOUT时由写线程发送，否则直接在当前线程尝试写
+    bool ok = m_armed || flush_locked();
+    m_lock.unlock();
+    return ok;
+}
+
+bool ws_session::send(int opcode, const char* data, int len)
+{
+    ws_message* msg = ws_message::create(opcode, data, len);
+    if(!msg)
+    {
+        return false;
+    }
+    bool ok = send(msg);
+    msg->unref();
+    return ok;
+}
+
+void ws_session::close(int code)
+{
+    unsigned char payload[2] = {(unsigned char)(code >> 8), (unsigned char)code};
+    ws_message* msg = ws_message::create(WS_CLOSE, (const char*)payload, 2);
+    if(!msg)
+    {
+        return;
+    }
+    m_close_received = true;        //不再处理后面的输入
+
+    m_lock.lock();
+    if(m_sockfd >= 0 && !m_closing)
+    {
+        msg->ref();
+        m_queue.push_back(msg);
+        m_queued_bytes += msg->len;
+        m_closing = true;
+        if(!m_armed)
+        {
+            flush_locked();
+        }
+    }
+    m_lock.unlock();
+    msg->unref();
+}
+
+void ws_session::shutdown()
+{
+    m_endpoint->on_close(this);
+    m_hub->detach(this);
+
+    m_lock.lock();
+    if(m_registered)
+    {
+        epoll_ctl(m_hub->epollfd(), EPOLL_CTL_DEL, m_sockfd, NULL);
+    }
+    m_registered = false;
+    m_armed = false;
+    release_queue_locked();
+    m_sockfd = -1;
+    m_lock.unlock();
+}
+
+void ws_session::on_writable()
+{
+    m_lock.lock();
+    if(m_sockfd >= 0 && m_armed)
+    {
+        m_armed = false;
+        flush_locked();
+    }
+    m_lock.unlock();
+}
+
+void ws_session::drop(uint32_t generation)
+{
+    m_lock.lock();
+    if(m_sockfd >= 0 && !m_closing && (!generation || generation == m_generation))
+    {
+        drop_locked();
+    }
+    m_lock.unlock();
+}
+
+//把发送队列写到socket：一次writev最多MAX_IOV条消息，每条消息都是共享的同一块内存
+bool ws_session::flush_locked()
+{
+    while(m_queue_head < m_queue.size())
+    {
+        struct iovec iov[MAX_IOV];
+        int count = 0;
+        for(size_t i = m_queue_head; i < m_queue.size() && count < MAX_IOV; i++, count++)
+        {
+            size_t skip = (i == m_queue_head) ? m_queue_off : 0;
+            iov[count].iov_base = m_queue[i]->data + skip;
+            iov[count].iov_len = m_queue[i]->len - skip;
+        }
+
+        ssize_t n = writev(m_sockfd, iov, count);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                arm_locked();
+                return true;
+            }
+            drop_locked();
+            return false;
+        }
+
+        m_queued_bytes -= n;
+        while(n > 0)
+        {
+            ws_message* msg = m_queue[m_queue_head];
+            size_t left = msg->len - m_queue_off;
+            if((size_t)n < left)
+            {
+                m_queue_off += n;
+                break;
+            }
+            n -= left;
+            m_queue_off = 0;
+            msg->unref();
+            m_queue_head++;
+        }
+    }
+
+    m_queue.clear();
+    m_queue_head = 0;
+
+    //关闭帧已经发出：半关闭，等对方关闭TCP连接后由主线程的EPOLLRDHUP清理
+    if(m_closing)
+    {
+        ::shutdown(m_sockfd, SHUT_WR);
+    }
+    return true;
+}
+
+void ws_session::arm_locked()
+{
+    epoll_event event;
+    event.data.ptr = this;
+    event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+    epoll_ctl(m_hub->epollfd(), m_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, m_sockfd, &event);
+    m_registered = true;
+    m_armed = true;
+}
+
+void ws_session::release_queue_locked()
+{
+    for(size_t i = m_queue_head; i < m_queue.size(); i++)
+    {
+        m_queue[i]->unref();
+    }
+    m_queue.clear();
+    m_queue_head = 0;
+    m_queue_off = 0;
+    m_queued_bytes = 0;
+}
+
+void ws_session::drop_locked()
+{
+    release_queue_locked();
+    m_hub->count_drop();
+    m_closing = true;
+    ::shutdown(m_sockfd, SHUT_RDWR);
+}
@@ -0,0 +1,141 @@
+#ifndef WEBSOCKET_H__
+#define WEBSOCKET_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "locker.h"
+#include "router.h"
+
+// WebSocket(RFC 6455)
+// 握手由http_conn完成（GET + Upgrade: websocket，路由到ws_endpoint），之后连接上的数据交给ws_session。
+// 读仍然走主线程的epoll和线程池；写不经过主线程：任何线程都可以调用ws_session::send，
+// 发送队列只保存共享消息的引用，socket写满时由ws_hub的写线程等待EPOLLOUT继续发送。
+
+class ws_session;
+class ws_hub;
+
+enum WS_OPCODE {WS_CONTINUATION = 0x0, WS_TEXT = 0x1, WS_BINARY = 0x2, WS_CLOSE = 0x8, WS_PING = 0x9, WS_PONG = 0xA};
+
+// 编码好的服务端帧（帧头+负载，服务端的帧不加掩码），一块连续内存，被多个发送队列共享
+// 广播时只序列化一次，每个订阅者的队列增加一个引用，最后一个引用释放时free
+struct ws_message{
+    std::atomic<int> refs;
+    int len;
+    char data[1];
+
+    //引用计数初始为1，属于调用者
+    static ws_message* create(int opcode, const char* payload, int payload_len);
+
+    void ref()
+    {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void unref();
+};
+
+// WebSocket端点：路由表中的处理器，GET请求带Upgrade: websocket时升级，普通请求返回426
+class ws_endpoint : public request_handler{
+
+public:
+    ws_endpoint* websocket() { return this; }
+
+    bool handle(http_request& req, http_response& resp);
+
+    //握手之前调用，返回false拒绝升级（403）
+    virtual bool accept(http_request& req) { return true; }
+
+    //握手完成；req在返回后失效
+    virtual void on_open(ws_session* s, http_request& req) {}
+
+    //一条完整的消息（分片已经拼接，文本已经校验UTF-8）；在工作线程中调用
+    virtual void on_message(ws_session* s, int opcode, const char* data, int len) {}
+
+    //连接关闭，之后不会再有这个会话的回调；在close_conn的线程中调用
+    virtual void on_close(ws_session* s) {}
+};
+
+//就地去掉掩码，offset是data[0]在负载中的位置（决定从掩码的哪个字节开始）
+void ws_unmask(unsigned char* data, size_t len, const unsigned char mask[4], size_t offset);
+
+//文本消息必须是合法的UTF-8（拒绝过长编码和代理项）
+bool ws_utf8_valid(const unsigned char* s, int len);
+
+//Sec-WebSocket-Accept = base64(SHA1(key + GUID))，out至少29字节
+void ws_accept_key(const char* key, char* out);
+
+class ws_session{
+
+public:
+    static const int MAX_MESSAGE = 64 * 1024;           //接收的消息（拼接分片后）的最大长度，超过关闭(1009)
+    static const int MAX_QUEUE_BYTES = 1024 * 1024;     //发送队列超过这个大小认为是慢消费者，断开
+    static const int MAX_QUEUE_MESSAGES = 4096;
+    static const int MAX_IOV = 64;
+
+    ws_session();
+    ~ws_session();
+
+    //http_conn在101发出后调用；同一个对象被连接复用，generation区分前后两个会话
+    void open(int sockfd, ws_endpoint* endpoint, ws_hub* hub);
+
+    //处理收到的数据，返回false表示连接应当关闭
+    bool on_input(const char* data, int len);
+
+    //发送一条消息（增加引用），可以在任何线程调用
+    //generation不为0时只发给这一代会话（广播用的快照可能已经过期）；返回false表示会话已经关闭或被断开
+    bool send(ws_message* msg, uint32_t generation = 0);
+
+    //文本/二进制的便捷函数
+    bool send(int opcode, const char* data, int len);
+
+    //发起关闭握手
+    void close(int code);
+
+    //http_conn关闭连接时调用，socket在这之后才被关闭
+    void shutdown();
+
+    //写线程：socket可写了
+    void on_writable();
+
+    uint32_t generation() const { return m_generation; }
+    int64_t last_seen() const { return m_last_seen.load(std::memory_order_relaxed); }
+
+    //慢消费者或者心跳超时：清空发送队列并shutdown socket，连接由主线程的EPOLLRDHUP关闭
+    void drop(uint32_t generation = 0);
+
+    //端点自己的每会话数据
+    void* context;
+    std::string topic;
+
+private:
+    bool process_frame(int opcode, bool fin, unsigned char* payload, int len);
+    bool flush_locked();
+    void arm_locked();
+    void release_queue_locked();
+    void drop_locked();
+
+private:
+    locker m_lock;                      //保护下面的发送状态和socket写
+    int m_sockfd;                       //-1表示会话已关闭
+    uint32_t m_generation;
+    bool m_closing;                     //关闭帧已经排队，发送完后shutdown
+    bool m_armed;                       //在写线程的epoll中等待EPOLLOUT
+    bool m_registered;                  //socket已经加入写线程的epoll
+    std::vector<ws_message*> m_queue;
+    size_t m_queue_head;
+    size_t m_queue_off;                 //队首消息已经发送的字节数
+    size_t m_queued_bytes;
+
+    //以下只在处理输入的工作线程中访问
+    ws_endpoint* m_endpoint;
+    ws_hub* m_hub;
+    std::string m_in;                   //还不是一个完整帧的输入
+    std::string m_message;              //正在拼接的分片消息
+    int m_message_opcode;               //0表示没有正在拼接的消息
+    bool m_close_received;
+    std::atomic<int64_t> m_last_seen;   //最后一次收到数据的时间（毫秒）
+};
+
+#endif
@@ -0,0 +1,288 @@
+#include "ws_hub.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+ws_hub::ws_hub(const char* prefix):
+    m_epollfd(-1), m_published(0), m_delivered(0), m_dropped(0) {
+
+    strncpy(m_prefix, prefix, sizeof(m_prefix) - 1);
+    m_prefix[sizeof(m_prefix) - 1] = '\0';
+    m_prefix_len = strlen(m_prefix);
+}
+
+ws_hub::~ws_hub()
+{
+    if(m_epollfd != -1)
+    {
+        close(m_epollfd);
+    }
+}
+
+bool ws_hub::start()
+{
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(m_epollfd < 0)
+    {
+        printf("epoll_create1 failure: %s\n", strerror(errno));
+        return false;
+    }
+
+    if(pthread_create(&m_thread, NULL, worker, this) != 0)
+    {
+        close(m_epollfd);
+        m_epollfd = -1;
+        return false;
+    }
+    pthread_detach(m_thread);
+    return true;
+}
+
+void* ws_hub::worker(void* arg)
+{
+    ws_hub* hub = (ws_hub*)arg;
+    profiler::register_thread("ws");
+    hub->run();
+    profiler::unregister_thread();
+    return hub;
+}
+
+void ws_hub::run()
+{
+    epoll_event events[256];
+    int64_t next_ping = now_ms() + PING_INTERVAL * 1000;
+
+    while(true)
+    {
+        int64_t timeout = next_ping - now_ms();
+        int num = epoll_wait(m_epollfd, events, 256, timeout > 0 ? (int)timeout : 0);
+        if(num < 0 && errno != EINTR)
+        {
+            printf("ws hub epoll failure\n");
+            break;
+        }
+
+        for(int i = 0; i < num; i++)
+        {
+            ((ws_session*)events[i].data.ptr)->on_writable();
+        }
+
+        if(now_ms() >= next_ping)
+        {
+            keepalive();
+            next_ping = now_ms() + PING_INTERVAL * 1000;
+        }
+    }
+}
+
+//所有会话共享同一条ping消息；两个周期内没有任何输入（包括pong）的会话认为已经失联
+void ws_hub::keepalive()
+{
+    std::vector<subscriber> sessions;
+    m_lock.lock();
+    sessions.reserve(m_sessions.size());
+    for(std::map<ws_session*, uint32_t>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
+    {
+        subscriber sub = {it->first, it->second};
+        sessions.push_back(sub);
+    }
+    m_lock.unlock();
+
+    ws_message* ping = ws_message::create(WS_PING, "", 0);
+    if(!ping)
+    {
+        return;
+    }
+    int64_t deadline = now_ms() - 2 * PING_INTERVAL * 1000;
+    for(size_t i = 0; i < sessions.size(); i++)
+    {
+        ws_session* s = sessions[i].session;
+        if(s->last_seen() < deadline)
+        {
+            s->drop(sessions[i].generation);
+        }
+        else
+        {
+            s->send(ping, sessions[i].generation);
+        }
+    }
+    ping->unref();
+}
+
+void ws_hub::attach(ws_session* s)
+{
+    m_lock.lock();
+    m_sessions[s] = s->generation();
+    m_lock.unlock();
+}
+
+void ws_hub::detach(ws_session* s)
+{
+    m_lock.lock();
+    m_sessions.erase(s);
+    m_lock.unlock();
+}
+
+int ws_hub::publish(const char* topic, int topic_len, int opcode, const char* data, int len)
+{
+    std::shared_ptr<const subscriber_list> subscribers;
+    m_lock.lock();
+    std::map<std::string, std::shared_ptr<const subscriber_list> >::iterator it = m_topics.find(std::string(topic, topic_len));
+    if(it != m_topics.end())
+    {
+        subscribers = it->second;
+    }
+    m_lock.unlock();
+
+    m_published.fetch_add(1, std::memory_order_relaxed);
+    if(!subscribers)
+    {
+        return 0;
+    }
+
+    //只编码一次，发给每个订阅者的都是同一块内存
+    ws_message* msg = ws_message::create(opcode, data, len);
+    if(!msg)
+    {
+        return 0;
+    }
+    int delivered = 0;
+    for(size_t i = 0; i < subscribers->size(); i++)
+    {
+        const subscriber& sub = (*subscribers)[i];
+        if(sub.session->send(msg, sub.generation))
+        {
+            delivered++;
+        }
+    }
+    msg->unref();
+
+    m_delivered.fetch_add(delivered, std::memory_order_relaxed);
+    return delivered;
+}
+
+bool ws_hub::handle(http_request& req, http_response& resp)
+{
+    if(req.path_len > m_prefix_len)
+    {
+        return ws_endpoint::handle(req, resp);
+    }
+
+    m_lock.lock();
+    size_t topics = m_topics.size();
+    size_t sessions = m_sessions.size();
+    m_lock.unlock();
+
+    char body[256];
+    int len = snprintf(body, sizeof(body),
+        "topics %zu\nsessions %zu\npublished %llu\ndelivered %llu\ndropped %llu\n",
+        topics, sessions,
+        (unsigned long long)m_published.load(std::memory_order_relaxed),
+        (unsigned long long)m_delivered.load(std::memory_order_relaxed),
+        (unsigned long long)m_dropped.load(std::memory_order_relaxed));
+    return resp.body("text/plain", body, len);
+}
+
+bool ws_hub::accept(http_request& req)
+{
+    int len = req.path_len - m_prefix_len;
+    return len > 0 && len <= MAX_TOPIC;
+}
+
+void ws_hub::on_open(ws_session* s, http_request& req)
+{
+    s->topic.assign(req.path + m_prefix_len, req.path_len - m_prefix_len);
+    subscriber sub = {s, s->generation()};
+
+    m_lock.lock();
+    std::shared_ptr<const subscriber_list>& list = m_topics[s->topic];
+    std::shared_ptr<subscriber_list> copy = list ? std::make_shared<subscriber_list>(*list) : std::make_shared<subscriber_list>();
+    copy->push_back(sub);
+    list = copy;
+    m_lock.unlock();
+}
+
+void ws_hub::on_close(ws_session* s)
+{
+    m_lock.lock();
+    std::map<std::string, std::shared_ptr<const subscriber_list> >::iterator it = m_topics.find(s->topic);
+    if(it != m_topics.end())
+    {
+        std::shared_ptr<subscriber_list> copy = std::make_shared<subscriber_list>();
+        copy->reserve(it->second->size());
+        for(size_t i = 0; i < it->second->size(); i++)
+        {
+            if((*it->second)[i].session != s)
+            {
+                copy->push_back((*it->second)[i]);
+            }
+        }
+        if(copy->empty())
+        {
+            m_topics.erase(it);
+        }
+        else
+        {
+            it->second = copy;
+        }
+    }
+    m_lock.unlock();
+}
+
+publish_handler::publish_handler(ws_hub* hub, const char* prefix):
+    m_hub(hub), m_prefix_len(strlen(prefix)) {
+
+}
+
+bool publish_handler::on_headers(http_request& req)
+{
+    int topic_len = req.path_len - m_prefix_len;
+    if(topic_len <= 0 || topic_len > ws_hub::MAX_TOPIC || req.content_length > ws_session::MAX_MESSAGE)
+    {
+        return false;
+    }
+    req.context = new std::string;
+    return true;
+}
+
+bool publish_handler::on_body(http_request& req, const char* data, int len)
+{
+    std::string* body = (std::string*)req.context;
+    if(body->size() + len > (size_t)ws_session::MAX_MESSAGE)
+    {
+        return false;
+    }
+    body->append(data, len);
+    return true;
+}
+
+bool publish_handler::handle(http_request& req, http_response& resp)
+{
+    std::string* body = (std::string*)req.context;
+    int delivered = m_hub->publish(req.path + m_prefix_len, req.path_len - m_prefix_len,
+                                   ws_utf8_valid((const unsigned char*)body->data(), body->size()) ? WS_TEXT : WS_BINARY,
+                                   body->data(), body->size());
+    delete body;
+    req.context = NULL;
+
+    char reply[32];
+    int len = snprintf(reply, sizeof(reply), "%d\n", delivered);
+    return resp.body("text/plain", reply, len);
+}
+
+void publish_handler::on_abort(http_request& req)
+{
+    delete (std::string*)req.context;
+    req.context = NULL;
+}
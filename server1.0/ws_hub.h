@@ -0,0 +1,94 @@
+#ifndef WS_HUB_H__
+#define WS_HUB_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "locker.h"
+#include "websocket.h"
+
+// 发布/订阅广播：GET <prefix><主题> 升级为WebSocket并订阅该主题，publish把一条消息推送给主题的所有订阅者
+// 消息只编码一次（ws_message），每个订阅者的发送队列只增加一个引用，由writev直接发送这块共享内存。
+// 订阅者列表写时复制：发布只在锁内取一个shared_ptr，订阅/退订时才复制列表。
+//
+// 所有WebSocket会话（不限于本端点的）共用hub的写线程：socket写满的会话在这里等待EPOLLOUT，
+// 同时每PING_INTERVAL秒发送一次心跳ping，超过两个周期没有收到任何数据的会话被断开。
+
+class ws_hub : public ws_endpoint{
+
+public:
+    static const int PING_INTERVAL = 30;    //秒
+    static const int MAX_TOPIC = 64;
+
+    explicit ws_hub(const char* prefix);
+    ~ws_hub();
+
+    //创建写线程，失败返回false
+    bool start();
+
+    //把消息推送给topic的所有订阅者，返回成功进入发送队列的订阅者个数；可以在任何线程调用
+    int publish(const char* topic, int topic_len, int opcode, const char* data, int len);
+
+    int epollfd() const { return m_epollfd; }
+
+    //ws_session调用：登记/注销心跳检查的会话，统计被断开的慢消费者
+    void attach(ws_session* s);
+    void detach(ws_session* s);
+    void count_drop() { m_dropped.fetch_add(1, std::memory_order_relaxed); }
+
+    //GET <prefix>（没有主题）返回统计信息
+    bool handle(http_request& req, http_response& resp);
+
+    bool accept(http_request& req);
+    void on_open(ws_session* s, http_request& req);
+    void on_close(ws_session* s);
+
+private:
+    //订阅者快照：会话可能被连接复用，generation保证不会发给下一个会话
+    struct subscriber{
+        ws_session* session;
+        uint32_t generation;
+    };
+    typedef std::vector<subscriber> subscriber_list;
+
+    static void* worker(void* arg);
+    void run();
+    void keepalive();
+
+private:
+    char m_prefix[64];
+    int m_prefix_len;
+    int m_epollfd;
+    pthread_t m_thread;
+
+    locker m_lock;                      //保护m_topics和m_sessions
+    std::map<std::string, std::shared_ptr<const subscriber_list> > m_topics;
+    std::map<ws_session*, uint32_t> m_sessions;
+
+    std::atomic<uint64_t> m_published;
+    std::atomic<uint64_t> m_delivered;
+    std::atomic<uint64_t> m_dropped;
+};
+
+// 发布接口：POST/PUT <prefix><主题>，请求体作为一条文本消息广播，应答成功推送的订阅者个数
+class publish_handler : public request_handler{
+
+public:
+    publish_handler(ws_hub* hub, const char* prefix);
+
+    bool on_headers(http_request& req);
+    bool on_body(http_request& req, const char* data, int len);
+    bool handle(http_request& req, http_response& resp);
+    void on_abort(http_request& req);
+
+private:
+    ws_hub* m_hub;
+    int m_prefix_len;
+};
+
+#endif